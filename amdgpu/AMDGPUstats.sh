@@ -16,6 +16,8 @@
 	https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 LICENSE
 
+# See gpustat.c for a compiled version of this script which does not fork processes.
+
 # This file has info on the GPU voltage (VDDGFX) ; Alternatively, without root
 # access you can get the voltage from /sys/class/drm/card0/device/hwmon/hwmon2/in0_input
 DBGFILE=/sys/kernel/debug/dri/0/amdgpu_pm_info
@@ -0,0 +1,513 @@
+/**
+ * Copyright (C) 2022  kevinlekiller
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// gcc gpustat.c -o gpustat -Wextra -O2
+
+/**
+ * Terminal dashboard for AMD GPUs, replacement for AMDGPUstats.sh.
+ *
+ * All the sysfs files are opened once and re-read with pread(), nothing is forked.
+ * If vega64control is running with --telemetry, the temperatures it reads, load and fan target
+ * are taken from its shared memory ring instead, which costs no syscalls.
+ * Only the characters that changed since the last refresh are sent to the terminal.
+ */
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "../fancontrol/telemetry.h"
+
+// Samples of history kept for the sparklines.
+#define HIST 512
+#define MAXROWS 64
+#define MAXCOLS 256
+#define LABELCOLS 28
+
+// A value shown on the dashboard, fd is -1 when the file doesn't exist.
+struct mStruct {
+    const char * label;
+    const char * unit;
+    const char * file;
+    bool hwmon, spark;
+    int fd;
+    int divisor;
+    long value;
+    bool valid;
+    long hist[HIST];
+    int histLen, histPos;
+};
+enum {
+    M_SCLK, M_MCLK, M_SOCCLK, M_LOAD, M_EDGE, M_JUNCTION, M_MEM, M_FAN, M_FANTARGET, M_POWER, M_VDDGFX, M_TICK, M_COUNT
+};
+struct mStruct metrics[M_COUNT] = {
+    {"GPU clock",     "MHz", "pp_dpm_sclk",      false, true,  -1, 1, 0, false, {0}, 0, 0},
+    {"HBM clock",     "MHz", "pp_dpm_mclk",      false, true,  -1, 1, 0, false, {0}, 0, 0},
+    {"SOC clock",     "MHz", "pp_dpm_socclk",    false, false, -1, 1, 0, false, {0}, 0, 0},
+    {"GPU load",      "%",   "gpu_busy_percent", false, true,  -1, 1, 0, false, {0}, 0, 0},
+    {"Edge temp",     "C",   "temp1_input",      true,  true,  -1, 1000, 0, false, {0}, 0, 0},
+    {"Junction temp", "C",   "temp2_input",      true,  true,  -1, 1000, 0, false, {0}, 0, 0},
+    {"Memory temp",   "C",   "temp3_input",      true,  true,  -1, 1000, 0, false, {0}, 0, 0},
+    {"Fan speed",     "RPM", "fan1_input",       true,  true,  -1, 1, 0, false, {0}, 0, 0},
+    {"Fan target",    "RPM", "fan1_target",      true,  false, -1, 1, 0, false, {0}, 0, 0},
+    {"Power",         "W",   "power1_average",   true,  true,  -1, 1000000, 0, false, {0}, 0, 0},
+    {"VDDGFX",        "mV",  "in0_input",        true,  false, -1, 1, 0, false, {0}, 0, 0},
+    {"Daemon loop",   "us",  NULL,               false, true,  -1, 1, 0, false, {0}, 0, 0},
+};
+
+struct cell {
+    char ch[4];
+};
+struct cell screen[MAXROWS][MAXCOLS], prevScreen[MAXROWS][MAXCOLS];
+int rows = 24, cols = 80, gpuID = 0;
+float interval = 1.0;
+bool quit = false, resized = true;
+char buf[4096], outBuf[65536], devPath[192], hwmonPath[256];
+int outLen = 0;
+const char * telePath = "/dev/shm/vega64control";
+const char * sysfsRoot = "/sys";
+struct teleHeader * tele = NULL;
+ino_t teleInode = 0;
+time_t teleRetry = 0;
+uint64_t teleHead = 0;
+struct termios oldTermios;
+int gpuMetricsFd = -1, throttleStatus = -1;
+const char * sparks[] = {"▁", "▂", "▃", "▄", "▅", "▆", "▇", "█"};
+
+void cleanup() {
+    const char * restore = "\033[0m\033[?25h\033[?1049l";
+    write(STDOUT_FILENO, restore, strlen(restore));
+    tcsetattr(STDIN_FILENO, TCSANOW, &oldTermios);
+    exit(EXIT_SUCCESS);
+}
+
+void onSignal(int sig) {
+    if (sig == SIGWINCH) {
+        resized = true;
+    } else {
+        quit = true;
+    }
+}
+
+// Reads a sysfs file from offset 0 using a fd that stays open.
+ssize_t readFd(int fd, size_t size) {
+    ssize_t len = pread(fd, buf, size - 1, 0);
+    buf[len > 0 ? len : 0] = 0;
+    return len;
+}
+
+// pp_dpm_* files : "0: 852Mhz \n1: 991Mhz *\n", returns the MHz of the line with the *.
+long parseDpm() {
+    char * star = strchr(buf, '*');
+    if (!star) {
+        return -1;
+    }
+    while (star > buf && *(star - 1) != '\n') {
+        star--;
+    }
+    char * colon = strchr(star, ':');
+    return colon ? atol(colon + 1) : -1;
+}
+
+void pushHist(struct mStruct * m) {
+    m->hist[m->histPos] = m->value;
+    m->histPos = (m->histPos + 1) % HIST;
+    if (m->histLen < HIST) {
+        m->histLen++;
+    }
+}
+
+bool attachTelemetry() {
+    if (tele) {
+        unmapRing(tele);
+    }
+    tele = mapRing(telePath, &teleInode);
+    teleHead = 0;
+    return tele != NULL;
+}
+
+// Copies the latest sample of the ring, retries if the daemon was writing it.
+bool readTelemetry(struct teleSample * smp) {
+    for (int tries = 0; tries < 8; tries++) {
+        uint64_t head = ringHead(tele);
+        if (!head) {
+            return false;
+        }
+        if (readSample(tele, head - 1, smp)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void setValue(int i, long value) {
+    metrics[i].value = value;
+    metrics[i].valid = true;
+}
+
+// The metric of a temps[] channel of the ring, from the name vega64control was given for it (a temp*_label or
+// tempN), -1 for the ones gpustat doesn't show.
+int tempMetric(const char * name) {
+    const char * labels[] = {"edge", "junction", "mem"};
+    char file[8];
+    for (int i = 0; i < 3; i++) {
+        snprintf(file, sizeof(file), "temp%d", i + 1);
+        if (strncmp(name, labels[i], 32) == 0 || strncmp(name, file, 32) == 0) {
+            return M_EDGE + i;
+        }
+    }
+    return -1;
+}
+
+void sample() {
+    struct teleSample smp;
+    bool fromTele = false, newTele = false, ringValue[M_COUNT] = {false};
+    for (int i = 0; i < M_COUNT; i++) {
+        metrics[i].valid = false;
+    }
+    if (tele && readTelemetry(&smp)) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        // vega64control restarted or stopped, the ring is stale.
+        if (now.tv_sec - (time_t) (smp.timeNs / 1000000000ULL) > 10) {
+            struct stat sb;
+            if (stat(telePath, &sb) != 0 || sb.st_ino != teleInode) {
+                attachTelemetry();
+            }
+        } else {
+            uint64_t head = ringHead(tele);
+            newTele = head != teleHead;
+            teleHead = head;
+            fromTele = true;
+            for (unsigned int i = 0; i < tele->nTemps && i < TELETEMPS; i++) {
+                int m = tempMetric(tele->tempNames[i]);
+                if (m >= 0) {
+                    setValue(m, smp.temps[i]);
+                    ringValue[m] = true;
+                }
+            }
+            setValue(M_LOAD, smp.load);
+            setValue(M_FANTARGET, smp.fans[0]);
+            setValue(M_TICK, smp.tickNs / 1000);
+            ringValue[M_LOAD] = ringValue[M_FANTARGET] = ringValue[M_TICK] = true;
+        }
+    } else if (!tele) {
+        // Don't look for the ring on every refresh, vega64control might never be started.
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec >= teleRetry) {
+            teleRetry = now.tv_sec + 5;
+            attachTelemetry();
+        }
+    }
+    for (int i = 0; i < M_COUNT; i++) {
+        struct mStruct * m = &metrics[i];
+        if (m->fd < 0 || (fromTele && m->valid)) {
+            continue;
+        }
+        if (readFd(m->fd, sizeof(buf)) <= 0) {
+            continue;
+        }
+        if (i <= M_SOCCLK) {
+            long mhz = parseDpm();
+            if (mhz >= 0) {
+                setValue(i, mhz);
+            }
+        } else {
+            setValue(i, atol(buf) / m->divisor);
+        }
+    }
+    if (gpuMetricsFd >= 0) {
+        // gpu_metrics v1.1 to v1.3 (format 1, content 1 to 3) : throttle_status is a uint32 at offset 68.
+        ssize_t len = pread(gpuMetricsFd, buf, sizeof(buf), 0);
+        throttleStatus = -1;
+        if (len >= 72 && (uint8_t) buf[2] == 1 && (uint8_t) buf[3] >= 1 && (uint8_t) buf[3] <= 3) {
+            uint32_t status;
+            memcpy(&status, buf + 68, sizeof(status));
+            throttleStatus = (int) status;
+        }
+    }
+    for (int i = 0; i < M_COUNT; i++) {
+        if (metrics[i].valid && metrics[i].spark && (!ringValue[i] || newTele)) {
+            pushHist(&metrics[i]);
+        }
+    }
+}
+
+// Puts a UTF-8 string at row / col, returns the amount of cells used.
+int putStr(int row, int col, const char * str) {
+    int used = 0;
+    while (*str && row < rows && col < cols) {
+        int len = ((unsigned char) *str >= 0xf0) ? 4 : ((unsigned char) *str >= 0xe0) ? 3 : ((unsigned char) *str >= 0xc0) ? 2 : 1;
+        memset(screen[row][col].ch, 0, 4);
+        memcpy(screen[row][col].ch, str, len);
+        str += len;
+        col++;
+        used++;
+    }
+    return used;
+}
+
+void drawSpark(int row, int col, int width, struct mStruct * m) {
+    int count = m->histLen < width ? m->histLen : width;
+    long min = 0, max = 0;
+    for (int i = 0; i < count; i++) {
+        long v = m->hist[(m->histPos - count + i + HIST) % HIST];
+        if (i == 0 || v < min) {
+            min = v;
+        }
+        if (i == 0 || v > max) {
+            max = v;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        long v = m->hist[(m->histPos - count + i + HIST) % HIST];
+        int level = max > min ? (int) ((v - min) * 7 / (max - min)) : 0;
+        putStr(row, col + i, sparks[level]);
+    }
+}
+
+void render() {
+    char line[MAXCOLS];
+    struct timespec now;
+    struct tm tm;
+    for (int r = 0; r < rows; r++) {
+        for (int c = 0; c < cols; c++) {
+            memcpy(screen[r][c].ch, " \0\0\0", 4);
+        }
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    localtime_r(&now.tv_sec, &tm);
+    if (tele) {
+        snprintf(line, sizeof(line), "gpustat - card%d - %.15s telemetry attached", gpuID, tele->daemon);
+    } else {
+        snprintf(line, sizeof(line), "gpustat - card%d - sysfs", gpuID);
+    }
+    putStr(0, 0, line);
+    strftime(line, sizeof(line), "%H:%M:%S", &tm);
+    putStr(0, cols - 8 > 0 ? cols - 8 : 0, line);
+    int row = 2;
+    for (int i = 0; i < M_COUNT && row < rows; i++) {
+        struct mStruct * m = &metrics[i];
+        if (m->fd < 0 && !(tele && m->valid)) {
+            continue;
+        }
+        if (m->valid) {
+            snprintf(line, sizeof(line), "%-14s %7ld %s", m->label, m->value, m->unit);
+        } else {
+            snprintf(line, sizeof(line), "%-14s %7s %s", m->label, "n/a", m->unit);
+        }
+        putStr(row, 0, line);
+        if (m->spark && cols > LABELCOLS + 2) {
+            drawSpark(row, LABELCOLS, cols - LABELCOLS, m);
+        }
+        row++;
+    }
+    if (gpuMetricsFd >= 0 && row + 1 < rows) {
+        if (throttleStatus >= 0) {
+            snprintf(line, sizeof(line), "%-14s 0x%08x%s", "Throttling", throttleStatus, throttleStatus ? " THROTTLED" : "");
+        } else {
+            snprintf(line, sizeof(line), "%-14s %7s", "Throttling", "n/a");
+        }
+        putStr(++row, 0, line);
+    }
+    if (rows > 1) {
+        snprintf(line, sizeof(line), "Refresh %.2f s ; q to quit", interval);
+        putStr(rows - 1, 0, line);
+    }
+}
+
+void outAppend(const char * str, int len) {
+    if (outLen + len > (int) sizeof(outBuf)) {
+        write(STDOUT_FILENO, outBuf, outLen);
+        outLen = 0;
+    }
+    memcpy(outBuf + outLen, str, len);
+    outLen += len;
+}
+
+// Sends only the runs of cells that differ from what is on the terminal, in one write().
+void flush() {
+    char esc[32];
+    if (resized) {
+        outAppend("\033[2J", 4);
+        memset(prevScreen, 0, sizeof(prevScreen));
+        resized = false;
+    }
+    for (int r = 0; r < rows; r++) {
+        int c = 0;
+        while (c < cols) {
+            if (memcmp(screen[r][c].ch, prevScreen[r][c].ch, 4) == 0) {
+                c++;
+                continue;
+            }
+            outAppend(esc, snprintf(esc, sizeof(esc), "\033[%d;%dH", r + 1, c + 1));
+            while (c < cols && memcmp(screen[r][c].ch, prevScreen[r][c].ch, 4) != 0) {
+                outAppend(screen[r][c].ch, strnlen(screen[r][c].ch, 4));
+                memcpy(prevScreen[r][c].ch, screen[r][c].ch, 4);
+                c++;
+            }
+        }
+    }
+    if (outLen) {
+        write(STDOUT_FILENO, outBuf, outLen);
+        outLen = 0;
+    }
+}
+
+void getSize() {
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row && ws.ws_col) {
+        rows = ws.ws_row > MAXROWS ? MAXROWS : ws.ws_row;
+        cols = ws.ws_col > MAXCOLS ? MAXCOLS : ws.ws_col;
+    }
+}
+
+bool openFiles() {
+    char path[256];
+    struct stat sb;
+    snprintf(devPath, sizeof(devPath), "%s/class/drm/card%d/device", sysfsRoot, gpuID);
+    if (stat(devPath, &sb) != 0 || !S_ISDIR(sb.st_mode)) {
+        fprintf(stderr, "ERROR: Could not find directory '%s'\n", devPath);
+        return false;
+    }
+    // The hwmon directory of the GPU, hwmon[0-9]* under the device.
+    for (int i = 0; i < 64; i++) {
+        sprintf(hwmonPath, "%s/hwmon/hwmon%d", devPath, i);
+        if (stat(hwmonPath, &sb) == 0) {
+            break;
+        }
+        hwmonPath[0] = 0;
+    }
+    for (int i = 0; i < M_COUNT; i++) {
+        if (!metrics[i].file || (metrics[i].hwmon && !hwmonPath[0])) {
+            continue;
+        }
+        sprintf(path, "%s/%s", metrics[i].hwmon ? hwmonPath : devPath, metrics[i].file);
+        metrics[i].fd = open(path, O_RDONLY);
+    }
+    sprintf(path, "%s/gpu_metrics", devPath);
+    gpuMetricsFd = open(path, O_RDONLY);
+    return true;
+}
+
+void printUsage() {
+    printf("Terminal dashboard for AMD GPUs.\n");
+    printf("Options:\n");
+    printf(" -h, --help\n");
+    printf("   Displays this information.\n");
+    printf(" -d, --gpu-id=NUM\n");
+    printf("   GPU id. (default: 0)\n");
+    printf(" -i, --interval=FLOAT\n");
+    printf("   Refresh time. (valid: 0.05 to 60) (default: 1.0)\n");
+    printf(" -r, --sysfs-root=DIR\n");
+    printf("   Use DIR instead of /sys.\n");
+    printf(" -T, --telemetry=FILE\n");
+    printf("   Telemetry ring of vega64control, used when it exists. (default: /dev/shm/vega64control)\n");
+}
+
+int main(int argc, char **argv) {
+    int c;
+    static struct option long_options[] = {
+        {"help",                  no_argument,       0, 'h'},
+        {"gpu-id",                required_argument, 0, 'd'},
+        {"interval",              required_argument, 0, 'i'},
+        {"sysfs-root",            required_argument, 0, 'r'},
+        {"telemetry",             required_argument, 0, 'T'},
+        {0,                       0,                 0,  0 }
+    };
+    while ((c = getopt_long(argc, argv, "d:hi:r:T:", long_options, NULL)) != -1) {
+        switch (c) {
+            case 'd':
+                gpuID = atoi(optarg);
+                if (gpuID < 0 || gpuID > 1024) {
+                    fprintf(stderr, "ERROR: Wrong --gpu-id passed.\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'h':
+                printUsage();
+                return EXIT_SUCCESS;
+            case 'i':
+                interval = atof(optarg);
+                if (!interval || interval < 0.05 || interval > 60.0) {
+                    fprintf(stderr, "ERROR: --interval must be between 0.05 and 60.0.\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'r':
+                sysfsRoot = optarg;
+                break;
+            case 'T':
+                telePath = optarg;
+                break;
+            default:
+                return EXIT_FAILURE;
+        }
+    }
+    if (!openFiles()) {
+        return EXIT_FAILURE;
+    }
+    attachTelemetry();
+    struct termios raw;
+    tcgetattr(STDIN_FILENO, &oldTermios);
+    raw = oldTermios;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+    signal(SIGQUIT, onSignal);
+    signal(SIGHUP, onSignal);
+    signal(SIGWINCH, onSignal);
+    outAppend("\033[?1049h\033[?25l", 14);
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    struct timespec next, now;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (!quit) {
+        if (resized) {
+            getSize();
+        }
+        sample();
+        render();
+        flush();
+        next.tv_nsec += (long) (interval * 1e9);
+        next.tv_sec += next.tv_nsec / 1000000000;
+        next.tv_nsec %= 1000000000;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long waitMs = (next.tv_sec - now.tv_sec) * 1000 + (next.tv_nsec - now.tv_nsec) / 1000000;
+        if (waitMs < 0) {
+            next = now;
+            waitMs = 0;
+        }
+        if (poll(&pfd, 1, (int) waitMs) > 0 && read(STDIN_FILENO, buf, 1) == 1 && (buf[0] == 'q' || buf[0] == 'Q')) {
+            break;
+        }
+    }
+    cleanup();
+    return EXIT_SUCCESS;
+}
@@ -15,7 +15,8 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-// gcc vega64control.c -o vega64control -Wextra -O2 -lm
+// gcc vega64control.c -o vega64control -Wextra -O2 -lm -pthread
+// With latency histograms (kill -USR1 prints them) : gcc vega64control.c -o vega64control -Wextra -O2 -lm -pthread -DLATENCYSTATS
 
 /**
 * This program can be used to control the P-States / fanspeed and set a custom
@@ -32,74 +33,497 @@
 * It will only lower the P-States if the GPU load has been lower than 50% for a period of time.
 */
 
+#define _GNU_SOURCE
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <malloc.h>
 #include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <linux/netlink.h>
+
+#include "../fancontrol/fanloop.h"
+#include "../fancontrol/telemetry.h"
+
+// Max amount of --profile.
+#define MAXPROFILES 8
+// Max amount of clients connected to --socket at once.
+#define MAXCLIENTS 8
 
 unsigned char iters = 0, lowTemp = 0, highTemp = 0, stuckIterChk = 60, stuckIters = 0;
 unsigned char gpuLoadCheck = 50, iterLimit = 10, gpuPstate = 0, socPstate = 0, vramPstate = 0;
 unsigned char maxGpuState = 7, maxSocState = 7, maxVramState = 3, smoothUp = 0, smoothDown = 0;
 unsigned short highFanSpeed = 0, lowFanSpeed = 0, minFanSpeed = 0, lastFanSpeed = 0;
-bool fanSpeedControl, pstateControl = false, silent = false;
+unsigned char gpuLoad = 0;
+int gpuTemp = 0;
+bool fanSpeedControl, pstateControl = false, silent = false, printLut = false, reloading = false;
+volatile sig_atomic_t reloadPending = 0, stopPending = 0;
+sigset_t waitMask;
+const char * confFile = NULL, * confBase = NULL;
+int optArgc, gpuID = 0;
+char ** optArgv;
+char devPath[PATH_MAX];
+char gpuDevPath[PATH_MAX];
+double slept = 0;
+char hwmonPath[PATH_MAX];
+const char * sysfsRoot = "/sys";
+bool fakeSysfs = false;
 float interval = 1.0;
 const char * user_pp_table;
-int fanLut[99];
-char power_dpm_force_performance_level[64];
-char pp_dpm_mclk[42];
-char pp_dpm_sclk[42];
-char pp_dpm_socclk[44];
-char pp_table[39];
-char gpu_busy_percent[47];
-char temp1_input[57];
-char fan1_enable[57];
-char fan1_target[57];
+int fanLut[100];
+unsigned long statLoops = 0, statFanWrites = 0, statPstateChanges = 0, statReadErrors = 0, statReloads = 0, statRequests = 0;
+
+// --profile : named fan curves, their LUT is made at startup so switching is a copy. 0 is the curve from the options.
+struct pStruct {
+    char name[32];
+    unsigned short minFanSpeed, lowFanSpeed, highFanSpeed;
+    unsigned char lowTemp, highTemp;
+    int fanLut[100];
+};
+struct pStruct profArr[MAXPROFILES + 1];
+int curProfs = 0, curProfile = 0;
+
+// --socket : fan speed / P-States set by a client until pin*Until (CLOCK_MONOTONIC seconds).
+const char * sockPath = NULL;
+int sockFd = -1;
+unsigned short pinFanSpeed = 0;
+unsigned char pinGpuPstate = 0, pinSocPstate = 0, pinVramPstate = 0;
+double pinFanUntil = 0, pinPstateUntil = 0;
+
+// --state-file : written when the fan speed / P-States change and at exit, so a restart continues where it was.
+const char * statePath = NULL;
+bool stateReady = false, stateDirty = false;
+char power_dpm_force_performance_level[PATH_MAX];
+char pp_dpm_mclk[PATH_MAX];
+char pp_dpm_sclk[PATH_MAX];
+char pp_dpm_socclk[PATH_MAX];
+char pp_table[PATH_MAX];
+char gpu_busy_percent[PATH_MAX];
+// --temp-sensors : temperature channels of the GPU (edge, junction, mem), each with an offset, the hottest sets the fan speed.
+#define MAXTEMPS 3
+// Highest N of the tempN_label / tempN_input looked at to find a --temp-sensors NAME, not tied to MAXTEMPS.
+#define MAXTEMPCHANS 32
+struct gStruct {
+    char name[16];               // Content of tempN_label, or tempN
+    int offset;
+    int temp;                    // Last temperature read (C), kept when a read fails
+};
+struct gStruct gpuTemps[MAXTEMPS];
+int curTemps = 0;
+char tempInputs[MAXTEMPS][PATH_MAX];
+char fan1_enable[PATH_MAX];
+char fan1_target[PATH_MAX];
 char buf[256];
-char pp_table[39];
 int fd;
 
+// Latency of the loop, its lateness and every sysfs read / write, only built with -DLATENCYSTATS.
+// Recording is a clock_gettime() and an increment, nothing is allocated. SIGUSR1 prints them to stderr.
+#ifdef LATENCYSTATS
+// Log-linear buckets : one per ns under LATSUB ns, above that every power of 2 is split in LATSUB
+// buckets (at most 1 / LATSUB off). The last bucket holds everything over ~4 s.
+#define LATSUBBITS 3
+#define LATSUB (1 << LATSUBBITS)
+#define LATBUCKETS ((32 - LATSUBBITS + 1) * LATSUB)
+struct latHist {
+    uint32_t buckets[LATBUCKETS];
+    uint64_t count, sumNs, maxNs;
+};
+struct latHist latTick, latLate;
+// readFile() / writeFile() find the histograms of a file by the address of its path.
+struct latFile {
+    const char * path;
+    const char * name;
+    struct latHist read, write;
+} latFiles[] = {
+    {.path = tempInputs[0], .name = "temp sensor 1"},
+    {.path = tempInputs[1], .name = "temp sensor 2"},
+    {.path = tempInputs[2], .name = "temp sensor 3"},
+    {.path = gpu_busy_percent, .name = "gpu_busy_percent"},
+    {.path = fan1_target, .name = "fan1_target"},
+    {.path = fan1_enable, .name = "fan1_enable"},
+    {.path = pp_dpm_sclk, .name = "pp_dpm_sclk"},
+    {.path = pp_dpm_socclk, .name = "pp_dpm_socclk"},
+    {.path = pp_dpm_mclk, .name = "pp_dpm_mclk"},
+    {.path = power_dpm_force_performance_level, .name = "power_dpm_force_performance_level"},
+    {.path = NULL, .name = "other files"}
+};
+volatile sig_atomic_t latDumpPending = 0;
+
+void latAdd(struct latHist * hist, uint64_t ns) {
+    int idx = ns;
+    if (ns >= LATSUB) {
+        int exp = 63 - __builtin_clzll(ns);
+        idx = (exp - LATSUBBITS + 1) * LATSUB + ((ns >> (exp - LATSUBBITS)) & (LATSUB - 1));
+        idx = idx < LATBUCKETS ? idx : LATBUCKETS - 1;
+    }
+    hist->buckets[idx]++;
+    hist->count++;
+    hist->sumNs += ns;
+    hist->maxNs = ns > hist->maxNs ? ns : hist->maxNs;
+}
+
+void latRecord(struct latHist * hist, const struct timespec * start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    latAdd(hist, (now.tv_sec - start->tv_sec) * 1000000000LL + now.tv_nsec - start->tv_nsec);
+}
+
+struct latHist * latFileHist(const char * path, bool write) {
+    struct latFile * file = latFiles;
+    while (file->path && file->path != path) {
+        file++;
+    }
+    return write ? &file->write : &file->read;
+}
+
+// Called when the loop timer fired : how long ago it was due, from the time left until the next one.
+void latLateness(int tfd) {
+    struct itimerspec its;
+    if (timerfd_gettime(tfd, &its) == 0) {
+        int64_t late = (its.it_interval.tv_sec - its.it_value.tv_sec) * 1000000000LL + its.it_interval.tv_nsec - its.it_value.tv_nsec;
+        latAdd(&latLate, late > 0 ? late : 0);
+    }
+}
+
+// Upper edge of the bucket holding the p quantile, in ns.
+uint64_t latQuantile(const struct latHist * hist, double p) {
+    uint64_t want = (uint64_t) ceil(hist->count * p), seen = 0;
+    for (int idx = 0; idx < LATBUCKETS; idx++) {
+        seen += hist->buckets[idx];
+        if (seen >= want && seen) {
+            if (idx < LATSUB - 1) {
+                return idx + 1;
+            }
+            int exp = (idx + 1) / LATSUB + LATSUBBITS - 1;
+            uint64_t edge = (uint64_t) (LATSUB + (idx + 1) % LATSUB) << (exp - LATSUBBITS);
+            return edge < hist->maxNs ? edge : hist->maxNs;
+        }
+    }
+    return hist->maxNs;
+}
+
+void latPrint(const char * name, const struct latHist * hist) {
+    if (!hist->count) {
+        return;
+    }
+    fprintf(stderr, "%10lu %10.1f %10.1f %10.1f %10.1f %10.1f  %s\n", (unsigned long) hist->count, hist->sumNs / 1e3 / hist->count,
+        latQuantile(hist, 0.5) / 1e3, latQuantile(hist, 0.9) / 1e3, latQuantile(hist, 0.99) / 1e3, hist->maxNs / 1e3, name);
+}
+
+void latDump() {
+    char name[64];
+    fprintf(stderr, "     count   mean(us)    p50(us)    p90(us)    p99(us)    max(us)\n");
+    latPrint("loop", &latTick);
+    latPrint("lateness of the loop timer", &latLate);
+    for (struct latFile * file = latFiles; ; file++) {
+        snprintf(name, sizeof(name), "read %s", file->name);
+        latPrint(name, &file->read);
+        snprintf(name, sizeof(name), "write %s", file->name);
+        latPrint(name, &file->write);
+        if (!file->path) {
+            break;
+        }
+    }
+}
+
+void onLatDump() {
+    latDumpPending = 1;
+}
+
+#define LATSTART(ts) struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts)
+#define LATEND(hist, ts) latRecord(hist, &ts)
+#define LATLATE(tfd) latLateness(tfd)
+#define LATDUMP() do { if (latDumpPending) { latDumpPending = 0; latDump(); } } while (0)
+#else
+#define LATSTART(ts)
+#define LATEND(hist, ts)
+#define LATLATE(tfd)
+#define LATDUMP()
+#endif
+
+// Also called by the actuator thread of --write-behind, it has its own fd.
 bool writeFile(const char * path, const char * value) {
     ssize_t size = strlen(value);
-    fd = open(path, O_RDWR);
-    if (fd < 0 || write(fd, value, size) != size) {
-        close(fd);
-        return false;
-    }
-    close(fd);
-    return true;
+    LATSTART(start);
+    // A --sysfs-root tree is made of regular files, cut what's left of a longer previous value.
+    int wfd = open(path, O_RDWR | (fakeSysfs ? O_TRUNC : 0));
+    bool ok = wfd >= 0 && write(wfd, value, size) == size;
+    close(wfd);
+    LATEND(latFileHist(path, true), start);
+    return ok;
 }
 
 bool readFile(const char * path, ssize_t size) {
+    LATSTART(start);
     fd = open(path, O_RDONLY);
-    if (fd < 0 || read(fd, buf, size) < 1) {
-        close(fd);
-        return false;
-    }
+    bool ok = fd >= 0 && read(fd, buf, size) >= 1;
     close(fd);
-    return true;
+    LATEND(latFileHist(path, false), start);
+    return ok;
 }
 
-void cleanup() {
-    if (fanSpeedControl) {
+// Fail-safe of vega64control : the fan at --fan-speed-high and the P-States at --fail-safe-pstates, see fanloop.h.
+// RTHEAP is made room for by enterRealtime(), for the FILE buffers of fopen() and the socket clients.
+#define RTHEAP (1024 * 1024)
+unsigned char safeGpuPstate = 0, safeSocPstate = 0, safeVramPstate = 0;
+
+// Once per tick before the fans are set, with the reads of the previous tick.
+void checkFailSafe() {
+    failedTicks = tickFailed ? failedTicks + 1 : 0;
+    if (deadlineMissed || failedTicks >= failSafeReads) {
+        goodTicks = 0;
+        if (!failSafe) {
+            failSafe = true;
+            statFailSafes++;
+            fprintf(stderr, "\nWARNING: %s, fail-safe fan speed and P-States.\n", deadlineMissed ? "Missed a deadline" : "Temperature reads failed");
+            sdNotify(deadlineMissed ? "STATUS=Fail-safe : missed a deadline" : "STATUS=Fail-safe : temperature reads failed");
+        }
+    } else if (failSafe && ++goodTicks >= failSafeReads) {
+        failSafe = false;
         if (!silent) {
-            printf("\nEnabling automatic fan control\n");
+            printf("\nLeft the fail-safe, back to the fan curve and P-State control.\n");
         }
-        writeFile(fan1_enable, "0");
+        sdNotify("STATUS=Running");
     }
-    if (pstateControl) {
+    deadlineMissed = false;
+}
+
+// Throttle detection : a loop is throttled when the SMU reports a throttle reason in the throttle_status of gpu_metrics,
+// or on GPUs without gpu_metrics (Vega 10) with --pstate-control, when the active level of pp_dpm_sclk is under the
+// GPU P-State that was set. From the onset until THROTTLEHOLD seconds after the last throttled loop, --throttle-boost
+// is added to the fan curve, the fan reacts before the temperature does.
+#define THROTTLEHOLD 30.0
+unsigned short throttleBoost = 0;
+unsigned char checkedPstate = 0;
+int gpuMetricsFd = -1;
+bool throttled = false;
+double throttleUntil = 0, throttleCheck = 0;
+unsigned long statThrottleEvents = 0, statThrottledMs = 0;
+
+// Only gpu_metrics v1.1 to v1.3 (format 1, content 1 to 3 in bytes 2-3 of the header) have throttle_status at
+// offset 68, like in gpustat. With another revision, the check of pp_dpm_sclk is used.
+void openThrottle() {
+    char path[PATH_MAX];
+    unsigned char header[4];
+    snprintf(path, sizeof(path), "%s/gpu_metrics", devPath);
+    gpuMetricsFd = open(path, O_RDONLY | O_CLOEXEC);
+    if (gpuMetricsFd >= 0 && (pread(gpuMetricsFd, header, sizeof(header), 0) != sizeof(header) || header[2] != 1
+        || header[3] < 1 || header[3] > 3)) {
+        close(gpuMetricsFd);
+        gpuMetricsFd = -1;
+    }
+}
+
+bool gpuThrottled() {
+    unsigned char metrics[72];
+    uint32_t status;
+    if (pread(gpuMetricsFd, metrics, sizeof(metrics), 0) != sizeof(metrics)) {
+        return false;
+    }
+    memcpy(&status, metrics + 68, sizeof(status));
+    return status != 0;
+}
+
+// pp_dpm_sclk : "0: 852Mhz \n1: 991Mhz *\n", the level of the line with the * is the one the GPU runs at.
+// Only once the GPU P-State was set for a loop, the SMU (or the actuator of --write-behind) had time to apply it,
+// and not at P-State 0, which can't be throttled and is where an idle GPU is, so it costs no SMU read then.
+bool sclkThrottled() {
+    bool settled = gpuPstate == checkedPstate;
+    checkedPstate = gpuPstate;
+    memset(buf, 0, sizeof(buf));
+    if (!settled || !gpuPstate || !readFile(pp_dpm_sclk, sizeof(buf) - 1)) {
+        return false;
+    }
+    char * star = strchr(buf, '*');
+    if (!star) {
+        return false;
+    }
+    while (star > buf && *(star - 1) != '\n') {
+        star--;
+    }
+    return atoi(star) < gpuPstate;
+}
+
+// Once per loop before the fan speed is set.
+void checkThrottle() {
+    double now = monoTime();
+    bool was = throttled;
+    if (gpuMetricsFd >= 0) {
+        throttled = gpuThrottled();
+    } else {
+        throttled = pstateControl && sclkThrottled();
+    }
+    // The time since the last check, which is 0 after a resume.
+    if (throttled && throttleCheck) {
+        statThrottledMs += (unsigned long) ((now - throttleCheck) * 1000.0 + 0.5);
+    }
+    throttleCheck = now;
+    if (!throttled) {
+        return;
+    }
+    throttleUntil = now + THROTTLEHOLD;
+    if (!was) {
+        statThrottleEvents++;
         if (!silent) {
-            printf("Enabling automatic P-State control.\n");
+            printf("\nThe GPU is throttling%s.\n", throttleBoost && fanSpeedControl ? ", raising the fan speed" : "");
         }
-        writeFile(power_dpm_force_performance_level, "auto");
     }
-    exit(EXIT_SUCCESS);
+}
+
+// Telemetry ring, see --telemetry and telemetry.h.
+struct teleHeader * tele = NULL;
+const char * telePath = NULL;
+// Counters in the telemetry header, in the order publishTelemetry() fills them.
+const char * teleCounters[] = {"fan_writes", "pstate_changes", "read_errors", "reloads", "requests", "deadline_misses", "fail_safes",
+    "throttle_events", "throttled_ms", NULL};
+
+void publishTelemetry(const struct timespec * tickStart) {
+    struct teleSample * smp = beginSample(tele, tickStart);
+    smp->temp = gpuTemp;
+    for (int i = 0; i < curTemps; i++) {
+        smp->temps[i] = gpuTemps[i].temp;
+    }
+    smp->fans[0] = lastFanSpeed;
+    smp->pstates[0] = gpuPstate;
+    smp->pstates[1] = socPstate;
+    smp->pstates[2] = vramPstate;
+    smp->load = gpuLoad;
+    smp->throttled = throttled;
+    endSample(tele, smp);
+    tele->counters[0] = statFanWrites;
+    tele->counters[1] = statPstateChanges;
+    tele->counters[2] = statReadErrors;
+    tele->counters[3] = statReloads;
+    tele->counters[4] = statRequests;
+    tele->counters[5] = statDeadlineMisses;
+    tele->counters[6] = statFailSafes;
+    tele->counters[7] = statThrottleEvents;
+    tele->counters[8] = statThrottledMs;
+}
+
+// --write-behind : the fan speed and P-States are written by an actuator thread instead of the loop, so a slow
+// write (pp_dpm_sclk goes through the SMU) doesn't hold up the next reads. Every output has a mailbox with the
+// latest value of the loop, the actuator only writes the value that's there when it gets to it, older ones are
+// coalesced. The actuator holds actLock while writing, the loop takes it to copy the pp_table.
+#define ACTSTACK (64 * 1024)
+#define MAILTIME 0xffffffffffffULL
+enum {OUTFAN, OUTSOC, OUTGPU, OUTVRAM, OUTS};
+const char * outPaths[OUTS] = {fan1_target, pp_dpm_socclk, pp_dpm_sclk, pp_dpm_mclk};
+_Atomic uint64_t outMail[OUTS];  // value + 1 << 48 | microseconds it was posted, 0 when empty
+atomic_bool outFailed[OUTS];     // The actuator's write failed, the loop writes it again
+bool writeBehind = false, actPosted = false;
+int actEvent = -1;
+pthread_t actThread;
+// Error checking : locking it twice from one thread fails instead of deadlocking.
+pthread_mutex_t actLock = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP;
+unsigned long statCoalesced = 0;
+_Atomic unsigned long statActWrites = 0, statQueueUs = 0, statQueueMaxUs = 0;
+
+uint64_t monoUs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+void * actuator(void * arg) {
+    char value[16];
+    uint64_t wakes;
+    (void) arg;
+    while (read(actEvent, &wakes, sizeof(wakes)) == sizeof(wakes)) {
+        pthread_mutex_lock(&actLock);
+        for (int i = 0; i < OUTS; i++) {
+            uint64_t mail = atomic_exchange(&outMail[i], 0);
+            if (!mail) {
+                continue;
+            }
+            unsigned long delay = (monoUs() - mail) & MAILTIME;
+            statQueueUs += delay;
+            if (delay > statQueueMaxUs) {
+                statQueueMaxUs = delay;
+            }
+            statActWrites++;
+            sprintf(value, "%d", (int) (mail >> 48) - 1);
+            if (!writeFile(outPaths[i], value)) {
+                atomic_store(&outFailed[i], true);
+            }
+        }
+        pthread_mutex_unlock(&actLock);
+    }
+    return NULL;
+}
+
+bool startActuator() {
+    pthread_attr_t attr;
+    sigset_t all, old;
+    actEvent = eventfd(0, EFD_CLOEXEC);
+    if (actEvent < 0) {
+        fprintf(stderr, "ERROR: --write-behind : Could not create eventfd.\n");
+        return false;
+    }
+    // Signals are handled by the loop. A small stack, mlockall() of --realtime locks all of it.
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, ACTSTACK);
+    // SCHED_RESET_ON_FORK of --realtime applies to threads too, the priority is given explicitly.
+    if (rtPriority) {
+        struct sched_param param = {.sched_priority = rtPriority};
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        pthread_attr_setschedparam(&attr, &param);
+    }
+    bool ok = pthread_create(&actThread, &attr, actuator, NULL) == 0;
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (!ok) {
+        fprintf(stderr, "ERROR: --write-behind : Could not start the actuator thread.\n");
+        close(actEvent);
+        actEvent = -1;
+    }
+    return ok;
+}
+
+// Output out gets value : written now, or with --write-behind posted to its mailbox for the actuator,
+// replacing a value the actuator didn't write yet. The caller wakes the actuator with wakeActuator().
+bool setOutput(int out, int value) {
+    if (actEvent >= 0) {
+        uint64_t mail = (uint64_t) (value + 1) << 48 | (monoUs() & MAILTIME);
+        statCoalesced += atomic_exchange(&outMail[out], mail) != 0;
+        actPosted = true;
+        return true;
+    }
+    sprintf(buf, "%d", value);
+    return writeFile(outPaths[out], buf);
+}
+
+void wakeActuator() {
+    uint64_t one = 1;
+    actPosted = false;
+    if (write(actEvent, &one, sizeof(one)) != sizeof(one)) {
+        fprintf(stderr, "WARNING: --write-behind : Could not wake the actuator.\n");
+    }
 }
 
 void setVramPstate() {
@@ -122,28 +546,234 @@ void setVramPstate() {
             vramPstate = 0;
             break;
     }
-    sprintf(buf, "%d", vramPstate);
-    writeFile(pp_dpm_mclk, buf);
+    setOutput(OUTVRAM, vramPstate);
 }
 
+// The table is copied in one write, the driver parses each write to pp_table as a whole table.
 void setPPTable() {
-    sprintf(buf, "cp \"%s\" \"%s\"", user_pp_table, pp_table);
-    system(buf);
+    char table[65536];
+    ssize_t len = -1;
+    int rfd = open(user_pp_table, O_RDONLY | O_CLOEXEC);
+    if (rfd >= 0) {
+        len = read(rfd, table, sizeof(table));
+        close(rfd);
+    }
+    if (len <= 0 || len == sizeof(table)) {
+        fprintf(stderr, "WARNING: Could not read pp_table '%s'\n", user_pp_table);
+        return;
+    }
+    // Not while the actuator of --write-behind writes P-States.
+    pthread_mutex_lock(&actLock);
+    int wfd = open(pp_table, O_WRONLY | O_CLOEXEC | (fakeSysfs ? O_TRUNC : 0));
+    bool ok = wfd >= 0 && write(wfd, table, len) == len;
+    close(wfd);
+    pthread_mutex_unlock(&actLock);
+    if (!ok) {
+        fprintf(stderr, "WARNING: Could not write pp_table '%s'\n", pp_table);
+    }
     if (fanSpeedControl) { // Setting the pp_table seems to reset fan1_enable to 0 sometimes.
         writeFile(fan1_enable, "1");
-        lastFanSpeed = 0;
+        // Write the current speed again instead of starting over from 0.
+        if (lastFanSpeed) {
+            setOutput(OUTFAN, lastFanSpeed);
+        }
+    }
+}
+
+void writePstates() {
+    setOutput(OUTSOC, socPstate);
+    setOutput(OUTGPU, gpuPstate);
+    setOutput(OUTVRAM, vramPstate);
+    statPstateChanges++;
+    stateDirty = true;
+}
+
+void setPinnedPstates() {
+    gpuPstate = pinGpuPstate;
+    socPstate = pinSocPstate;
+    vramPstate = pinVramPstate;
+    writePstates();
+    if (!silent) {
+        printf("\nPinned P-States: GPU %d ; SOC %d ; VRAM %d\n", gpuPstate, socPstate, vramPstate);
     }
 }
 
+// Copying the pp_table resets the GPU clocks, so it's skipped when the GPU already has the same table.
+bool ppTableApplied() {
+    char cur[65536], want[65536];
+    size_t curLen = 0, wantLen = 0;
+    FILE * fh = fopen(pp_table, "r");
+    if (fh) {
+        curLen = fread(cur, 1, sizeof(cur), fh);
+        fclose(fh);
+    }
+    fh = fopen(user_pp_table, "r");
+    if (fh) {
+        wantLen = fread(want, 1, sizeof(want), fh);
+        fclose(fh);
+    }
+    return curLen && curLen == wantLen && memcmp(cur, want, curLen) == 0;
+}
+
+// After a resume or a GPU reset the driver is back to automatic fan and P-State control
+// (and maybe the default pp_table), take it back now instead of on the next change.
+void resumeControl() {
+    slept = suspendedTime();
+    throttleCheck = 0;
+    if (user_pp_table && !ppTableApplied()) {
+        setPPTable();
+    }
+    if (fanSpeedControl) {
+        writeFile(fan1_enable, "1");
+        setOutput(OUTFAN, lastFanSpeed);
+    }
+    if (pstateControl) {
+        writeFile(power_dpm_force_performance_level, "manual");
+        writePstates();
+    }
+    if (actPosted) {
+        wakeActuator();
+    }
+    if (!silent) {
+        printf("\nResumed / GPU reset (or the clock was set), fan and P-State control enabled again.\n");
+    }
+}
+
+// Kernel uevents, a GPU reset or the GPU coming back from suspend sends drm / hwmon events.
+// Messages are "ACTION@DEVPATH" followed by NUL separated KEY=VALUE, only events for this GPU are used.
+bool gpuUevent(int nfd) {
+    char msg[8192];
+    bool found = false;
+    ssize_t len;
+    while ((len = recv(nfd, msg, sizeof(msg) - 1, 0)) > 0) {
+        msg[len] = 0;
+        bool gpu = false, subsystem = false;
+        for (char * ptr = msg; ptr < msg + len; ptr += strlen(ptr) + 1) {
+            if (strncmp(ptr, "DEVPATH=", 8) == 0 && strncmp(ptr + 8, gpuDevPath + 4, strlen(gpuDevPath + 4)) == 0) {
+                gpu = true;
+            } else if (strcmp(ptr, "SUBSYSTEM=drm") == 0 || strcmp(ptr, "SUBSYSTEM=hwmon") == 0) {
+                subsystem = true;
+            }
+        }
+        found |= gpu && subsystem;
+    }
+    return found;
+}
+
+// State file : the GPU device (PCI path), fan speed and P-States.
+void saveState() {
+    char tmpPath[PATH_MAX], devReal[PATH_MAX];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", statePath);
+    FILE * out = fopen(tmpPath, "w");
+    if (!out) {
+        return;
+    }
+    fprintf(out, "vega64control-state 1\ndevice %s\nfan %d\npstates %d %d %d\n",
+        realpath(devPath, devReal) ? devReal : devPath, lastFanSpeed, gpuPstate, socPstate, vramPstate);
+    // Write to a temporary file then rename, a crash never leaves half a state file.
+    if (fclose(out) == 0) {
+        rename(tmpPath, statePath);
+    }
+    stateDirty = false;
+}
+
+// Only used if it was saved for the same GPU, the fan speed and P-States are applied right away.
+void loadState() {
+    char line[1024], dev[PATH_MAX], devReal[PATH_MAX];
+    int version = 0, fan = -1, gpu = -1, soc = -1, vram = -1;
+    FILE * in = fopen(statePath, "r");
+    stateReady = true;
+    if (!in) {
+        return;
+    }
+    dev[0] = 0;
+    while (fgets(line, sizeof(line), in)) {
+        if (sscanf(line, "vega64control-state %d", &version) != 1 && sscanf(line, "device %4095s", dev) != 1 &&
+            sscanf(line, "fan %d", &fan) != 1) {
+            sscanf(line, "pstates %d %d %d", &gpu, &soc, &vram);
+        }
+    }
+    fclose(in);
+    if (version != 1 || !realpath(devPath, devReal) || strcmp(dev, devReal) != 0) {
+        if (!silent) {
+            printf("State file '%s' doesn't match this GPU, not using it.\n", statePath);
+        }
+        return;
+    }
+    if (fanSpeedControl && fan >= 0 && fan <= 10000) {
+        lastFanSpeed = fan;
+        setOutput(OUTFAN, lastFanSpeed);
+    }
+    if (pstateControl && gpu >= 0 && soc >= 0 && vram >= 0) {
+        gpuPstate = gpu > maxGpuState ? maxGpuState : gpu;
+        socPstate = soc > maxSocState ? maxSocState : soc;
+        vramPstate = vram > maxVramState ? maxVramState : vram;
+        writePstates();
+    }
+    if (!silent) {
+        printf("Resumed from state file '%s' : fan speed %d RPM ; P-States GPU %d ; SOC %d ; VRAM %d\n",
+            statePath, lastFanSpeed, gpuPstate, socPstate, vramPstate);
+    }
+}
+
+// Called from main() once the loop stopped, or when starting failed after manual control was enabled.
+void cleanup() {
+    if (tele) {
+        unlink(telePath);
+    }
+    if (sockFd >= 0) {
+        unlink(sockPath);
+    }
+    if (statePath && stateReady) {
+        saveState();
+    }
+    // The actuator of --write-behind must not write after automatic control is enabled.
+    pthread_mutex_lock(&actLock);
+    if (fanSpeedControl) {
+        if (!silent) {
+            printf("\nEnabling automatic fan control\n");
+        }
+        writeFile(fan1_enable, "0");
+    }
+    if (pstateControl) {
+        if (!silent) {
+            printf("Enabling automatic P-State control.\n");
+        }
+        writeFile(power_dpm_force_performance_level, "auto");
+    }
+}
+
+
 void setPstates() {
+    // A write of the actuator of --write-behind failed, write them all again.
+    if (atomic_exchange(&outFailed[OUTSOC], false) | atomic_exchange(&outFailed[OUTGPU], false) | atomic_exchange(&outFailed[OUTVRAM], false)) {
+        writePstates();
+    }
+    // The normal logic starts from the fail-safe P-States once it's left.
+    if (failSafe) {
+        if (gpuPstate != safeGpuPstate || socPstate != safeSocPstate || vramPstate != safeVramPstate) {
+            gpuPstate = safeGpuPstate;
+            socPstate = safeSocPstate;
+            vramPstate = safeVramPstate;
+            writePstates();
+            iters = 0;
+        }
+        return;
+    }
     if (!readFile(gpu_busy_percent, 4)) {
+        statReadErrors++;
         return;
     }
-    if (atoi(buf) >= gpuLoadCheck) {
+    gpuLoad = (unsigned char) atoi(buf);
+    // Pinned P-States, once they expire the normal logic lowers them when the load is low.
+    if (pinPstateUntil && monoTime() < pinPstateUntil) {
+        return;
+    }
+    pinPstateUntil = 0;
+    if (gpuLoad >= gpuLoadCheck) {
         iters = 0;
         if (socPstate < maxSocState) {
-            sprintf(buf, "%d", socPstate + 1);
-            if (writeFile(pp_dpm_socclk, buf)) {
+            if (setOutput(OUTSOC, socPstate + 1)) {
                 iters = 1;
                 socPstate++;
                 if (vramPstate < maxVramState) {
@@ -152,12 +782,15 @@ void setPstates() {
             }
         }
         if (gpuPstate < maxGpuState) {
-            sprintf(buf, "%d", gpuPstate + 1);
-            if (writeFile(pp_dpm_sclk, buf)) {
+            if (setOutput(OUTGPU, gpuPstate + 1)) {
                 iters = 1;
                 gpuPstate++;
             }
         }
+        if (iters) {
+            statPstateChanges++;
+            stateDirty = true;
+        }
         if (!silent && iters) {
             printf("\nIncreased P-States: GPU %d ; SOC %d ; VRAM %d\n", gpuPstate, socPstate, vramPstate);
         }
@@ -169,15 +802,15 @@ void setPstates() {
         iters = 0;
         if (socPstate > 0) {
             socPstate--;
-            sprintf(buf, "%d", socPstate);
-            writeFile(pp_dpm_socclk, buf);
+            setOutput(OUTSOC, socPstate);
             setVramPstate();
         }
         if (gpuPstate > 0) {
             gpuPstate--;
-            sprintf(buf, "%d", gpuPstate);
-            writeFile(pp_dpm_sclk, buf);
+            setOutput(OUTGPU, gpuPstate);
         }
+        statPstateChanges++;
+        stateDirty = true;
         if (!silent) {
             printf("\nDecreased P-States: GPU %d ; SOC %d ; VRAM %d\n", gpuPstate, socPstate, vramPstate);
         }
@@ -194,64 +827,84 @@ void setPstates() {
     }
 }
 
-void setFanSpeed() {
-    if (!readFile(temp1_input, 7)) {
-        return;
-    }
-    int tmpSpeed, gpuTemp =  (int) round(atof(buf) / 1000.0);
+// The RPM for gpuTemp after the fail-safe, pinning, the throttle boost and smoothing.
+int targetSpeed() {
+    int tmpSpeed;
+    // Junction and HBM temperatures go over 99 C, where the LUT ends.
     if (gpuTemp < lowTemp) {
         tmpSpeed = minFanSpeed;
-    } else if (fanLut[gpuTemp]) {
+    } else if (gpuTemp < 100 && fanLut[gpuTemp]) {
         tmpSpeed = fanLut[gpuTemp];
     } else {
         tmpSpeed = highFanSpeed;
     }
-    if (smoothDown && tmpSpeed < lastFanSpeed) {
+    double now = monoTime();
+    if (pinFanUntil && now >= pinFanUntil) {
+        pinFanUntil = 0;
+    }
+    // Ahead of the curve while throttling, not slowed down by --fan-smooth-up.
+    bool boost = throttleBoost && throttleUntil > now;
+    if (boost) {
+        tmpSpeed = tmpSpeed + throttleBoost > highFanSpeed ? highFanSpeed : tmpSpeed + throttleBoost;
+    }
+    if (failSafe) {
+        tmpSpeed = highFanSpeed;
+    } else if (pinFanUntil) {
+        tmpSpeed = pinFanSpeed;
+    } else if (smoothDown && tmpSpeed < lastFanSpeed) {
         tmpSpeed = lastFanSpeed - smoothDown;
         if (tmpSpeed < minFanSpeed) {
             tmpSpeed = minFanSpeed;
         }
-    } else if (smoothUp && tmpSpeed > lastFanSpeed) {
+    } else if (smoothUp && tmpSpeed > lastFanSpeed && !boost) {
         tmpSpeed = lastFanSpeed + smoothUp;
         if (tmpSpeed > highFanSpeed) {
             tmpSpeed = highFanSpeed;
         }
     }
-    if (tmpSpeed != lastFanSpeed) {
-        sprintf(buf, "%d", tmpSpeed);
-        writeFile(fan1_target, buf);
+    return tmpSpeed;
+}
+
+void writeFan(int tmpSpeed) {
+    if (tmpSpeed != lastFanSpeed || atomic_exchange(&outFailed[OUTFAN], false)) {
+        setOutput(OUTFAN, tmpSpeed);
+        statFanWrites++;
+        stateDirty = true;
+    }
+    lastFanSpeed = tmpSpeed;
+}
+
+void setFanSpeed() {
+    tickFailed = false;
+    for (int i = 0; i < curTemps; i++) {
+        // Keep the last temperature of a sensor when it can't be read.
+        if (readFile(tempInputs[i], 7)) {
+            gpuTemps[i].temp = (int) round(atof(buf) / 1000.0);
+        } else {
+            tickFailed = true;
+            statReadErrors++;
+        }
+        int temp = gpuTemps[i].temp + gpuTemps[i].offset;
+        gpuTemp = !i || temp > gpuTemp ? temp : gpuTemp;
     }
+    int tmpSpeed = targetSpeed();
+    writeFan(tmpSpeed);
     if (!silent) {
         printf("\rGpu Temp %2d C -> Fan Speed %4d RPM", gpuTemp, tmpSpeed);
         fflush(stdout);
     }
-    lastFanSpeed = tmpSpeed;
 }
 
 void mkFanLut(bool printLut) {
-    float tdiff = (float) (highFanSpeed - lowFanSpeed) / (float) (highTemp - lowTemp);
-    float curSpeed = (float) lowFanSpeed;
-    int rndSpeed;
-    if (!silent && printLut) {
-        printf("Temp <= %2d C ; FanSpeed = %4d RPM\n", lowTemp-1, minFanSpeed);
+    fillFanLut(fanLut, lowFanSpeed, lowTemp, highFanSpeed, highTemp);
+    if (silent || !printLut) {
+        return;
     }
+    printf("Temp <= %2d C ; FanSpeed = %4d RPM\n", lowTemp-1, minFanSpeed);
     for (int i = lowTemp; i <= highTemp; i++) {
-        rndSpeed = (int) round(curSpeed);
-        if (rndSpeed <= lowFanSpeed) {
-            fanLut[i] = lowFanSpeed;
-        } else if (rndSpeed >= highFanSpeed) {
-            fanLut[i] = highFanSpeed;
-        } else {
-            fanLut[i] = rndSpeed;
-        }
-        curSpeed += tdiff;
-        if (!silent && printLut) {
-            printf("Temp == %2d C ; FanSpeed = %4d RPM\n", i, fanLut[i]);
-        }
-    }
-    if (!silent && printLut) {
-        printf("Temp >= %2d C ; FanSpeed = %4d RPM\n", highTemp+1, highFanSpeed);
+        printf("Temp == %2d C ; FanSpeed = %4d RPM\n", i, fanLut[i]);
     }
+    printf("Temp >= %2d C ; FanSpeed = %4d RPM\n", highTemp+1, highFanSpeed);
 }
 
 bool dirExists(const char * path, bool showErr) {
@@ -273,8 +926,26 @@ bool fileExists(const char * path) {
     return false;
 }
 
+// tempN_input of the channel whose tempN_label is name (edge, junction, mem), or of tempN.
+bool findTempInput(const char * hwmonPath, const char * name, char * path) {
+    char tmpPath[PATH_MAX], label[16];
+    for (int n = 1; n <= MAXTEMPCHANS; n++) {
+        snprintf(label, sizeof(label), "temp%d", n);
+        snprintf(tmpPath, sizeof(tmpPath), "%s/temp%d_label", hwmonPath, n);
+        memset(buf, 0, sizeof(buf));
+        bool match = strcmp(name, label) == 0 || (readFile(tmpPath, sizeof(label) - 1) && strncmp(buf, name, strlen(name)) == 0
+            && (buf[strlen(name)] == '\n' || !buf[strlen(name)]));
+        snprintf(tmpPath, sizeof(tmpPath), "%s/temp%d_input", hwmonPath, n);
+        if (match && fileExists(tmpPath)) {
+            snprintf(path, PATH_MAX, "%s", tmpPath);
+            return true;
+        }
+    }
+    return false;
+}
+
 bool checkFiles(char * devPath, char * hwmonPath) {
-    char tmpPath[64];
+    char tmpPath[PATH_MAX];
     const char devFiles[][35] = {
         "gpu_busy_percent",
         "power_dpm_force_performance_level",
@@ -285,8 +956,7 @@ bool checkFiles(char * devPath, char * hwmonPath) {
     };
     const char hwmonFiles[][15] = {
         "fan1_enable",
-        "fan1_target",
-        "temp1_input"
+        "fan1_target"
     };
     int i, arrSize = sizeof(devFiles) / sizeof(devFiles[0]);
     for (i = 0; i < arrSize; i++) {
@@ -322,15 +992,20 @@ bool checkFiles(char * devPath, char * hwmonPath) {
             sprintf(fan1_enable, "%s", tmpPath);
         } else if (strcmp(hwmonFiles[i], "fan1_target") == 0) {
             sprintf(fan1_target, "%s", tmpPath);
-        } else if (strcmp(hwmonFiles[i], "temp1_input") == 0) {
-            sprintf(temp1_input, "%s", tmpPath);
+        }
+    }
+    for (i = 0; i < curTemps; i++) {
+        if (!findTempInput(hwmonPath, gpuTemps[i].name, tempInputs[i])) {
+            fprintf(stderr, "ERROR: --temp-sensors : GPU temperature sensor '%s' not found, the names are in %s/temp*_label\n",
+                gpuTemps[i].name, hwmonPath);
+            return false;
         }
     }
     return true;
 }
 
 bool getDevPath(char * devPath, int gpuID) {
-    sprintf(devPath, "/sys/class/drm/card%d/device", gpuID);
+    sprintf(devPath, "%.100s/class/drm/card%d/device", sysfsRoot, gpuID);
     return dirExists(devPath, true);
 }
 
@@ -341,28 +1016,255 @@ bool getHwmonPath(char * devPath, char * hwmonPath) {
         fprintf(stderr, "ERROR: Could not find base hwmon directory.\n");
         return false;
     }
-    const char * foundHwmon = "";
+    char foundHwmon[256] = "";
     struct dirent *files;
     while ((files = readdir(dir)) != NULL) {
         if (strstr(files->d_name, "hwmon")) {
-            foundHwmon = files->d_name;
+            snprintf(foundHwmon, sizeof(foundHwmon), "%s", files->d_name);
             break;
         }
     }
     closedir(dir);
-    if (!foundHwmon) {
+    if (!foundHwmon[0]) {
         fprintf(stderr, "ERROR: Could not find hwmon directory.\n");
         return false;
     }
-    sprintf(hwmonPath, "%s/%s", hwmonPath, foundHwmon);
+    size_t len = strlen(hwmonPath);
+    snprintf(hwmonPath + len, PATH_MAX - len, "/%s", foundHwmon);
+    return true;
+}
+
+int findProfile(const char * name) {
+    for (int i = 0; i <= curProfs; i++) {
+        if (strcmp(profArr[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void loadProfile(int i) {
+    minFanSpeed = profArr[i].minFanSpeed;
+    lowFanSpeed = profArr[i].lowFanSpeed;
+    lowTemp = profArr[i].lowTemp;
+    highFanSpeed = profArr[i].highFanSpeed;
+    highTemp = profArr[i].highTemp;
+    memcpy(fanLut, profArr[i].fanLut, sizeof(fanLut));
+    curProfile = i;
+}
+
+// Makes the LUT of every profile, then switches back to the profile named active.
+void mkProfiles(const char * active) {
+    snprintf(profArr[0].name, sizeof(profArr[0].name), "default");
+    profArr[0].minFanSpeed = minFanSpeed;
+    profArr[0].lowFanSpeed = lowFanSpeed;
+    profArr[0].lowTemp = lowTemp;
+    profArr[0].highFanSpeed = highFanSpeed;
+    profArr[0].highTemp = highTemp;
+    for (int i = 0; i <= curProfs; i++) {
+        loadProfile(i);
+        memset(fanLut, 0, sizeof(fanLut));
+        mkFanLut(false);
+        memcpy(profArr[i].fanLut, fanLut, sizeof(fanLut));
+    }
+    loadProfile(findProfile(active) > 0 ? findProfile(active) : 0);
+}
+
+// --socket protocol : one request per line, every request gets one line back starting with "OK" or "ERR".
+//  status                        OK profile=NAME temp=C fan=RPM load=% pstates=GPU:SOC:VRAM pinned_fan=SECONDS pinned_pstates=SECONDS
+//                                throttled=0|1 boosted=SECONDS temps=NAME:C,NAME:C
+//  counters                      OK loops=N fan_writes=N pstate_changes=N read_errors=N reloads=N requests=N
+//                                deadline_misses=N fail_safes=N coalesced=N queue_us_avg=N queue_us_max=N throttle_events=N
+//                                throttled_ms=N
+//  profiles                      OK NAME,NAME
+//  profile NAME                  Switch to the fan curve of --profile NAME, "default" is the curve from the options.
+//  pin RPM SECONDS               Set the fan to RPM for SECONDS, ignoring the temperature.
+//  pstates GPU:SOC:VRAM SECONDS  Set the P-States for SECONDS, ignoring the GPU load, "max" uses the --pstate-*-max values.
+//  unpin                         Go back to the fan curve and load based P-States.
+struct cStruct {
+    int fd;
+    int len;
+    char req[256];
+};
+struct cStruct clientArr[MAXCLIENTS];
+
+bool openSocket() {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(sockPath) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "ERROR: --socket path is too long.\n");
+        return false;
+    }
+    strcpy(addr.sun_path, sockPath);
+    unlink(sockPath);
+    sockFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sockFd < 0 || bind(sockFd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || chmod(sockPath, 0660) != 0 || listen(sockFd, MAXCLIENTS) != 0) {
+        fprintf(stderr, "ERROR: Could not create control socket '%s'\n", sockPath);
+        return false;
+    }
+    for (int i = 0; i < MAXCLIENTS; i++) {
+        clientArr[i].fd = -1;
+    }
     return true;
 }
 
+void handleRequest(char * req, char * resp, size_t size) {
+    char * tail;
+    char * cmd = strtok_r(req, " \t\r", &tail);
+    char * arg1 = strtok_r(NULL, " \t\r", &tail);
+    char * arg2 = strtok_r(NULL, " \t\r", &tail);
+    double now = monoTime();
+    if (!cmd) {
+        snprintf(resp, size, "ERR empty request\n");
+    } else if (strcmp(cmd, "status") == 0) {
+        size_t len = snprintf(resp, size, "OK profile=%s temp=%d fan=%d load=%d pstates=%d:%d:%d pinned_fan=%.1f pinned_pstates=%.1f"
+            " throttled=%d boosted=%.1f temps=", profArr[curProfile].name, gpuTemp, lastFanSpeed, gpuLoad, gpuPstate, socPstate, vramPstate,
+            pinFanUntil ? fmax(pinFanUntil - now, 0.0) : 0.0, pinPstateUntil ? fmax(pinPstateUntil - now, 0.0) : 0.0, throttled,
+            throttleBoost ? fmax(throttleUntil - now, 0.0) : 0.0);
+        for (int i = 0; i < curTemps && len < size; i++) {
+            len += snprintf(resp + len, size - len, "%s%s:%d", i ? "," : "", gpuTemps[i].name, gpuTemps[i].temp);
+        }
+        if (len < size) {
+            snprintf(resp + len, size - len, "\n");
+        }
+    } else if (strcmp(cmd, "counters") == 0) {
+        snprintf(resp, size, "OK loops=%lu fan_writes=%lu pstate_changes=%lu read_errors=%lu reloads=%lu requests=%lu deadline_misses=%lu"
+            " fail_safes=%lu coalesced=%lu queue_us_avg=%lu queue_us_max=%lu throttle_events=%lu throttled_ms=%lu\n", statLoops, statFanWrites,
+            statPstateChanges, statReadErrors, statReloads, statRequests, statDeadlineMisses, statFailSafes, statCoalesced,
+            statActWrites ? statQueueUs / statActWrites : 0, (unsigned long) statQueueMaxUs, statThrottleEvents, statThrottledMs);
+    } else if (strcmp(cmd, "profiles") == 0) {
+        size_t len = snprintf(resp, size, "OK ");
+        for (int i = 0; i <= curProfs && len < size; i++) {
+            len += snprintf(resp + len, size - len, i ? ",%s" : "%s", profArr[i].name);
+        }
+        if (len < size) {
+            snprintf(resp + len, size - len, "\n");
+        }
+    } else if (strcmp(cmd, "profile") == 0) {
+        int i = arg1 ? findProfile(arg1) : -1;
+        if (!fanSpeedControl) {
+            snprintf(resp, size, "ERR fan control is disabled\n");
+        } else if (i < 0) {
+            snprintf(resp, size, "ERR unknown profile\n");
+        } else {
+            loadProfile(i);
+            snprintf(resp, size, "OK\n");
+        }
+    } else if (strcmp(cmd, "pin") == 0) {
+        int rpm = arg1 ? atoi(arg1) : -1;
+        double secs = arg2 ? atof(arg2) : 0;
+        if (!fanSpeedControl) {
+            snprintf(resp, size, "ERR fan control is disabled\n");
+        } else if (rpm < 0 || rpm > 10000 || secs <= 0 || secs > 86400) {
+            snprintf(resp, size, "ERR usage: pin RPM SECONDS (RPM 0 to 10000, SECONDS up to 86400)\n");
+        } else {
+            pinFanSpeed = rpm;
+            pinFanUntil = now + secs;
+            // Don't wait for the next loop, the fan only, with the temperature of the last loop.
+            writeFan(targetSpeed());
+            if (actPosted) {
+                wakeActuator();
+            }
+            snprintf(resp, size, "OK\n");
+        }
+    } else if (strcmp(cmd, "pstates") == 0) {
+        unsigned int gpu = maxGpuState, soc = maxSocState, vram = maxVramState;
+        double secs = arg2 ? atof(arg2) : 0;
+        if (!pstateControl) {
+            snprintf(resp, size, "ERR P-State control is disabled\n");
+        } else if (!arg1 || (strcmp(arg1, "max") != 0 && sscanf(arg1, "%u:%u:%u", &gpu, &soc, &vram) != 3) ||
+            gpu > maxGpuState || soc > maxSocState || vram > maxVramState || secs <= 0 || secs > 86400) {
+            snprintf(resp, size, "ERR usage: pstates GPU:SOC:VRAM|max SECONDS (up to the --pstate-*-max values, SECONDS up to 86400)\n");
+        } else {
+            pinGpuPstate = gpu;
+            pinSocPstate = soc;
+            pinVramPstate = vram;
+            pinPstateUntil = now + secs;
+            iters = 0;
+            setPinnedPstates();
+            if (actPosted) {
+                wakeActuator();
+            }
+            snprintf(resp, size, "OK\n");
+        }
+    } else if (strcmp(cmd, "unpin") == 0) {
+        pinFanUntil = pinPstateUntil = 0;
+        if (fanSpeedControl) {
+            writeFan(targetSpeed());
+            if (actPosted) {
+                wakeActuator();
+            }
+        }
+        snprintf(resp, size, "OK\n");
+    } else {
+        snprintf(resp, size, "ERR unknown request\n");
+    }
+}
+
+void closeClient(struct cStruct * cl) {
+    close(cl->fd);
+    cl->fd = -1;
+}
+
+void acceptClients() {
+    int cfd;
+    while ((cfd = accept4(sockFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        int i = 0;
+        while (i < MAXCLIENTS && clientArr[i].fd >= 0) {
+            i++;
+        }
+        if (i == MAXCLIENTS) {
+            send(cfd, "ERR too many clients\n", 21, MSG_NOSIGNAL);
+            close(cfd);
+            continue;
+        }
+        clientArr[i].fd = cfd;
+        clientArr[i].len = 0;
+    }
+}
+
+// Answers every complete line the client sent, never waits on the client.
+void serveClient(struct cStruct * cl) {
+    char resp[1024];
+    ssize_t len = read(cl->fd, cl->req + cl->len, sizeof(cl->req) - 1 - cl->len);
+    if (len == 0 || (len < 0 && errno != EAGAIN)) {
+        closeClient(cl);
+        return;
+    } else if (len < 0) {
+        return;
+    }
+    cl->len += len;
+    cl->req[cl->len] = 0;
+    char * line = cl->req, * end;
+    while ((end = strchr(line, '\n')) != NULL) {
+        *end = 0;
+        statRequests++;
+        handleRequest(line, resp, sizeof(resp));
+        len = strlen(resp);
+        if (send(cl->fd, resp, len, MSG_NOSIGNAL) != len) {
+            closeClient(cl);
+            return;
+        }
+        line = end + 1;
+    }
+    cl->len -= line - cl->req;
+    memmove(cl->req, line, cl->len);
+    if (cl->len == sizeof(cl->req) - 1) {
+        send(cl->fd, "ERR request too long\n", 21, MSG_NOSIGNAL);
+        closeClient(cl);
+    }
+}
+
 void printUsage() {
     printf("Program for controling Fan / P-States on AMD Vega 64.\n");
     printf("Options:\n");
     printf(" -h, --help\n");
     printf("   Displays this information.\n");
+    printf(" -C, --config=FILE\n");
+    printf("   Read options from FILE, one per line using the long option names, for example: fan-speed-low = 500\n");
+    printf("   Options passed on the command line override the ones in FILE.\n");
+    printf("   FILE is reloaded when it changes or on SIGHUP, --gpu-id, --sysfs-root and --telemetry are only read at startup.\n");
     printf(" -s, --silent\n");
     printf("   Output nothing to stdout.\n");
     printf(" -d, --gpu-id=NUM\n");
@@ -404,6 +1306,44 @@ void printUsage() {
     printf("   Fan speed used for fan LUT calculation when temperature at --fan-temp-high. (valid: 1 to 10000)\n");
     printf(" -z, --fan-temp-high=NUM\n");
     printf("   Highest temperature for fan LUT calculation. (valid: 1 to 99)\n");
+    printf(" -m, --temp-sensors=NAME:OFFSET;NAME:OFFSET\n");
+    printf("   GPU temperature sensors the fan speed is based on, the hottest one after adding its OFFSET is used. (default: temp1:0)\n");
+    printf("   NAME is the content of a tempN_label file (edge, junction, mem on Vega) or tempN (N up to %d), OFFSET is added to the sensor's\n", MAXTEMPCHANS);
+    printf("   temperature (valid: -50 to 50), a negative OFFSET puts a sensor that runs hotter on the same curve. Up to %d sensors.\n", MAXTEMPS);
+    printf("   Example: --temp-sensors=\"edge:0;junction:-15;mem:-10\"\n");
+    printf(" -P, --profile=NAME:MIN:LOW:TEMPLOW:HIGH:TEMPHIGH\n");
+    printf("   Named fan curve that can be switched to with --socket, the values are like --fan-speed-min, --fan-speed-low,\n");
+    printf("   --fan-temp-low, --fan-speed-high and --fan-temp-high. Can be passed up to %d times.\n", MAXPROFILES);
+    printf("   Example: --profile=quiet:400:500:50:1200:70 --profile=max:3000:3000:1:3000:2\n");
+    printf(" -S, --socket=FILE\n");
+    printf("   Create a control socket, one request per line : status, counters, profiles, profile NAME, pin RPM SECONDS,\n");
+    printf("   pstates GPU:SOC:VRAM SECONDS (or pstates max SECONDS), unpin.\n");
+    printf("   Example: echo \"pstates max 600\" | socat - UNIX-CONNECT:/run/vega64control.sock\n");
+    printf(" -F, --state-file=FILE\n");
+    printf("   Save the fan speed and P-States to FILE when they change and at exit, on startup continue from FILE instead of\n");
+    printf("   starting from the lowest P-States. FILE is only used if it's for the same GPU, for example: --state-file=/run/vega64control.state\n");
+    printf(" -R, --sysfs-root=DIR\n");
+    printf("   Use DIR instead of /sys, for example a directory made by fancontrol/fanbench.sh.\n");
+    printf(" -T, --telemetry=FILE\n");
+    printf("   Publish every loop's temperatures and fan speeds, P-States and GPU load to a shared memory ring in FILE, for example /dev/shm/vega64control\n");
+    printf(" -k, --realtime=NUM\n");
+    printf("   Run the loop with SCHED_FIFO priority NUM and the memory locked, so it isn't starved when the machine is busy. (valid: 1 to 99)\n");
+    printf(" -D, --deadline=MS\n");
+    printf("   A loop that takes longer than MS milliseconds, or starts a loop late, switches to the fail-safe. (valid: 1 to 60000) (default: --interval)\n");
+    printf(" -E, --fail-safe-reads=NUM\n");
+    printf("   NUM loops in a row where the temperature can't be read switch to the fail-safe, after NUM good loops in a row it's left.\n");
+    printf("   (valid: 1 to 255) (default: 3)\n");
+    printf(" -G, --fail-safe-pstates=GPU:SOC:VRAM\n");
+    printf("   P-States used in the fail-safe, the fan is at --fan-speed-high. (default: 0:0:0)\n");
+    printf(" -W, --write-behind\n");
+    printf("   Write the fan speed and P-States from a second thread, so a slow write (pp_dpm_sclk goes through the SMU) doesn't\n");
+    printf("   delay the next reads. Only the latest value is written, the ones that weren't written in time are counted as coalesced.\n");
+    printf("   The time a value waited to be written is in the counters request of --socket.\n");
+    printf(" -A, --throttle-boost=RPM\n");
+    printf("   When the GPU throttles (throttle_status of gpu_metrics, or without it the GPU clock under the P-State of --pstate-control),\n");
+    printf("   add RPM to the fan curve right away, until %.0f seconds after the throttling stopped. (valid: 1 to 10000)\n", THROTTLEHOLD);
+    printf("   The throttling is detected without it too, the time spent throttled is in the counters request of --socket and --telemetry.\n");
+    printf("   Missed deadlines are sent to systemd (sd_notify), every loop feeds the watchdog (WatchdogSec=, at least 4 --interval).\n");
     printf("Examples:\n");
     printf(" Show fan LUT with minimum 500RPM at 40C, maximum 1600RPM at 55C, 400RPM under 40c.\n");
     printf("  ./vega64control --fan-speed-low=500 --fan-speed-high=1600 --fan-temp-low=40 --fan-temp-high 55 --fan-speed-min=400 --fan-print-lut\n");
@@ -411,205 +1351,626 @@ void printUsage() {
     printf("  ./vega64control --pptable=/etc/default/pp_table --pstate-control\n");
 }
 
+struct option long_options[] = {
+    {"help",                  no_argument,       0, 'h'},
+    {"silent",                no_argument,       0, 's'},
+    {"gpu-id",                required_argument, 0, 'd'},
+    {"pstate-control",        no_argument,       0, 'c'},
+    {"pstate-gpu-max",        required_argument, 0, 'e'},
+    {"pstate-soc-max",        required_argument, 0, 'f'},
+    {"pstate-vram-max",       required_argument, 0, 'g'},
+    {"pstate-load",           required_argument, 0, 'l'},
+    {"pstate-decrease-loops", required_argument, 0, 'r'},
+    {"pptable",               required_argument, 0, 'p'},
+    {"pstate-check-stuck",    required_argument, 0, 't'},
+    {"interval",              required_argument, 0, 'i'},
+    {"niceness",              required_argument, 0, 'n'},
+    {"fan-print-lut",         no_argument,       0, 'u'},
+    {"fan-smooth-up",         required_argument, 0, 'a'},
+    {"fan-smooth-down",       required_argument, 0, 'b'},
+    {"fan-speed-min",         required_argument, 0, 'v'},
+    {"fan-speed-low",         required_argument, 0, 'w'},
+    {"fan-temp-low",          required_argument, 0, 'x'},
+    {"fan-speed-high",        required_argument, 0, 'y'},
+    {"fan-temp-high",         required_argument, 0, 'z'},
+    {"temp-sensors",          required_argument, 0, 'm'},
+    {"sysfs-root",            required_argument, 0, 'R'},
+    {"telemetry",             required_argument, 0, 'T'},
+    {"config",                required_argument, 0, 'C'},
+    {"profile",               required_argument, 0, 'P'},
+    {"socket",                required_argument, 0, 'S'},
+    {"state-file",            required_argument, 0, 'F'},
+    {"realtime",              required_argument, 0, 'k'},
+    {"deadline",              required_argument, 0, 'D'},
+    {"fail-safe-reads",       required_argument, 0, 'E'},
+    {"fail-safe-pstates",     required_argument, 0, 'G'},
+    {"write-behind",          no_argument,       0, 'W'},
+    {"throttle-boost",        required_argument, 0, 'A'},
+    {0,                       0,                 0,  0 }
+};
+const char * short_options = "a:A:b:cd:e:f:g:hi:k:l:m:n:p:r:st:uv:w:x:y:z:C:D:E:F:G:P:R:S:T:W";
+
+bool setOption(int c, const char * arg) {
+    // These only apply when vega64control starts.
+    if (reloading && strchr("dkuDEFGRSTW", c)) {
+        return true;
+    }
+    switch (c) {
+        case 'a':
+            smoothUp = (unsigned char) atoi(arg);
+            if (smoothUp == 0) {
+                fprintf(stderr, "ERROR: --fan-smooth-up must be between 1 and 255.\n");
+                return false;
+            }
+            break;
+        case 'b':
+            smoothDown = (unsigned char) atoi(arg);
+            if (smoothDown == 0) {
+                fprintf(stderr, "ERROR: --fan-smooth-down must be between 1 and 255.\n");
+                return false;
+            }
+            break;
+        case 'c':
+            pstateControl = true;
+            break;
+        case 'd':
+            gpuID = atoi(arg);
+            if (gpuID < 0 || gpuID > 1024) {
+                fprintf(stderr, "ERROR: Wrong --gpu-id passed.\n");
+                return false;
+            }
+            break;
+        case 'e':
+            maxGpuState = (unsigned char) atoi(arg);
+            if (maxGpuState > 7) {
+                fprintf(stderr, "ERROR: --pstate-gpu-max must be between 0 and 7.\n");
+                return false;
+            }
+            break;
+        case 'f':
+            maxSocState = (unsigned char) atoi(arg);
+            if (maxSocState > 7) {
+                fprintf(stderr, "ERROR: --pstate-soc-max must be between 0 and 7.\n");
+                return false;
+            }
+            break;
+        case 'g':
+            maxVramState = (unsigned char) atoi(arg);
+            if (maxVramState > 3) {
+                fprintf(stderr, "ERROR: --pstate-vram-max must be between 0 and 3.\n");
+                return false;
+            }
+            break;
+        case 'h':
+            printUsage();
+            exit(EXIT_SUCCESS);
+        case 'i':
+            interval = atof(arg);
+            if (!interval || interval < 0.05 || interval > 60.0) {
+                fprintf(stderr, "ERROR: --interval must be between 0.05 and 60.0.\n");
+                return false;
+            }
+            break;
+        case 'l':
+            gpuLoadCheck = (unsigned char) atoi(arg);
+            if (gpuLoadCheck > 100 || gpuLoadCheck < 1) {
+                fprintf(stderr, "ERROR: --pstate-load must be between 1 and 100.\n");
+                return false;
+            }
+            break;
+        case 'n': {
+            int niceness = atoi(arg);
+            if (niceness < -20 || niceness > 19) {
+                fprintf(stderr, "ERROR: --niceness must be -20 to 19.\n");
+                return false;
+            }
+            setpriority(PRIO_PROCESS, 0, niceness);
+            break;
+        }
+        case 'p':
+            user_pp_table = strdup(arg);
+            if (!fileExists(user_pp_table)) {
+                return false;
+            }
+            break;
+        case 'r':
+            iterLimit = (unsigned char) atoi(arg);
+            if (iterLimit == 0) {
+                fprintf(stderr, "ERROR: --pstate-decrease-loops must be between 1 and 255.\n");
+                return false;
+            }
+            break;
+        case 's':
+            silent = true;
+            break;
+        case 't':
+            stuckIterChk = (unsigned char) atoi(arg);
+            if (stuckIterChk == 0) {
+                fprintf(stderr, "ERROR: --pstate-check-stuck must be between 1 and 255.\n");
+                return false;
+            }
+            break;
+        case 'u':
+            printLut = true;
+            break;
+        case 'v':
+            minFanSpeed = (unsigned short) atoi(arg);
+            break;
+        case 'w':
+            lowFanSpeed = (unsigned short) atoi(arg);
+            break;
+        case 'x':
+            lowTemp = (unsigned char) atoi(arg);
+            if (lowTemp == 0 || lowTemp > 99) {
+                fprintf(stderr, "ERROR: --fan-temp-low must be between 1 and 99.\n");
+                return false;
+            }
+            break;
+        case 'y':
+            highFanSpeed = (unsigned short) atoi(arg);
+            break;
+        case 'z':
+            highTemp = (unsigned char) atoi(arg);
+            if (highTemp == 0 || highTemp > 99) {
+                fprintf(stderr, "ERROR: --fan-temp-high must be between 1 and 99.\n");
+                return false;
+            }
+            break;
+        case 'm': {
+            char list[256], * tail, * tok;
+            snprintf(list, sizeof(list), "%s", arg);
+            for (tok = strtok_r(list, ";", &tail); tok; tok = strtok_r(NULL, ";", &tail)) {
+                const char * sep = strchr(tok, ':');
+                int offset;
+                if (!sep || sep == tok || sep - tok >= (int) sizeof(gpuTemps[0].name) || sscanf(sep + 1, "%d", &offset) != 1) {
+                    fprintf(stderr, "ERROR: --temp-sensors must be in the format NAME:OFFSET;NAME:OFFSET\n");
+                    return false;
+                }
+                if (offset < -50 || offset > 50) {
+                    fprintf(stderr, "ERROR: --temp-sensors : OFFSET must be between -50 and 50.\n");
+                    return false;
+                }
+                if (curTemps >= MAXTEMPS) {
+                    fprintf(stderr, "ERROR: --temp-sensors : Exceeded maximum allowed sensors (%d).\n", MAXTEMPS);
+                    return false;
+                }
+                snprintf(gpuTemps[curTemps].name, sep - tok + 1, "%s", tok);
+                gpuTemps[curTemps].offset = offset;
+                gpuTemps[curTemps].temp = 0;
+                curTemps++;
+            }
+            break;
+        }
+        case 'P': {
+            if (curProfs >= MAXPROFILES) {
+                fprintf(stderr, "ERROR: --profile : Exceeded maximum allowed profiles (%d).\n", MAXPROFILES);
+                return false;
+            }
+            struct pStruct * prof = &profArr[curProfs + 1];
+            unsigned int vals[5];
+            const char * sep = strchr(arg, ':');
+            if (!sep || sep == arg || sep - arg >= (int) sizeof(prof->name) || sscanf(sep + 1, "%u:%u:%u:%u:%u", &vals[0], &vals[1], &vals[2], &vals[3], &vals[4]) != 5) {
+                fprintf(stderr, "ERROR: --profile must be in the format NAME:MIN:LOW:TEMPLOW:HIGH:TEMPHIGH\n");
+                return false;
+            }
+            if (vals[0] > vals[1] || vals[1] > vals[3] || vals[3] > 10000 || !vals[2] || vals[2] >= vals[4] || vals[4] > 99) {
+                fprintf(stderr, "ERROR: --profile : Speeds must be MIN <= LOW <= HIGH <= 10000, temperatures 1 to 99 with TEMPLOW < TEMPHIGH.\n");
+                return false;
+            }
+            snprintf(prof->name, sep - arg + 1, "%s", arg);
+            prof->minFanSpeed = vals[0];
+            prof->lowFanSpeed = vals[1];
+            prof->lowTemp = vals[2];
+            prof->highFanSpeed = vals[3];
+            prof->highTemp = vals[4];
+            curProfs++;
+            break;
+        }
+        case 'S':
+            sockPath = strdup(arg);
+            break;
+        case 'F':
+            statePath = strdup(arg);
+            break;
+        case 'R':
+            sysfsRoot = strdup(arg);
+            fakeSysfs = strcmp(sysfsRoot, "/sys") != 0;
+            break;
+        case 'T':
+            telePath = strdup(arg);
+            break;
+        case 'W':
+            writeBehind = true;
+            break;
+        case 'A':
+            throttleBoost = (unsigned short) atoi(arg);
+            if (atoi(arg) < 1 || atoi(arg) > 10000) {
+                fprintf(stderr, "ERROR: --throttle-boost must be between 1 and 10000.\n");
+                return false;
+            }
+            break;
+        case 'k':
+            rtPriority = atoi(arg);
+            if (rtPriority < 1 || rtPriority > 99) {
+                fprintf(stderr, "ERROR: --realtime must be between 1 and 99.\n");
+                return false;
+            }
+            break;
+        case 'D':
+            deadline = (unsigned short) atoi(arg);
+            if (atoi(arg) < 1 || atoi(arg) > 60000) {
+                fprintf(stderr, "ERROR: --deadline must be between 1 and 60000.\n");
+                return false;
+            }
+            break;
+        case 'E':
+            failSafeReads = (unsigned char) atoi(arg);
+            if (atoi(arg) < 1 || atoi(arg) > 255) {
+                fprintf(stderr, "ERROR: --fail-safe-reads must be between 1 and 255.\n");
+                return false;
+            }
+            break;
+        case 'G': {
+            unsigned int gpu, soc, vram;
+            if (sscanf(arg, "%u:%u:%u", &gpu, &soc, &vram) != 3 || gpu > 7 || soc > 7 || vram > 3) {
+                fprintf(stderr, "ERROR: --fail-safe-pstates must be GPU:SOC:VRAM, GPU and SOC 0 to 7, VRAM 0 to 3.\n");
+                return false;
+            }
+            safeGpuPstate = gpu;
+            safeSocPstate = soc;
+            safeVramPstate = vram;
+            break;
+        }
+        case 'C':
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+// Config file, one option per line, same names as the long options : "fan-speed-low = 500"
+// Empty lines and text after a # are ignored, options without a value are written without "=".
+bool loadConfig(const char * path) {
+    char line[1024];
+    int lineNum = 0;
+    bool ok = true;
+    FILE * in = fopen(path, "r");
+    if (!in) {
+        fprintf(stderr, "ERROR: Could not open config file '%s'\n", path);
+        return false;
+    }
+    while (ok && fgets(line, sizeof(line), in)) {
+        lineNum++;
+        char * name = line + strspn(line, " \t");
+        name[strcspn(name, "#\r\n")] = 0;
+        char * value = strchr(name, '=');
+        if (value) {
+            *value++ = 0;
+            value += strspn(value, " \t");
+            for (int i = strlen(value) - 1; i >= 0 && (value[i] == ' ' || value[i] == '\t'); i--) {
+                value[i] = 0;
+            }
+        }
+        for (int i = strlen(name) - 1; i >= 0 && (name[i] == ' ' || name[i] == '\t'); i--) {
+            name[i] = 0;
+        }
+        if (!*name) {
+            continue;
+        }
+        struct option * opt = long_options;
+        while (opt->name && strcmp(opt->name, name) != 0) {
+            opt++;
+        }
+        if (!opt->name || opt->val == 'C' || opt->val == 'h') {
+            fprintf(stderr, "ERROR: %s line %d : Unknown option '%s'\n", path, lineNum, name);
+            ok = false;
+        } else if ((opt->has_arg == required_argument) != (value != NULL && *value)) {
+            fprintf(stderr, "ERROR: %s line %d : '%s' %s\n", path, lineNum, name, opt->has_arg ? "requires a value" : "takes no value");
+            ok = false;
+        } else {
+            ok = setOption(opt->val, value);
+        }
+    }
+    fclose(in);
+    return ok;
+}
+
+// The config file is applied first, then the command line, so command line options win.
+bool applyOptions() {
+    int c;
+    if (confFile && !loadConfig(confFile)) {
+        return false;
+    }
+    optind = 0;
+    while ((c = getopt_long(optArgc, optArgv, short_options, long_options, NULL)) != -1) {
+        if (!setOption(c, optarg)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool checkOptions() {
+    fanSpeedControl = highFanSpeed > 0 && highTemp > 0;
+    if (!curTemps) {
+        snprintf(gpuTemps[0].name, sizeof(gpuTemps[0].name), "temp1");
+        gpuTemps[0].offset = 0;
+        curTemps = 1;
+    }
+    if (!checkFiles(devPath, hwmonPath)) {
+        fprintf(stderr, "ERROR: Could not open a required file.\n");
+        return false;
+    }
+    if (safeGpuPstate > maxGpuState || safeSocPstate > maxSocState || safeVramPstate > maxVramState) {
+        fprintf(stderr, "ERROR: --fail-safe-pstates must be under the --pstate-*-max values.\n");
+        return false;
+    }
+    if (!fanSpeedControl) {
+        return true;
+    }
+    if (minFanSpeed >= lowFanSpeed) {
+        fprintf(stderr, "ERROR: --fan-speed-min must be less than --fan-speed-low.\n");
+        return false;
+    }
+    if (lowFanSpeed >= highFanSpeed) {
+        fprintf(stderr, "ERROR: --fan-speed-low must be less than -fan-speed-high.\n");
+        return false;
+    }
+    if (lowFanSpeed == 0 || highFanSpeed > 10000) {
+        fprintf(stderr, "ERROR: Fan speed values must be between 0 and 10000.\n");
+        return false;
+    }
+    return true;
+}
+
+// Everything a config reload can change, so a bad config can be rolled back.
+struct confStruct {
+    unsigned char lowTemp, highTemp, stuckIterChk, gpuLoadCheck, iterLimit;
+    unsigned char maxGpuState, maxSocState, maxVramState, smoothUp, smoothDown;
+    unsigned short highFanSpeed, lowFanSpeed, minFanSpeed, throttleBoost;
+    bool fanSpeedControl, pstateControl, silent;
+    float interval;
+    const char * user_pp_table;
+    int fanLut[100];
+    struct pStruct profArr[MAXPROFILES + 1];
+    int curProfs, curProfile;
+    struct gStruct gpuTemps[MAXTEMPS];
+    int curTemps;
+    char tempInputs[MAXTEMPS][PATH_MAX];
+};
+struct confStruct oldConf;
+
+void saveConf(struct confStruct * conf) {
+    conf->lowTemp = lowTemp;
+    conf->highTemp = highTemp;
+    conf->stuckIterChk = stuckIterChk;
+    conf->gpuLoadCheck = gpuLoadCheck;
+    conf->iterLimit = iterLimit;
+    conf->maxGpuState = maxGpuState;
+    conf->maxSocState = maxSocState;
+    conf->maxVramState = maxVramState;
+    conf->smoothUp = smoothUp;
+    conf->smoothDown = smoothDown;
+    conf->highFanSpeed = highFanSpeed;
+    conf->lowFanSpeed = lowFanSpeed;
+    conf->minFanSpeed = minFanSpeed;
+    conf->throttleBoost = throttleBoost;
+    conf->fanSpeedControl = fanSpeedControl;
+    conf->pstateControl = pstateControl;
+    conf->silent = silent;
+    conf->interval = interval;
+    conf->user_pp_table = user_pp_table;
+    memcpy(conf->fanLut, fanLut, sizeof(fanLut));
+    memcpy(conf->profArr, profArr, sizeof(profArr));
+    conf->curProfs = curProfs;
+    memcpy(conf->gpuTemps, gpuTemps, sizeof(gpuTemps));
+    conf->curTemps = curTemps;
+    memcpy(conf->tempInputs, tempInputs, sizeof(tempInputs));
+    conf->curProfile = curProfile;
+}
+
+void restoreConf(const struct confStruct * conf) {
+    lowTemp = conf->lowTemp;
+    highTemp = conf->highTemp;
+    stuckIterChk = conf->stuckIterChk;
+    gpuLoadCheck = conf->gpuLoadCheck;
+    iterLimit = conf->iterLimit;
+    maxGpuState = conf->maxGpuState;
+    maxSocState = conf->maxSocState;
+    maxVramState = conf->maxVramState;
+    smoothUp = conf->smoothUp;
+    smoothDown = conf->smoothDown;
+    highFanSpeed = conf->highFanSpeed;
+    lowFanSpeed = conf->lowFanSpeed;
+    minFanSpeed = conf->minFanSpeed;
+    throttleBoost = conf->throttleBoost;
+    fanSpeedControl = conf->fanSpeedControl;
+    pstateControl = conf->pstateControl;
+    silent = conf->silent;
+    interval = conf->interval;
+    user_pp_table = conf->user_pp_table;
+    memcpy(fanLut, conf->fanLut, sizeof(fanLut));
+    memcpy(profArr, conf->profArr, sizeof(profArr));
+    curProfs = conf->curProfs;
+    memcpy(gpuTemps, conf->gpuTemps, sizeof(gpuTemps));
+    curTemps = conf->curTemps;
+    memcpy(tempInputs, conf->tempInputs, sizeof(tempInputs));
+    curProfile = conf->curProfile;
+}
+
+// Runs between two loops : the new config is parsed and checked, then it replaces the old one.
+// The current P-States and fan speed are kept, fan / P-State control is only handed back to the
+// driver if the new config disables it, and the pp_table is only copied again if it changed.
+void reloadConfig(int tfd) {
+    saveConf(&oldConf);
+    lowTemp = highTemp = smoothUp = smoothDown = 0;
+    highFanSpeed = lowFanSpeed = minFanSpeed = throttleBoost = 0;
+    stuckIterChk = 60;
+    gpuLoadCheck = 50;
+    iterLimit = 10;
+    maxGpuState = maxSocState = 7;
+    maxVramState = 3;
+    pstateControl = silent = false;
+    interval = 1.0;
+    user_pp_table = NULL;
+    curProfs = curTemps = 0;
+    reloading = true;
+    bool ok = applyOptions() && checkOptions() && checkWatchdog();
+    reloading = false;
+    if (!ok) {
+        restoreConf(&oldConf);
+        fprintf(stderr, "ERROR: Reloading the config failed, keeping the current config.\n");
+        return;
+    }
+    if (fanSpeedControl) {
+        // Stay on the same profile if it still exists.
+        mkProfiles(oldConf.profArr[oldConf.curProfile].name);
+        if (!oldConf.fanSpeedControl) {
+            writeFile(fan1_enable, "1");
+            lastFanSpeed = 0;
+        }
+    } else if (oldConf.fanSpeedControl) {
+        writeFile(fan1_enable, "0");
+    }
+    if (pstateControl && !oldConf.pstateControl) {
+        writeFile(power_dpm_force_performance_level, "manual");
+        gpuPstate = socPstate = vramPstate = 0;
+    } else if (!pstateControl && oldConf.pstateControl) {
+        writeFile(power_dpm_force_performance_level, "auto");
+    }
+    if (user_pp_table && (!oldConf.user_pp_table || strcmp(user_pp_table, oldConf.user_pp_table) != 0)) {
+        setPPTable();
+    }
+    // A sensor that's still used keeps its last temperature.
+    for (int i = 0; i < curTemps; i++) {
+        for (int j = 0; j < oldConf.curTemps; j++) {
+            if (strcmp(tempInputs[i], oldConf.tempInputs[j]) == 0) {
+                gpuTemps[i].temp = oldConf.gpuTemps[j].temp;
+            }
+        }
+    }
+    statReloads++;
+    if (interval != oldConf.interval) {
+        armTimer(tfd);
+    }
+    if (tele) {
+        tele->nTemps = curTemps;
+    }
+    if (!silent) {
+        printf("\nConfig reloaded.\n");
+    }
+}
+
+int watchConfig() {
+    char dir[PATH_MAX];
+    if (!confFile) {
+        return -1;
+    }
+    snprintf(dir, sizeof(dir), "%s", confFile);
+    if (strrchr(dir, '/') != NULL) {
+        *strrchr(dir, '/') = 0;
+        confBase = strrchr(confFile, '/') + 1;
+    } else {
+        sprintf(dir, ".");
+        confBase = confFile;
+    }
+    // Watch the directory, editors often replace the file instead of writing to it.
+    int ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (ifd >= 0 && inotify_add_watch(ifd, dir[0] ? dir : "/", IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        close(ifd);
+        ifd = -1;
+    }
+    if (ifd < 0) {
+        fprintf(stderr, "WARNING: Could not watch '%s' for changes, use SIGHUP to reload it.\n", confFile);
+    }
+    return ifd;
+}
+
+bool configChanged(int ifd) {
+    char evBuf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    ssize_t len;
+    while ((len = read(ifd, evBuf, sizeof(evBuf))) > 0) {
+        for (char * ptr = evBuf; ptr < evBuf + len; ptr += sizeof(struct inotify_event) + ((struct inotify_event *) ptr)->len) {
+            struct inotify_event * ev = (struct inotify_event *) ptr;
+            if (ev->len && strcmp(ev->name, confBase) == 0) {
+                changed = true;
+            }
+        }
+    }
+    return changed;
+}
+
+void onReload() {
+    reloadPending = 1;
+}
+
+// Only sets a flag, nothing cleanup() calls is async-signal-safe.
+void onStop() {
+    stopPending = 1;
+}
+
+// Before the files are made and the fans are driven, a stop has to go through cleanup() from main().
+// The signals stay blocked outside of ppoll(), so a stop can't slip in between the check and the wait,
+// threads started after this inherit the mask.
+void catchStop() {
+    sigset_t sigs;
+    signal(SIGQUIT, onStop);
+    signal(SIGINT, onStop);
+    signal(SIGTERM, onStop);
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGQUIT);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGHUP);
+    sigprocmask(SIG_BLOCK, &sigs, &waitMask);
+}
+
 int main(int argc, char **argv) {
 #ifndef linux
     fprintf(stderr, "ERROR: Operating system must be Linux.\n");
     return 1;
 #endif
-    signal(SIGQUIT, cleanup);
-    signal(SIGINT, cleanup);
-    signal(SIGTERM, cleanup);
-    signal(SIGHUP, cleanup);
+    signal(SIGHUP, onReload);
+#ifdef LATENCYSTATS
+    signal(SIGUSR1, onLatDump);
+#endif
     {
-        bool printLut = false;
-        int c, gpuID = 0;
-        static struct option long_options[] = {
-            {"help",                  no_argument,       0, 'h'},
-            {"silent",                no_argument,       0, 's'},
-            {"gpu-id",                required_argument, 0, 'd'},
-            {"pstate-control",        no_argument,       0, 'c'},
-            {"pstate-gpu-max",        required_argument, 0, 'e'},
-            {"pstate-soc-max",        required_argument, 0, 'f'},
-            {"pstate-vram-max",       required_argument, 0, 'g'},
-            {"pstate-load",           required_argument, 0, 'l'},
-            {"pstate-decrease-loops", required_argument, 0, 'r'},
-            {"pptable",               required_argument, 0, 'p'},
-            {"pstate-check-stuck",    required_argument, 0, 't'},
-            {"interval",              required_argument, 0, 'i'},
-            {"niceness",              required_argument, 0, 'n'},
-            {"fan-print-lut",         no_argument,       0, 'u'},
-            {"fan-smooth-up",         required_argument, 0, 'a'},
-            {"fan-smooth-down",       required_argument, 0, 'b'},
-            {"fan-speed-min",         required_argument, 0, 'v'},
-            {"fan-speed-low",         required_argument, 0, 'w'},
-            {"fan-temp-low",          required_argument, 0, 'x'},
-            {"fan-speed-high",        required_argument, 0, 'y'},
-            {"fan-temp-high",         required_argument, 0, 'z'},
-            {0,                       0,                 0,  0 }
-        };
-        while (c = getopt_long(argc, argv, "a:b:cd:e:f:g:hi:l:n:p:r:st:uv:w:x:y:z:", long_options, NULL)) {
-            if (c == -1) {
-                break;
-            }
-            switch (c) {
-                case 'a':
-                    smoothUp = (unsigned char) atoi(optarg);
-                    if (smoothUp == 0) {
-                        fprintf(stderr, "ERROR: --fan-smooth-up must be between 1 and 255.\n");
-                        return EXIT_FAILURE;
-                    }
-                    break;
-                case 'b':
-                    smoothDown = (unsigned char) atoi(optarg);
-                    if (smoothDown == 0) {
-                        fprintf(stderr, "ERROR: --fan-smooth-down must be between 1 and 255.\n");
-                        return EXIT_FAILURE;
-                    }
-                    break;
-                case 'c':
-                    pstateControl = true;
-                    break;
-                case 'd':
-                    gpuID = atoi(optarg);
-                    if (gpuID < 0 || gpuID > 1024) {
-                        fprintf(stderr, "ERROR: Wrong --gpu-id passed.\n");
-                        return EXIT_FAILURE;
-                    }
-                    break;
-                case 'e':
-                    maxGpuState = (unsigned char) atoi(optarg);
-                    if (maxGpuState > 7) {
-                        fprintf(stderr, "ERROR: --pstate-gpu-max must be between 0 and 7.\n");
-                        return EXIT_FAILURE;
-                    }
-                    break;
-                case 'f':
-                    maxSocState = (unsigned char) atoi(optarg);
-                    if (maxSocState > 7) {
-                        fprintf(stderr, "ERROR: --pstate-soc-max must be between 0 and 7.\n");
-                        return EXIT_FAILURE;
-                    }
-                    break;
-                case 'g':
-                    maxVramState = (unsigned char) atoi(optarg);
-                    if (maxVramState > 3) {
-                        fprintf(stderr, "ERROR: --pstate-vram-max must be between 0 and 3.\n");
-                        return EXIT_FAILURE;
-                    }
-                    break;
-                case 'h':
-                    printUsage();
-                    return EXIT_SUCCESS;
-                case 'i':
-                    interval = atof(optarg);
-                    if (!interval || interval < 0.05 || interval > 60.0) {
-                        fprintf(stderr, "ERROR: --interval must be between 0.05 and 60.0.\n");
-                        return EXIT_FAILURE;
-                    }
-                    break;
-                case 'l':
-                    gpuLoadCheck = (unsigned char) atoi(optarg);
-                    if (gpuLoadCheck > 100 || gpuLoadCheck < 1) {
-                        fprintf(stderr, "ERROR: --pstate-load must be between 1 and 100.\n");
-                        return EXIT_FAILURE;
-                    }
-                    break;
-                case 'n':
-                    int niceness = atoi(optarg);
-                    if (niceness < -20 || niceness > 19) {
-                        fprintf(stderr, "ERROR: --niceness must be -20 to 19.\n");
-                        return EXIT_FAILURE;
-                    }
-                    nice(niceness);
-                    break;
-                case 'p':
-                    user_pp_table = optarg;
-                    if (!fileExists(user_pp_table)) {
-                        return EXIT_FAILURE;
-                    }
-                    break;
-                case 'r':
-                    iterLimit = (unsigned char) atoi(optarg);
-                    if (iterLimit == 0) {
-                        fprintf(stderr, "ERROR: --pstate-decrease-loops must be between 1 and 255.\n");
-                        return EXIT_FAILURE;
-                    }
-                    break;
-                case 's':
-                    silent = true;
-                    break;
-                case 't':
-                    stuckIterChk = (unsigned char) atoi(optarg);
-                    if (stuckIterChk == 0) {
-                        fprintf(stderr, "ERROR: --pstate-check-stuck must be between 1 and 255.\n");
-                        return EXIT_FAILURE;
-                    }
-                    break;
-                case 'u':
-                    printLut = true;
-                    break;
-                case 'v':
-                    minFanSpeed = (unsigned short) atoi(optarg);
-                    break;
-                case 'w':
-                    lowFanSpeed = (unsigned short) atoi(optarg);
-                    break;
-                case 'x':
-                    lowTemp = (unsigned char) atoi(optarg);
-                    if (lowTemp == 0 || lowTemp > 99) {
-                        fprintf(stderr, "ERROR: --fan-temp-low must be between 1 and 99.\n");
-                        return EXIT_FAILURE;
-                    }
-                    break;
-                case 'y':
-                    highFanSpeed = (unsigned short) atoi(optarg);
-                    break;
-                case 'z':
-                    highTemp = (unsigned char) atoi(optarg);
-                    if (highTemp == 0 || highTemp > 99) {
-                        fprintf(stderr, "ERROR: --fan-temp-high must be between 1 and 99.\n");
-                        return EXIT_FAILURE;
-                    }
-                    break;
-            }
-        }
-        if (geteuid() != 0) {
+        int c;
+        optArgc = argc;
+        optArgv = argv;
+        opterr = 0;
+        while ((c = getopt_long(argc, argv, short_options, long_options, NULL)) != -1) {
+            if (c == 'C') {
+                confFile = optarg;
+            }
+        }
+        opterr = 1;
+        if (!applyOptions()) {
+            return EXIT_FAILURE;
+        }
+        if (geteuid() != 0 && !fakeSysfs) {
             fprintf(stderr, "ERROR: vega64control must be run as root.\n");
             return EXIT_FAILURE;
         }
-        char devPath[30];
-        char *devPathptr = devPath;
-        if (!getDevPath(devPathptr, gpuID)) {
+        if (!getDevPath(devPath, gpuID)) {
             return EXIT_FAILURE;
         }
-        char hwmonPath[45];
-        char *hwmonPathptr = hwmonPath;
-        if (!getHwmonPath(devPathptr, hwmonPathptr)) {
+        if (!getHwmonPath(devPath, hwmonPath)) {
             fprintf(stderr, "ERROR: Could not find hwmon path for GPU.\n");
             return EXIT_FAILURE;
         }
-        fanSpeedControl = highFanSpeed > 0 && highTemp > 0;
-        if (!checkFiles(devPathptr, hwmonPathptr)) {
-            fprintf(stderr, "ERROR: Could not open a required file.\n");
+        if (!checkOptions()) {
             return EXIT_FAILURE;
         }
+        catchStop();
         if (fanSpeedControl) {
-            if (minFanSpeed >= lowFanSpeed) {
-                fprintf(stderr, "ERROR: --fan-speed-min must be less than --fan-speed-low.\n");
-                return EXIT_FAILURE;
-            }
-            if (lowFanSpeed >= highFanSpeed) {
-                fprintf(stderr, "ERROR: --fan-speed-low must be less than -fan-speed-high.\n");
-                return EXIT_FAILURE;
-            }
-            if (lowFanSpeed == 0 || highFanSpeed > 10000) {
-                fprintf(stderr, "ERROR: Fan speed values must be between 0 and 10000.\n");
-                return EXIT_FAILURE;
-            }
             mkFanLut(printLut);
             if (printLut) {
                 return EXIT_SUCCESS;
             }
+            mkProfiles("default");
             writeFile(fan1_enable, "1");
             if (!silent) {
                 printf("Manual fan control enabled.\n");
@@ -621,21 +1982,134 @@ int main(int argc, char **argv) {
             }
             writeFile(power_dpm_force_performance_level, "manual");
         }
-        if (user_pp_table) {
+        if (user_pp_table && ppTableApplied()) {
+            if (!silent) {
+                printf("Power play table '%s' is already applied.\n", user_pp_table);
+            }
+        } else if (user_pp_table) {
             if (!silent) {
                 printf("Copying power play table: '%s' -> '%s'\n", user_pp_table, pp_table);
             }
             setPPTable();
         }
+        if (statePath) {
+            loadState();
+        }
+        openThrottle();
+        if (telePath) {
+            if (!(tele = createRing(telePath, "vega64control", curTemps, 1, "RPM", teleCounters))) {
+                cleanup();
+                return EXIT_FAILURE;
+            }
+            // Without gpu_metrics, the throttling is only seen with P-State control.
+            tele->flags = TELEGPU | (gpuMetricsFd >= 0 || pstateControl ? TELETHROTTLE : 0);
+            snprintf(tele->rpmPaths[0], sizeof(tele->rpmPaths[0]), "%s/fan1_input", hwmonPath);
+            for (unsigned int i = 0; i < tele->nTemps; i++) {
+                snprintf(tele->tempNames[i], sizeof(tele->tempNames[i]), "%s", gpuTemps[i].name);
+            }
+        }
+        if (sockPath && !openSocket()) {
+            cleanup();
+            return EXIT_FAILURE;
+        }
+        if (rtPriority && !enterRealtime(RTHEAP)) {
+            cleanup();
+            return EXIT_FAILURE;
+        }
+        // After enterRealtime(), its stack is locked with the rest.
+        if (writeBehind && !startActuator()) {
+            cleanup();
+            return EXIT_FAILURE;
+        }
+        if (!openNotify()) {
+            cleanup();
+            return EXIT_FAILURE;
+        }
+    }
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tfd < 0) {
+        fprintf(stderr, "ERROR: Could not create timer.\n");
+        cleanup();
+        return EXIT_FAILURE;
     }
-    while (pstateControl || fanSpeedControl) {
+    armTimer(tfd);
+    int ifd = watchConfig();
+    int rfd = openResumeTimer();
+    // DEVPATH of the uevents is the path under /sys.
+    int nfd = realpath(devPath, gpuDevPath) && strncmp(gpuDevPath, "/sys/", 5) == 0 ? openUevents("GPU resets won't be noticed.") : -1;
+    // ppoll() skips the negative fds : no --config, no --socket, free client slots.
+    struct pollfd pfds[5 + MAXCLIENTS];
+    struct timespec tickStart;
+    uint64_t expirations;
+    slept = suspendedTime();
+    sdNotify("READY=1\nSTATUS=Running");
+    // With a config file keep running, a reload can enable fan or P-State control again.
+    while (!stopPending && (pstateControl || fanSpeedControl || confFile)) {
+        clock_gettime(CLOCK_MONOTONIC, &tickStart);
+        // In case the resume timer was missed.
+        if (suspendedTime() > slept + 1.0) {
+            resumeControl();
+        }
+        checkFailSafe();
+        checkThrottle();
         if (fanSpeedControl) {
             setFanSpeed();
         }
         if (pstateControl) {
             setPstates();
         }
-        sleep(interval);
+        if (actPosted) {
+            wakeActuator();
+        }
+        statLoops++;
+        if (stateDirty && statePath) {
+            saveState();
+        }
+        if (tele) {
+            publishTelemetry(&tickStart);
+        }
+        LATEND(&latTick, tickStart);
+        endTick(&tickStart);
+        // Wait for the next loop, config reloads and socket requests are done while waiting.
+        do {
+            LATDUMP();
+            if (reloadPending) {
+                reloadPending = 0;
+                reloadConfig(tfd);
+            }
+            pfds[0] = (struct pollfd) {tfd, POLLIN, 0};
+            pfds[1] = (struct pollfd) {ifd, POLLIN, 0};
+            pfds[2] = (struct pollfd) {sockFd, POLLIN, 0};
+            pfds[3] = (struct pollfd) {rfd, POLLIN, 0};
+            pfds[4] = (struct pollfd) {nfd, POLLIN, 0};
+            for (int i = 0; i < MAXCLIENTS; i++) {
+                pfds[5 + i] = (struct pollfd) {sockFd >= 0 ? clientArr[i].fd : -1, POLLIN, 0};
+            }
+            if (ppoll(pfds, 5 + MAXCLIENTS, NULL, &waitMask) < 0) {
+                continue;
+            }
+            // Not ||, both have to be read.
+            if (((pfds[3].revents & POLLIN) && clockWasSet(rfd)) | ((pfds[4].revents & POLLIN) && gpuUevent(nfd))) {
+                resumeControl();
+            }
+            if ((pfds[1].revents & POLLIN) && configChanged(ifd)) {
+                reloadPending = 1;
+            }
+            for (int i = 0; i < MAXCLIENTS; i++) {
+                if (pfds[5 + i].revents) {
+                    serveClient(&clientArr[i]);
+                }
+            }
+            if (pfds[2].revents & POLLIN) {
+                acceptClients();
+            }
+        } while (!stopPending && read(tfd, &expirations, sizeof(expirations)) != sizeof(expirations));
+        if (stopPending) {
+            break;
+        }
+        checkLateness(expirations);
+        LATLATE(tfd);
     }
+    cleanup();
     return EXIT_SUCCESS;
 }
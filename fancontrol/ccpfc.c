@@ -18,50 +18,400 @@
 /**
  * Chassis & CPU fan control using CORSAIR Commander Pro
  *
- * Compile: gcc ccpfc.c -o ccpfc -Wextra -O2 -lm
+ * Compile: gcc ccpfc.c -o ccpfc -Wextra -O2 -lm -pthread
+ * With latency histograms (kill -USR1 prints them) : gcc ccpfc.c -o ccpfc -Wextra -O2 -lm -pthread -DLATENCYSTATS
  * Run : ./ccpfc --help
 */
 
+#define _GNU_SOURCE
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <malloc.h>
 #include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <linux/netlink.h>
 
-// CCP can only control 6 fans.
-#define MAXFANS 6
-// Sane limit on max amount of temp sensors to monitor.
-#define MAXTSEN 8
+#include "fanloop.h"
+#include "telemetry.h"
 
-bool silent = false;
+// Temperature of a sensor that wasn't read yet, never the highest one. A failed read keeps the last temperature.
+#define TEMPNONE -274
+// The temp sensor table is allocated in multiples of this, a power of 2.
+#define TSENPAD 8
+// PWM step used when sweeping a fan with --calibrate.
+#define CALSTEP 5
+#define CALPOINTS (255 / CALSTEP + 1)
+// Max amount of --interval polls to wait for a fan's RPM to settle.
+#define CALSETTLE 40
+// Max amount of --profile.
+#define MAXPROFILES 8
+// Max amount of clients connected to --socket at once.
+#define MAXCLIENTS 8
+// Min seconds between looking up the hwmon directories again after failed reads / writes.
+#define REBINDDELAY 5.0
+// Failed or slow reads in a row before a sensor is probed with backoff, see sensorHealth(). Under the default
+// --fail-safe-reads, so a sensor that is gone is backed off before it switches to the fail-safe.
+#define SENBADREADS 2
+// C added to the last temperature of a sensor that failed, while it's backed off.
+#define SENMARGIN 5
+// Good probes in a row before a backed off sensor is read every loop again.
+#define SENGOODREADS 3
+// Max loops between the probes of a backed off sensor.
+#define SENMAXBACKOFF 256
+
+bool silent = false, calibrate = false, replay = false, printLut = false, reloading = false;
+volatile sig_atomic_t reloadPending = 0, stopPending = 0;
+sigset_t waitMask;
+const char * confFile = NULL, * confBase = NULL;
+int optArgc;
+char ** optArgv;
 char buf[256];
+const char * sysfsRoot = "/sys";
+bool fakeSysfs = false;
+const char * calFile = "/var/cache/ccpfc/calibration";
 float interval = 1.0;
-int fd;
+int fd, lastTemp = 0;
 unsigned char lowTemp = 0, highTemp = 0, smoothUp = 0, smoothDown = 0;
 unsigned char highFanSpeed = 0, lowFanSpeed = 0, minFanSpeed = 0, lastFanSpeed = 0;
-unsigned char fanLut[99];
-char curFans = -1, curTsen = -1;
+int fanLut[100];
+int curFans = -1, curTsen = -1;
+unsigned long statLoops = 0, statWrites = 0, statReadErrors = 0, statReloads = 0, statRequests = 0;
+unsigned long statHidRequests = 0, statHidRoundTrips = 0, statSensorReads = 0, statLazySkips = 0;
+
+// --profile : named fan curves, their LUT is made at startup so switching is a copy. 0 is the curve from the options.
+struct pStruct {
+    char name[32];
+    unsigned char minFanSpeed, lowFanSpeed, lowTemp, highFanSpeed, highTemp;
+    int fanLut[100];
+};
+struct pStruct profArr[MAXPROFILES + 1];
+int curProfs = 0, curProfile = 0;
+
+// --socket : fan speed set by a client until pinUntil (CLOCK_MONOTONIC seconds).
+const char * sockPath = NULL;
+int sockFd = -1;
+unsigned char pinSpeed = 0;
+double pinUntil = 0;
+
+// --state-file : written when the fan speeds change and at exit, so a restart continues where it was.
+const char * statePath = NULL;
+bool stateReady = false, stateDirty = false;
+
+// --replay : sensor values come from a trace or a thermal model instead of sysfs, on a virtual clock.
+const char * replayTrace = NULL, * replayLoad = NULL, * replayOutput = NULL;
+bool replayModel = false;
+float modelAmbient = 25.0, modelRise = 50.0, modelCooling = 0.6, modelTau = 60.0, replayTime = 3600.0;
+// A trace value that's not a number (x for example) is a failed read of the sensor.
+#define REPLAYFAIL INT_MIN
+int * replayTemps = NULL;
+unsigned long replayWrites = 0;
+double replayNow = 0;
+
+// --benchmark : amount of loops to time.
+int benchTicks = 0;
+
+// --bake : header for ccpfcmin.c.
+const char * bakePath = NULL;
+
+// Latency of the loop, its lateness and every sensor read / fan write, only built with -DLATENCYSTATS.
+// Recording is a clock_gettime() and an increment, nothing is allocated. SIGUSR1 prints them to stderr.
+#ifdef LATENCYSTATS
+// Log-linear buckets : one per ns under LATSUB ns, above that every power of 2 is split in LATSUB
+// buckets (at most 1 / LATSUB off). The last bucket holds everything over ~4 s.
+#define LATSUBBITS 3
+#define LATSUB (1 << LATSUBBITS)
+#define LATBUCKETS ((32 - LATSUBBITS + 1) * LATSUB)
+struct latHist {
+    uint32_t buckets[LATBUCKETS];
+    uint64_t count, sumNs, maxNs;
+};
+struct latHist latTick, latLate;
+volatile sig_atomic_t latDumpPending = 0;
+
+void latAdd(struct latHist * hist, uint64_t ns) {
+    int idx = ns;
+    if (ns >= LATSUB) {
+        int exp = 63 - __builtin_clzll(ns);
+        idx = (exp - LATSUBBITS + 1) * LATSUB + ((ns >> (exp - LATSUBBITS)) & (LATSUB - 1));
+        idx = idx < LATBUCKETS ? idx : LATBUCKETS - 1;
+    }
+    hist->buckets[idx]++;
+    hist->count++;
+    hist->sumNs += ns;
+    hist->maxNs = ns > hist->maxNs ? ns : hist->maxNs;
+}
+
+void latRecord(struct latHist * hist, const struct timespec * start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    latAdd(hist, (now.tv_sec - start->tv_sec) * 1000000000LL + now.tv_nsec - start->tv_nsec);
+}
+
+// Called when the loop timer fired : how long ago it was due, from the time left until the next one.
+void latLateness(int tfd) {
+    struct itimerspec its;
+    if (timerfd_gettime(tfd, &its) == 0) {
+        int64_t late = (its.it_interval.tv_sec - its.it_value.tv_sec) * 1000000000LL + its.it_interval.tv_nsec - its.it_value.tv_nsec;
+        latAdd(&latLate, late > 0 ? late : 0);
+    }
+}
+
+// Upper edge of the bucket holding the p quantile, in ns.
+uint64_t latQuantile(const struct latHist * hist, double p) {
+    uint64_t want = (uint64_t) ceil(hist->count * p), seen = 0;
+    for (int idx = 0; idx < LATBUCKETS; idx++) {
+        seen += hist->buckets[idx];
+        if (seen >= want && seen) {
+            if (idx < LATSUB - 1) {
+                return idx + 1;
+            }
+            int exp = (idx + 1) / LATSUB + LATSUBBITS - 1;
+            uint64_t edge = (uint64_t) (LATSUB + (idx + 1) % LATSUB) << (exp - LATSUBBITS);
+            return edge < hist->maxNs ? edge : hist->maxNs;
+        }
+    }
+    return hist->maxNs;
+}
+
+void latPrint(const char * name, const struct latHist * hist) {
+    if (!hist->count) {
+        return;
+    }
+    fprintf(stderr, "%10lu %10.1f %10.1f %10.1f %10.1f %10.1f  %s\n", (unsigned long) hist->count, hist->sumNs / 1e3 / hist->count,
+        latQuantile(hist, 0.5) / 1e3, latQuantile(hist, 0.9) / 1e3, latQuantile(hist, 0.99) / 1e3, hist->maxNs / 1e3, name);
+}
+
+void onLatDump() {
+    latDumpPending = 1;
+}
 
+#define LATSTART(ts) struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts)
+#define LATEND(hist, ts) latRecord(hist, &ts)
+#define LATLATE(tfd) latLateness(tfd)
+#define LATDUMP() do { if (latDumpPending) { latDumpPending = 0; latDump(); } } while (0)
+#else
+#define LATSTART(ts)
+#define LATEND(hist, ts)
+#define LATLATE(tfd)
+#define LATDUMP()
+#endif
+
+// Fans and temp sensors are structures of arrays grown with realloc, so a loop only goes through the
+// fds and values it uses. The paths and names in fStruct / tStruct are only used to (re)open them.
 struct fStruct {
     char path[256];
-    int offs;
+    char rpmPath[256];
+    char key[128];
+    char dev[64];
+    char pwm[64];
+};
+struct fTable {
+    int size;
+    int * fd;
+    bool * stale;
+    int * offs;
+    int * chan;                  // Commander Pro channel with --hidraw, else -1
+    int * maxRpm;                // fanN_target fans (3-pin / DC mode), RPM at 255 of the curve, else 0
+    unsigned char * startPwm, * stopPwm, * satPwm;
+    int * lastPwm;               // PWM written last, -1 until the first write
+    _Atomic uint64_t * mail;     // --write-behind : PWM + 1 << 48 | microseconds it was posted, 0 when empty
+    atomic_bool * failed;        // --write-behind : the actuator's write failed
+    struct fStruct * info;
+#ifdef LATENCYSTATS
+    struct latHist * lat;
+#endif
 };
-struct fStruct fanArr[MAXFANS];
+struct fTable fans;
 struct tStruct {
     char path[256];
-    int offs;
-    int thres;
+    char dev[64];
+    char sen[64];
 };
-struct tStruct tsenArr[MAXTSEN];
+enum {SENOK, SENBACKOFF};
+struct sHealth {
+    unsigned char state;         // SENOK or SENBACKOFF
+    unsigned char good;          // Good probes in a row while backed off
+    unsigned short bad;          // Failed or slow reads in a row
+    unsigned short backoff;      // Loops between probes while backed off
+    unsigned short wait;         // Loops until the next probe
+    unsigned int latUs;          // Moving average of the read time
+    unsigned long reads, errors, slow, backoffs;
+};
+struct tTable {
+    int size;
+    bool lazy;                   // A sensor has a RATE, see canSkipSensor()
+    int * fd;
+    bool * stale;
+    int * offs;
+    int * thres;
+    int * last;
+    int * chan;                  // Commander Pro channel with --hidraw, else -1
+    float * rate;                // Max C per second the sensor changes, 0 to read it every loop
+    double * readAt;             // sensorClock() of the last good read
+    int * order;                 // Indexes of the sensors, hottest first when lazy
+    struct tStruct * info;
+    struct sHealth * health;
+#ifdef LATENCYSTATS
+    struct latHist * lat;
+#endif
+};
+struct tTable tsen;
+
+// Index of the hwmon directories, made with one readdir of class/hwmon and sorted by the device
+// they belong to, which unlike the hwmonN number doesn't change across reboots / driver reloads.
+struct hStruct {
+    char name[64];
+    char path[256];
+    char dev[256];
+};
+struct hStruct * hwmonArr = NULL;
+int curHwmon = 0, hwmonSize = 0, ueventFd = -1;
+bool rebindPending = false;
+double lastRebind = 0, slept = 0;
+
+#define GROWARR(arr, size) do { void * tmp = realloc(arr, (size) * sizeof(*(arr))); if (!tmp) { return false; } arr = tmp; } while (0)
+
+// Appends an empty fan to fans, curFans is its index.
+bool addFan() {
+    if (curFans + 1 >= fans.size) {
+        int size = fans.size ? fans.size * 2 : 8;
+        GROWARR(fans.fd, size);
+        GROWARR(fans.stale, size);
+        GROWARR(fans.offs, size);
+        GROWARR(fans.chan, size);
+        GROWARR(fans.maxRpm, size);
+        GROWARR(fans.startPwm, size);
+        GROWARR(fans.stopPwm, size);
+        GROWARR(fans.satPwm, size);
+        GROWARR(fans.lastPwm, size);
+        GROWARR(fans.mail, size);
+        GROWARR(fans.failed, size);
+        GROWARR(fans.info, size);
+#ifdef LATENCYSTATS
+        GROWARR(fans.lat, size);
+#endif
+        fans.size = size;
+    }
+    curFans++;
+    fans.fd[curFans] = -1;
+    fans.stale[curFans] = false;
+    fans.offs[curFans] = 0;
+    fans.chan[curFans] = -1;
+    fans.maxRpm[curFans] = 0;
+    fans.startPwm[curFans] = fans.stopPwm[curFans] = 0;
+    // The firmware can have left the fan at any speed, the first PWM is always written, even 0.
+    fans.lastPwm[curFans] = -1;
+    fans.satPwm[curFans] = 255;
+    atomic_init(&fans.mail[curFans], 0);
+    atomic_init(&fans.failed[curFans], false);
+    memset(&fans.info[curFans], 0, sizeof(struct fStruct));
+#ifdef LATENCYSTATS
+    memset(&fans.lat[curFans], 0, sizeof(struct latHist));
+#endif
+    return true;
+}
+
+// Appends an empty temp sensor to tsen, curTsen is its index. The unused entries
+// at the end of the table never change maxSensorTemp(), it can go over them.
+bool addSensor() {
+    if (curTsen + 1 >= tsen.size) {
+        int size = tsen.size ? tsen.size * 2 : TSENPAD;
+        GROWARR(tsen.fd, size);
+        GROWARR(tsen.stale, size);
+        GROWARR(tsen.offs, size);
+        GROWARR(tsen.thres, size);
+        GROWARR(tsen.last, size);
+        GROWARR(tsen.chan, size);
+        GROWARR(tsen.rate, size);
+        GROWARR(tsen.readAt, size);
+        GROWARR(tsen.order, size);
+        GROWARR(tsen.info, size);
+        GROWARR(tsen.health, size);
+#ifdef LATENCYSTATS
+        GROWARR(tsen.lat, size);
+        memset(tsen.lat + tsen.size, 0, (size - tsen.size) * sizeof(struct latHist));
+#endif
+        for (int i = tsen.size; i < size; i++) {
+            tsen.fd[i] = -1;
+            tsen.stale[i] = false;
+            tsen.offs[i] = tsen.thres[i] = 0;
+            tsen.last[i] = TEMPNONE;
+            tsen.chan[i] = -1;
+            tsen.rate[i] = 0;
+            tsen.readAt[i] = 0;
+            tsen.order[i] = i;
+            memset(&tsen.info[i], 0, sizeof(struct tStruct));
+            memset(&tsen.health[i], 0, sizeof(struct sHealth));
+        }
+        tsen.size = size;
+    }
+    curTsen++;
+    return true;
+}
+
+void freeFans(struct fTable * table) {
+    free(table->fd);
+    free(table->stale);
+    free(table->offs);
+    free(table->chan);
+    free(table->maxRpm);
+    free(table->startPwm);
+    free(table->stopPwm);
+    free(table->satPwm);
+    free(table->lastPwm);
+    free((void *) table->mail);
+    free((void *) table->failed);
+    free(table->info);
+#ifdef LATENCYSTATS
+    free(table->lat);
+#endif
+    memset(table, 0, sizeof(struct fTable));
+}
+
+void freeSensors(struct tTable * table) {
+    free(table->fd);
+    free(table->stale);
+    free(table->offs);
+    free(table->thres);
+    free(table->last);
+    free(table->chan);
+    free(table->rate);
+    free(table->readAt);
+    free(table->order);
+    free(table->info);
+    free(table->health);
+#ifdef LATENCYSTATS
+    free(table->lat);
+#endif
+    memset(table, 0, sizeof(struct tTable));
+}
 
 bool writeFile(const char * path, const char * value) {
     ssize_t size = strlen(value);
-    fd = open(path, O_RDWR);
+    fd = open(path, O_RDWR | O_TRUNC);
     if (fd < 0 || write(fd, value, size) != size) {
         close(fd);
         return false;
@@ -80,127 +430,1864 @@ bool readFile(const char * path, ssize_t size) {
     return true;
 }
 
-int getMaxTemp() {
-    int maxTemp = 0, senTemp = 0;
-    for (int i = 0; i <= curTsen; i++) {
-        if (!readFile(tsenArr[i].path, 7)) {
+// A failed read / write usually means the driver was reloaded, see rebindHwmon().
+void markStale(bool * stale) {
+    *stale = true;
+    if (monoTime() - lastRebind >= REBINDDELAY) {
+        rebindPending = true;
+    }
+}
+
+// Fail-safe of ccpfc : the fans at --fan-speed-high, see fanloop.h. RTHEAP is made room for by enterRealtime(),
+// for the tables of reloads and the socket clients.
+#define RTHEAP (1024 * 1024)
+
+// Once per tick before the fans are set, with the reads of the previous tick.
+void checkFailSafe() {
+    failedTicks = tickFailed ? failedTicks + 1 : 0;
+    if (deadlineMissed || failedTicks >= failSafeReads) {
+        goodTicks = 0;
+        if (!failSafe) {
+            failSafe = true;
+            statFailSafes++;
+            fprintf(stderr, "\nWARNING: %s, fans at --fan-speed-high.\n", deadlineMissed ? "Missed a deadline" : "Sensor reads failed");
+            sdNotify(deadlineMissed ? "STATUS=Fail-safe : missed a deadline" : "STATUS=Fail-safe : sensor reads failed");
+        }
+    } else if (failSafe && ++goodTicks >= failSafeReads) {
+        failSafe = false;
+        if (!silent) {
+            printf("\nLeft the fail-safe, back to the fan curve.\n");
+        }
+        sdNotify("STATUS=Running");
+    }
+    deadlineMissed = false;
+}
+
+// Sensor health : a sensor with SENBADREADS failed or slower than --sensor-slow reads in a row is backed off,
+// it's only probed after 2 loops, then 4, 8, ... up to SENMAXBACKOFF loops, so a gone device or a runtime
+// suspended GPU doesn't add its failed reads to every loop. Until it's back, the last temperature it read
+// stands in for it, plus SENMARGIN when its reads failed. After SENGOODREADS good probes in a row it's read every
+// loop again. On purpose, the failed probes of a backed off sensor don't count for --fail-safe-reads : one gone
+// sensor doesn't keep the fans at --fan-speed-high, its stand-in does. With --fail-safe-reads under SENBADREADS
+// the fail-safe comes first.
+unsigned short sensorSlowMs = 50;
+unsigned long statSensorBackoffs = 0;
+
+// The read of sensor i in the last loop failed (ok false) or took secs.
+void sensorHealth(int i, bool ok, double secs) {
+    struct sHealth * hl = &tsen.health[i];
+    bool slow = secs * 1000 > sensorSlowMs;
+    hl->reads++;
+    hl->errors += !ok;
+    hl->slow += slow;
+    hl->latUs = (hl->latUs * 7 + (unsigned int) (secs * 1e6)) / 8;
+    if (ok && !slow) {
+        hl->bad = 0;
+        if (hl->state == SENOK) {
+            return;
+        }
+        if (++hl->good < SENGOODREADS) {
+            hl->wait = 1;
+            return;
+        }
+        hl->state = SENOK;
+        if (!silent) {
+            printf("\nSensor '%s' is fine again.\n", tsen.info[i].path);
+        }
+        return;
+    }
+    hl->good = 0;
+    if (hl->state == SENBACKOFF) {
+        hl->backoff = hl->backoff * 2 > SENMAXBACKOFF ? SENMAXBACKOFF : hl->backoff * 2;
+    } else if (++hl->bad >= SENBADREADS) {
+        hl->state = SENBACKOFF;
+        hl->backoff = 2;
+        hl->backoffs++;
+        statSensorBackoffs++;
+        // A slow read is still a temperature, a failed one could be hiding a rise.
+        if (!ok && tsen.last[i] != TEMPNONE) {
+            tsen.last[i] += SENMARGIN;
+        }
+        fprintf(stderr, "\nWARNING: Sensor '%s' %s, probing it with backoff, its last temperature (+%d C) stands in for it.\n",
+            tsen.info[i].path, ok ? "is slow" : "failed", ok ? 0 : SENMARGIN);
+    }
+    hl->wait = hl->backoff;
+}
+
+// Throttle detection : a loop is throttled when the package_throttle_count (thermal_throttle, x86) of a CPU package
+// went up since the last loop, or on CPUs without it, when the scaling_max_freq of a cpufreq policy is under its
+// cpuinfo_max_freq and under the highest one it had since startup : a cooling device capping the clock while ccpfc
+// runs, not a cap that was set before. From the onset until THROTTLEHOLD seconds after the last
+// throttled loop, --throttle-boost is added to the fan curve, the fans react before the temperature does.
+#define THROTTLEHOLD 30.0
+#define MAXTHROTTLEFDS 64
+unsigned char throttleBoost = 0;
+int throttleFds[MAXTHROTTLEFDS], throttleFdCnt = 0;
+long throttleLast[MAXTHROTTLEFDS];  // Last count, or the highest scaling_max_freq
+long throttleMax[MAXTHROTTLEFDS];   // cpuinfo_max_freq
+bool throttleCounts = false, throttled = false;
+double throttleUntil = 0, throttleCheck = 0;
+unsigned long statThrottleEvents = 0, statThrottledMs = 0;
+
+long readThrottleFd(int tfd) {
+    char val[24];
+    ssize_t len = pread(tfd, val, sizeof(val) - 1, 0);
+    if (len < 1) {
+        return -1;
+    }
+    val[len] = 0;
+    return atol(val);
+}
+
+// Opens the counter of one CPU per package, or else the scaling_max_freq of every cpufreq policy.
+void openThrottle() {
+    char path[PATH_MAX];
+    long packages[MAXTHROTTLEFDS];
+    struct dirent * ent;
+    int num;
+    snprintf(path, sizeof(path), "%s/devices/system/cpu", sysfsRoot);
+    DIR * dir = opendir(path);
+    while (dir && (ent = readdir(dir)) && throttleFdCnt < MAXTHROTTLEFDS) {
+        if (sscanf(ent->d_name, "cpu%d", &num) != 1) {
             continue;
         }
-        senTemp = (int) round(atof(buf) / 1000.0);
-        if (senTemp > tsenArr[i].thres) {
-            senTemp += tsenArr[i].offs;
+        snprintf(path, sizeof(path), "%s/devices/system/cpu/cpu%d/topology/physical_package_id", sysfsRoot, num);
+        long package = readFile(path, sizeof(buf) - 1) ? atol(buf) : num;
+        bool seen = false;
+        for (int i = 0; i < throttleFdCnt; i++) {
+            seen = seen || packages[i] == package;
         }
-        if (senTemp > maxTemp) {
-            maxTemp = senTemp;
+        snprintf(path, sizeof(path), "%s/devices/system/cpu/cpu%d/thermal_throttle/package_throttle_count", sysfsRoot, num);
+        int tfd = seen ? -1 : open(path, O_RDONLY | O_CLOEXEC);
+        if (tfd >= 0) {
+            packages[throttleFdCnt] = package;
+            throttleLast[throttleFdCnt] = readThrottleFd(tfd);
+            throttleFds[throttleFdCnt++] = tfd;
         }
-        if (maxTemp >= highTemp) {
-            break;
+    }
+    if (dir) {
+        closedir(dir);
+    }
+    throttleCounts = throttleFdCnt > 0;
+    if (throttleCounts) {
+        return;
+    }
+    snprintf(path, sizeof(path), "%s/devices/system/cpu/cpufreq", sysfsRoot);
+    dir = opendir(path);
+    while (dir && (ent = readdir(dir)) && throttleFdCnt < MAXTHROTTLEFDS) {
+        if (sscanf(ent->d_name, "policy%d", &num) != 1) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/devices/system/cpu/cpufreq/policy%d/cpuinfo_max_freq", sysfsRoot, num);
+        long maxFreq = readFile(path, sizeof(buf) - 1) ? atol(buf) : -1;
+        snprintf(path, sizeof(path), "%s/devices/system/cpu/cpufreq/policy%d/scaling_max_freq", sysfsRoot, num);
+        int tfd = maxFreq > 0 ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+        if (tfd >= 0) {
+            throttleMax[throttleFdCnt] = maxFreq;
+            throttleLast[throttleFdCnt] = readThrottleFd(tfd);
+            throttleFds[throttleFdCnt++] = tfd;
         }
     }
-    return maxTemp;
+    if (dir) {
+        closedir(dir);
+    }
 }
 
-void setFanSpeed() {
-    int tmpSpeed, fanSpeed, temp = getMaxTemp();
-    if (temp < lowTemp) {
-        tmpSpeed = minFanSpeed;
-    } else if (fanLut[temp]) {
-        tmpSpeed = fanLut[temp];
+// Once per loop before the fans are set.
+void checkThrottle() {
+    double now = monoTime();
+    bool was = throttled;
+    throttled = false;
+    for (int i = 0; i < throttleFdCnt; i++) {
+        long val = readThrottleFd(throttleFds[i]);
+        if (val < 0) {
+            continue;
+        }
+        if (throttleCounts) {
+            throttled = throttled || val > throttleLast[i];
+            throttleLast[i] = val;
+        } else {
+            // A cap that was lifted raises the reference, a new one under it is throttling.
+            throttleLast[i] = val > throttleLast[i] ? val : throttleLast[i];
+            throttled = throttled || (val < throttleMax[i] && val < throttleLast[i]);
+        }
+    }
+    // The time since the last check, which is 0 after a resume.
+    if (throttled && throttleCheck) {
+        statThrottledMs += (unsigned long) ((now - throttleCheck) * 1000.0 + 0.5);
+    }
+    throttleCheck = now;
+    if (!throttled) {
+        return;
+    }
+    throttleUntil = now + THROTTLEHOLD;
+    if (!was) {
+        statThrottleEvents++;
+        if (!silent) {
+            printf("\nThe CPU is throttling%s.\n", throttleBoost ? ", raising the fan speed" : "");
+        }
+    }
+}
+
+// Commander Pro over /dev/hidrawN (--hidraw) instead of the corsair-cpro driver, which sends one request and
+// waits for its response per sysfs read / write. A request is an output report of 63 bytes (written with the
+// report number 0 in front), the response an input report of 16 bytes, its first byte is 0 on success.
+// The requests of a loop are queued, then up to hidDepth are written before reading their responses, which
+// the device sends back in order. The temperature of a channel is in centidegrees in bytes 1-2 of the response.
+#define HIDOUT 64
+#define HIDIN 16
+#define HIDTIMEOUT 300
+#define HIDTEMPS 4
+#define HIDFANS 6
+#define HIDQUEUE 16
+#define HIDGETTEMPCNCT 0x10
+#define HIDGETTEMP 0x11
+#define HIDSETPWM 0x23
+#define HIDSETTARGET 0x24
+#define HIDID "HID_ID=0003:00001B1C:00000C10"
+struct hidReq {
+    unsigned char cmd, chan;
+    unsigned short value;        // PWM in percent, or RPM sent big endian in 2 bytes
+    int idx;                     // Index in tsen / fans of the sensor / fan the request is for
+};
+struct hidReq hidQueue[HIDQUEUE];
+int hidFd = -1, hidQueued = 0, hidDepth = 8;
+const char * hidPath = NULL;
+char hidDev[64] = "socket";
+
+// --write-behind : the fans are written by an actuator thread instead of the loop, so a slow write (a USB round
+// trip of the corsair-cpro driver) doesn't hold up the next sensor reads. Every fan has a mailbox with the latest
+// PWM of the loop, the actuator only writes the PWM that's there when it gets to it, older ones are coalesced.
+#define ACTSTACK (64 * 1024)
+#define MAILTIME 0xffffffffffffULL
+bool writeBehind = false, actPosted = false;
+int actEvent = -1;
+pthread_t actThread;
+pthread_mutex_t actLock = PTHREAD_MUTEX_INITIALIZER;
+unsigned long statCoalesced = 0;
+_Atomic unsigned long statActWrites = 0, statQueueUs = 0, statQueueMaxUs = 0;
+
+// -1 if there was no response in time, else the status byte.
+int hidResponse(unsigned char * in) {
+    struct pollfd pfd = {hidFd, POLLIN, 0};
+    if (poll(&pfd, 1, HIDTIMEOUT) < 1 || read(hidFd, in, HIDIN) < 3) {
+        return -1;
+    }
+    return in[0];
+}
+
+void hidResult(const struct hidReq * req, int status, const unsigned char * in) {
+    if (req->cmd == HIDGETTEMP) {
+        // A failed read keeps the last temperature, it only fails the loop when the sensor isn't backed off.
+        if (status == 0) {
+            tsen.last[req->idx] = (int) round((in[1] << 8 | in[2]) / 100.0);
+        }
+        statReadErrors += status != 0;
+        tickFailed = tickFailed || (status != 0 && tsen.health[req->idx].state == SENOK);
+        sensorHealth(req->idx, status == 0, 0);
     } else {
-        tmpSpeed = highFanSpeed;
+        // Written again on the next loop.
+        fans.stale[req->idx] = status != 0;
+    }
+}
+
+void hidFlush() {
+    unsigned char out[HIDOUT], in[HIDIN];
+    bool lost = false;
+    // A response that came after its timeout would be taken for the one of the next request.
+    while (read(hidFd, in, sizeof(in)) > 0);
+    for (int start = 0; start < hidQueued; start += hidDepth) {
+        int end = start + hidDepth < hidQueued ? start + hidDepth : hidQueued, sent = start;
+        for (; !lost && sent < end; sent++) {
+            memset(out, 0, sizeof(out));
+            out[1] = hidQueue[sent].cmd;
+            out[2] = hidQueue[sent].chan;
+            if (out[1] == HIDSETTARGET) {
+                out[3] = hidQueue[sent].value >> 8;
+                out[4] = hidQueue[sent].value & 0xff;
+            } else {
+                out[3] = hidQueue[sent].value;
+            }
+            if (write(hidFd, out, sizeof(out)) != sizeof(out)) {
+                break;
+            }
+            statHidRequests++;
+        }
+        statHidRoundTrips += sent > start;
+        for (int i = start; i < end; i++) {
+            int status = !lost && i < sent ? hidResponse(in) : -1;
+            // Don't wait HIDTIMEOUT for every request when the device stopped answering.
+            lost = lost || status < 0;
+            hidResult(&hidQueue[i], status, in);
+        }
+    }
+    hidQueued = 0;
+}
+
+void hidRequest(unsigned char cmd, int chan, int value, int idx) {
+    if (hidQueued == HIDQUEUE) {
+        hidFlush();
+    }
+    hidQueue[hidQueued++] = (struct hidReq) {cmd, (unsigned char) chan, (unsigned short) value, idx};
+}
+
+// Commander Pro channel of a corsaircpro tempN_input / pwmN / fanN_target with --hidraw, else -1.
+int hidChannel(const char * dev, const char * file, const char * prefix, int channels) {
+    if (hidFd < 0 || strcmp(dev, "corsaircpro") != 0 || strncmp(file, prefix, strlen(prefix)) != 0) {
+        return -1;
+    }
+    int num = atoi(file + strlen(prefix));
+    return num >= 1 && num <= channels ? num - 1 : -1;
+}
+
+// --hidraw=auto : the first hidraw device with the USB IDs of the Commander Pro.
+bool findHidraw(char * path, size_t size) {
+    char base[128], tmpPath[400];
+    sprintf(base, "%.100s/class/hidraw", sysfsRoot);
+    DIR *dir = opendir(base);
+    struct dirent *files;
+    bool found = false;
+    while (dir && !found && (files = readdir(dir)) != NULL) {
+        snprintf(tmpPath, sizeof(tmpPath), "%s/%.200s/device/uevent", base, files->d_name);
+        buf[0] = 0;
+        if (files->d_name[0] != '.' && readFile(tmpPath, sizeof(buf) - 1) && strstr(buf, HIDID)) {
+            snprintf(path, size, "/dev/%s", files->d_name);
+            found = true;
+        }
     }
-    if (smoothDown && tmpSpeed < lastFanSpeed) {
-        tmpSpeed = lastFanSpeed - smoothDown;
-        if (tmpSpeed < minFanSpeed) {
-            tmpSpeed = minFanSpeed;
+    if (dir) {
+        closedir(dir);
+    }
+    return found;
+}
+
+// The corsair-cpro driver keeps sending its own requests when it's bound, the responses would get mixed up.
+// hidDev is the HID device, the same one the hwmon directory of the driver belongs to, so the calibration
+// of the fans made with the driver is used with --hidraw too.
+bool checkHidDriver(const char * path) {
+    char tmpPath[300], realPath[PATH_MAX];
+    const char * name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    snprintf(tmpPath, sizeof(tmpPath), "%.100s/class/hidraw/%.100s/device", sysfsRoot, name);
+    if (realpath(tmpPath, realPath)) {
+        snprintf(hidDev, sizeof(hidDev), "%s", strrchr(realPath, '/') + 1);
+    }
+    strcat(tmpPath, "/driver");
+    if (realpath(tmpPath, realPath) && strcmp(strrchr(realPath, '/') + 1, "corsair-cpro") == 0) {
+        fprintf(stderr, "ERROR: %s is used by the corsair-cpro driver, unbind it first: echo %s > /sys/bus/hid/drivers/corsair-cpro/unbind\n",
+            path, hidDev);
+        return false;
+    }
+    return true;
+}
+
+// A path to a unix socket is a stand-in device (ccpsim.c), a SOCK_SEQPACKET socket keeps the reports apart like hidraw.
+bool openHidraw() {
+    char path[PATH_MAX];
+    unsigned char out[HIDOUT] = {0, HIDGETTEMPCNCT}, in[HIDIN];
+    struct stat st;
+    if (strcmp(hidPath, "auto") != 0) {
+        snprintf(path, sizeof(path), "%s", hidPath);
+    } else if (!findHidraw(path, sizeof(path))) {
+        fprintf(stderr, "ERROR: Could not find a Commander Pro hidraw device.\n");
+        return false;
+    }
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+        hidFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (hidFd >= 0 && connect(hidFd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+            close(hidFd);
+            hidFd = -1;
         }
-    } else if (smoothUp && tmpSpeed > lastFanSpeed) {
-        tmpSpeed = lastFanSpeed + smoothUp;
-        if (tmpSpeed > highFanSpeed) {
-            tmpSpeed = highFanSpeed;
+    } else if (checkHidDriver(path)) {
+        hidFd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    } else {
+        return false;
+    }
+    // Which temperature probes are connected, in bytes 1-4, also tells if it's a Commander Pro answering.
+    if (hidFd < 0 || write(hidFd, out, sizeof(out)) != sizeof(out) || hidResponse(in) != 0) {
+        fprintf(stderr, "ERROR: No response from the Commander Pro at '%s'\n", path);
+        return false;
+    }
+    for (int i = 0; i <= curTsen; i++) {
+        int chan = hidChannel(tsen.info[i].dev, tsen.info[i].sen, "temp", HIDTEMPS);
+        if (chan >= 0 && !in[chan + 1]) {
+            fprintf(stderr, "ERROR: No temperature probe connected to channel %d of the Commander Pro.\n", chan + 1);
+            return false;
         }
     }
-    if (tmpSpeed != lastFanSpeed) {
+    if (!silent) {
+        printf("Using the Commander Pro at '%s' (%s)\n", path, hidDev);
+    }
+    return true;
+}
+
+// Sensors and fans stay open, sysfs files can be read / written again at offset 0.
+bool readSensor(int i) {
+    if (replay) {
+        sprintf(buf, "%d", replayTemps[i]);
+        return replayTemps[i] != REPLAYFAIL;
+    }
+    LATSTART(start);
+    ssize_t len = tsen.fd[i] >= 0 ? pread(tsen.fd[i], buf, 7, 0) : -1;
+    LATEND(&tsen.lat[i], start);
+    if (len < 1) {
+        markStale(&tsen.stale[i]);
+        return false;
+    }
+    buf[len] = 0;
+    return true;
+}
+
+// What writeFan() puts in the file of fan i for PWM pwm of the curve, RPM for fanN_target fans.
+int fanValue(int i, int pwm) {
+    return fans.maxRpm[i] ? (pwm * fans.maxRpm[i] + 127) / 255 : pwm;
+}
+
+// value is from the curve (0-255). fanN_target fans get it as RPM, up to their MAXRPM.
+// Fans on --hidraw are queued, the caller sends them with hidFlush().
+bool writeFan(int i, const char * value) {
+    char rpm[8];
+    if (replay) {
+        replayWrites++;
+        return true;
+    }
+    if (fans.maxRpm[i]) {
+        snprintf(rpm, sizeof(rpm), "%d", fanValue(i, atoi(value)));
+        value = rpm;
+    }
+    if (fans.chan[i] >= 0) {
+        hidRequest(fans.maxRpm[i] ? HIDSETTARGET : HIDSETPWM, fans.chan[i], fans.maxRpm[i] ? atoi(value) : (atoi(value) * 100 + 127) / 255, i);
+        return true;
+    }
+    ssize_t size = strlen(value);
+    LATSTART(start);
+    // A --sysfs-root tree is made of regular files, cut what's left of a longer previous value.
+    bool ok = fans.fd[i] >= 0 && pwrite(fans.fd[i], value, size, 0) == size && (!fakeSysfs || ftruncate(fans.fd[i], size) == 0);
+    LATEND(&fans.lat[i], start);
+    // The actuator of --write-behind leaves the rebind to the loop, see setFanSpeed().
+    if (!ok && actEvent >= 0) {
+        atomic_store(&fans.failed[i], true);
+    } else if (!ok) {
+        markStale(&fans.stale[i]);
+    }
+    return ok;
+}
+
+uint64_t monoUs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+// The actuator thread of --write-behind : writes what's in the mailboxes when the loop wakes it. It holds
+// actLock while writing, the loop only takes it to change the fds or the tables (rebind, reload).
+void * actuator(void * arg) {
+    char value[8];
+    uint64_t wakes;
+    (void) arg;
+    while (read(actEvent, &wakes, sizeof(wakes)) == sizeof(wakes)) {
+        pthread_mutex_lock(&actLock);
         for (int i = 0; i <= curFans; i++) {
-            fanSpeed = tmpSpeed + fanArr[i].offs;
-            if (fanSpeed < 0) {
-                fanSpeed = 0;
-            } else if (fanSpeed > 255) {
-                fanSpeed = 255;
+            uint64_t mail = atomic_exchange(&fans.mail[i], 0);
+            if (!mail) {
+                continue;
             }
-            sprintf(buf, "%d", fanSpeed);
-            writeFile(fanArr[i].path, buf);
+            unsigned long delay = (monoUs() - mail) & MAILTIME;
+            statQueueUs += delay;
+            if (delay > statQueueMaxUs) {
+                statQueueMaxUs = delay;
+            }
+            statActWrites++;
+            sprintf(value, "%d", (int) (mail >> 48) - 1);
+            writeFan(i, value);
+        }
+        pthread_mutex_unlock(&actLock);
+    }
+    return NULL;
+}
+
+bool startActuator() {
+    pthread_attr_t attr;
+    sigset_t all, old;
+    actEvent = eventfd(0, EFD_CLOEXEC);
+    if (actEvent < 0) {
+        fprintf(stderr, "ERROR: --write-behind : Could not create eventfd.\n");
+        return false;
+    }
+    // Signals are handled by the loop. A small stack, mlockall() of --realtime locks all of it.
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, ACTSTACK);
+    // SCHED_RESET_ON_FORK of --realtime applies to threads too, the priority is given explicitly.
+    if (rtPriority) {
+        struct sched_param param = {.sched_priority = rtPriority};
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        pthread_attr_setschedparam(&attr, &param);
+    }
+    bool ok = pthread_create(&actThread, &attr, actuator, NULL) == 0;
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (!ok) {
+        fprintf(stderr, "ERROR: --write-behind : Could not start the actuator thread.\n");
+        close(actEvent);
+        actEvent = -1;
+    }
+    return ok;
+}
+
+// Fan i gets pwm : written now, or with --write-behind posted to its mailbox for the actuator,
+// replacing a PWM the actuator didn't write yet. The caller wakes the actuator with wakeActuator().
+bool setFan(int i, int pwm) {
+    char value[8];
+    if (actEvent >= 0 && fans.chan[i] < 0) {
+        uint64_t mail = (uint64_t) (pwm + 1) << 48 | (monoUs() & MAILTIME);
+        statCoalesced += atomic_exchange(&fans.mail[i], mail) != 0;
+        actPosted = true;
+        return true;
+    }
+    sprintf(value, "%d", pwm);
+    return writeFan(i, value);
+}
+
+void wakeActuator() {
+    uint64_t one = 1;
+    actPosted = false;
+    if (write(actEvent, &one, sizeof(one)) != sizeof(one)) {
+        fprintf(stderr, "WARNING: --write-behind : Could not wake the actuator.\n");
+    }
+}
+
+// The fan curve's PWM for temp, before the fail-safe, pinning and smoothing.
+int curveSpeed(int temp) {
+    return lutSpeed(fanLut, temp, minFanSpeed, lowTemp, highTemp, highFanSpeed);
+}
+
+// Temperature of sensor i with its offset applied.
+int sensorTemp(int i) {
+    return offsetTemp(tsen.last[i], tsen.offs[i], tsen.thres[i]);
+}
+
+// Seconds, virtual with --replay.
+double sensorClock() {
+    return replay ? replayNow : monoTime();
+}
+
+// Lazy sensors : a sensor with a RATE is not read when, changing at most RATE C per second since its last good
+// read, it can't be above maxTemp (the highest temperature read so far this loop), or only where the fan curve
+// gives the same PWM as for maxTemp. The fans get the same PWM as when every sensor is read.
+bool canSkipSensor(int i, int maxTemp, double now) {
+    if (tsen.rate[i] <= 0 || tsen.last[i] == TEMPNONE) {
+        return false;
+    }
+    // last is rounded, the sensor could have been up to 0.5 C higher.
+    int bound = tsen.last[i] + (int) ceil(0.5 + tsen.rate[i] * (now - tsen.readAt[i]));
+    if (bound > tsen.thres[i] && tsen.offs[i] > 0) {
+        bound += tsen.offs[i];
+    }
+    if (bound <= maxTemp) {
+        return true;
+    }
+    int speed = curveSpeed(maxTemp);
+    // Every temperature below lowTemp and above highTemp has the same PWM.
+    for (int t = maxTemp + 1 > lowTemp ? maxTemp + 1 : lowTemp; t <= bound && t <= highTemp + 1; t++) {
+        if (curveSpeed(t) != speed) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Insertion sort of tsen.order by the last temperatures, hottest first. The order rarely changes between
+// loops, so it's about one pass over the sensors.
+void sortSensors() {
+    for (int k = 1; k <= curTsen; k++) {
+        int i = tsen.order[k], temp = sensorTemp(i), j = k - 1;
+        for (; j >= 0 && sensorTemp(tsen.order[j]) < temp; j--) {
+            tsen.order[j + 1] = tsen.order[j];
+        }
+        tsen.order[j + 1] = i;
+    }
+}
+
+void readSensors() {
+    double now = tsen.lazy ? sensorClock() : 0;
+    int maxTemp = TEMPNONE;
+    tickFailed = false;
+    // The Commander Pro sensors are read together first, they count as read for the lazy sensors.
+    for (int i = 0; i <= curTsen; i++) {
+        if (tsen.chan[i] >= 0 && (tsen.health[i].state == SENOK || !(tsen.health[i].wait && --tsen.health[i].wait))) {
+            hidRequest(HIDGETTEMP, tsen.chan[i], 0, i);
+            statSensorReads++;
+        }
+    }
+    if (hidQueued) {
+        hidFlush();
+    }
+    if (tsen.lazy) {
+        sortSensors();
+    }
+    for (int k = 0; k <= curTsen; k++) {
+        int i = tsen.order[k];
+        if (tsen.chan[i] >= 0 || (tsen.health[i].state == SENBACKOFF && tsen.health[i].wait && --tsen.health[i].wait)) {
+            maxTemp = sensorTemp(i) > maxTemp ? sensorTemp(i) : maxTemp;
+            continue;
+        }
+        // A backed off sensor is probed when its wait is over, sensorHealth() sets the next wait.
+        if (tsen.lazy && tsen.health[i].state == SENOK && canSkipSensor(i, maxTemp, now)) {
+            statLazySkips++;
+            continue;
+        }
+        double start = monoTime();
+        bool ok = readSensor(i);
+        if (ok) {
+            tsen.last[i] = (int) round(atof(buf) / 1000.0);
+            tsen.readAt[i] = now;
+        }
+        statSensorReads++;
+        statReadErrors += !ok;
+        tickFailed = tickFailed || (!ok && tsen.health[i].state == SENOK);
+        sensorHealth(i, ok, replay ? 0 : monoTime() - start);
+        maxTemp = sensorTemp(i) > maxTemp ? sensorTemp(i) : maxTemp;
+    }
+}
+
+// Highest temperature with the offsets applied, in a loop without branches or calls that gcc vectorizes.
+// It goes up to a multiple of TSENPAD so -O2 needs no scalar loop for the rest, see addSensor().
+int maxSensorTemp() {
+    int maxTemp = 0;
+    const int * restrict last = tsen.last, * restrict offs = tsen.offs, * restrict thres = tsen.thres;
+    for (int i = 0, n = (curTsen + TSENPAD) & ~(TSENPAD - 1); i < n; i++) {
+        int senTemp = offsetTemp(last[i], offs[i], thres[i]);
+        maxTemp = senTemp > maxTemp ? senTemp : maxTemp;
+    }
+    return maxTemp;
+}
+
+int getMaxTemp() {
+    readSensors();
+    return maxSensorTemp();
+}
+
+// The PWM for temp after the fail-safe, pinning, the throttle boost and smoothing.
+int targetSpeed(int temp) {
+    int tmpSpeed = curveSpeed(temp);
+    double now = monoTime();
+    if (pinUntil && now >= pinUntil) {
+        pinUntil = 0;
+    }
+    // Ahead of the curve while throttling, not slowed down by --fan-smooth-up.
+    bool boost = throttleBoost && throttleUntil > now;
+    if (boost) {
+        tmpSpeed = tmpSpeed + throttleBoost > highFanSpeed ? highFanSpeed : tmpSpeed + throttleBoost;
+    }
+    if (failSafe) {
+        tmpSpeed = highFanSpeed;
+    } else if (pinUntil) {
+        tmpSpeed = pinSpeed;
+    } else {
+        tmpSpeed = smoothSpeed(tmpSpeed, lastFanSpeed, boost ? 0 : smoothUp, smoothDown, minFanSpeed, highFanSpeed);
+    }
+    return tmpSpeed;
+}
+
+// Writes tmpSpeed plus their offsets to the fans.
+void writeFans(int tmpSpeed) {
+    int fanSpeed;
+    // Checked per fan, so a fan that was reopened or had a failed write gets its speed again.
+    for (int i = 0; i <= curFans; i++) {
+        fanSpeed = tmpSpeed + fans.offs[i];
+        if (fanSpeed < 0) {
+            fanSpeed = 0;
+        } else if (fanSpeed > 255) {
+            fanSpeed = 255;
+        }
+        // Keep the fan inside the range found by --calibrate.
+        if (fanSpeed > fans.satPwm[i]) {
+            fanSpeed = fans.satPwm[i];
+        } else if (fanSpeed && fans.lastPwm[i] > 0 && fanSpeed < fans.stopPwm[i]) {
+            fanSpeed = fans.stopPwm[i];
+        } else if (fanSpeed && fans.lastPwm[i] <= 0 && fanSpeed < fans.startPwm[i]) {
+            fanSpeed = fans.startPwm[i];
+        }
+        if (actEvent >= 0 && atomic_exchange(&fans.failed[i], false)) {
+            markStale(&fans.stale[i]);
+        }
+        if (fanSpeed == fans.lastPwm[i] && !fans.stale[i]) {
+            continue;
+        }
+        if (setFan(i, fanSpeed)) {
+            fans.lastPwm[i] = fanSpeed;
+            statWrites++;
+            stateDirty = true;
+        }
+    }
+    if (hidQueued) {
+        hidFlush();
+    }
+    if (actPosted) {
+        wakeActuator();
+    }
+    lastFanSpeed = tmpSpeed;
+}
+
+void setFanSpeed() {
+    int temp = getMaxTemp();
+    // The sensor that failed could be the hottest one, a failed read never lowers the temperature.
+    if (tickFailed && temp < lastTemp) {
+        temp = lastTemp;
+    }
+    int tmpSpeed = targetSpeed(temp);
+    writeFans(tmpSpeed);
+    if (!silent) {
+        printf("\rHighest Temp %2d C -> Fan Speed %3d PWM", temp, tmpSpeed);
+        fflush(stdout);
+    }
+    lastTemp = temp;
+}
+
+// Telemetry ring, see --telemetry and telemetry.h.
+struct teleHeader * tele = NULL;
+const char * telePath = NULL;
+// Counters in the telemetry header, in the order publishTelemetry() fills them.
+const char * teleCounters[] = {"fan_writes", "read_errors", "reloads", "requests", "hid_requests", "hid_round_trips",
+    "deadline_misses", "fail_safes", "throttle_events", "throttled_ms", NULL};
+
+void publishTelemetry(const struct timespec * tickStart) {
+    struct teleSample * smp = beginSample(tele, tickStart);
+    smp->temp = lastTemp;
+    for (unsigned int i = 0; i < tele->nTemps; i++) {
+        smp->temps[i] = tsen.last[i];
+    }
+    for (unsigned int i = 0; i < tele->nFans; i++) {
+        smp->fans[i] = fans.lastPwm[i] < 0 ? 0 : fans.lastPwm[i];
+    }
+    smp->throttled = throttled;
+    endSample(tele, smp);
+    tele->counters[0] = statWrites;
+    tele->counters[1] = statReadErrors;
+    tele->counters[2] = statReloads;
+    tele->counters[3] = statRequests;
+    tele->counters[4] = statHidRequests;
+    tele->counters[5] = statHidRoundTrips;
+    tele->counters[6] = statDeadlineMisses;
+    tele->counters[7] = statFailSafes;
+    tele->counters[8] = statThrottleEvents;
+    tele->counters[9] = statThrottledMs;
+}
+
+// After the fans are (re)opened, so fanexporter reads the RPM of the right fanN_input,
+// and the readers name the temps of the sensors of the current config.
+void publishRpmPaths() {
+    for (unsigned int i = 0; i < tele->nFans; i++) {
+        snprintf(tele->rpmPaths[i], sizeof(tele->rpmPaths[i]), "%s", fans.info[i].rpmPath);
+    }
+    for (unsigned int i = 0; i < tele->nTemps; i++) {
+        snprintf(tele->tempNames[i], sizeof(tele->tempNames[i]), "%.15s:%.15s", tsen.info[i].dev, tsen.info[i].sen);
+    }
+}
+
+bool fileExists(const char * path) {
+    if (path && access(path, F_OK) == 0) {
+        return true;
+    }
+    fprintf(stderr, "ERROR: Could not find file '%s'\n", path);
+    return false;
+}
+
+int cmpHwmon(const void * a, const void * b) {
+    return strcmp(((const struct hStruct *) a)->dev, ((const struct hStruct *) b)->dev);
+}
+
+bool scanHwmon() {
+    char base[128], tmpPath[300], devPath[PATH_MAX];
+    sprintf(base, "%.100s/class/hwmon", sysfsRoot);
+    DIR *dir = opendir(base);
+    if (!dir) {
+        fprintf(stderr, "ERROR: Could not find base hwmon directory.\n");
+        return false;
+    }
+    struct dirent *files;
+    curHwmon = 0;
+    while ((files = readdir(dir)) != NULL) {
+        if (!strstr(files->d_name, "hwmon")) {
+            continue;
+        }
+        if (curHwmon == hwmonSize) {
+            struct hStruct * tmp = realloc(hwmonArr, (hwmonSize ? hwmonSize * 2 : 32) * sizeof(struct hStruct));
+            if (!tmp) {
+                break;
+            }
+            hwmonArr = tmp;
+            hwmonSize = hwmonSize ? hwmonSize * 2 : 32;
+        }
+        struct hStruct * hw = &hwmonArr[curHwmon];
+        snprintf(hw->path, sizeof(hw->path), "%.100s/%.100s", base, files->d_name);
+        snprintf(tmpPath, sizeof(tmpPath), "%s/name", hw->path);
+        if (!readFile(tmpPath, sizeof(hw->name) - 1)) {
+            continue;
+        }
+        snprintf(hw->name, sizeof(hw->name), "%.*s", (int) strcspn(buf, "\n"), buf);
+        snprintf(tmpPath, sizeof(tmpPath), "%s/device", hw->path);
+        snprintf(hw->dev, sizeof(hw->dev), "%s", realpath(tmpPath, devPath) ? devPath : hw->path);
+        curHwmon++;
+    }
+    closedir(dir);
+    qsort(hwmonArr, curHwmon, sizeof(struct hStruct), cmpHwmon);
+    return true;
+}
+
+// NAME@N is the Nth (from 0) hwmon directory called NAME in the index, for devices that
+// have one hwmon directory per disk / controller like drivetemp and nvme.
+const struct hStruct * lookupHwmon(const char * name) {
+    char want[64];
+    int skip = strchr(name, '@') ? atoi(strchr(name, '@') + 1) : 0;
+    snprintf(want, sizeof(want), "%.*s", (int) strcspn(name, "@"), name);
+    for (int i = 0; i < curHwmon; i++) {
+        if (strstr(hwmonArr[i].name, want) != NULL && skip-- == 0) {
+            return &hwmonArr[i];
+        }
+    }
+    return NULL;
+}
+
+const char * findHwmon(const char * name, bool showErr) {
+    const struct hStruct * hw = lookupHwmon(name);
+    if (!hw && showErr) {
+        fprintf(stderr, "ERROR: Could not find hwmon directory. '%s'\n", name);
+    }
+    return hw ? hw->path : NULL;
+}
+
+// Cache key of a fan : hwmon name, the device the hwmon dir belongs to and the pwm file.
+void setFanKey(struct fStruct * fan, const struct hStruct * hw) {
+    const char * devName = strrchr(hw->dev, '/') != NULL ? strrchr(hw->dev, '/') + 1 : "unknown";
+    snprintf(fan->key, sizeof(fan->key), "%s@%s:%s", hw->name, devName, fan->pwm);
+}
+
+// fanN_input of a pwmN / fanN_target fan.
+void setRpmPath(struct fStruct * fan, const char * hwmonPath) {
+    const char * num = fan->pwm + strcspn(fan->pwm, "0123456789");
+    snprintf(fan->rpmPath, sizeof(fan->rpmPath), "%.190s/fan%.*s_input", hwmonPath, (int) strspn(num, "0123456789"), num);
+}
+
+// Waits for the fan RPM to stop changing, returns -1 if it can't be read.
+int settleFanRpm(const char * path) {
+    int rpm = -1, lastRpm = -1;
+    for (int i = 0; i < CALSETTLE; i++) {
+        usleep(interval * 1000000);
+        if (!readFile(path, 7)) {
+            return -1;
+        }
+        rpm = atoi(buf);
+        if (lastRpm >= 0 && abs(rpm - lastRpm) <= (lastRpm / 50 > 30 ? lastRpm / 50 : 30)) {
+            break;
+        }
+        lastRpm = rpm;
+    }
+    return rpm;
+}
+
+bool setCalPwm(int fan, int pwm) {
+    sprintf(buf, "%d", pwm);
+    if (!writeFile(fans.info[fan].path, buf)) {
+        fprintf(stderr, "ERROR: Could not write to '%s'\n", fans.info[fan].path);
+        return false;
+    }
+    return true;
+}
+
+// Sweeps the fan from 255 PWM down to 0 PWM and back up, to find at what PWM the fan
+// stops spinning, at what PWM it starts spinning and at what PWM the RPM stops rising.
+bool calibrateFan(int fan, int * rpmMap) {
+    int i, rpm, maxRpm;
+    const char * key = fans.info[fan].key, * rpmPath = fans.info[fan].rpmPath;
+    if (!setCalPwm(fan, 255) || (maxRpm = settleFanRpm(rpmPath)) < 0) {
+        return false;
+    }
+    if (maxRpm == 0) {
+        fprintf(stderr, "ERROR: %s : fan is not spinning at 255 PWM.\n", key);
+        return false;
+    }
+    fans.stopPwm[fan] = 0;
+    for (i = CALPOINTS - 1; i >= 0; i--) {
+        if (fans.stopPwm[fan]) {
+            rpmMap[i] = 0;
+            continue;
+        }
+        if (!setCalPwm(fan, i * CALSTEP) || (rpm = settleFanRpm(rpmPath)) < 0) {
+            return false;
+        }
+        rpmMap[i] = rpm;
+        if (rpm == 0) {
+            fans.stopPwm[fan] = (i + 1) * CALSTEP;
+        }
+        if (!silent) {
+            printf("\r%s : %3d PWM -> %5d RPM", key, i * CALSTEP, rpm);
+            fflush(stdout);
+        }
+    }
+    fans.startPwm[fan] = fans.satPwm[fan] = 255;
+    for (i = fans.stopPwm[fan] / CALSTEP; i < CALPOINTS; i++) {
+        if (!setCalPwm(fan, i * CALSTEP) || (rpm = settleFanRpm(rpmPath)) < 0) {
+            return false;
+        }
+        if (rpm > 0) {
+            fans.startPwm[fan] = i * CALSTEP;
+            break;
+        }
+    }
+    for (i = 0; i < CALPOINTS; i++) {
+        if (rpmMap[i] * 100 >= maxRpm * 97) {
+            fans.satPwm[fan] = i * CALSTEP;
+            break;
+        }
+    }
+    if (!silent) {
+        printf("\r%s : start %3d PWM ; stop %3d PWM ; saturation %3d PWM (%d RPM)\n",
+            key, fans.startPwm[fan], fans.stopPwm[fan], fans.satPwm[fan], rpmMap[fans.satPwm[fan] / CALSTEP]);
+    }
+    return setCalPwm(fan, 255);
+}
+
+// Calibration file format, one fan per line : KEY START_PWM STOP_PWM SATURATION_PWM RPM,RPM,...
+// The RPM list is the measured RPM from 0 to 255 PWM in steps of CALSTEP.
+bool saveCalibration(int rpmMaps[][CALPOINTS]) {
+    char tmpFile[PATH_MAX], line[1024];
+    snprintf(tmpFile, sizeof(tmpFile), "%s", calFile);
+    if (strrchr(tmpFile, '/') != NULL) {
+        *strrchr(tmpFile, '/') = 0;
+        mkdir(tmpFile, 0755);
+    }
+    snprintf(tmpFile, sizeof(tmpFile), "%s.tmp", calFile);
+    FILE * out = fopen(tmpFile, "w");
+    if (!out) {
+        fprintf(stderr, "ERROR: Could not write calibration file '%s'\n", tmpFile);
+        return false;
+    }
+    FILE * in = fopen(calFile, "r");
+    if (in) {
+        while (fgets(line, sizeof(line), in)) {
+            bool replaced = false;
+            for (int i = 0; i <= curFans; i++) {
+                size_t len = strlen(fans.info[i].key);
+                if (strncmp(line, fans.info[i].key, len) == 0 && line[len] == ' ') {
+                    replaced = true;
+                    break;
+                }
+            }
+            if (!replaced) {
+                fputs(line, out);
+            }
+        }
+        fclose(in);
+    }
+    for (int i = 0; i <= curFans; i++) {
+        fprintf(out, "%s %d %d %d ", fans.info[i].key, fans.startPwm[i], fans.stopPwm[i], fans.satPwm[i]);
+        for (int j = 0; j < CALPOINTS; j++) {
+            fprintf(out, j ? ",%d" : "%d", rpmMaps[i][j]);
+        }
+        fprintf(out, "\n");
+    }
+    if (fclose(out) != 0 || rename(tmpFile, calFile) != 0) {
+        fprintf(stderr, "ERROR: Could not write calibration file '%s'\n", calFile);
+        return false;
+    }
+    return true;
+}
+
+void loadCalibration() {
+    char line[1024], key[128];
+    int startPwm, stopPwm, satPwm;
+    for (int i = 0; i <= curFans; i++) {
+        fans.startPwm[i] = fans.stopPwm[i] = 0;
+        fans.satPwm[i] = 255;
+    }
+    FILE * in = fopen(calFile, "r");
+    if (!in) {
+        return;
+    }
+    while (fgets(line, sizeof(line), in)) {
+        if (sscanf(line, "%127s %d %d %d", key, &startPwm, &stopPwm, &satPwm) != 4) {
+            continue;
+        }
+        for (int i = 0; i <= curFans; i++) {
+            if (strcmp(key, fans.info[i].key) != 0) {
+                continue;
+            }
+            fans.startPwm[i] = (unsigned char) startPwm;
+            fans.stopPwm[i] = (unsigned char) stopPwm;
+            fans.satPwm[i] = satPwm > 0 ? (unsigned char) satPwm : 255;
+            if (!silent) {
+                printf("%s : using calibration, start %d PWM ; stop %d PWM ; saturation %d PWM\n",
+                    key, startPwm, stopPwm, satPwm);
+            }
+        }
+    }
+    fclose(in);
+}
+
+bool openSensors() {
+    for (int i = 0; i <= curTsen; i++) {
+        tsen.fd[i] = -1;
+    }
+    for (int i = 0; i <= curTsen; i++) {
+        struct tStruct * sen = &tsen.info[i];
+        tsen.chan[i] = hidChannel(sen->dev, sen->sen, "temp", HIDTEMPS);
+        if (tsen.chan[i] >= 0) {
+            tsen.stale[i] = false;
+            snprintf(sen->path, sizeof(sen->path), "hidraw %s:%s", hidDev, sen->sen);
+            continue;
+        }
+        const char * hwmonPath = findHwmon(sen->dev, true);
+        if (!hwmonPath) {
+            return false;
+        }
+        sprintf(sen->path, "%.190s/%s", hwmonPath, sen->sen);
+        if (!fileExists(sen->path)) {
+            fprintf(stderr, "File not found: %s\n", sen->path);
+            return false;
+        }
+        tsen.fd[i] = open(sen->path, O_RDONLY | O_CLOEXEC);
+        tsen.stale[i] = false;
+    }
+    return true;
+}
+
+bool openFans() {
+    for (int i = 0; i <= curFans; i++) {
+        fans.fd[i] = -1;
+    }
+    for (int i = 0; i <= curFans; i++) {
+        struct fStruct * fan = &fans.info[i];
+        fans.chan[i] = hidChannel(fan->dev, fan->pwm, fans.maxRpm[i] ? "fan" : "pwm", HIDFANS);
+        if (fans.chan[i] >= 0) {
+            fans.stale[i] = false;
+            // Same key as with the corsair-cpro driver, there is no fanN_input for fanexporter.
+            snprintf(fan->path, sizeof(fan->path), "hidraw %s:%s", hidDev, fan->pwm);
+            snprintf(fan->key, sizeof(fan->key), "corsaircpro@%s:%s", hidDev, fan->pwm);
+            fan->rpmPath[0] = 0;
+            continue;
+        }
+        const struct hStruct * hw = lookupHwmon(fan->dev);
+        if (!hw) {
+            fprintf(stderr, "ERROR: Could not find hwmon directory. '%s'\n", fan->dev);
+            return false;
+        }
+        sprintf(fan->path, "%.190s/%s", hw->path, fan->pwm);
+        if (!fileExists(fan->path)) {
+            fprintf(stderr, "File not found: %s\n", fan->path);
+            return false;
+        }
+        fans.fd[i] = open(fan->path, O_RDWR | O_CLOEXEC);
+        fans.stale[i] = false;
+        setRpmPath(fan, hw->path);
+        setFanKey(fan, hw);
+    }
+    return true;
+}
+
+void closeFds() {
+    for (int i = 0; i <= curTsen; i++) {
+        if (tsen.fd[i] >= 0) {
+            close(tsen.fd[i]);
+        }
+        tsen.fd[i] = -1;
+    }
+    for (int i = 0; i <= curFans; i++) {
+        if (fans.fd[i] >= 0) {
+            close(fans.fd[i]);
+        }
+        fans.fd[i] = -1;
+    }
+}
+
+// Reopens a sensor / fan if its hwmon directory moved or its fd stopped working.
+bool reopenFd(int * fd, bool * stale, char * path, const char * hwmonPath, const char * file, int flags) {
+    char newPath[256];
+    if (!hwmonPath) {
+        return false;
+    }
+    snprintf(newPath, sizeof(newPath), "%.190s/%s", hwmonPath, file);
+    if (*fd >= 0 && !*stale && strcmp(newPath, path) == 0) {
+        return false;
+    }
+    if (*fd >= 0) {
+        close(*fd);
+    }
+    strcpy(path, newPath);
+    *fd = open(path, flags | O_CLOEXEC);
+    *stale = false;
+    if (!silent) {
+        printf("\n%s '%s'\n", *fd >= 0 ? "Reopened" : "Could not reopen", path);
+    }
+    return true;
+}
+
+// After a hwmon uevent or failed reads / writes : the hwmon index is made again and the
+// sensors / fans that moved to another hwmonN (a driver reload for example) are reopened.
+void rebindHwmon() {
+    rebindPending = false;
+    lastRebind = monoTime();
+    if (!scanHwmon()) {
+        return;
+    }
+    for (int i = 0; i <= curTsen; i++) {
+        struct tStruct * sen = &tsen.info[i];
+        if (tsen.chan[i] >= 0) {
+            continue;
+        }
+        reopenFd(&tsen.fd[i], &tsen.stale[i], sen->path, findHwmon(sen->dev, false), sen->sen, O_RDONLY);
+    }
+    pthread_mutex_lock(&actLock);
+    for (int i = 0; i <= curFans; i++) {
+        struct fStruct * fan = &fans.info[i];
+        const char * hwmonPath = findHwmon(fan->dev, false);
+        if (fans.chan[i] < 0 && reopenFd(&fans.fd[i], &fans.stale[i], fan->path, hwmonPath, fan->pwm, O_RDWR)) {
+            // The driver doesn't remember the PWM, write it on the next loop.
+            setRpmPath(fan, hwmonPath);
+            fans.stale[i] = true;
+        }
+    }
+    pthread_mutex_unlock(&actLock);
+    if (tele) {
+        publishRpmPaths();
+    }
+}
+
+// After a resume the Commander Pro can come back with its default fan speeds,
+// look up the hwmon directory again and write the PWM of every fan now.
+void resumeFans() {
+    slept = suspendedTime();
+    throttleCheck = 0;
+    for (int i = 0; i <= curFans; i++) {
+        fans.stale[i] = true;
+    }
+    rebindHwmon();
+    for (int i = 0; i <= curFans; i++) {
+        if (fans.lastPwm[i] >= 0 && setFan(i, fans.lastPwm[i])) {
+            fans.stale[i] = false;
+        }
+    }
+    if (hidQueued) {
+        hidFlush();
+    }
+    if (actPosted) {
+        wakeActuator();
+    }
+    if (!silent) {
+        printf("\nResumed (or the clock was set), fan speeds written again.\n");
+    }
+}
+
+// Loads a CSV file, the first column is the time in seconds, the other columns are values.
+// Lines that don't start with a number (a header for example) are skipped.
+// The first line with values sets the amount of columns.
+bool loadCsv(const char * path, double ** times, int ** values, int * rows, int * cols) {
+    char line[16384];
+    int size = 0;
+    FILE * in = fopen(path, "r");
+    if (!in) {
+        fprintf(stderr, "ERROR: Could not open '%s'\n", path);
+        return false;
+    }
+    *rows = *cols = 0;
+    *times = NULL;
+    *values = NULL;
+    while (fgets(line, sizeof(line), in)) {
+        char * tail, * tok = strtok_r(line, ",", &tail);
+        if (tok == NULL || (tok[0] < '0' || tok[0] > '9')) {
+            continue;
+        }
+        if (*rows == 0) {
+            for (char * ptr = tail; ptr && *ptr; ptr = strchr(ptr + 1, ',')) {
+                (*cols)++;
+            }
+        }
+        if (*rows == size) {
+            size = size ? size * 2 : 4096;
+            *times = realloc(*times, size * sizeof(double));
+            *values = realloc(*values, size * (*cols ? *cols : 1) * sizeof(int));
+            if (!*times || !*values) {
+                fprintf(stderr, "ERROR: Out of memory loading '%s'\n", path);
+                fclose(in);
+                return false;
+            }
+        }
+        (*times)[*rows] = atof(tok);
+        int col = 0;
+        while ((tok = strtok_r(NULL, ",", &tail)) != NULL) {
+            if (col < *cols) {
+                (*values)[*rows * *cols + col] = (tok[0] >= '0' && tok[0] <= '9') || tok[0] == '-' ? atoi(tok) : REPLAYFAIL;
+            }
+            col++;
+        }
+        if (col != *cols) {
+            fprintf(stderr, "ERROR: '%s' line %d has %d values, expected %d.\n", path, *rows + 1, col, *cols);
+            fclose(in);
+            return false;
+        }
+        (*rows)++;
+    }
+    fclose(in);
+    if (*rows == 0 || *cols == 0) {
+        fprintf(stderr, "ERROR: '%s' contains no samples.\n", path);
+        return false;
+    }
+    return true;
+}
+
+// Runs getMaxTemp() / setFanSpeed() on a virtual clock, every tick is --interval simulated seconds.
+int runReplay() {
+    double * traceTimes = NULL, * loadTimes = NULL;
+    int * traceValues = NULL, * loadValues = NULL;
+    int traceRows = 0, traceCols = 0, loadRows = 0, loadCols = 0, row = 0, loadRow = 0, maxTemp = 0;
+    unsigned long lazyDiffs = 0, probeMisses = 0, * probeReads, * probeTick;
+    double * modelTemps, simTime = 0.0, tempSum = 0.0, pwmSum = 0.0, pwmSqSum = 0.0;
+    double energy = 0.0, hotTime = 0.0, load = 100.0;
+    unsigned long ticks = 0;
+    struct timespec start, end;
+    FILE * out = NULL;
+    if (replayTrace) {
+        if (!loadCsv(replayTrace, &traceTimes, &traceValues, &traceRows, &traceCols)) {
+            return EXIT_FAILURE;
+        }
+        if (curTsen < 0) {
+            for (int i = 0; i < traceCols; i++) {
+                if (!addSensor()) {
+                    fprintf(stderr, "ERROR: Out of memory.\n");
+                    return EXIT_FAILURE;
+                }
+            }
+        } else if (traceCols < curTsen + 1) {
+            fprintf(stderr, "ERROR: '%s' has %d sensor columns, --temp-sensors has %d sensors.\n", replayTrace, traceCols, curTsen + 1);
+            return EXIT_FAILURE;
+        }
+    } else if (curTsen < 0 && !addSensor()) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        return EXIT_FAILURE;
+    }
+    if (replayLoad && !loadCsv(replayLoad, &loadTimes, &loadValues, &loadRows, &loadCols)) {
+        return EXIT_FAILURE;
+    }
+    if (curFans < 0 && !addFan()) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i <= curFans; i++) {
+        fans.startPwm[i] = fans.stopPwm[i] = fans.lastPwm[i] = 0;
+        fans.satPwm[i] = 255;
+    }
+    replayTemps = calloc(curTsen + 1, sizeof(int));
+    modelTemps = malloc((curTsen + 1) * sizeof(double));
+    probeReads = calloc(curTsen + 1, sizeof(unsigned long));
+    probeTick = calloc(curTsen + 1, sizeof(unsigned long));
+    if (!replayTemps || !modelTemps || !probeReads || !probeTick) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        return EXIT_FAILURE;
+    }
+    if (replayOutput) {
+        out = fopen(replayOutput, "w");
+        if (!out) {
+            fprintf(stderr, "ERROR: Could not open '%s'\n", replayOutput);
+            return EXIT_FAILURE;
+        }
+        fprintf(out, "time,temp,pwm,writes\n");
+    }
+    for (int i = 0; i <= curTsen; i++) {
+        modelTemps[i] = modelAmbient;
+    }
+    bool wasSilent = silent;
+    silent = true;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (1) {
+        if (replayTrace) {
+            if (simTime > traceTimes[traceRows - 1]) {
+                break;
+            }
+            while (row + 1 < traceRows && traceTimes[row + 1] <= simTime) {
+                row++;
+            }
+            for (int i = 0; i <= curTsen; i++) {
+                replayTemps[i] = traceValues[row * traceCols + i];
+                // With --replay-model, the trace is the temperature the sensor would have with the fans off.
+                if (replayModel && replayTemps[i] != REPLAYFAIL) {
+                    modelTemps[i] = modelStep(modelTemps[i], modelAmbient, replayTemps[i] / 1000.0, modelCooling, lastFanSpeed,
+                        1.0 - exp(-interval / modelTau));
+                    replayTemps[i] = (int) (modelTemps[i] * 1000.0);
+                }
+            }
+        } else {
+            if (simTime > replayTime) {
+                break;
+            }
+            if (replayLoad) {
+                while (loadRow + 1 < loadRows && loadTimes[loadRow + 1] <= simTime) {
+                    loadRow++;
+                }
+                load = loadValues[loadRow * loadCols];
+            }
+            // First order model, the temperature moves towards a steady state that depends on load and fan PWM.
+            modelTemps[0] = modelStep(modelTemps[0], modelAmbient, modelAmbient + modelRise * load / 100.0, modelCooling, lastFanSpeed,
+                1.0 - exp(-interval / modelTau));
+            for (int i = 0; i <= curTsen; i++) {
+                replayTemps[i] = (int) (modelTemps[0] * 1000.0);
+            }
+        }
+        replayNow = simTime;
+        setFanSpeed();
+        // Lazy sensors must give the PWM of the fan curve for the highest temperature of all sensors, the backed off
+        // and failing ones count with the temperature that stands in for them.
+        if (tsen.lazy) {
+            int allMax = 0;
+            for (int i = 0; i <= curTsen; i++) {
+                int senTemp = sensorTemp(i);
+                if (tsen.health[i].state == SENOK && replayTemps[i] != REPLAYFAIL) {
+                    senTemp = offsetTemp((int) round(replayTemps[i] / 1000.0), tsen.offs[i], tsen.thres[i]);
+                }
+                allMax = senTemp > allMax ? senTemp : allMax;
+            }
+            lazyDiffs += curveSpeed(allMax) != curveSpeed(lastTemp);
+        }
+        // A backed off sensor must be probed at least every SENMAXBACKOFF loops.
+        for (int i = 0; i <= curTsen; i++) {
+            if (tsen.health[i].reads != probeReads[i] || tsen.health[i].state == SENOK) {
+                probeReads[i] = tsen.health[i].reads;
+                probeTick[i] = ticks;
+            } else if (ticks - probeTick[i] > SENMAXBACKOFF) {
+                probeMisses++;
+            }
+        }
+        ticks++;
+        tempSum += lastTemp;
+        pwmSum += lastFanSpeed;
+        pwmSqSum += (double) lastFanSpeed * lastFanSpeed;
+        for (int i = 0; i <= curFans; i++) {
+            energy += pow(fans.lastPwm[i] / 255.0, 3) * interval;
+        }
+        if (lastTemp > highTemp) {
+            hotTime += interval;
+        }
+        if (lastTemp > maxTemp) {
+            maxTemp = lastTemp;
+        }
+        if (out) {
+            fprintf(out, "%.2f,%d,%d,%lu\n", simTime, lastTemp, lastFanSpeed, replayWrites);
+        }
+        simTime += interval;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    silent = wasSilent;
+    if (out) {
+        fclose(out);
+    }
+    free(traceTimes);
+    free(traceValues);
+    free(loadTimes);
+    free(loadValues);
+    free(modelTemps);
+    free(probeReads);
+    free(probeTick);
+    if (!ticks) {
+        fprintf(stderr, "ERROR: Nothing to replay.\n");
+        return EXIT_FAILURE;
+    }
+    double wallTime = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    double pwmMean = pwmSum / ticks;
+    printf("Replay       : %lu ticks, %.1f s simulated in %.4f s (%.0fx real time)\n",
+        ticks, ticks * interval, wallTime, wallTime > 0 ? ticks * interval / wallTime : 0.0);
+    printf("Temperature  : mean %.1f C ; max %d C ; %.1f s above --fan-temp-high\n", tempSum / ticks, maxTemp, hotTime);
+    printf("Fan PWM      : mean %.1f ; stddev %.1f\n", pwmMean, sqrt(fmax(pwmSqSum / ticks - pwmMean * pwmMean, 0.0)));
+    printf("Fan writes   : %lu (%.3f per tick)\n", replayWrites, (double) replayWrites / ticks);
+    printf("Energy proxy : %.1f full speed fan seconds (sum of (PWM / 255)^3 * seconds)\n", energy);
+    if (tsen.lazy) {
+        printf("Lazy sensors : %lu reads (%.2f per tick) ; %lu skipped ; %lu ticks with another PWM than reading every sensor\n",
+            statSensorReads, (double) statSensorReads / ticks, statLazySkips, lazyDiffs);
+    }
+    if (statSensorBackoffs) {
+        printf("Sensor health: %lu backoffs ; %lu ticks with a backed off sensor not probed for over %d loops\n",
+            statSensorBackoffs, probeMisses, SENMAXBACKOFF);
+    }
+    return lazyDiffs || probeMisses ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+double elapsedNs(const struct timespec * start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e9 + (now.tv_nsec - start->tv_nsec);
+}
+
+// Runs --benchmark loops back to back on the opened sensors and fans, without waiting --interval.
+int runBenchmark() {
+    struct timespec start;
+    volatile int maxTemp = 0;
+    silent = true;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < benchTicks; i++) {
+        setFanSpeed();
+    }
+    double tickNs = elapsedNs(&start) / benchTicks;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < benchTicks; i++) {
+        readSensors();
+    }
+    double readNs = elapsedNs(&start) / benchTicks;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < benchTicks; i++) {
+        maxTemp = maxSensorTemp();
+    }
+    double maxNs = elapsedNs(&start) / benchTicks;
+    printf("Benchmark    : %d ticks ; %d sensors ; %d fans ; %lu read errors\n", benchTicks, curTsen + 1, curFans + 1, statReadErrors);
+    printf("Tick         : %.0f ns (%.1f ns per sensor)\n", tickNs, tickNs / (curTsen + 1));
+    printf("Sensor reads : %.0f ns (%.1f ns per sensor)\n", readNs, readNs / (curTsen + 1));
+    printf("Max temp     : %.0f ns (%.2f ns per sensor) -> %d C\n", maxNs, maxNs / (curTsen + 1), maxTemp);
+    return EXIT_SUCCESS;
+}
+
+void mkFanLut(bool printLut) {
+    fillFanLut(fanLut, lowFanSpeed, lowTemp, highFanSpeed, highTemp);
+    if (silent || !printLut) {
+        return;
+    }
+    printf("Temp <= %2d C ; FanSpeed = %3d PWM\n", lowTemp-1, minFanSpeed);
+    for (int i = lowTemp; i <= highTemp; i++) {
+        printf("Temp == %2d C ; FanSpeed = %3d PWM\n", i, fanLut[i]);
+    }
+    printf("Temp >= %2d C ; FanSpeed = %3d PWM\n", highTemp+1, highFanSpeed);
+}
+
+// Writes the config as constants for ccpfcmin.c, which includes the file as ccpfcmin.h. The LUT is the one
+// mkFanLut() makes, so ccpfcmin sets the same speeds as ccpfc without floating point.
+bool bakeConfig() {
+    if (hidPath) {
+        fprintf(stderr, "ERROR: --bake : ccpfcmin only uses the hwmon files, not --hidraw.\n");
+        return false;
+    }
+    FILE * out = fopen(bakePath, "w");
+    if (!out) {
+        fprintf(stderr, "ERROR: Could not write '%s'\n", bakePath);
+        return false;
+    }
+    mkFanLut(false);
+    fprintf(out, "// Made by ccpfc --bake%s%s, build ccpfcmin.c with it.\n", confFile ? " --config=" : "", confFile ? confFile : "");
+    fprintf(out, "#define BAKEDSYSFS \"%s\"\n#define BAKEDFAKESYSFS %d\n", sysfsRoot, fakeSysfs);
+    fprintf(out, "#define BAKEDINTERVALNS %lldLL\n", (long long) llround(interval * 1e9));
+    fprintf(out, "#define BAKEDNICENESS %d\n", getpriority(PRIO_PROCESS, 0));
+    fprintf(out, "#define BAKEDSMOOTHUP %d\n#define BAKEDSMOOTHDOWN %d\n", smoothUp, smoothDown);
+    fprintf(out, "#define BAKEDMINSPEED %d\n#define BAKEDHIGHSPEED %d\n", minFanSpeed, highFanSpeed);
+    fprintf(out, "#define BAKEDLOWTEMP %d\n#define BAKEDHIGHTEMP %d\n", lowTemp, highTemp);
+    fprintf(out, "#define BAKEDFAILSAFEREADS %d\n", failSafeReads);
+    fprintf(out, "static const unsigned char bakedLut[100] = {");
+    for (int i = 0; i < 100; i++) {
+        fprintf(out, "%s%d", i ? (i % 20 ? ", " : ",\n    ") : "\n    ", fanLut[i]);
+    }
+    fprintf(out, "\n};\n// DEVICE, FILE, OFFSET, THRES\nstatic const struct bakedSensor bakedSensors[] = {\n");
+    for (int i = 0; i <= curTsen; i++) {
+        fprintf(out, "    {\"%s\", \"%s\", %d, %d},\n", tsen.info[i].dev, tsen.info[i].sen, tsen.offs[i], tsen.thres[i]);
+    }
+    fprintf(out, "};\n// DEVICE, FILE, OFFSET, MAXRPM\nstatic const struct bakedFan bakedFans[] = {\n");
+    for (int i = 0; i <= curFans; i++) {
+        fprintf(out, "    {\"%s\", \"%s\", %d, %d},\n", fans.info[i].dev, fans.info[i].pwm, fans.offs[i], fans.maxRpm[i]);
+    }
+    fprintf(out, "};\n");
+    if (fclose(out) != 0) {
+        fprintf(stderr, "ERROR: Could not write '%s'\n", bakePath);
+        return false;
+    }
+    if (curProfs) {
+        fprintf(stderr, "WARNING: --bake : ccpfcmin has no --socket, the --profile curves are left out.\n");
+    }
+    return true;
+}
+
+int findProfile(const char * name) {
+    for (int i = 0; i <= curProfs; i++) {
+        if (strcmp(profArr[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void loadProfile(int i) {
+    minFanSpeed = profArr[i].minFanSpeed;
+    lowFanSpeed = profArr[i].lowFanSpeed;
+    lowTemp = profArr[i].lowTemp;
+    highFanSpeed = profArr[i].highFanSpeed;
+    highTemp = profArr[i].highTemp;
+    memcpy(fanLut, profArr[i].fanLut, sizeof(fanLut));
+    curProfile = i;
+}
+
+// Makes the LUT of every profile, then switches back to the profile named active.
+void mkProfiles(const char * active) {
+    snprintf(profArr[0].name, sizeof(profArr[0].name), "default");
+    profArr[0].minFanSpeed = minFanSpeed;
+    profArr[0].lowFanSpeed = lowFanSpeed;
+    profArr[0].lowTemp = lowTemp;
+    profArr[0].highFanSpeed = highFanSpeed;
+    profArr[0].highTemp = highTemp;
+    for (int i = 0; i <= curProfs; i++) {
+        loadProfile(i);
+        mkFanLut(false);
+        memcpy(profArr[i].fanLut, fanLut, sizeof(fanLut));
+    }
+    loadProfile(findProfile(active) > 0 ? findProfile(active) : 0);
+}
+
+// State file : the fan speed, profile, PWM of every fan (with the value written to its file, RPM for fanN_target fans)
+// and the hwmon directories in use (name and device).
+void saveState() {
+    char tmpPath[PATH_MAX];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", statePath);
+    bool * used = calloc(curHwmon + 1, sizeof(bool));
+    FILE * out = used ? fopen(tmpPath, "w") : NULL;
+    if (!out) {
+        free(used);
+        return;
+    }
+    fprintf(out, "ccpfc-state 2\nspeed %d\nprofile %s\n", lastFanSpeed, profArr[curProfile].name);
+    // Fans first, then sensors, every hwmon directory only once.
+    for (int i = 0; i <= curFans + curTsen + 1; i++) {
+        const char * name = i <= curFans ? fans.info[i].dev : tsen.info[i - curFans - 1].dev;
+        const struct hStruct * hw = lookupHwmon(name);
+        if (hw && !used[hw - hwmonArr]) {
+            used[hw - hwmonArr] = true;
+            fprintf(out, "hwmon %s %s\n", name, hw->dev);
+        }
+    }
+    free(used);
+    for (int i = 0; i <= curFans; i++) {
+        if (fans.lastPwm[i] >= 0) {
+            fprintf(out, "fan %s %d %d\n", fans.info[i].key, fans.lastPwm[i], fanValue(i, fans.lastPwm[i]));
+        }
+    }
+    // Write to a temporary file then rename, a crash never leaves half a state file.
+    if (fclose(out) == 0) {
+        rename(tmpPath, statePath);
+    }
+    stateDirty = false;
+}
+
+// Only used if every hwmon name in the state file still belongs to the same device,
+// fans are matched with their calibration key (device and pwm file).
+void loadState() {
+    char line[1024], name[128], dev[256];
+    int version = 0, speed = -1, pwm, value;
+    bool valid = true;
+    char profile[32] = "";
+    FILE * in = fopen(statePath, "r");
+    stateReady = true;
+    if (!in) {
+        return;
+    }
+    int * pwms = malloc((curFans + 1) * 2 * sizeof(int));
+    if (!pwms) {
+        fclose(in);
+        return;
+    }
+    // values : what was written to the file of the fan, compared with what the file reads back.
+    int * values = pwms + curFans + 1;
+    for (int i = 0; i <= curFans; i++) {
+        pwms[i] = -1;
+    }
+    while (fgets(line, sizeof(line), in)) {
+        if (sscanf(line, "ccpfc-state %d", &version) == 1 || sscanf(line, "speed %d", &speed) == 1 || sscanf(line, "profile %31s", profile) == 1) {
+            continue;
+        } else if (sscanf(line, "hwmon %127s %255s", name, dev) == 2) {
+            const struct hStruct * hw = lookupHwmon(name);
+            if (!hw || strcmp(hw->dev, dev) != 0) {
+                valid = false;
+            }
+        } else if (sscanf(line, "fan %127s %d %d", name, &pwm, &value) == 3 && pwm >= 0 && pwm <= 255) {
+            for (int i = 0; i <= curFans; i++) {
+                if (strcmp(name, fans.info[i].key) == 0) {
+                    pwms[i] = pwm;
+                    values[i] = value;
+                }
+            }
+        }
+    }
+    fclose(in);
+    if (version != 2 || !valid || speed < 0 || speed > 255) {
+        if (!silent) {
+            printf("State file '%s' doesn't match this system, not using it.\n", statePath);
+        }
+        free(pwms);
+        return;
+    }
+    if (findProfile(profile) > 0) {
+        loadProfile(findProfile(profile));
+    }
+    lastFanSpeed = speed;
+    // The fans keep their PWM when ccpfc exits, only write the ones that don't have it anymore.
+    for (int i = 0; i <= curFans; i++) {
+        if (pwms[i] < 0) {
+            continue;
+        }
+        // A changed MAXRPM of a fanN_target fan writes it again.
+        ssize_t len = pread(fans.fd[i], buf, 8, 0);
+        buf[len > 0 ? len : 0] = 0;
+        if (len > 0 && values[i] == fanValue(i, pwms[i]) && atoi(buf) == values[i]) {
+            fans.lastPwm[i] = pwms[i];
+            continue;
+        }
+        sprintf(buf, "%d", pwms[i]);
+        if (writeFan(i, buf)) {
+            fans.lastPwm[i] = pwms[i];
+        }
+    }
+    if (hidQueued) {
+        hidFlush();
+    }
+    free(pwms);
+    if (!silent) {
+        printf("Resumed from state file '%s' : fan speed %d PWM ; profile %s\n", statePath, speed, profArr[curProfile].name);
+    }
+}
+
+// Called from main() once the loop stopped, or when starting failed after the files were made.
+void cleanup() {
+    if (tele) {
+        unlink(telePath);
+    }
+    if (sockFd >= 0) {
+        unlink(sockPath);
+    }
+    if (statePath && stateReady) {
+        saveState();
+    }
+}
+
+#ifdef LATENCYSTATS
+// Per sensor / fan stats start over when a config reload makes new tables.
+void latDump() {
+    char name[300];
+    fprintf(stderr, "     count   mean(us)    p50(us)    p90(us)    p99(us)    max(us)\n");
+    latPrint("loop", &latTick);
+    latPrint("lateness of the loop timer", &latLate);
+    for (int i = 0; i <= curTsen; i++) {
+        snprintf(name, sizeof(name), "read %s", tsen.info[i].path);
+        latPrint(name, &tsen.lat[i]);
+    }
+    for (int i = 0; i <= curFans; i++) {
+        snprintf(name, sizeof(name), "write %s", fans.info[i].path);
+        latPrint(name, &fans.lat[i]);
+    }
+}
+#endif
+
+// --socket protocol : one request per line, every request gets one line back starting with "OK" or "ERR".
+// A reply that doesn't fit in the 8 KiB buffer of serveClient() is "ERR too long".
+//  status                 OK profile=NAME temp=C pwm=PWM pinned=SECONDS throttled=0|1 boosted=SECONDS temps=C,C fans=PWM,PWM
+//  counters               OK loops=N writes=N read_errors=N reloads=N requests=N hid_requests=N hid_round_trips=N
+//                         deadline_misses=N fail_safes=N sensor_backoffs=N sensors_ok=N sensors_backoff=N sensor_reads=N lazy_skips=N
+//                         coalesced=N queue_us_avg=N queue_us_max=N throttle_events=N throttled_ms=N
+//  sensors [OFFSET]       OK total=N next=N PATH=STATE:READS:ERRORS:SLOW:BACKOFFS:LATENCY_US,PATH=... STATE is ok or backoff
+//                         The sensors from OFFSET (default 0) that fit in the reply, ask again with OFFSET next until next is total.
+//  backoff [OFFSET]       Like sensors, only the backed off ones. OFFSET and next are still positions in the whole table.
+//  profiles               OK NAME,NAME
+//  profile NAME           Switch to the fan curve of --profile NAME, "default" is the curve from the options.
+//  pin PWM SECONDS        Set the fans to PWM (plus their offset) for SECONDS, ignoring the temperature.
+//  unpin                  Go back to the fan curve.
+struct cStruct {
+    int fd;
+    int len;
+    char req[256];
+};
+struct cStruct clientArr[MAXCLIENTS];
+
+bool openSocket() {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(sockPath) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "ERROR: --socket path is too long.\n");
+        return false;
+    }
+    strcpy(addr.sun_path, sockPath);
+    unlink(sockPath);
+    sockFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sockFd < 0 || bind(sockFd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || chmod(sockPath, 0660) != 0 || listen(sockFd, MAXCLIENTS) != 0) {
+        fprintf(stderr, "ERROR: Could not create control socket '%s'\n", sockPath);
+        return false;
+    }
+    for (int i = 0; i < MAXCLIENTS; i++) {
+        clientArr[i].fd = -1;
+    }
+    return true;
+}
+
+// One sensor of the "sensors" and "backoff" replies, the length it has (or would have with a NULL out) like snprintf().
+int sensorEntry(char * out, size_t size, int i, bool first) {
+    const struct sHealth * hl = &tsen.health[i];
+    return snprintf(out, size, "%s%s=%s:%lu:%lu:%lu:%lu:%u", first ? " " : ",", tsen.info[i].path,
+        hl->state == SENOK ? "ok" : "backoff", hl->reads, hl->errors, hl->slow, hl->backoffs, hl->latUs);
+}
+
+// The "sensors" and "backoff" replies, paged : the sensors from first on that fit in size (only the backed off ones
+// with backoffOnly), next= is where the next page starts.
+void listSensors(char * resp, size_t size, int first, bool backoffOnly) {
+    int total = curTsen + 1, next = first;
+    bool none = true;
+    // The header is sized for the largest next.
+    size_t len = snprintf(NULL, 0, "OK total=%d next=%d\n", total, total);
+    for (; next < total; next++) {
+        if (backoffOnly && tsen.health[next].state == SENOK) {
+            continue;
+        }
+        size_t entry = sensorEntry(NULL, 0, next, none);
+        if (len + entry >= size) {
+            break;
+        }
+        len += entry;
+        none = false;
+    }
+    len = snprintf(resp, size, "OK total=%d next=%d", total, next);
+    none = true;
+    for (int i = first; i < next; i++) {
+        if (!backoffOnly || tsen.health[i].state != SENOK) {
+            len += sensorEntry(resp + len, size - len, i, none);
+            none = false;
+        }
+    }
+    snprintf(resp + len, size - len, "\n");
+}
+
+void handleRequest(char * req, char * resp, size_t size) {
+    char * tail;
+    char * cmd = strtok_r(req, " \t\r", &tail);
+    char * arg1 = strtok_r(NULL, " \t\r", &tail);
+    char * arg2 = strtok_r(NULL, " \t\r", &tail);
+    size_t len;
+    if (!cmd) {
+        snprintf(resp, size, "ERR empty request\n");
+    } else if (strcmp(cmd, "status") == 0) {
+        double now = monoTime();
+        len = snprintf(resp, size, "OK profile=%s temp=%d pwm=%d pinned=%.1f throttled=%d boosted=%.1f temps=", profArr[curProfile].name,
+            lastTemp, lastFanSpeed, pinUntil ? fmax(pinUntil - now, 0.0) : 0.0, throttled, throttleBoost ? fmax(throttleUntil - now, 0.0) : 0.0);
+        for (int i = 0; i <= curTsen && len < size; i++) {
+            len += snprintf(resp + len, size - len, i ? ",%d" : "%d", tsen.last[i]);
+        }
+        for (int i = 0; i <= curFans && len < size; i++) {
+            len += snprintf(resp + len, size - len, i ? ",%d" : " fans=%d", fans.lastPwm[i]);
+        }
+        if (len < size) {
+            snprintf(resp + len, size - len, "\n");
+        }
+    } else if (strcmp(cmd, "counters") == 0) {
+        int sensorsBackoff = 0;
+        for (int i = 0; i <= curTsen; i++) {
+            sensorsBackoff += tsen.health[i].state == SENBACKOFF;
+        }
+        snprintf(resp, size, "OK loops=%lu writes=%lu read_errors=%lu reloads=%lu requests=%lu hid_requests=%lu hid_round_trips=%lu"
+            " deadline_misses=%lu fail_safes=%lu sensor_backoffs=%lu sensors_ok=%d sensors_backoff=%d sensor_reads=%lu lazy_skips=%lu coalesced=%lu"
+            " queue_us_avg=%lu queue_us_max=%lu throttle_events=%lu throttled_ms=%lu\n", statLoops, statWrites, statReadErrors, statReloads,
+            statRequests, statHidRequests, statHidRoundTrips, statDeadlineMisses, statFailSafes, statSensorBackoffs, curTsen + 1 - sensorsBackoff, sensorsBackoff, statSensorReads,
+            statLazySkips, statCoalesced, statActWrites ? statQueueUs / statActWrites : 0, (unsigned long) statQueueMaxUs, statThrottleEvents,
+            statThrottledMs);
+    } else if (strcmp(cmd, "sensors") == 0 || strcmp(cmd, "backoff") == 0) {
+        int first = arg1 ? atoi(arg1) : 0;
+        if (first < 0 || first > curTsen + 1) {
+            snprintf(resp, size, "ERR usage: %s [OFFSET] (OFFSET 0 to %d)\n", cmd, curTsen + 1);
+        } else {
+            listSensors(resp, size, first, cmd[0] == 'b');
+        }
+    } else if (strcmp(cmd, "profiles") == 0) {
+        len = snprintf(resp, size, "OK ");
+        for (int i = 0; i <= curProfs && len < size; i++) {
+            len += snprintf(resp + len, size - len, i ? ",%s" : "%s", profArr[i].name);
+        }
+        if (len < size) {
+            snprintf(resp + len, size - len, "\n");
+        }
+    } else if (strcmp(cmd, "profile") == 0) {
+        int i = arg1 ? findProfile(arg1) : -1;
+        if (i < 0) {
+            snprintf(resp, size, "ERR unknown profile\n");
+        } else {
+            loadProfile(i);
+            stateDirty = true;
+            snprintf(resp, size, "OK\n");
+        }
+    } else if (strcmp(cmd, "pin") == 0) {
+        int pwm = arg1 ? atoi(arg1) : -1;
+        double secs = arg2 ? atof(arg2) : 0;
+        if (pwm < 0 || pwm > 255 || secs <= 0 || secs > 86400) {
+            snprintf(resp, size, "ERR usage: pin PWM SECONDS (PWM 0 to 255, SECONDS up to 86400)\n");
+        } else {
+            pinSpeed = pwm;
+            pinUntil = monoTime() + secs;
+            // Don't wait for the next loop, the fans only, with the temperature of the last loop.
+            writeFans(targetSpeed(lastTemp));
+            snprintf(resp, size, "OK\n");
         }
+    } else if (strcmp(cmd, "unpin") == 0) {
+        pinUntil = 0;
+        writeFans(targetSpeed(lastTemp));
+        snprintf(resp, size, "OK\n");
+    } else {
+        snprintf(resp, size, "ERR unknown request\n");
     }
-    if (!silent) {
-        printf("\rHighest Temp %2d C -> Fan Speed %3d PWM", temp, tmpSpeed);
-        fflush(stdout);
-    }
-    lastFanSpeed = tmpSpeed;
-}
-
-void cleanup() {
-    exit(EXIT_SUCCESS);
 }
 
-bool fileExists(const char * path) {
-    if (path && access(path, F_OK) == 0) {
-        return true;
-    }
-    fprintf(stderr, "ERROR: Could not find file '%s'\n", path);
-    return false;
+void closeClient(struct cStruct * cl) {
+    close(cl->fd);
+    cl->fd = -1;
 }
 
-bool getHwmonPath(char * name) {
-    bool foundPath = false;
-    DIR *dir = opendir("/sys/class/hwmon");
-    if (!dir) {
-        fprintf(stderr, "ERROR: Could not find base hwmon directory.\n");
-        return foundPath;
-    }
-    struct dirent *files;
-    char buf2[30];
-    while ((files = readdir(dir)) != NULL) {
-        if (strstr(files->d_name, "hwmon")) {
-            sprintf(buf2, "%s/%s/name", "/sys/class/hwmon", files->d_name);
-            if (!readFile(buf2, 50) || strstr(buf, name) == NULL) {
-                continue;
-            }
-            sprintf(buf, "%s/%s", "/sys/class/hwmon", files->d_name);
-            foundPath = true;
-            break;
+void acceptClients() {
+    int cfd;
+    while ((cfd = accept4(sockFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        int i = 0;
+        while (i < MAXCLIENTS && clientArr[i].fd >= 0) {
+            i++;
         }
+        if (i == MAXCLIENTS) {
+            send(cfd, "ERR too many clients\n", 21, MSG_NOSIGNAL);
+            close(cfd);
+            continue;
+        }
+        clientArr[i].fd = cfd;
+        clientArr[i].len = 0;
     }
-    closedir(dir);
-    if (!foundPath) {
-        fprintf(stderr, "ERROR: Could not find hwmon directory. '%s'\n", foundPath);
-    }
-    return foundPath;
 }
 
-void mkFanLut(bool printLut) {
-    float tdiff = (float) (highFanSpeed - lowFanSpeed) / (float) (highTemp - lowTemp);
-    float curSpeed = (float) lowFanSpeed;
-    int rndSpeed;
-    if (!silent && printLut) {
-        printf("Temp <= %2d C ; FanSpeed = %3d PWM\n", lowTemp-1, minFanSpeed);
+// Answers every complete line the client sent, never waits on the client.
+void serveClient(struct cStruct * cl) {
+    char resp[8192];
+    ssize_t len = read(cl->fd, cl->req + cl->len, sizeof(cl->req) - 1 - cl->len);
+    if (len == 0 || (len < 0 && errno != EAGAIN)) {
+        closeClient(cl);
+        return;
+    } else if (len < 0) {
+        return;
     }
-    for (int i = lowTemp; i <= highTemp; i++) {
-        rndSpeed = (int) round(curSpeed);
-        if (rndSpeed <= lowFanSpeed) {
-            fanLut[i] = lowFanSpeed;
-        } else if (rndSpeed >= highFanSpeed) {
-            fanLut[i] = highFanSpeed;
-        } else {
-            fanLut[i] = rndSpeed;
+    cl->len += len;
+    cl->req[cl->len] = 0;
+    char * line = cl->req, * end;
+    while ((end = strchr(line, '\n')) != NULL) {
+        *end = 0;
+        statRequests++;
+        handleRequest(line, resp, sizeof(resp));
+        len = strlen(resp);
+        // Cut by snprintf(), many sensors or fans.
+        if (resp[len - 1] != '\n') {
+            len = sprintf(resp, "ERR too long\n");
         }
-        curSpeed += tdiff;
-        if (!silent && printLut) {
-            printf("Temp == %2d C ; FanSpeed = %3d PWM\n", i, fanLut[i]);
+        if (send(cl->fd, resp, len, MSG_NOSIGNAL) != len) {
+            closeClient(cl);
+            return;
         }
+        line = end + 1;
     }
-    if (!silent && printLut) {
-        printf("Temp >= %2d C ; FanSpeed = %3d PWM\n", highTemp+1, highFanSpeed);
+    cl->len -= line - cl->req;
+    memmove(cl->req, line, cl->len);
+    if (cl->len == sizeof(cl->req) - 1) {
+        send(cl->fd, "ERR request too long\n", 21, MSG_NOSIGNAL);
+        closeClient(cl);
     }
 }
 
@@ -209,6 +2296,11 @@ void printUsage() {
     printf("Options:\n");
     printf(" -h, --help\n");
     printf("   Displays this information.\n");
+    printf(" -C, --config=FILE\n");
+    printf("   Read options from FILE, one per line using the long option names, for example: fan-speed-low = 45\n");
+    printf("   Options passed on the command line override the ones in FILE.\n");
+    printf("   --fans and --temp-sensors from FILE and the command line are combined.\n");
+    printf("   FILE is reloaded when it changes or on SIGHUP, without restarting the fans.\n");
     printf(" -s, --silent\n");
     printf("   Output nothing to stdout.\n");
     printf(" -i, --interval=FLOAT\n");
@@ -231,240 +2323,893 @@ void printUsage() {
     printf("   Fan PWM used for fan LUT calculation when temperature at --fan-temp-high. (valid: 1 to 255)\n");
     printf(" -g, --fan-temp-high=NUM\n");
     printf("   Highest temperature for fan LUT calculation. (valid: 1 to 99)\n");
+    printf(" -k, --calibrate\n");
+    printf("   Sweep the PWM of every fan in --fans, store the start, stop and saturation PWM in --calibration-file and exit.\n");
+    printf("   Normal runs use the stored values to keep fan PWM between the stop and saturation PWM.\n");
+    printf(" -m, --calibration-file=FILE\n");
+    printf("   File where --calibrate results are stored. (default: /var/cache/ccpfc/calibration)\n");
+    printf(" -p, --replay=FILE\n");
+    printf("   Run the fan control logic on a virtual clock against a recorded trace instead of the hardware, then print statistics.\n");
+    printf("   FILE is CSV : TIME_SECONDS,SENSOR1,SENSOR2,... with sensor values in millidegrees, in the order of --temp-sensors.\n");
+    printf("   Without --temp-sensors, every column is used as a sensor without OFFSET and THRES.\n");
+    printf("   A sensor value that is not a number (x for example) is a failed read, ccpfc then checks that the backed off sensor\n");
+    printf("    is probed at least every %d loops, and fails if not.\n", SENMAXBACKOFF);
+    printf(" -q, --replay-model=AMBIENT:RISE:COOLING:TAU\n");
+    printf("   Like --replay, but the temperature comes from a first order thermal model instead of a trace.\n");
+    printf("   The temperature moves towards AMBIENT + RISE * LOAD / 100 * (1 - COOLING * PWM / 255) with a time constant of TAU seconds.\n");
+    printf("   Example: --replay-model=25:50:0.6:60\n");
+    printf("   Combined with --replay, every sensor of the trace is used as the temperature with the fans off (RISE is unused).\n");
+    printf(" -u, --replay-load=FILE\n");
+    printf("   CSV file with the load for --replay-model : TIME_SECONDS,LOAD_PERCENT (default: 100%% load)\n");
+    printf(" -v, --replay-time=FLOAT\n");
+    printf("   Seconds to simulate with --replay-model. (default: 3600)\n");
+    printf(" -w, --replay-output=FILE\n");
+    printf("   Write the temperature, PWM and fan write count of every replayed tick to FILE as CSV.\n");
+    printf(" -B, --benchmark=TICKS\n");
+    printf("   Run TICKS loops without waiting --interval, print the time a loop, the sensor reads and the max temperature take and exit.\n");
+    printf("   Together with --sysfs-root and simfan.sh, shows how the loop time grows with the amount of sensors.\n");
+    printf(" -r, --sysfs-root=DIR\n");
+    printf("   Use DIR instead of /sys, for example a directory containing a simulated fan controller.\n");
+    printf(" -P, --profile=NAME:MIN:LOW:TEMPLOW:HIGH:TEMPHIGH\n");
+    printf("   Named fan curve that can be switched to with --socket, the values are like --fan-speed-min, --fan-speed-low,\n");
+    printf("   --fan-temp-low, --fan-speed-high and --fan-temp-high. Can be passed up to %d times.\n", MAXPROFILES);
+    printf("   Example: --profile=quiet:0:40:55:180:80 --profile=max:255:255:1:255:2\n");
+    printf(" -S, --socket=FILE\n");
+    printf("   Create a control socket, one request per line : status, counters, sensors [OFFSET], backoff [OFFSET], profiles, profile NAME, pin PWM SECONDS, unpin.\n");
+    printf("   Example: echo \"pin 255 600\" | socat - UNIX-CONNECT:/run/ccpfc.sock\n");
+    printf(" -F, --state-file=FILE\n");
+    printf("   Save the fan speeds to FILE when they change and at exit, on startup continue from FILE instead of ramping up from 0.\n");
+    printf("   FILE is only used if the devices in it are the ones found, for example: --state-file=/run/ccpfc.state\n");
+    printf(" -T, --telemetry=FILE\n");
+    printf("   Publish every loop's temperatures and fan speeds to a shared memory ring in FILE, for example /dev/shm/ccpfc\n");
+    printf(" -M, --bake=FILE\n");
+    printf("   Write the fan curve, sensors, fans and --interval as a header for ccpfcmin.c and exit, see ccpfcbake.sh.\n");
+    printf("   Example: ccpfc --config=/etc/ccpfc.conf --bake=ccpfcmin.h\n");
+    printf(" -H, --hidraw=DEVICE[:DEPTH]\n");
+    printf("   Talk to the Commander Pro over DEVICE (/dev/hidrawN, auto to find it) instead of the corsair-cpro driver, the pwmN fans\n");
+    printf("   and corsaircpro temperature sensors of a loop are sent together, DEPTH requests at a time (default: 8, 1 waits for every one).\n");
+    printf("   The corsair-cpro driver must be unbound from the device. DEVICE can be the socket of ccpsim, a stand-in device.\n");
+    printf("   Example: --hidraw=auto\n");
+    printf(" -R, --realtime=NUM\n");
+    printf("   Run the loop with SCHED_FIFO priority NUM and the memory locked, so it isn't starved when the machine is busy. (valid: 1 to 99)\n");
+    printf("   A low priority is enough, for example 1, --niceness is not used then.\n");
+    printf(" -D, --deadline=MS\n");
+    printf("   A loop that takes longer than MS milliseconds, or starts a loop late, switches to the fail-safe. (valid: 1 to 60000) (default: --interval)\n");
+    printf(" -E, --fail-safe-reads=NUM\n");
+    printf("   NUM loops in a row with a failed sensor read switch to the fail-safe, after NUM good loops in a row it's left. (valid: 1 to 255) (default: 3)\n");
+    printf("   In the fail-safe the fans are at --fan-speed-high. Missed deadlines are sent to systemd (sd_notify), with WatchdogSec=\n");
+    printf("   in the service (at least 4 --interval) every loop feeds the watchdog, so a hung loop gets ccpfc restarted.\n");
+    printf(" -L, --sensor-slow=MS\n");
+    printf("   A sensor whose reads fail or take longer than MS milliseconds 2 times in a row is only probed with a growing backoff\n");
+    printf("   (2 to 256 loops), its last temperature (plus 5 C if the reads failed) stands in for it until 3 probes in a row are good.\n");
+    printf("   The failed probes don't count for --fail-safe-reads. (valid: 1 to 10000) (default: 50)\n");
+    printf("   The state of every sensor is in the sensors request of --socket, the backed off ones in the backoff request, their\n");
+    printf("   count in the counters request.\n");
+    printf(" -W, --write-behind\n");
+    printf("   Write the fans from a second thread, so a slow write (a USB round trip of the corsair-cpro driver) doesn't delay\n");
+    printf("   the next sensor reads. A fan only gets the latest PWM, the ones it didn't get in time are counted as coalesced.\n");
+    printf("   The time a PWM waited to be written is in the counters request of --socket. --hidraw fans are always written by the loop.\n");
+    printf(" -A, --throttle-boost=PWM\n");
+    printf("   When the CPU throttles (package_throttle_count goes up, or a cooling device caps scaling_max_freq), add PWM to the fan curve\n");
+    printf("   right away, until %.0f seconds after the throttling stopped. (valid: 1 to 255)\n", THROTTLEHOLD);
+    printf("   The throttling is detected without it too, the time spent throttled is in the counters request of --socket and --telemetry.\n");
     printf(" -z, --fans=\n");
     printf("   List of CORSAIR Commander Pro PWM fans to control.\n");
     printf("   Must be in this format: --fans=PWM:OFFSET\n");
     printf("   PWM is the file name of fan to control. Get a list of all files: ls /sys/bus/hid/drivers/corsair-cpro/[0-9]*/hwmon/hwmon*/pwm* | grep -o pwm[0-6]\n");
+    printf("   PWM can be DEVICE_NAME/PWM for a fan on another fan controller, DEVICE_NAME is like in --temp-sensors.\n");
     printf("   OFFSET can be a positive or negative number to apply to the fan's PWM, (valid -128 to 128).\n");
     printf("   Example: --fans=\"pwm1:0;pwm2:5;pwm3:-10\"\n");
+    printf("   3-pin fans (DC mode) are set by RPM instead : fanN_target:OFFSET:MAXRPM, the fan curve's 0 to 255 is 0 to MAXRPM RPM.\n");
+    printf("   Example: --fans=\"pwm1:0;fan4_target:0:1200\"\n");
     printf(" -t, --temp-sensors=\n");
     printf("   List of hwmon temperature sensors.\n");
     printf("   Must be in this format: --temp-sensors=DEVICE_NAME:SENSOR_NAME:OFFSET:THRES;DEVICE_NAME:SENSOR_NAME:OFFSET:THRES\n");
     printf("   DEVICE_NAME is from the hwmon name file. Get all possible values with: cat /sys/class/hwmon/hwmon*/name\n");
+    printf("   DEVICE_NAME@N is the Nth (from 0) device with that name, ordered by device path, for example drivetemp@3\n");
     printf("   SENSOR_NAME is the file name of the temp sensor. Get a list of all files: ls /sys/class/hwmon/hwmon*/temp*_input\n");
     printf("   OFFSET If for example the sensor reads 34C, we can apply a 10C offset so the program thinks it's 44C.\n");
     printf("   THRES Only applies the OFFSET if the sensor is above THRES.\n");
     printf("    This is useful if you have a GPU and want the case fans to spin faster if the GPU is hot and the CPU is cool.\n");
-    printf("   Example: --temp-sensors=\"k10temp:temp1_input:0:0;amdgpu:temp1_input:20:42\"\n");
+    printf("   RATE (optional) is the most C per second the sensor can change, ccpfc then reads the sensors hottest first and skips\n");
+    printf("    the ones that can't have changed enough to change the fan speed since they were read, like drives next to a hot CPU.\n");
+    printf("    With --replay, ccpfc checks that every tick gets the fan speed it would get reading every sensor, and fails if not.\n");
+    printf("   Example: --temp-sensors=\"k10temp:temp1_input:0:0;amdgpu:temp1_input:20:42;drivetemp:temp1_input:0:0:0.5\"\n");
+    printf("   There is no limit on the amount of sensors, in --config FILE they can be split over several temp-sensors lines.\n");
 }
 
-int main(int argc, char **argv) {
-#ifndef linux
-    fprintf(stderr, "ERROR: Operating system must be Linux.\n");
-    return 1;
-#endif
-    signal(SIGQUIT, cleanup);
-    signal(SIGINT, cleanup);
-    signal(SIGTERM, cleanup);
-    signal(SIGHUP, cleanup);
-    atexit(cleanup);
-    {
-        bool printLut = false;
-        int c;
-        static struct option long_options[] = {
-            {"help",                  no_argument,       0, 'h'},
-            {"silent",                no_argument,       0, 's'},
-            {"interval",              required_argument, 0, 'i'},
-            {"niceness",              required_argument, 0, 'n'},
-            {"fan-print-lut",         no_argument,       0, 'l'},
-            {"fan-smooth-up",         required_argument, 0, 'a'},
-            {"fan-smooth-down",       required_argument, 0, 'b'},
-            {"fan-speed-min",         required_argument, 0, 'c'},
-            {"fan-speed-low",         required_argument, 0, 'd'},
-            {"fan-temp-low",          required_argument, 0, 'e'},
-            {"fan-speed-high",        required_argument, 0, 'f'},
-            {"fan-temp-high",         required_argument, 0, 'g'},
-            {"fans",                  required_argument, 0, 'z'},
-            {"temp-sensors",          required_argument, 0, 't'},
-            {0,                       0,                 0,  0 }
-        };
-        while (c = getopt_long(argc, argv, "a:b:c:d:e:f:g:hi:j:ln:st:z:", long_options, NULL)) {
-            if (c == -1) {
-                break;
+struct option long_options[] = {
+    {"help",                  no_argument,       0, 'h'},
+    {"silent",                no_argument,       0, 's'},
+    {"interval",              required_argument, 0, 'i'},
+    {"niceness",              required_argument, 0, 'n'},
+    {"fan-print-lut",         no_argument,       0, 'l'},
+    {"fan-smooth-up",         required_argument, 0, 'a'},
+    {"fan-smooth-down",       required_argument, 0, 'b'},
+    {"fan-speed-min",         required_argument, 0, 'c'},
+    {"fan-speed-low",         required_argument, 0, 'd'},
+    {"fan-temp-low",          required_argument, 0, 'e'},
+    {"fan-speed-high",        required_argument, 0, 'f'},
+    {"fan-temp-high",         required_argument, 0, 'g'},
+    {"fans",                  required_argument, 0, 'z'},
+    {"temp-sensors",          required_argument, 0, 't'},
+    {"calibrate",             no_argument,       0, 'k'},
+    {"calibration-file",      required_argument, 0, 'm'},
+    {"sysfs-root",            required_argument, 0, 'r'},
+    {"replay",                required_argument, 0, 'p'},
+    {"replay-model",          required_argument, 0, 'q'},
+    {"replay-load",           required_argument, 0, 'u'},
+    {"replay-time",           required_argument, 0, 'v'},
+    {"replay-output",         required_argument, 0, 'w'},
+    {"benchmark",             required_argument, 0, 'B'},
+    {"telemetry",             required_argument, 0, 'T'},
+    {"config",                required_argument, 0, 'C'},
+    {"profile",               required_argument, 0, 'P'},
+    {"socket",                required_argument, 0, 'S'},
+    {"state-file",            required_argument, 0, 'F'},
+    {"hidraw",                required_argument, 0, 'H'},
+    {"bake",                  required_argument, 0, 'M'},
+    {"realtime",              required_argument, 0, 'R'},
+    {"deadline",              required_argument, 0, 'D'},
+    {"fail-safe-reads",       required_argument, 0, 'E'},
+    {"sensor-slow",           required_argument, 0, 'L'},
+    {"write-behind",          no_argument,       0, 'W'},
+    {"throttle-boost",        required_argument, 0, 'A'},
+    {0,                       0,                 0,  0 }
+};
+const char * short_options = "a:b:A:B:c:d:e:f:g:hi:j:klm:n:p:q:r:st:u:v:w:z:C:D:E:F:H:L:M:P:R:S:T:W";
+
+bool setOption(int c, const char * value) {
+    // strtok_r() modifies the string, use a copy so the command line can be parsed again on reload.
+    char arg[16384];
+    snprintf(arg, sizeof(arg), "%s", value ? value : "");
+    // These only apply when ccpfc starts.
+    if (reloading && strchr("klmpqruvwBDEFHLMRSTW", c)) {
+        return true;
+    }
+    switch (c) {
+        case 'a':
+            smoothUp = (unsigned char) atoi(arg);
+            if (smoothUp == 0) {
+                fprintf(stderr, "ERROR: --fan-smooth-up must be between 1 and 255.\n");
+                return false;
             }
-            switch (c) {
-                case 'a':
-                    smoothUp = (unsigned char) atoi(optarg);
-                    if (smoothUp == 0) {
-                        fprintf(stderr, "ERROR: --fan-smooth-up must be between 1 and 255.\n");
-                        return EXIT_FAILURE;
-                    }
-                    break;
-                case 'b':
-                    smoothDown = (unsigned char) atoi(optarg);
-                    if (smoothDown == 0) {
-                        fprintf(stderr, "ERROR: --fan-smooth-down must be between 1 and 255.\n");
-                        return EXIT_FAILURE;
-                    }
-                    break;
-                case 'c':
-                    minFanSpeed = (unsigned short) atoi(optarg);
-                    break;
-                case 'd':
-                    lowFanSpeed = (unsigned short) atoi(optarg);
-                    break;
-                case 'e':
-                    lowTemp = (unsigned char) atoi(optarg);
-                    if (lowTemp == 0 || lowTemp > 99) {
-                        fprintf(stderr, "ERROR: --fan-temp-low must be between 1 and 99.\n");
-                        return EXIT_FAILURE;
-                    }
-                    break;
-                case 'f':
-                    highFanSpeed = (unsigned short) atoi(optarg);
-                    break;
-                case 'g':
-                    highTemp = (unsigned char) atoi(optarg);
-                    if (highTemp == 0 || highTemp > 99) {
-                        fprintf(stderr, "ERROR: --fan-temp-high must be between 1 and 99.\n");
-                        return EXIT_FAILURE;
-                    }
-                    break;
-                case 'h':
-                    printUsage();
-                    return EXIT_SUCCESS;
-                case 'i':
-                    interval = atof(optarg);
-                    if (!interval || interval < 0.05 || interval > 60.0) {
-                        fprintf(stderr, "ERROR: --interval must be between 0.05 and 60.0.\n");
-                        return EXIT_FAILURE;
-                    }
-                    break;
-                case 'l':
-                    printLut = true;
-                    break;
-                case 'n':
-                    int niceness = atoi(optarg);
-                    if (niceness < -20 || niceness > 19) {
-                        fprintf(stderr, "ERROR: --niceness must be -20 to 19.\n");
-                        return EXIT_FAILURE;
-                    }
-                    nice(niceness);
-                    break;
-                case 's':
-                    silent = true;
-                    break;
-                case 't': {
-                    char * tail1;
-                    char * tok1 = strtok_r(optarg, ";", &tail1);
-                    while (tok1 != NULL) {
-                        if (++curTsen > MAXTSEN) {
-                            fprintf(stderr, "ERROR: --temp-sensors : Exceeded maximum allowed temp sensors (%d).\n", MAXTSEN);
-                            return EXIT_FAILURE;
-                        }
-                        char * tail2;
-                        char * tok2 = strtok_r(tok1, ":", &tail2);
-                        int i = 0;
-                        char dev[64];
-                        char sen[64];
-                        while (tok2 != NULL) {
-                            switch (i++) {
-                                case 0:
-                                    sprintf(dev, "%s", tok2);
-                                    break;
-                                case 1:
-                                    sprintf(sen, "%s", tok2);
-                                    break;
-                                case 2:
-                                    tsenArr[curTsen].offs = atoi(tok2);
-                                    break;
-                                case 3:
-                                    tsenArr[curTsen].thres = atoi(tok2);
-                                    break;
-                                default:
-                                    fprintf(stderr, "ERROR: --temp-sensors : Format exceeds maximum parameters: '%s'\n", tok1);
-                                    return EXIT_FAILURE;
+            break;
+        case 'b':
+            smoothDown = (unsigned char) atoi(arg);
+            if (smoothDown == 0) {
+                fprintf(stderr, "ERROR: --fan-smooth-down must be between 1 and 255.\n");
+                return false;
+            }
+            break;
+        case 'c':
+            minFanSpeed = (unsigned short) atoi(arg);
+            break;
+        case 'd':
+            lowFanSpeed = (unsigned short) atoi(arg);
+            break;
+        case 'e':
+            lowTemp = (unsigned char) atoi(arg);
+            if (lowTemp == 0 || lowTemp > 99) {
+                fprintf(stderr, "ERROR: --fan-temp-low must be between 1 and 99.\n");
+                return false;
+            }
+            break;
+        case 'f':
+            highFanSpeed = (unsigned short) atoi(arg);
+            break;
+        case 'g':
+            highTemp = (unsigned char) atoi(arg);
+            if (highTemp == 0 || highTemp > 99) {
+                fprintf(stderr, "ERROR: --fan-temp-high must be between 1 and 99.\n");
+                return false;
+            }
+            break;
+        case 'h':
+            printUsage();
+            exit(EXIT_SUCCESS);
+        case 'i':
+            interval = atof(arg);
+            if (!interval || interval < 0.05 || interval > 60.0) {
+                fprintf(stderr, "ERROR: --interval must be between 0.05 and 60.0.\n");
+                return false;
+            }
+            break;
+        case 'k':
+            calibrate = true;
+            break;
+        case 'B':
+            benchTicks = atoi(arg);
+            if (benchTicks < 1) {
+                fprintf(stderr, "ERROR: --benchmark must be 1 or more.\n");
+                return false;
+            }
+            break;
+        case 'l':
+            printLut = true;
+            break;
+        case 'm':
+            calFile = strdup(value);
+            break;
+        case 'n': {
+            int niceness = atoi(arg);
+            if (niceness < -20 || niceness > 19) {
+                fprintf(stderr, "ERROR: --niceness must be -20 to 19.\n");
+                return false;
+            }
+            setpriority(PRIO_PROCESS, 0, niceness);
+            break;
+        }
+        case 'p':
+            replayTrace = strdup(value);
+            replay = true;
+            break;
+        case 'q':
+            if (sscanf(arg, "%f:%f:%f:%f", &modelAmbient, &modelRise, &modelCooling, &modelTau) != 4 || modelTau <= 0) {
+                fprintf(stderr, "ERROR: --replay-model must be in the format AMBIENT:RISE:COOLING:TAU\n");
+                return false;
+            }
+            replayModel = replay = true;
+            break;
+        case 'r':
+            sysfsRoot = strdup(value);
+            fakeSysfs = strcmp(sysfsRoot, "/sys") != 0;
+            break;
+        case 'u':
+            replayLoad = strdup(value);
+            break;
+        case 'v':
+            replayTime = atof(arg);
+            if (replayTime <= 0) {
+                fprintf(stderr, "ERROR: --replay-time must be more than 0.\n");
+                return false;
+            }
+            break;
+        case 'w':
+            replayOutput = strdup(value);
+            break;
+        case 'P': {
+            if (curProfs >= MAXPROFILES) {
+                fprintf(stderr, "ERROR: --profile : Exceeded maximum allowed profiles (%d).\n", MAXPROFILES);
+                return false;
+            }
+            struct pStruct * prof = &profArr[curProfs + 1];
+            unsigned int vals[5];
+            char * sep = strchr(arg, ':');
+            if (!sep || sep == arg || sep - arg >= (int) sizeof(prof->name) || sscanf(sep + 1, "%u:%u:%u:%u:%u", &vals[0], &vals[1], &vals[2], &vals[3], &vals[4]) != 5) {
+                fprintf(stderr, "ERROR: --profile must be in the format NAME:MIN:LOW:TEMPLOW:HIGH:TEMPHIGH\n");
+                return false;
+            }
+            if (vals[0] > vals[1] || vals[1] > vals[3] || vals[3] > 255 || !vals[2] || vals[2] >= vals[4] || vals[4] > 99) {
+                fprintf(stderr, "ERROR: --profile : Speeds must be MIN <= LOW <= HIGH <= 255, temperatures 1 to 99 with TEMPLOW < TEMPHIGH.\n");
+                return false;
+            }
+            *sep = 0;
+            snprintf(prof->name, sizeof(prof->name), "%s", arg);
+            prof->minFanSpeed = vals[0];
+            prof->lowFanSpeed = vals[1];
+            prof->lowTemp = vals[2];
+            prof->highFanSpeed = vals[3];
+            prof->highTemp = vals[4];
+            curProfs++;
+            break;
+        }
+        case 'S':
+            sockPath = strdup(value);
+            break;
+        case 'F':
+            statePath = strdup(value);
+            break;
+        case 'T':
+            telePath = strdup(value);
+            break;
+        case 'M':
+            bakePath = strdup(value);
+            break;
+        case 'R':
+            rtPriority = atoi(arg);
+            if (rtPriority < 1 || rtPriority > 99) {
+                fprintf(stderr, "ERROR: --realtime must be between 1 and 99.\n");
+                return false;
+            }
+            break;
+        case 'D':
+            deadline = (unsigned short) atoi(arg);
+            if (atoi(arg) < 1 || atoi(arg) > 60000) {
+                fprintf(stderr, "ERROR: --deadline must be between 1 and 60000.\n");
+                return false;
+            }
+            break;
+        case 'E':
+            failSafeReads = (unsigned char) atoi(arg);
+            if (atoi(arg) < 1 || atoi(arg) > 255) {
+                fprintf(stderr, "ERROR: --fail-safe-reads must be between 1 and 255.\n");
+                return false;
+            }
+            break;
+        case 'W':
+            writeBehind = true;
+            break;
+        case 'A':
+            throttleBoost = (unsigned char) atoi(arg);
+            if (atoi(arg) < 1 || atoi(arg) > 255) {
+                fprintf(stderr, "ERROR: --throttle-boost must be between 1 and 255.\n");
+                return false;
+            }
+            break;
+        case 'L':
+            sensorSlowMs = (unsigned short) atoi(arg);
+            if (atoi(arg) < 1 || atoi(arg) > 10000) {
+                fprintf(stderr, "ERROR: --sensor-slow must be between 1 and 10000.\n");
+                return false;
+            }
+            break;
+        case 'H': {
+            char * depth = strrchr(arg, ':');
+            if (depth) {
+                *depth++ = 0;
+                hidDepth = atoi(depth);
+            }
+            if (!arg[0] || hidDepth < 1 || hidDepth > HIDQUEUE) {
+                fprintf(stderr, "ERROR: --hidraw must be in the format DEVICE[:DEPTH], DEPTH 1 to %d.\n", HIDQUEUE);
+                return false;
+            }
+            hidPath = strdup(arg);
+            break;
+        }
+        case 's':
+            silent = true;
+            break;
+        case 't': {
+            char * tail1;
+            char * tok1 = strtok_r(arg, ";", &tail1);
+            while (tok1 != NULL) {
+                if (!addSensor()) {
+                    fprintf(stderr, "ERROR: --temp-sensors : Out of memory.\n");
+                    return false;
+                }
+                char * tail2;
+                char * tok2 = strtok_r(tok1, ":", &tail2);
+                int i = 0;
+                while (tok2 != NULL) {
+                    switch (i++) {
+                        case 0:
+                            snprintf(tsen.info[curTsen].dev, sizeof(tsen.info[curTsen].dev), "%s", tok2);
+                            break;
+                        case 1:
+                            snprintf(tsen.info[curTsen].sen, sizeof(tsen.info[curTsen].sen), "%s", tok2);
+                            break;
+                        case 2:
+                            tsen.offs[curTsen] = atoi(tok2);
+                            break;
+                        case 3:
+                            tsen.thres[curTsen] = atoi(tok2);
+                            break;
+                        case 4:
+                            tsen.rate[curTsen] = atof(tok2);
+                            if (tsen.rate[curTsen] < 0) {
+                                fprintf(stderr, "ERROR: --temp-sensors : RATE can't be negative: '%s'\n", tok1);
+                                return false;
                             }
-                            tok2 = strtok_r(NULL, ":", &tail2);
-                        }
-                        if (i < 4) {
-                            fprintf(stderr, "ERROR: --temp-sensors : Format contains too few parameters: '%s'\n", tok1);
-                            return EXIT_FAILURE;
-                        }
-                        if (!getHwmonPath(dev)) {
-                            return EXIT_FAILURE;
-                        }
-                        sprintf(tsenArr[curTsen].path, "%s/%s", buf, sen);
-                        if (!fileExists(tsenArr[curTsen].path)) {
-                            fprintf(stderr, "File not found: %s\n", tsenArr[curTsen].path);
-                            return EXIT_FAILURE;
-                        }
-                        tok1 = strtok_r(NULL, ";", &tail1);
+                            tsen.lazy = tsen.lazy || tsen.rate[curTsen] > 0;
+                            break;
+                        default:
+                            fprintf(stderr, "ERROR: --temp-sensors : Format exceeds maximum parameters: '%s'\n", tok1);
+                            return false;
                     }
-                    break;
+                    tok2 = strtok_r(NULL, ":", &tail2);
                 }
-                case 'z': {
-                    if (!getHwmonPath("corsaircpro")) {
-                        return EXIT_FAILURE;
-                    }
-                    char * tail1;
-                    char * tok1 = strtok_r(optarg, ";", &tail1);
-                    while (tok1 != NULL) {
-                        if (++curFans > MAXFANS) {
-                            fprintf(stderr, "ERROR: --fans : Exceeded maximum allowed fans (%d).\n", MAXFANS);
-                            return EXIT_FAILURE;
-                        }
-                        char * tail2;
-                        char * tok2 = strtok_r(tok1, ":", &tail2);
-                        int i = 0;
-                        char pwm[64];
-                        while (tok2 != NULL) {
-                            switch (i++) {
-                                case 0:
-                                    sprintf(pwm, "%s", tok2);
-                                    break;
-                                case 1:
-                                    fanArr[curFans].offs = atoi(tok2);
-                                    break;
-                                default:
-                                    fprintf(stderr, "ERROR: --fans : Format exceeds maximum parameters: '%s'\n", tok1);
-                                    return EXIT_FAILURE;
+                if (i < 4) {
+                    fprintf(stderr, "ERROR: --temp-sensors : Format contains too few parameters: '%s'\n", tok1);
+                    return false;
+                }
+                tok1 = strtok_r(NULL, ";", &tail1);
+            }
+            break;
+        }
+        case 'z': {
+            char * tail1;
+            char * tok1 = strtok_r(arg, ";", &tail1);
+            while (tok1 != NULL) {
+                if (!addFan()) {
+                    fprintf(stderr, "ERROR: --fans : Out of memory.\n");
+                    return false;
+                }
+                char * tail2;
+                char * tok2 = strtok_r(tok1, ":", &tail2);
+                int i = 0;
+                while (tok2 != NULL) {
+                    switch (i++) {
+                        case 0: {
+                            // DEVICE_NAME/PWM, a fan on another controller than the Commander Pro.
+                            struct fStruct * fan = &fans.info[curFans];
+                            char * pwm = strchr(tok2, '/');
+                            if (pwm) {
+                                *pwm++ = 0;
                             }
-                            tok2 = strtok_r(NULL, ":", &tail2);
+                            snprintf(fan->dev, sizeof(fan->dev), "%s", pwm ? tok2 : "corsaircpro");
+                            snprintf(fan->pwm, sizeof(fan->pwm), "%s", pwm ? pwm : tok2);
+                            break;
                         }
-                        if (i < 2) {
-                            fprintf(stderr, "ERROR: --fans : Format contains too few parameters: '%s'\n", tok1);
-                            return EXIT_FAILURE;
-                        }
-                        sprintf(fanArr[curFans].path, "%s/%s", buf, pwm);
-                        if (!fileExists(fanArr[curFans].path)) {
-                            fprintf(stderr, "File not found: %s\n", fanArr[curFans].path);
-                            return EXIT_FAILURE;
-                        }
-                        tok1 = strtok_r(NULL, ";", &tail1);
+                        case 1:
+                            fans.offs[curFans] = atoi(tok2);
+                            break;
+                        case 2:
+                            fans.maxRpm[curFans] = atoi(tok2);
+                            break;
+                        default:
+                            fprintf(stderr, "ERROR: --fans : Format exceeds maximum parameters: '%s'\n", tok1);
+                            return false;
                     }
-                    break;
+                    tok2 = strtok_r(NULL, ":", &tail2);
+                }
+                if (i < 2) {
+                    fprintf(stderr, "ERROR: --fans : Format contains too few parameters: '%s'\n", tok1);
+                    return false;
                 }
+                const char * file = fans.info[curFans].pwm;
+                bool target = strncmp(file, "fan", 3) == 0 && strstr(file, "_target") != NULL;
+                if (target != (i == 3) || (target && (fans.maxRpm[curFans] < 1 || fans.maxRpm[curFans] > 10000))) {
+                    fprintf(stderr, "ERROR: --fans : fanN_target fans need a MAXRPM (1 to 10000), pwmN fans don't: '%s'\n", file);
+                    return false;
+                }
+                tok1 = strtok_r(NULL, ";", &tail1);
+            }
+            break;
+        }
+        case 'C':
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+// Config file, one option per line, same names as the long options : "fan-speed-low = 45"
+// Empty lines and text after a # are ignored, options without a value are written without "=".
+bool loadConfig(const char * path) {
+    char line[16384];
+    int lineNum = 0;
+    bool ok = true;
+    FILE * in = fopen(path, "r");
+    if (!in) {
+        fprintf(stderr, "ERROR: Could not open config file '%s'\n", path);
+        return false;
+    }
+    while (ok && fgets(line, sizeof(line), in)) {
+        lineNum++;
+        char * name = line + strspn(line, " \t");
+        name[strcspn(name, "#\r\n")] = 0;
+        char * value = strchr(name, '=');
+        if (value) {
+            *value++ = 0;
+            value += strspn(value, " \t");
+            for (int i = strlen(value) - 1; i >= 0 && (value[i] == ' ' || value[i] == '\t'); i--) {
+                value[i] = 0;
+            }
+        }
+        for (int i = strlen(name) - 1; i >= 0 && (name[i] == ' ' || name[i] == '\t'); i--) {
+            name[i] = 0;
+        }
+        if (!*name) {
+            continue;
+        }
+        struct option * opt = long_options;
+        while (opt->name && strcmp(opt->name, name) != 0) {
+            opt++;
+        }
+        if (!opt->name || opt->val == 'C' || opt->val == 'h') {
+            fprintf(stderr, "ERROR: %s line %d : Unknown option '%s'\n", path, lineNum, name);
+            ok = false;
+        } else if ((opt->has_arg == required_argument) != (value != NULL && *value)) {
+            fprintf(stderr, "ERROR: %s line %d : '%s' %s\n", path, lineNum, name, opt->has_arg ? "requires a value" : "takes no value");
+            ok = false;
+        } else {
+            ok = setOption(opt->val, value);
+        }
+    }
+    fclose(in);
+    return ok;
+}
+
+// The config file is applied first, then the command line, so command line options win.
+bool applyOptions() {
+    int c;
+    if (confFile && !loadConfig(confFile)) {
+        return false;
+    }
+    optind = 0;
+    while ((c = getopt_long(optArgc, optArgv, short_options, long_options, NULL)) != -1) {
+        if (!setOption(c, optarg)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool checkOptions() {
+    if (minFanSpeed >= lowFanSpeed) {
+        fprintf(stderr, "ERROR: --fan-speed-min must be less than --fan-speed-low.\n");
+        return false;
+    }
+    if (lowFanSpeed >= highFanSpeed) {
+        fprintf(stderr, "ERROR: --fan-speed-low must be less than -fan-speed-high.\n");
+        return false;
+    }
+    if (lowFanSpeed == 0) {
+        fprintf(stderr, "ERROR: Fan speed values must be between 0 and 10000.\n");
+        return false;
+    }
+    return true;
+}
+
+// Everything a config reload can change, so a bad config can be rolled back.
+struct confStruct {
+    bool silent;
+    float interval;
+    unsigned char lowTemp, highTemp, smoothUp, smoothDown, highFanSpeed, lowFanSpeed, minFanSpeed, throttleBoost;
+    int fanLut[100];
+    int curFans, curTsen;
+    struct fTable fans;
+    struct tTable tsen;
+    struct pStruct profArr[MAXPROFILES + 1];
+    int curProfs, curProfile;
+};
+struct confStruct oldConf;
+
+void saveConf(struct confStruct * conf) {
+    conf->silent = silent;
+    conf->interval = interval;
+    conf->lowTemp = lowTemp;
+    conf->highTemp = highTemp;
+    conf->smoothUp = smoothUp;
+    conf->smoothDown = smoothDown;
+    conf->highFanSpeed = highFanSpeed;
+    conf->lowFanSpeed = lowFanSpeed;
+    conf->minFanSpeed = minFanSpeed;
+    conf->throttleBoost = throttleBoost;
+    memcpy(conf->fanLut, fanLut, sizeof(fanLut));
+    conf->curFans = curFans;
+    conf->curTsen = curTsen;
+    conf->fans = fans;
+    conf->tsen = tsen;
+    memcpy(conf->profArr, profArr, sizeof(profArr));
+    conf->curProfs = curProfs;
+    conf->curProfile = curProfile;
+}
+
+void restoreConf(const struct confStruct * conf) {
+    silent = conf->silent;
+    interval = conf->interval;
+    lowTemp = conf->lowTemp;
+    highTemp = conf->highTemp;
+    smoothUp = conf->smoothUp;
+    smoothDown = conf->smoothDown;
+    highFanSpeed = conf->highFanSpeed;
+    lowFanSpeed = conf->lowFanSpeed;
+    minFanSpeed = conf->minFanSpeed;
+    throttleBoost = conf->throttleBoost;
+    memcpy(fanLut, conf->fanLut, sizeof(fanLut));
+    curFans = conf->curFans;
+    curTsen = conf->curTsen;
+    fans = conf->fans;
+    tsen = conf->tsen;
+    memcpy(profArr, conf->profArr, sizeof(profArr));
+    curProfs = conf->curProfs;
+    curProfile = conf->curProfile;
+}
+
+// Runs between two loops : the new config is parsed, checked and its LUT built, then it replaces
+// the old one. lastFanSpeed and the PWM of the fans are kept, so the fans don't restart from 0.
+// The new config gets new fan / sensor tables, the tables that are not used anymore are freed.
+void reloadConfig(int tfd) {
+    // The actuator of --write-behind waits, the fan table is replaced.
+    pthread_mutex_lock(&actLock);
+    saveConf(&oldConf);
+    silent = false;
+    interval = 1.0;
+    lowTemp = highTemp = smoothUp = smoothDown = highFanSpeed = lowFanSpeed = minFanSpeed = throttleBoost = 0;
+    curFans = curTsen = -1;
+    curProfs = 0;
+    memset(&fans, 0, sizeof(fans));
+    memset(&tsen, 0, sizeof(tsen));
+    reloading = true;
+    bool ok = applyOptions() && curFans >= 0 && curTsen >= 0 && checkOptions() && checkWatchdog() && scanHwmon() && openFans() && openSensors();
+    reloading = false;
+    if (!ok) {
+        closeFds();
+        freeFans(&fans);
+        freeSensors(&tsen);
+        restoreConf(&oldConf);
+        pthread_mutex_unlock(&actLock);
+        fprintf(stderr, "ERROR: Reloading the config failed, keeping the current config.\n");
+        return;
+    }
+    for (int i = 0; i <= oldConf.curTsen; i++) {
+        close(oldConf.tsen.fd[i]);
+    }
+    for (int i = 0; i <= oldConf.curFans; i++) {
+        close(oldConf.fans.fd[i]);
+    }
+    loadCalibration();
+    for (int i = 0; i <= curFans; i++) {
+        for (int j = 0; j <= oldConf.curFans; j++) {
+            if (strcmp(fans.info[i].path, oldConf.fans.info[j].path) == 0) {
+                fans.lastPwm[i] = oldConf.fans.lastPwm[j];
+                // Not written yet by the actuator, post it again.
+                fans.stale[i] = fans.stale[i] || atomic_load(&oldConf.fans.mail[j]) || atomic_load(&oldConf.fans.failed[j]);
+            }
+        }
+    }
+    freeFans(&oldConf.fans);
+    freeSensors(&oldConf.tsen);
+    pthread_mutex_unlock(&actLock);
+    // Stay on the same profile if it still exists.
+    mkProfiles(oldConf.profArr[oldConf.curProfile].name);
+    statReloads++;
+    if (interval != oldConf.interval) {
+        armTimer(tfd);
+    }
+    if (tele) {
+        tele->nTemps = curTsen + 1 > TELETEMPS ? TELETEMPS : curTsen + 1;
+        tele->nFans = curFans + 1 > TELEFANS ? TELEFANS : curFans + 1;
+        publishRpmPaths();
+    }
+    if (!silent) {
+        printf("\nConfig reloaded.\n");
+    }
+}
+
+int watchConfig() {
+    char dir[PATH_MAX];
+    if (!confFile) {
+        return -1;
+    }
+    snprintf(dir, sizeof(dir), "%s", confFile);
+    if (strrchr(dir, '/') != NULL) {
+        *strrchr(dir, '/') = 0;
+        confBase = strrchr(confFile, '/') + 1;
+    } else {
+        sprintf(dir, ".");
+        confBase = confFile;
+    }
+    // Watch the directory, editors often replace the file instead of writing to it.
+    int ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (ifd >= 0 && inotify_add_watch(ifd, dir[0] ? dir : "/", IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        close(ifd);
+        ifd = -1;
+    }
+    if (ifd < 0) {
+        fprintf(stderr, "WARNING: Could not watch '%s' for changes, use SIGHUP to reload it.\n", confFile);
+    }
+    return ifd;
+}
+
+bool configChanged(int ifd) {
+    char evBuf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    ssize_t len;
+    while ((len = read(ifd, evBuf, sizeof(evBuf))) > 0) {
+        for (char * ptr = evBuf; ptr < evBuf + len; ptr += sizeof(struct inotify_event) + ((struct inotify_event *) ptr)->len) {
+            struct inotify_event * ev = (struct inotify_event *) ptr;
+            if (ev->len && strcmp(ev->name, confBase) == 0) {
+                changed = true;
+            }
+        }
+    }
+    return changed;
+}
+
+void onReload() {
+    reloadPending = 1;
+}
+
+// Only sets a flag, nothing cleanup() calls is async-signal-safe.
+void onStop() {
+    stopPending = 1;
+}
+
+// Before the files are made and the fans are driven, a stop has to go through cleanup() from main().
+// The signals stay blocked outside of ppoll(), so a stop can't slip in between the check and the wait,
+// threads started after this inherit the mask.
+void catchStop() {
+    sigset_t sigs;
+    signal(SIGQUIT, onStop);
+    signal(SIGINT, onStop);
+    signal(SIGTERM, onStop);
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGQUIT);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGHUP);
+    sigprocmask(SIG_BLOCK, &sigs, &waitMask);
+}
+
+int main(int argc, char **argv) {
+#ifndef linux
+    fprintf(stderr, "ERROR: Operating system must be Linux.\n");
+    return 1;
+#endif
+    signal(SIGHUP, onReload);
+    // Writing to a --hidraw stand-in that exited must fail instead of killing ccpfc.
+    signal(SIGPIPE, SIG_IGN);
+#ifdef LATENCYSTATS
+    signal(SIGUSR1, onLatDump);
+#endif
+    {
+        int c;
+        optArgc = argc;
+        optArgv = argv;
+        opterr = 0;
+        while ((c = getopt_long(argc, argv, short_options, long_options, NULL)) != -1) {
+            if (c == 'C') {
+                confFile = optarg;
             }
         }
-        if (argc <= 1 || curFans <= 0 || curTsen <= 0) {
+        opterr = 1;
+        if (!applyOptions()) {
+            return EXIT_FAILURE;
+        }
+        if ((argc <= 1 && !confFile) || (!replay && curFans < 0) || (!calibrate && !replay && curTsen < 0)) {
             printUsage();
             return EXIT_FAILURE;
         }
-        if (geteuid() != 0) {
+        if (bakePath) {
+            return checkOptions() && bakeConfig() ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        if (!replay && geteuid() != 0 && !fakeSysfs) {
             fprintf(stderr, "ERROR: ccpfc must be run as root.\n");
             return EXIT_FAILURE;
-        }
-        if (minFanSpeed >= lowFanSpeed) {
-            fprintf(stderr, "ERROR: --fan-speed-min must be less than --fan-speed-low.\n");
+        } else if (calibrate && hidPath) {
+            fprintf(stderr, "ERROR: --calibrate reads the fanN_input files of the corsair-cpro driver, it can't be used with --hidraw.\n");
             return EXIT_FAILURE;
-        }
-        if (lowFanSpeed >= highFanSpeed) {
-            fprintf(stderr, "ERROR: --fan-speed-low must be less than -fan-speed-high.\n");
+        } else if (!replay && (!scanHwmon() || (hidPath && !openHidraw()) || !openFans() || (!calibrate && !openSensors()))) {
             return EXIT_FAILURE;
         }
-        if (lowFanSpeed == 0) {
-            fprintf(stderr, "ERROR: Fan speed values must be between 0 and 10000.\n");
+        if (calibrate) {
+            int (* rpmMaps)[CALPOINTS] = calloc(curFans + 1, sizeof(*rpmMaps));
+            if (!rpmMaps) {
+                fprintf(stderr, "ERROR: Out of memory.\n");
+                return EXIT_FAILURE;
+            }
+            for (int i = 0; i <= curFans; i++) {
+                if (fans.maxRpm[i]) {
+                    fprintf(stderr, "ERROR: --calibrate only works with pwmN fans, '%s' is set by RPM.\n", fans.info[i].pwm);
+                    return EXIT_FAILURE;
+                }
+                if (!fileExists(fans.info[i].rpmPath) || !calibrateFan(i, rpmMaps[i])) {
+                    setCalPwm(i, 255);
+                    return EXIT_FAILURE;
+                }
+            }
+            return saveCalibration(rpmMaps) ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        loadCalibration();
+        if (!checkOptions()) {
             return EXIT_FAILURE;
         }
         mkFanLut(printLut);
         if (printLut) {
             return EXIT_SUCCESS;
         }
+        if (replay) {
+            return runReplay();
+        }
+        if (benchTicks) {
+            return runBenchmark();
+        }
+        catchStop();
+        openThrottle();
+        if (telePath) {
+            if (!(tele = createRing(telePath, "ccpfc", curTsen + 1, curFans + 1, "PWM", teleCounters))) {
+                return EXIT_FAILURE;
+            }
+            tele->flags = throttleFdCnt ? TELETHROTTLE : 0;
+            publishRpmPaths();
+        }
+        if (sockPath && !openSocket()) {
+            cleanup();
+            return EXIT_FAILURE;
+        }
+        mkProfiles("default");
+        if (statePath) {
+            loadState();
+        }
+        if (rtPriority && !enterRealtime(RTHEAP)) {
+            cleanup();
+            return EXIT_FAILURE;
+        }
+        // After enterRealtime(), its stack is locked with the rest.
+        if (writeBehind && !startActuator()) {
+            cleanup();
+            return EXIT_FAILURE;
+        }
+        if (!openNotify()) {
+            cleanup();
+            return EXIT_FAILURE;
+        }
     }
-    while (1) {
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tfd < 0) {
+        fprintf(stderr, "ERROR: Could not create timer.\n");
+        cleanup();
+        return EXIT_FAILURE;
+    }
+    armTimer(tfd);
+    int ifd = watchConfig();
+    int rfd = openResumeTimer();
+    if (!fakeSysfs) {
+        ueventFd = openUevents("hwmon directories are only looked up again after failed reads.");
+    }
+    // ppoll() skips the negative fds : no --config, no --socket, free client slots.
+    struct pollfd pfds[5 + MAXCLIENTS];
+    struct timespec tickStart;
+    uint64_t expirations;
+    slept = suspendedTime();
+    sdNotify("READY=1\nSTATUS=Running");
+    while (!stopPending) {
+        clock_gettime(CLOCK_MONOTONIC, &tickStart);
+        // In case the resume timer was missed.
+        if (suspendedTime() > slept + 1.0) {
+            resumeFans();
+        }
+        checkFailSafe();
+        checkThrottle();
         setFanSpeed();
-        sleep(interval);
+        statLoops++;
+        if (stateDirty && statePath) {
+            saveState();
+        }
+        if (tele) {
+            publishTelemetry(&tickStart);
+        }
+        LATEND(&latTick, tickStart);
+        endTick(&tickStart);
+        // Wait for the next loop, config reloads, hwmon rebinds and socket requests are done while waiting.
+        do {
+            LATDUMP();
+            if (reloadPending) {
+                reloadPending = 0;
+                reloadConfig(tfd);
+            }
+            if (rebindPending) {
+                rebindHwmon();
+            }
+            pfds[0] = (struct pollfd) {tfd, POLLIN, 0};
+            pfds[1] = (struct pollfd) {ifd, POLLIN, 0};
+            pfds[2] = (struct pollfd) {sockFd, POLLIN, 0};
+            pfds[3] = (struct pollfd) {ueventFd, POLLIN, 0};
+            pfds[4] = (struct pollfd) {rfd, POLLIN, 0};
+            for (int i = 0; i < MAXCLIENTS; i++) {
+                pfds[5 + i] = (struct pollfd) {sockFd >= 0 ? clientArr[i].fd : -1, POLLIN, 0};
+            }
+            if (ppoll(pfds, 5 + MAXCLIENTS, NULL, &waitMask) < 0) {
+                continue;
+            }
+            if ((pfds[4].revents & POLLIN) && clockWasSet(rfd)) {
+                resumeFans();
+            }
+            if ((pfds[1].revents & POLLIN) && configChanged(ifd)) {
+                reloadPending = 1;
+            }
+            if ((pfds[3].revents & POLLIN) && hwmonUevent(ueventFd)) {
+                rebindPending = true;
+            }
+            for (int i = 0; i < MAXCLIENTS; i++) {
+                if (pfds[5 + i].revents) {
+                    serveClient(&clientArr[i]);
+                }
+            }
+            if (pfds[2].revents & POLLIN) {
+                acceptClients();
+            }
+        } while (!stopPending && read(tfd, &expirations, sizeof(expirations)) != sizeof(expirations));
+        if (stopPending) {
+            break;
+        }
+        checkLateness(expirations);
+        LATLATE(tfd);
     }
+    cleanup();
     return EXIT_SUCCESS;
 }
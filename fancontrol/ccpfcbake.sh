@@ -0,0 +1,119 @@
+#!/bin/bash
+
+cat > /dev/null <<LICENSE
+    Copyright (C) 2022  kevinlekiller
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+    https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
+LICENSE
+
+# Builds ccpfcmin for one ccpfc config : ccpfc --bake writes the config as ccpfcmin.h, then ccpfcmin.c is
+# built with it as a static binary (dynamic if there is no static libc).
+# With COMPARE=1, ccpfcmin and ccpfc also run on a fake sysfs tree with the devices of the config,
+# and their binary size, startup time (start, one loop, exit) and RSS are printed.
+# Example:
+#  ./ccpfcbake.sh /etc/ccpfc.conf /usr/local/bin/ccpfcmin
+#  COMPARE=1 ./ccpfcbake.sh ccpfc.conf
+
+CONFIG=$1
+OUTPUT=${2:-./ccpfcmin}
+
+# Times to start each daemon for the startup time.
+STARTS=${STARTS:-200}
+
+SRCDIR=$(cd "$(dirname "$0")" && pwd)
+
+if [[ ! -f $CONFIG ]]; then
+    echo "Usage: $0 CONFIG [OUTPUT]" >&2
+    exit 1
+fi
+BUILD=$(mktemp -d) || exit 1
+trap 'rm -rf "$BUILD"' EXIT
+
+# $1 directory, $2 output, $3 extra ccpfc options, $4 extra gcc options
+function bake() {
+    mkdir -p "$1" && cp "$SRCDIR/ccpfcmin.c" "$1/" || return 1
+    # shellcheck disable=SC2086
+    "$BUILD/ccpfc" --config="$CONFIG" --bake="$1/ccpfcmin.h" $3 || return 1
+    # shellcheck disable=SC2086
+    if ! gcc "$1/ccpfcmin.c" -o "$2" -Wextra -O2 -static -s $4 2> /dev/null; then
+        echo "WARNING: Could not link statically, building a dynamic binary." >&2
+        gcc "$1/ccpfcmin.c" -o "$2" -Wextra -O2 -s $4 || return 1
+    fi
+}
+
+gcc "$SRCDIR/ccpfc.c" -o "$BUILD/ccpfc" -Wextra -O2 -lm -pthread || exit 1
+bake "$BUILD/min" "$OUTPUT" || exit 1
+echo "Built $OUTPUT"
+[[ $COMPARE == 1 ]] || exit 0
+
+# A hwmon directory for every DEVICE (DEVICE@N : N + 1 of them) with the files of the config.
+SYS=$BUILD/sys
+HWMON=0
+mkdir -p "$SYS/class/hwmon"
+while read -r DEV FILES; do
+    COUNT=$((${DEV#*@} + 1))
+    for ((i = 0; i < COUNT; i++)); do
+        DIR=$SYS/devices/${DEV%@*}.$i/hwmon/hwmon$HWMON
+        mkdir -p "$DIR"
+        ln -s "../../devices/${DEV%@*}.$i/hwmon/hwmon$HWMON" "$SYS/class/hwmon/hwmon$HWMON"
+        ln -s "../.." "$DIR/device"
+        echo "${DEV%@*}" > "$DIR/name"
+        for FILE in $FILES; do
+            if [[ $FILE == temp* ]]; then
+                echo 45000 > "$DIR/$FILE"
+            else
+                echo 0 > "$DIR/$FILE"
+            fi
+        done
+        HWMON=$((HWMON + 1))
+    done
+done < <(awk -F'"' '/^    \{"/ {dev = $2; n = 0; at = index(dev, "@"); if (at) {n = substr(dev, at + 1) + 0; dev = substr(dev, 1, at - 1)}
+    if (n > count[dev]) {count[dev] = n} files[dev] = files[dev] " " $4}
+    END {for (dev in files) print dev "@" count[dev] files[dev]}' "$BUILD/min/ccpfcmin.h")
+
+strip -o "$BUILD/ccpfc.stripped" "$BUILD/ccpfc"
+bake "$BUILD/bench" "$BUILD/ccpfcmin" "--sysfs-root=$SYS" || exit 1
+bake "$BUILD/once" "$BUILD/ccpfcmin.once" "--sysfs-root=$SYS" "-DTICKS=1" || exit 1
+
+# $@ command, prints the average ms from start to exit.
+function startTime() {
+    local START END
+    START=$(date +%s%N)
+    for ((i = 0; i < STARTS; i++)); do
+        "$@" > /dev/null 2>&1
+    done
+    END=$(date +%s%N)
+    awk -v ns=$((END - START)) -v n="$STARTS" 'BEGIN {printf "%.3f", ns / n / 1e6}'
+}
+
+# $@ command, prints the RSS in kB after a second.
+function rss() {
+    local PID RSS
+    "$@" > /dev/null 2>&1 &
+    PID=$!
+    sleep 1
+    RSS=$(awk '/VmRSS/ {print $2}' "/proc/$PID/status")
+    kill "$PID"
+    wait "$PID" 2> /dev/null
+    echo "$RSS"
+}
+
+GENERIC=("$BUILD/ccpfc" --config="$CONFIG" --sysfs-root="$SYS" --calibration-file="$BUILD/calibration")
+echo "build       size (stripped)  startup ms    RSS kB"
+printf "%-10s %16d %11s %9s\n" ccpfc "$(stat -c %s "$BUILD/ccpfc.stripped")" \
+    "$(startTime "${GENERIC[@]}" --benchmark=1)" "$(rss "${GENERIC[@]}")"
+printf "%-10s %16d %11s %9s\n" ccpfcmin "$(stat -c %s "$BUILD/ccpfcmin")" \
+    "$(startTime "$BUILD/ccpfcmin.once")" "$(rss "$BUILD/ccpfcmin")"
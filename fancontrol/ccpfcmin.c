@@ -0,0 +1,338 @@
+/**
+ * Copyright (C) 2022  kevinlekiller
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * ccpfc built for one config : the fan curve, sensors, fans and interval are constants from ccpfcmin.h,
+ * made by ccpfc --bake. The loop is the one of ccpfc (same temperatures, curve, smoothing, offsets and
+ * fail-safe on failed sensor reads, so the same fan speeds), without options, floating point, stdio or heap.
+ * Left out : --calibrate results, --profile / --socket, --telemetry, --state-file, --hidraw, config reloads,
+ * hwmon rebinds on uevents (a failed read / write reopens the same file instead), the deadlines and the
+ * sensor backoff.
+ *
+ * Compile: ccpfc --config=/etc/ccpfc.conf --bake=ccpfcmin.h && gcc ccpfcmin.c -o ccpfcmin -Wextra -O2 -static -s
+ * Or : ./ccpfcbake.sh /etc/ccpfc.conf
+ * With -DTICKS=N it exits after N loops, used by ccpfcbake.sh to time the startup.
+ * Run : ./ccpfcmin
+*/
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+
+#define TEMPNONE -274
+#define MAXHWMON 128
+
+struct bakedSensor {
+    const char * dev;
+    const char * file;
+    int offs, thres;
+};
+struct bakedFan {
+    const char * dev;
+    const char * file;
+    int offs, maxRpm;
+};
+#include "ccpfcmin.h"
+// Headers baked before --fail-safe-reads was baked.
+#ifndef BAKEDFAILSAFEREADS
+#define BAKEDFAILSAFEREADS 3
+#endif
+
+#define NSENSORS (sizeof(bakedSensors) / sizeof(bakedSensors[0]))
+#define NFANS (sizeof(bakedFans) / sizeof(bakedFans[0]))
+
+int senFd[NSENSORS], senLast[NSENSORS];
+int fanFd[NFANS];
+bool fanStale[NFANS];
+unsigned char fanLastPwm[NFANS], lastFanSpeed = 0;
+int lastTemp = 0;
+unsigned int failedTicks = 0, goodTicks = 0;
+bool tickFailed = false, failSafe = false;
+char senPath[NSENSORS][PATH_MAX], fanPath[NFANS][PATH_MAX];
+
+// Index of the hwmon directories sorted by device path, like ccpfc, so DEVICE@N is the same directory.
+struct hStruct {
+    char name[64];
+    char path[256];
+    char dev[PATH_MAX];
+};
+struct hStruct hwmonArr[MAXHWMON];
+int hwmonOrder[MAXHWMON], curHwmon = 0;
+
+// Errors without stdio.
+void say(const char * msg, const char * arg) {
+    struct iovec iov[3] = {{(void *) msg, strlen(msg)}, {(void *) arg, strlen(arg)}, {"\n", 1}};
+    writev(STDERR_FILENO, iov, 3);
+}
+
+// path = a + b + c, false if it doesn't fit.
+bool joinPath(char * path, size_t size, const char * a, const char * b, const char * c) {
+    size_t la = strlen(a), lb = strlen(b), lc = strlen(c);
+    if (la + lb + lc >= size) {
+        return false;
+    }
+    memcpy(path, a, la);
+    memcpy(path + la, b, lb);
+    memcpy(path + la + lb, c, lc + 1);
+    return true;
+}
+
+bool scanHwmon() {
+    char base[PATH_MAX], tmpPath[PATH_MAX];
+    joinPath(base, sizeof(base), BAKEDSYSFS, "/class/hwmon", "");
+    DIR * dir = opendir(base);
+    if (!dir) {
+        say("ERROR: Could not find base hwmon directory ", base);
+        return false;
+    }
+    struct dirent * files;
+    while ((files = readdir(dir)) != NULL && curHwmon < MAXHWMON) {
+        struct hStruct * hw = &hwmonArr[curHwmon];
+        if (!strstr(files->d_name, "hwmon") || !joinPath(hw->path, sizeof(hw->path), base, "/", files->d_name)
+            || !joinPath(tmpPath, sizeof(tmpPath), hw->path, "/name", "")) {
+            continue;
+        }
+        int fd = open(tmpPath, O_RDONLY | O_CLOEXEC);
+        ssize_t len = fd >= 0 ? read(fd, hw->name, sizeof(hw->name) - 1) : -1;
+        close(fd);
+        if (len < 1) {
+            continue;
+        }
+        hw->name[strcspn(hw->name, "\n")] = 0;
+        joinPath(tmpPath, sizeof(tmpPath), hw->path, "/device", "");
+        if (!realpath(tmpPath, hw->dev)) {
+            strcpy(hw->dev, hw->path);
+        }
+        // Insertion sort, there are a few dozen at most.
+        int i = curHwmon++;
+        for (; i > 0 && strcmp(hwmonArr[hwmonOrder[i - 1]].dev, hw->dev) > 0; i--) {
+            hwmonOrder[i] = hwmonOrder[i - 1];
+        }
+        hwmonOrder[i] = hw - hwmonArr;
+    }
+    closedir(dir);
+    return true;
+}
+
+// NAME@N is the Nth (from 0) hwmon directory whose name contains NAME, like ccpfc.
+const char * findHwmon(const char * name) {
+    char want[64];
+    const char * at = strchr(name, '@');
+    int skip = at ? atoi(at + 1) : 0;
+    size_t len = at ? (size_t) (at - name) : strlen(name);
+    len = len < sizeof(want) - 1 ? len : sizeof(want) - 1;
+    memcpy(want, name, len);
+    want[len] = 0;
+    for (int i = 0; i < curHwmon; i++) {
+        if (strstr(hwmonArr[hwmonOrder[i]].name, want) != NULL && skip-- == 0) {
+            return hwmonArr[hwmonOrder[i]].path;
+        }
+    }
+    say("ERROR: Could not find hwmon directory ", name);
+    return NULL;
+}
+
+bool openAll() {
+    for (unsigned int i = 0; i < NSENSORS; i++) {
+        const char * hwmonPath = findHwmon(bakedSensors[i].dev);
+        if (!hwmonPath || !joinPath(senPath[i], sizeof(senPath[i]), hwmonPath, "/", bakedSensors[i].file)
+            || (senFd[i] = open(senPath[i], O_RDONLY | O_CLOEXEC)) < 0) {
+            say("ERROR: Could not open sensor ", bakedSensors[i].file);
+            return false;
+        }
+        senLast[i] = TEMPNONE;
+    }
+    for (unsigned int i = 0; i < NFANS; i++) {
+        const char * hwmonPath = findHwmon(bakedFans[i].dev);
+        if (!hwmonPath || !joinPath(fanPath[i], sizeof(fanPath[i]), hwmonPath, "/", bakedFans[i].file)
+            || (fanFd[i] = open(fanPath[i], O_RDWR | O_CLOEXEC)) < 0) {
+            say("ERROR: Could not open fan ", bakedFans[i].file);
+            return false;
+        }
+    }
+    return true;
+}
+
+// A failed read / write : open the file again, for the next loop.
+void reopen(int * fd, const char * path, int flags) {
+    close(*fd);
+    *fd = open(path, flags | O_CLOEXEC);
+}
+
+// Millidegrees to degrees, rounded half away from zero like round() in ccpfc.
+int readSensor(int i) {
+    char buf[8];
+    ssize_t len = pread(senFd[i], buf, 7, 0);
+    if (len < 1) {
+        reopen(&senFd[i], senPath[i], O_RDONLY);
+        return TEMPNONE;
+    }
+    int value = 0, pos = buf[0] == '-';
+    for (; pos < len && buf[pos] >= '0' && buf[pos] <= '9'; pos++) {
+        value = value * 10 + buf[pos] - '0';
+    }
+    return buf[0] == '-' ? -((value + 500) / 1000) : (value + 500) / 1000;
+}
+
+bool writeFan(int i, int value) {
+    char buf[12];
+    int len = 0;
+    // fanN_target fans get the curve's 0-255 as RPM, up to their MAXRPM.
+    if (bakedFans[i].maxRpm) {
+        value = (value * bakedFans[i].maxRpm + 127) / 255;
+    }
+    do {
+        buf[sizeof(buf) - 1 - len++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    const char * str = buf + sizeof(buf) - len;
+    // A --sysfs-root tree is made of regular files, cut what's left of a longer previous value.
+    if (pwrite(fanFd[i], str, len, 0) != len || (BAKEDFAKESYSFS && ftruncate(fanFd[i], len) != 0)) {
+        reopen(&fanFd[i], fanPath[i], O_RDWR);
+        return false;
+    }
+    return true;
+}
+
+// Same as checkFailSafe() of ccpfc without the deadlines, with the reads of the previous loop.
+void checkFailSafe() {
+    failedTicks = tickFailed ? failedTicks + 1 : 0;
+    if (failedTicks >= BAKEDFAILSAFEREADS) {
+        goodTicks = 0;
+        if (!failSafe) {
+            failSafe = true;
+            say("WARNING: Sensor reads failed, fans at the high speed.", "");
+        }
+    } else if (failSafe && ++goodTicks >= BAKEDFAILSAFEREADS) {
+        failSafe = false;
+    }
+}
+
+// Same as setFanSpeed() of ccpfc without --calibrate results and pinning.
+void setFanSpeed() {
+    int temp = 0, tmpSpeed;
+    tickFailed = false;
+    for (unsigned int i = 0; i < NSENSORS; i++) {
+        // A failed read keeps the last temperature of the sensor.
+        int value = readSensor(i);
+        if (value == TEMPNONE) {
+            tickFailed = true;
+        } else {
+            senLast[i] = value;
+        }
+        int senTemp = senLast[i] + (senLast[i] > bakedSensors[i].thres) * bakedSensors[i].offs;
+        temp = senTemp > temp ? senTemp : temp;
+    }
+    // The sensor that failed could be the hottest one, a failed read never lowers the temperature.
+    if (tickFailed && temp < lastTemp) {
+        temp = lastTemp;
+    }
+    if (temp < BAKEDLOWTEMP) {
+        tmpSpeed = BAKEDMINSPEED;
+    } else if (temp <= BAKEDHIGHTEMP && bakedLut[temp]) {
+        tmpSpeed = bakedLut[temp];
+    } else {
+        tmpSpeed = BAKEDHIGHSPEED;
+    }
+    if (failSafe) {
+        tmpSpeed = BAKEDHIGHSPEED;
+    } else if (BAKEDSMOOTHDOWN && tmpSpeed < lastFanSpeed) {
+        tmpSpeed = lastFanSpeed - BAKEDSMOOTHDOWN;
+        if (tmpSpeed < BAKEDMINSPEED) {
+            tmpSpeed = BAKEDMINSPEED;
+        }
+    } else if (BAKEDSMOOTHUP && tmpSpeed > lastFanSpeed) {
+        tmpSpeed = lastFanSpeed + BAKEDSMOOTHUP;
+        if (tmpSpeed > BAKEDHIGHSPEED) {
+            tmpSpeed = BAKEDHIGHSPEED;
+        }
+    }
+    for (unsigned int i = 0; i < NFANS; i++) {
+        int fanSpeed = tmpSpeed + bakedFans[i].offs;
+        fanSpeed = fanSpeed < 0 ? 0 : fanSpeed > 255 ? 255 : fanSpeed;
+        if (fanSpeed == fanLastPwm[i] && !fanStale[i]) {
+            continue;
+        }
+        fanStale[i] = !writeFan(i, fanSpeed);
+        if (!fanStale[i]) {
+            fanLastPwm[i] = fanSpeed;
+        }
+    }
+    lastFanSpeed = tmpSpeed;
+    lastTemp = temp;
+}
+
+// Nanoseconds spent suspended since boot, the fans are written again after a resume.
+int64_t suspendedNs() {
+    struct timespec boot, mono;
+    clock_gettime(CLOCK_BOOTTIME, &boot);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    return (boot.tv_sec - mono.tv_sec) * 1000000000LL + boot.tv_nsec - mono.tv_nsec;
+}
+
+int main() {
+    if (geteuid() != 0 && !BAKEDFAKESYSFS) {
+        say("ERROR: ccpfcmin must be run as root.", "");
+        return EXIT_FAILURE;
+    }
+    setpriority(PRIO_PROCESS, 0, BAKEDNICENESS);
+    if (!scanHwmon() || !openAll()) {
+        return EXIT_FAILURE;
+    }
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    struct itimerspec its;
+    its.it_interval.tv_sec = BAKEDINTERVALNS / 1000000000LL;
+    its.it_interval.tv_nsec = BAKEDINTERVALNS % 1000000000LL;
+    its.it_value = its.it_interval;
+    if (tfd < 0 || timerfd_settime(tfd, 0, &its, NULL) != 0) {
+        say("ERROR: Could not create timer.", "");
+        return EXIT_FAILURE;
+    }
+    int64_t slept = suspendedNs();
+    uint64_t expirations;
+    // The first loop writes every fan, even a PWM of 0, the firmware can have left them at any speed.
+    memset(fanStale, true, sizeof(fanStale));
+#ifdef TICKS
+    for (int tick = 0; tick < TICKS; tick++) {
+#else
+    while (1) {
+#endif
+        if (suspendedNs() > slept + 1000000000LL) {
+            slept = suspendedNs();
+            memset(fanStale, true, sizeof(fanStale));
+        }
+        checkFailSafe();
+        setFanSpeed();
+#ifdef TICKS
+        if (tick + 1 == TICKS) {
+            break;
+        }
+#endif
+        while (read(tfd, &expirations, sizeof(expirations)) != sizeof(expirations));
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,709 @@
+/**
+ * Copyright (C) 2022  kevinlekiller
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Offline fan curve tuner for ccpfc.
+ *
+ * Replays recorded temperature traces (same CSV format as ccpfc --replay) through
+ * ccpfc's fan LUT, smoothing and thermal model (fancurve.h, the code ccpfc runs) for many
+ * fan curves, and prints the ccpfc arguments of the curve with the lowest cost.
+ * Search is a grid search followed by a local refinement around the best grid points,
+ * every batch of curves is spread over all CPU cores by a work stealing thread pool that
+ * is started once. --scaling shows how the search speed grows with the amount of threads.
+ *
+ * Compile: gcc ccpfctune.c -o ccpfctune -Wextra -O2 -lm -pthread
+ * Run : ./ccpfctune --help
+*/
+
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fancurve.h"
+
+// Max amount of sensor columns used from a trace.
+#define MAXTSEN 8
+// Amount of best grid points refined by the local search.
+#define SEEDS 8
+// Dimensions of the search : lowTemp, highTemp, lowFanSpeed, highFanSpeed, smoothUp, smoothDown.
+#define DIMS 6
+
+struct cStruct {
+    int p[DIMS];
+    double cost, pwmMean, pwmVar, hotFrac;
+};
+struct trStruct {
+    int * temps; // ticks * (curTsen + 1) sensor values in millidegrees
+    int ticks;
+};
+struct tStruct {
+    int offs;
+    int thres;
+};
+struct wsDeque {
+    pthread_mutex_t lock;
+    int * tasks;
+    int top, bottom;
+};
+
+bool silent = false;
+float interval = 1.0;
+float modelAmbient = 25.0, modelCooling = 0.6, modelTau = 60.0;
+double wMean = 1.0, wVar = 1.0, wHot = 10.0;
+int ceiling = 80, gridPoints = 6, nThreads = 0, minFanSpeed = 0, curTsen = -1, curTraces = 0;
+int dimMin[DIMS] = {30, 30, 1, 1, 1, 1}, dimMax[DIMS] = {90, 90, 255, 255, 255, 255};
+struct tStruct tsenArr[MAXTSEN];
+struct trStruct * traceArr;
+struct cStruct * candArr;
+int curCands = 0, sizeCands = 0;
+struct wsDeque * deques;
+unsigned long stolen = 0;
+// Thread pool : poolThreads workers wait for runBatch() to start a batch, the last one done wakes it.
+pthread_t * poolArr;
+pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t poolWake = PTHREAD_COND_INITIALIZER, poolDone = PTHREAD_COND_INITIALIZER;
+unsigned long poolBatch = 0;
+int poolThreads = 0, poolBusy = 0;
+bool poolStop = false, scaling = false;
+
+// Same as ccpfc --replay --replay-model=AMBIENT:0:COOLING:TAU with a single fan, for one curve.
+void evalCandidate(struct cStruct * cand) {
+    int fanLut[100] = {0};
+    int lowTemp = cand->p[0], highTemp = cand->p[1], lowFanSpeed = cand->p[2], highFanSpeed = cand->p[3];
+    int smoothUp = cand->p[4], smoothDown = cand->p[5];
+    double pwmSum = 0.0, pwmSqSum = 0.0, decay = 1.0 - exp(-interval / modelTau);
+    unsigned long ticks = 0, hotTicks = 0;
+    fillFanLut(fanLut, lowFanSpeed, lowTemp, highFanSpeed, highTemp);
+    for (int t = 0; t < curTraces; t++) {
+        double modelTemps[MAXTSEN];
+        int lastFanSpeed = 0;
+        for (int i = 0; i <= curTsen; i++) {
+            modelTemps[i] = modelAmbient;
+        }
+        for (int k = 0; k < traceArr[t].ticks; k++) {
+            int * row = &traceArr[t].temps[k * (curTsen + 1)];
+            int temp = 0, rawTemp = 0, senTemp, tmpSpeed;
+            // readSensors() and maxSensorTemp()
+            for (int i = 0; i <= curTsen; i++) {
+                modelTemps[i] = modelStep(modelTemps[i], modelAmbient, row[i] / 1000.0, modelCooling, lastFanSpeed, decay);
+                senTemp = (int) round((int) (modelTemps[i] * 1000.0) / 1000.0);
+                rawTemp = senTemp > rawTemp ? senTemp : rawTemp;
+                senTemp = offsetTemp(senTemp, tsenArr[i].offs, tsenArr[i].thres);
+                temp = senTemp > temp ? senTemp : temp;
+            }
+            // targetSpeed()
+            tmpSpeed = lutSpeed(fanLut, temp, minFanSpeed, lowTemp, highTemp, highFanSpeed);
+            tmpSpeed = smoothSpeed(tmpSpeed, lastFanSpeed, smoothUp, smoothDown, minFanSpeed, highFanSpeed);
+            lastFanSpeed = tmpSpeed;
+            pwmSum += tmpSpeed;
+            pwmSqSum += (double) tmpSpeed * tmpSpeed;
+            if (rawTemp > ceiling) {
+                hotTicks++;
+            }
+            ticks++;
+        }
+    }
+    cand->pwmMean = pwmSum / ticks;
+    cand->pwmVar = fmax(pwmSqSum / ticks - cand->pwmMean * cand->pwmMean, 0.0);
+    cand->hotFrac = (double) hotTicks / ticks;
+    // Every term is normalized to 0..1, 127.5^2 is the largest possible PWM variance.
+    cand->cost = wMean * cand->pwmMean / 255.0 + wVar * cand->pwmVar / (127.5 * 127.5) + wHot * cand->hotFrac;
+}
+
+// Owner takes tasks from the bottom of its own deque, when it is empty it steals from the top of the others.
+bool getTask(int self, int * task) {
+    struct wsDeque * dq = &deques[self];
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom > dq->top) {
+        *task = dq->tasks[--dq->bottom];
+        pthread_mutex_unlock(&dq->lock);
+        return true;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    for (int i = 1; i < poolThreads; i++) {
+        dq = &deques[(self + i) % poolThreads];
+        pthread_mutex_lock(&dq->lock);
+        if (dq->bottom > dq->top) {
+            *task = dq->tasks[dq->top++];
+            pthread_mutex_unlock(&dq->lock);
+            __atomic_add_fetch(&stolen, 1, __ATOMIC_RELAXED);
+            return true;
+        }
+        pthread_mutex_unlock(&dq->lock);
+    }
+    return false;
+}
+
+// Waits for a batch, runs it until every deque is empty, and waits for the next one.
+void * worker(void * arg) {
+    int task, self = (int) (long) arg;
+    unsigned long batch = 0;
+    pthread_mutex_lock(&poolLock);
+    while (1) {
+        while (!poolStop && poolBatch == batch) {
+            pthread_cond_wait(&poolWake, &poolLock);
+        }
+        if (poolStop) {
+            break;
+        }
+        batch = poolBatch;
+        pthread_mutex_unlock(&poolLock);
+        while (getTask(self, &task)) {
+            evalCandidate(&candArr[task]);
+        }
+        pthread_mutex_lock(&poolLock);
+        if (--poolBusy == 0) {
+            pthread_cond_signal(&poolDone);
+        }
+    }
+    pthread_mutex_unlock(&poolLock);
+    return NULL;
+}
+
+// Starts count workers, at most nThreads.
+bool startPool(int count) {
+    poolStop = false;
+    poolBatch = 0;
+    for (poolThreads = 0; poolThreads < count; poolThreads++) {
+        if (pthread_create(&poolArr[poolThreads], NULL, worker, (void *) (long) poolThreads) != 0) {
+            fprintf(stderr, "ERROR: Could not start thread %d.\n", poolThreads + 1);
+            return false;
+        }
+    }
+    return true;
+}
+
+void stopPool() {
+    pthread_mutex_lock(&poolLock);
+    poolStop = true;
+    pthread_cond_broadcast(&poolWake);
+    pthread_mutex_unlock(&poolLock);
+    for (int i = 0; i < poolThreads; i++) {
+        pthread_join(poolArr[i], NULL);
+    }
+    poolThreads = 0;
+}
+
+// Evaluates candidates first to curCands - 1 on the pool. The workers are waiting while the deques are filled.
+void runBatch(int first) {
+    int count = curCands - first;
+    if (count <= 0) {
+        return;
+    }
+    for (int i = 0; i < poolThreads; i++) {
+        int from = first + (long) count * i / poolThreads, to = first + (long) count * (i + 1) / poolThreads;
+        deques[i].top = 0;
+        deques[i].bottom = 0;
+        for (int j = from; j < to; j++) {
+            deques[i].tasks[deques[i].bottom++] = j;
+        }
+    }
+    pthread_mutex_lock(&poolLock);
+    poolBusy = poolThreads;
+    poolBatch++;
+    pthread_cond_broadcast(&poolWake);
+    while (poolBusy) {
+        pthread_cond_wait(&poolDone, &poolLock);
+    }
+    pthread_mutex_unlock(&poolLock);
+}
+
+bool validParams(const int * p) {
+    for (int i = 0; i < DIMS; i++) {
+        if (p[i] < dimMin[i] || p[i] > dimMax[i]) {
+            return false;
+        }
+    }
+    return p[0] < p[1] && minFanSpeed < p[2] && p[2] < p[3];
+}
+
+bool addCandidate(const int * p) {
+    if (!validParams(p)) {
+        return false;
+    }
+    if (curCands == sizeCands) {
+        sizeCands = sizeCands ? sizeCands * 2 : 4096;
+        struct cStruct * newCands = realloc(candArr, sizeCands * sizeof(struct cStruct));
+        if (!newCands) {
+            fprintf(stderr, "ERROR: Out of memory.\n");
+            exit(EXIT_FAILURE);
+        }
+        candArr = newCands;
+        for (int i = 0; i < nThreads; i++) {
+            int * newTasks = realloc(deques[i].tasks, sizeCands * sizeof(int));
+            if (!newTasks) {
+                fprintf(stderr, "ERROR: Out of memory.\n");
+                exit(EXIT_FAILURE);
+            }
+            deques[i].tasks = newTasks;
+        }
+    }
+    memcpy(candArr[curCands++].p, p, sizeof(int) * DIMS);
+    return true;
+}
+
+int cmpCost(const void * a, const void * b) {
+    double d = ((const struct cStruct *) a)->cost - ((const struct cStruct *) b)->cost;
+    return d < 0 ? -1 : d > 0;
+}
+
+int gridValue(int dim, int i) {
+    if (gridPoints == 1) {
+        return dimMin[dim];
+    }
+    // The smoothing steps are spread geometrically, 1 2 4 8 ... is more useful than 1 52 103 ...
+    if (dim >= 4) {
+        return (int) round(dimMin[dim] * pow((double) dimMax[dim] / dimMin[dim], (double) i / (gridPoints - 1)));
+    }
+    return dimMin[dim] + (dimMax[dim] - dimMin[dim]) * i / (gridPoints - 1);
+}
+
+void gridSearch() {
+    int idx[DIMS] = {0}, p[DIMS];
+    while (1) {
+        for (int d = 0; d < DIMS; d++) {
+            p[d] = gridValue(d, idx[d]);
+        }
+        addCandidate(p);
+        int d = 0;
+        while (d < DIMS && ++idx[d] == gridPoints) {
+            idx[d++] = 0;
+        }
+        if (d == DIMS) {
+            break;
+        }
+    }
+    runBatch(0);
+}
+
+bool seenParams(struct cStruct * seeds, int nSeeds, int first, const int * p) {
+    for (int i = 0; i < nSeeds; i++) {
+        if (memcmp(seeds[i].p, p, sizeof(int) * DIMS) == 0) {
+            return true;
+        }
+    }
+    for (int i = first; i < curCands; i++) {
+        if (memcmp(candArr[i].p, p, sizeof(int) * DIMS) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Pattern search around the best curves : try +-step on every dimension, keep the best SEEDS curves,
+// halve the steps when nothing improved, stop when every step is under 1.
+void refine(struct cStruct * seeds, int nSeeds) {
+    int step[DIMS];
+    for (int d = 0; d < DIMS; d++) {
+        step[d] = gridPoints > 1 ? (dimMax[d] - dimMin[d]) / (gridPoints - 1) / 2 : 1;
+        if (step[d] < 1) {
+            step[d] = 1;
+        }
+    }
+    while (1) {
+        int first = curCands, p[DIMS];
+        for (int s = 0; s < nSeeds; s++) {
+            for (int d = 0; d < DIMS; d++) {
+                for (int dir = -1; dir <= 1; dir += 2) {
+                    memcpy(p, seeds[s].p, sizeof(p));
+                    p[d] += dir * step[d];
+                    if (validParams(p) && !seenParams(seeds, nSeeds, first, p)) {
+                        addCandidate(p);
+                    }
+                }
+            }
+        }
+        runBatch(first);
+        bool improved = false;
+        qsort(&candArr[first], curCands - first, sizeof(struct cStruct), cmpCost);
+        for (int i = first; i < curCands && i < first + nSeeds; i++) {
+            if (candArr[i].cost < seeds[nSeeds - 1].cost) {
+                seeds[nSeeds - 1] = candArr[i];
+                qsort(seeds, nSeeds, sizeof(struct cStruct), cmpCost);
+                improved = true;
+            }
+        }
+        if (improved) {
+            continue;
+        }
+        bool done = true;
+        for (int d = 0; d < DIMS; d++) {
+            if (step[d] > 1) {
+                step[d] /= 2;
+                done = false;
+            }
+        }
+        if (done) {
+            break;
+        }
+    }
+}
+
+// Loads a ccpfc --replay trace and resamples it to one row per --interval, like ccpfc does.
+bool loadTrace(const char * path, struct trStruct * trace) {
+    char line[1024];
+    int rows = 0, size = 0, cols = -1;
+    double * times = NULL;
+    int * values = NULL;
+    FILE * in = fopen(path, "r");
+    if (!in) {
+        fprintf(stderr, "ERROR: Could not open '%s'\n", path);
+        return false;
+    }
+    while (fgets(line, sizeof(line), in)) {
+        char * tail, * tok = strtok_r(line, ",", &tail);
+        if (tok == NULL || (tok[0] < '0' || tok[0] > '9')) {
+            continue;
+        }
+        if (rows == size) {
+            size = size ? size * 2 : 4096;
+            double * newTimes = realloc(times, size * sizeof(double));
+            int * newValues = newTimes ? realloc(values, size * MAXTSEN * sizeof(int)) : NULL;
+            if (!newTimes || !newValues) {
+                fprintf(stderr, "ERROR: Out of memory loading '%s'\n", path);
+                free(newTimes ? newTimes : times);
+                free(values);
+                fclose(in);
+                return false;
+            }
+            times = newTimes;
+            values = newValues;
+        }
+        times[rows] = atof(tok);
+        int col = 0;
+        while ((tok = strtok_r(NULL, ",", &tail)) != NULL && col < MAXTSEN) {
+            values[rows * MAXTSEN + col++] = atoi(tok);
+        }
+        // The model only has MAXTSEN sensors, dropping the columns past it would tune against the wrong maximum.
+        if (tok != NULL) {
+            fprintf(stderr, "ERROR: '%s' line %d has more than %d sensor columns.\n", path, rows + 1, MAXTSEN);
+            fclose(in);
+            return false;
+        }
+        if (cols < 0) {
+            cols = col;
+        }
+        if (col != cols) {
+            fprintf(stderr, "ERROR: '%s' line %d has %d values, expected %d.\n", path, rows + 1, col, cols);
+            fclose(in);
+            return false;
+        }
+        rows++;
+    }
+    fclose(in);
+    if (rows == 0 || cols <= 0) {
+        fprintf(stderr, "ERROR: '%s' contains no samples.\n", path);
+        return false;
+    }
+    if (curTsen < 0) {
+        curTsen = cols - 1;
+    } else if (cols < curTsen + 1) {
+        fprintf(stderr, "ERROR: '%s' has %d sensor columns, expected %d.\n", path, cols, curTsen + 1);
+        return false;
+    }
+    trace->ticks = (int) (times[rows - 1] / interval) + 1;
+    trace->temps = malloc((size_t) trace->ticks * (curTsen + 1) * sizeof(int));
+    if (!trace->temps) {
+        fprintf(stderr, "ERROR: Out of memory loading '%s'\n", path);
+        return false;
+    }
+    int row = 0;
+    for (int k = 0; k < trace->ticks; k++) {
+        while (row + 1 < rows && times[row + 1] <= k * (double) interval) {
+            row++;
+        }
+        for (int i = 0; i <= curTsen; i++) {
+            trace->temps[k * (curTsen + 1) + i] = values[row * MAXTSEN + i];
+        }
+    }
+    free(times);
+    free(values);
+    return true;
+}
+
+// --scaling : the grid search on 1, 2, 4, ... --threads threads. A search that scales with the cores has a speedup
+// close to the amount of threads.
+int runScaling() {
+    double baseRate = 0.0;
+    printf("threads   curves/s   speedup   efficiency   stolen\n");
+    for (int n = 1; ; n = n * 2 < nThreads ? n * 2 : nThreads) {
+        struct timespec start, end;
+        curCands = 0;
+        stolen = 0;
+        if (!startPool(n)) {
+            stopPool();
+            return EXIT_FAILURE;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        gridSearch();
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        stopPool();
+        double rate = curCands / ((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+        baseRate = baseRate ? baseRate : rate;
+        printf("%7d %10.0f %8.2fx %11.0f%% %8lu\n", n, rate, rate / baseRate, rate / baseRate / n * 100.0, stolen);
+        if (n == nThreads) {
+            break;
+        }
+    }
+    return curCands ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+bool parseRange(const char * arg, int * min, int * max, int low, int high) {
+    if (sscanf(arg, "%d:%d", min, max) != 2 || *min < low || *max > high || *min >= *max) {
+        return false;
+    }
+    return true;
+}
+
+void printUsage() {
+    printf("Offline fan curve tuner for ccpfc.\n");
+    printf("Usage: ccpfctune [OPTIONS] TRACE.csv [TRACE.csv ...]\n");
+    printf("Traces are in the ccpfc --replay format : TIME_SECONDS,SENSOR1,SENSOR2,... with sensor values in millidegrees.\n");
+    printf("Every sensor of a trace is used as the temperature with the fans off, the fans cool it with the --model.\n");
+    printf("Options:\n");
+    printf(" -h, --help\n");
+    printf("   Displays this information.\n");
+    printf(" -s, --silent\n");
+    printf("   Only output the ccpfc arguments.\n");
+    printf(" -j, --threads=NUM\n");
+    printf("   Amount of threads. (default: amount of CPU cores)\n");
+    printf(" -S, --scaling\n");
+    printf("   Run the grid search on 1, 2, 4, ... --threads threads, print the curves per second and speedup of each and exit.\n");
+    printf(" -i, --interval=FLOAT\n");
+    printf("   ccpfc --interval to tune for. (valid: 0.05 to 60) (default: 1.0)\n");
+    printf(" -t, --temp-sensors=\n");
+    printf("   ccpfc --temp-sensors, only OFFSET and THRES are used, in the order of the trace columns.\n");
+    printf(" -c, --fan-speed-min=NUM\n");
+    printf("   ccpfc --fan-speed-min, it is not tuned. (valid: 0 to 254) (default: 0)\n");
+    printf(" -m, --model=AMBIENT:COOLING:TAU\n");
+    printf("   Thermal model, the temperature moves towards AMBIENT + (TRACE - AMBIENT) * (1 - COOLING * PWM / 255)\n");
+    printf("   with a time constant of TAU seconds. COOLING 0 replays the traces as they are. (default: 25:0.6:60)\n");
+    printf(" -x, --ceiling=NUM\n");
+    printf("   Temperature ceiling, time spent above it is penalized. (default: 80)\n");
+    printf(" -w, --weights=MEAN:VARIANCE:HOT\n");
+    printf("   Weights of the normalized mean PWM, PWM variance and fraction of time above --ceiling. (default: 1:1:10)\n");
+    printf(" -g, --grid=NUM\n");
+    printf("   Grid points per tuned parameter before the local refinement. (valid: 1 to 32) (default: 6)\n");
+    printf(" -a, --temp-range=MIN:MAX\n");
+    printf("   Range for --fan-temp-low and --fan-temp-high. (valid: 1 to 99) (default: 30:90)\n");
+    printf(" -b, --pwm-range=MIN:MAX\n");
+    printf("   Range for --fan-speed-low and --fan-speed-high. (valid: 1 to 255) (default: 1:255)\n");
+    printf(" -d, --smooth-range=MIN:MAX\n");
+    printf("   Range for --fan-smooth-up and --fan-smooth-down. (valid: 1 to 255) (default: 1:255)\n");
+    printf("Example:\n");
+    printf("  ./ccpfctune --interval=2.0 --temp-sensors=\"k10temp:temp1_input:0:0;amdgpu:temp1_input:10:60\" --ceiling=75 day1.csv day2.csv\n");
+}
+
+int main(int argc, char **argv) {
+    int c;
+    static struct option long_options[] = {
+        {"help",                  no_argument,       0, 'h'},
+        {"silent",                no_argument,       0, 's'},
+        {"threads",               required_argument, 0, 'j'},
+        {"scaling",               no_argument,       0, 'S'},
+        {"interval",              required_argument, 0, 'i'},
+        {"temp-sensors",          required_argument, 0, 't'},
+        {"fan-speed-min",         required_argument, 0, 'c'},
+        {"model",                 required_argument, 0, 'm'},
+        {"ceiling",               required_argument, 0, 'x'},
+        {"weights",               required_argument, 0, 'w'},
+        {"grid",                  required_argument, 0, 'g'},
+        {"temp-range",            required_argument, 0, 'a'},
+        {"pwm-range",             required_argument, 0, 'b'},
+        {"smooth-range",          required_argument, 0, 'd'},
+        {0,                       0,                 0,  0 }
+    };
+    while ((c = getopt_long(argc, argv, "a:b:c:d:g:hi:j:m:sSt:w:x:", long_options, NULL)) != -1) {
+        switch (c) {
+            case 'a':
+                if (!parseRange(optarg, &dimMin[0], &dimMax[0], 1, 99)) {
+                    fprintf(stderr, "ERROR: --temp-range must be MIN:MAX between 1 and 99.\n");
+                    return EXIT_FAILURE;
+                }
+                dimMin[1] = dimMin[0];
+                dimMax[1] = dimMax[0];
+                break;
+            case 'b':
+                if (!parseRange(optarg, &dimMin[2], &dimMax[2], 1, 255)) {
+                    fprintf(stderr, "ERROR: --pwm-range must be MIN:MAX between 1 and 255.\n");
+                    return EXIT_FAILURE;
+                }
+                dimMin[3] = dimMin[2];
+                dimMax[3] = dimMax[2];
+                break;
+            case 'c':
+                minFanSpeed = atoi(optarg);
+                if (minFanSpeed < 0 || minFanSpeed > 254) {
+                    fprintf(stderr, "ERROR: --fan-speed-min must be between 0 and 254.\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'd':
+                if (!parseRange(optarg, &dimMin[4], &dimMax[4], 1, 255)) {
+                    fprintf(stderr, "ERROR: --smooth-range must be MIN:MAX between 1 and 255.\n");
+                    return EXIT_FAILURE;
+                }
+                dimMin[5] = dimMin[4];
+                dimMax[5] = dimMax[4];
+                break;
+            case 'g':
+                gridPoints = atoi(optarg);
+                if (gridPoints < 1 || gridPoints > 32) {
+                    fprintf(stderr, "ERROR: --grid must be between 1 and 32.\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'h':
+                printUsage();
+                return EXIT_SUCCESS;
+            case 'i':
+                interval = atof(optarg);
+                if (!interval || interval < 0.05 || interval > 60.0) {
+                    fprintf(stderr, "ERROR: --interval must be between 0.05 and 60.0.\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'j':
+                nThreads = atoi(optarg);
+                if (nThreads < 1 || nThreads > 1024) {
+                    fprintf(stderr, "ERROR: --threads must be between 1 and 1024.\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'm':
+                if (sscanf(optarg, "%f:%f:%f", &modelAmbient, &modelCooling, &modelTau) != 3 || modelTau <= 0) {
+                    fprintf(stderr, "ERROR: --model must be in the format AMBIENT:COOLING:TAU\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 's':
+                silent = true;
+                break;
+            case 'S':
+                scaling = true;
+                break;
+            case 't': {
+                char * tail1;
+                char * tok1 = strtok_r(optarg, ";", &tail1);
+                while (tok1 != NULL) {
+                    if (++curTsen >= MAXTSEN) {
+                        fprintf(stderr, "ERROR: --temp-sensors : Exceeded maximum allowed temp sensors (%d).\n", MAXTSEN);
+                        return EXIT_FAILURE;
+                    }
+                    char * tail2;
+                    char * tok2 = strtok_r(tok1, ":", &tail2);
+                    int i = 0;
+                    while (tok2 != NULL) {
+                        if (i == 2) {
+                            tsenArr[curTsen].offs = atoi(tok2);
+                        } else if (i == 3) {
+                            tsenArr[curTsen].thres = atoi(tok2);
+                        }
+                        i++;
+                        tok2 = strtok_r(NULL, ":", &tail2);
+                    }
+                    if (i != 4) {
+                        fprintf(stderr, "ERROR: --temp-sensors : Format must be DEVICE_NAME:SENSOR_NAME:OFFSET:THRES : '%s'\n", tok1);
+                        return EXIT_FAILURE;
+                    }
+                    tok1 = strtok_r(NULL, ";", &tail1);
+                }
+                break;
+            }
+            case 'w':
+                if (sscanf(optarg, "%lf:%lf:%lf", &wMean, &wVar, &wHot) != 3 || wMean < 0 || wVar < 0 || wHot < 0) {
+                    fprintf(stderr, "ERROR: --weights must be in the format MEAN:VARIANCE:HOT\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'x':
+                ceiling = atoi(optarg);
+                break;
+            default:
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc) {
+        printUsage();
+        return EXIT_FAILURE;
+    }
+    if (!nThreads) {
+        nThreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+        nThreads = nThreads > 0 ? nThreads : 1;
+    }
+    traceArr = calloc(argc - optind, sizeof(struct trStruct));
+    deques = calloc(nThreads, sizeof(struct wsDeque));
+    poolArr = calloc(nThreads, sizeof(pthread_t));
+    if (!traceArr || !deques || !poolArr) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        return EXIT_FAILURE;
+    }
+    for (int i = optind; i < argc; i++) {
+        if (!loadTrace(argv[i], &traceArr[curTraces++])) {
+            return EXIT_FAILURE;
+        }
+    }
+    for (int i = 0; i < nThreads; i++) {
+        pthread_mutex_init(&deques[i].lock, NULL);
+    }
+    if (scaling) {
+        return runScaling();
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!startPool(nThreads)) {
+        stopPool();
+        return EXIT_FAILURE;
+    }
+    gridSearch();
+    int gridCands = curCands;
+    if (!gridCands) {
+        fprintf(stderr, "ERROR: No valid fan curve in the search ranges.\n");
+        stopPool();
+        return EXIT_FAILURE;
+    }
+    struct cStruct seeds[SEEDS];
+    qsort(candArr, curCands, sizeof(struct cStruct), cmpCost);
+    int nSeeds = curCands < SEEDS ? curCands : SEEDS;
+    memcpy(seeds, candArr, nSeeds * sizeof(struct cStruct));
+    refine(seeds, nSeeds);
+    stopPool();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    struct cStruct * best = &seeds[0];
+    if (!silent) {
+        double wallTime = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        unsigned long ticks = 0;
+        for (int i = 0; i < curTraces; i++) {
+            ticks += traceArr[i].ticks;
+        }
+        printf("Evaluated %d curves (%d grid, %d refinement) on %d traces (%lu ticks) in %.2f s with %d threads.\n",
+            curCands, gridCands, curCands - gridCands, curTraces, ticks, wallTime, nThreads);
+        printf("%.0f curves per second, %.0f ticks per second, %lu tasks stolen.\n",
+            curCands / wallTime, curCands * (double) ticks / wallTime, stolen);
+        printf("Best cost %.4f : mean PWM %.1f ; PWM stddev %.1f ; %.2f%% of the time above %d C\n",
+            best->cost, best->pwmMean, sqrt(best->pwmVar), best->hotFrac * 100.0, ceiling);
+    }
+    printf("--interval=%.2f --fan-speed-min=%d --fan-speed-low=%d --fan-temp-low=%d --fan-speed-high=%d --fan-temp-high=%d --fan-smooth-up=%d --fan-smooth-down=%d\n",
+        interval, minFanSpeed, best->p[2], best->p[0], best->p[3], best->p[1], best->p[4], best->p[5]);
+    return EXIT_SUCCESS;
+}
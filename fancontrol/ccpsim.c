@@ -0,0 +1,252 @@
+/**
+ * Copyright (C) 2022  kevinlekiller
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Stand-in CORSAIR Commander Pro for ccpfc --hidraw, on a SOCK_SEQPACKET unix socket instead of /dev/hidrawN.
+ * Answers the requests of the HID protocol (one 64 byte output report in, one 16 byte input report out),
+ * 4 temperature probes and 6 fans, whose RPM follows their PWM (20 RPM per percent) or is their RPM target.
+ * Counts the requests and the round trips : the times it woke up to answer, after waiting --delay-us like
+ * a USB transfer. Requests written together before waiting for a response are answered in one round trip.
+ * The counts are printed every --report seconds and at exit.
+ *
+ * Compile: gcc ccpsim.c -o ccpsim -Wextra -O2
+ * Run : ./ccpsim --socket=/tmp/ccpsim.sock & ./ccpfc --hidraw=/tmp/ccpsim.sock ...
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define HIDOUT 64
+#define HIDIN 16
+#define TEMPS 4
+#define FANS 6
+// Status byte of a response, 0 is success.
+#define STATUSOK 0x00
+#define STATUSBADVALUE 0x10
+#define STATUSBADCMD 0x11
+
+const char * sockPath = NULL, * tempFile = NULL;
+int delayUs = 1000, report = 0, sockFd = -1, clientFd = -1;
+int defaultTemp = 40000;
+unsigned char fanPwm[FANS];
+int fanRpm[FANS];
+unsigned long requests = 0, roundTrips = 0, errors = 0;
+volatile sig_atomic_t stop = 0;
+
+void onStop() {
+    stop = 1;
+}
+
+// Millidegrees from --temp-file, read again for every request so a script can change it.
+int readTemp() {
+    char buf[16];
+    int fd = tempFile ? open(tempFile, O_RDONLY) : -1;
+    ssize_t len = fd >= 0 ? read(fd, buf, sizeof(buf) - 1) : -1;
+    close(fd);
+    if (len < 1) {
+        return defaultTemp;
+    }
+    buf[len] = 0;
+    return atoi(buf);
+}
+
+void answer(const unsigned char * req, unsigned char * resp) {
+    // req[0] is the report number.
+    unsigned char cmd = req[1], chan = req[2], value = req[3];
+    int temp;
+    memset(resp, 0, HIDIN);
+    switch (cmd) {
+        case 0x02:                   // Firmware version
+            resp[1] = 0;
+            resp[2] = 9;
+            resp[3] = 214;
+            break;
+        case 0x10:                   // Connected temperature probes
+            memset(resp + 1, 1, TEMPS);
+            break;
+        case 0x11:                   // Temperature of a channel, centidegrees
+            if (chan >= TEMPS) {
+                resp[0] = STATUSBADVALUE;
+                break;
+            }
+            temp = readTemp() / 10 + chan * 100;
+            resp[1] = temp >> 8;
+            resp[2] = temp & 0xff;
+            break;
+        case 0x20:                   // Connected fans, 2 is 4-pin
+            memset(resp + 1, 2, FANS);
+            break;
+        case 0x21:                   // RPM of a channel
+            if (chan >= FANS) {
+                resp[0] = STATUSBADVALUE;
+                break;
+            }
+            resp[1] = fanRpm[chan] >> 8;
+            resp[2] = fanRpm[chan] & 0xff;
+            break;
+        case 0x22:                   // PWM of a channel, percent
+            resp[0] = chan >= FANS ? STATUSBADVALUE : STATUSOK;
+            resp[1] = chan >= FANS ? 0 : fanPwm[chan];
+            break;
+        case 0x23:                   // Set the PWM of a channel, percent
+            if (chan >= FANS || value > 100) {
+                resp[0] = STATUSBADVALUE;
+                break;
+            }
+            fanPwm[chan] = value;
+            fanRpm[chan] = value * 20;
+            break;
+        case 0x24:                   // Set the RPM target of a channel, big endian
+            if (chan >= FANS) {
+                resp[0] = STATUSBADVALUE;
+                break;
+            }
+            fanRpm[chan] = value << 8 | req[4];
+            break;
+        default:
+            resp[0] = STATUSBADCMD;
+            break;
+    }
+}
+
+// Answers every request waiting on the socket, one round trip.
+bool serveClient() {
+    unsigned char req[HIDOUT + 1], resp[HIDIN];
+    ssize_t len;
+    int count = 0;
+    if (delayUs) {
+        usleep(delayUs);
+    }
+    while ((len = recv(clientFd, req, sizeof(req), MSG_DONTWAIT)) > 0) {
+        if (len != HIDOUT) {
+            errors++;
+            continue;
+        }
+        answer(req, resp);
+        errors += resp[0] != STATUSOK;
+        if (send(clientFd, resp, sizeof(resp), MSG_NOSIGNAL) != sizeof(resp)) {
+            return false;
+        }
+        count++;
+    }
+    requests += count;
+    roundTrips += count > 0;
+    return len != 0 && (len > 0 || errno == EAGAIN);
+}
+
+void printCounts() {
+    printf("requests %lu ; round trips %lu ; errors %lu ; RPM", requests, roundTrips, errors);
+    for (int i = 0; i < FANS; i++) {
+        printf(" %d", fanRpm[i]);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+void printUsage() {
+    printf("Stand-in CORSAIR Commander Pro for ccpfc --hidraw, counts the requests and round trips.\n");
+    printf("Options:\n");
+    printf(" -h, --help\n");
+    printf("   Displays this information.\n");
+    printf(" -s, --socket=FILE\n");
+    printf("   Unix socket to create, passed to ccpfc as --hidraw=FILE.\n");
+    printf(" -t, --temp-file=FILE\n");
+    printf("   Temperature in millidegrees of probe 1 is read from FILE on every request, probe N is N - 1 C hotter. (default: 40 C)\n");
+    printf(" -d, --delay-us=NUM\n");
+    printf("   Microseconds a round trip takes. (default: 1000)\n");
+    printf(" -r, --report=NUM\n");
+    printf("   Print the counts every NUM seconds, they are always printed at exit.\n");
+}
+
+struct option long_options[] = {
+    {"help",                  no_argument,       0, 'h'},
+    {"socket",                required_argument, 0, 's'},
+    {"temp-file",             required_argument, 0, 't'},
+    {"delay-us",              required_argument, 0, 'd'},
+    {"report",                required_argument, 0, 'r'},
+    {0,                       0,                 0,  0 }
+};
+
+int main(int argc, char **argv) {
+    int c;
+    while ((c = getopt_long(argc, argv, "hs:t:d:r:", long_options, NULL)) != -1) {
+        switch (c) {
+            case 's':
+                sockPath = optarg;
+                break;
+            case 't':
+                tempFile = optarg;
+                break;
+            case 'd':
+                delayUs = atoi(optarg);
+                break;
+            case 'r':
+                report = atoi(optarg);
+                break;
+            case 'h':
+            default:
+                printUsage();
+                return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (!sockPath || delayUs < 0 || report < 0) {
+        printUsage();
+        return EXIT_FAILURE;
+    }
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", sockPath);
+    unlink(sockPath);
+    sockFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sockFd < 0 || bind(sockFd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(sockFd, 1) != 0) {
+        fprintf(stderr, "ERROR: Could not create socket '%s'\n", sockPath);
+        return EXIT_FAILURE;
+    }
+    signal(SIGINT, onStop);
+    signal(SIGTERM, onStop);
+    time_t lastReport = time(NULL);
+    while (!stop) {
+        // One client at a time, like a hidraw device opened by one daemon.
+        struct pollfd pfd = {clientFd >= 0 ? clientFd : sockFd, POLLIN, 0};
+        if (poll(&pfd, 1, report ? 1000 : -1) > 0) {
+            if (clientFd < 0) {
+                clientFd = accept4(sockFd, NULL, NULL, SOCK_CLOEXEC);
+            } else if (!serveClient()) {
+                close(clientFd);
+                clientFd = -1;
+            }
+        }
+        if (report && time(NULL) - lastReport >= report) {
+            lastReport = time(NULL);
+            printCounts();
+        }
+    }
+    printCounts();
+    unlink(sockPath);
+    return EXIT_SUCCESS;
+}
@@ -17,34 +17,62 @@
 
 // gcc cfancontrol.c -o cfancontrol -Wextra -O2 -lm
 
+#define _GNU_SOURCE
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <malloc.h>
 #include <math.h>
+#include <poll.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <linux/netlink.h>
+
+#include "fanloop.h"
+#include "telemetry.h"
 
 float interval = 1.0;
 unsigned char lowTemp = 0, highTemp = 0, smoothUp = 0, smoothDown = 0;
 unsigned char highFanSpeed = 0, lowFanSpeed = 0, minFanSpeed = 0, lastFanSpeed = 0;
 bool silent = false;
-unsigned char fanLut[99];
+int fanLut[99];
 char buf[256];
+int cpuTemp = 0, gpuTemp = 0, lastTemp = 0;
+double slept = 0;
 FILE * fh;
+const char * sysfsRoot = "/sys";
+bool fakeSysfs = false;
+volatile sig_atomic_t stopPending = 0;
+sigset_t waitMask;
 
 int amdgpu_temp1_input_offset = 30000;
 int amdgpu_temp1_input_thresh = 42000; // If GPU temp is above this, increment by amdgpu_temp1_input_offset
-char amdgpu_temp1_input[57];
-char it8665_temp1_input[57];
-char it8665_pwm5_enable[57];
-char it8665_pwm5[50];
+char amdgpu_temp1_input[PATH_MAX];
+char it8665_temp1_input[PATH_MAX];
+char it8665_pwm5_enable[PATH_MAX];
+char it8665_pwm5[PATH_MAX];
 
 bool writeFile(const char * path, const char * value) {
-    fh = fopen(path, "r+");
+    // A --sysfs-root tree is made of regular files, cut what's left of a longer previous value.
+    fh = fopen(path, fakeSysfs ? "w" : "r+");
+    if (!fh) {
+        return false;
+    }
     if (fputs(value, fh) < 0 || fseek(fh, 0, SEEK_SET) != 0){
         fclose(fh);
         return false;
@@ -55,6 +83,9 @@ bool writeFile(const char * path, const char * value) {
 
 bool readFile(const char * path, size_t size) {
     fh = fopen(path, "r");
+    if (!fh) {
+        return false;
+    }
     if (fseek(fh, 0, SEEK_SET) != 0 || fread(buf, 1, size, fh) < 1) {
         fclose(fh);
         return false;
@@ -63,18 +94,46 @@ bool readFile(const char * path, size_t size) {
     return true;
 }
 
-int getMaxTemp() {
-    int cpuTemp = 0, gpuTemp;
-    if (!readFile(it8665_temp1_input, 7)) {
-        return cpuTemp;
+// Fail-safe of cfancontrol : the fan at --fan-speed-high, see fanloop.h. RTHEAP is made room for by enterRealtime(),
+// for the FILE buffers of fopen().
+#define RTHEAP (1024 * 1024)
+
+// Once per tick before the fans are set, with the reads of the previous tick.
+void checkFailSafe() {
+    failedTicks = tickFailed ? failedTicks + 1 : 0;
+    if (deadlineMissed || failedTicks >= failSafeReads) {
+        goodTicks = 0;
+        if (!failSafe) {
+            failSafe = true;
+            statFailSafes++;
+            fprintf(stderr, "\nWARNING: %s, fan at --fan-speed-high.\n", deadlineMissed ? "Missed a deadline" : "Sensor reads failed");
+            sdNotify(deadlineMissed ? "STATUS=Fail-safe : missed a deadline" : "STATUS=Fail-safe : sensor reads failed");
+        }
+    } else if (failSafe && ++goodTicks >= failSafeReads) {
+        failSafe = false;
+        if (!silent) {
+            printf("\nLeft the fail-safe, back to the fan curve.\n");
+        }
+        sdNotify("STATUS=Running");
     }
-    cpuTemp = atoi(buf);
-    if (!readFile(amdgpu_temp1_input, 7)) {
-        return cpuTemp;
+    deadlineMissed = false;
+}
+
+// A sensor that can't be read keeps its last temperature, instead of 0 which would slow the fan down.
+int getMaxTemp() {
+    tickFailed = false;
+    if (readFile(it8665_temp1_input, 7)) {
+        cpuTemp = atoi(buf);
+    } else {
+        tickFailed = true;
     }
-    gpuTemp = atoi(buf);
-    if (gpuTemp > amdgpu_temp1_input_thresh) {
-        gpuTemp += amdgpu_temp1_input_offset;
+    if (readFile(amdgpu_temp1_input, 7)) {
+        gpuTemp = atoi(buf);
+        if (gpuTemp > amdgpu_temp1_input_thresh) {
+            gpuTemp += amdgpu_temp1_input_offset;
+        }
+    } else {
+        tickFailed = true;
     }
     return gpuTemp > cpuTemp ? gpuTemp : cpuTemp;
 }
@@ -88,7 +147,9 @@ void setFanSpeed() {
     } else {
         tmpSpeed = highFanSpeed;
     }
-    if (smoothDown && tmpSpeed < lastFanSpeed) {
+    if (failSafe) {
+        tmpSpeed = highFanSpeed;
+    } else if (smoothDown && tmpSpeed < lastFanSpeed) {
         tmpSpeed = lastFanSpeed - smoothDown;
         if (tmpSpeed < minFanSpeed) {
             tmpSpeed = minFanSpeed;
@@ -108,11 +169,32 @@ void setFanSpeed() {
         fflush(stdout);
     }
     lastFanSpeed = tmpSpeed;
+    lastTemp = temp;
 }
 
+// Telemetry ring, see --telemetry and telemetry.h.
+struct teleHeader * tele = NULL;
+const char * telePath = NULL;
+// Counters in the telemetry header.
+const char * teleCounters[] = {"deadline_misses", "fail_safes", NULL};
+
+void publishTelemetry(const struct timespec * tickStart) {
+    struct teleSample * smp = beginSample(tele, tickStart);
+    smp->temp = lastTemp;
+    smp->temps[0] = (int) round(cpuTemp / 1000.0);
+    smp->temps[1] = (int) round(gpuTemp / 1000.0);
+    smp->fans[0] = lastFanSpeed;
+    endSample(tele, smp);
+    tele->counters[0] = statDeadlineMisses;
+    tele->counters[1] = statFailSafes;
+}
+
+// Called from main() once the loop stopped, or when starting failed after the telemetry file was made.
 void cleanup() {
     //writeFile(it8665_pwm5_enable, "0");
-    exit(EXIT_SUCCESS);
+    if (tele) {
+        unlink(telePath);
+    }
 }
 
 bool fileExists(const char * path) {
@@ -125,20 +207,22 @@ bool fileExists(const char * path) {
 
 bool getHwmonPath(char * name) {
     bool foundPath = false;
-    DIR *dir = opendir("/sys/class/hwmon");
+    char base[128];
+    sprintf(base, "%.100s/class/hwmon", sysfsRoot);
+    DIR *dir = opendir(base);
     if (!dir) {
         fprintf(stderr, "ERROR: Could not find base hwmon directory.\n");
         return foundPath;
     }
     struct dirent *files;
-    char buf2[30];
+    char buf2[PATH_MAX];
     while ((files = readdir(dir)) != NULL) {
         if (strstr(files->d_name, "hwmon")) {
-            sprintf(buf2, "%s/%s/name", "/sys/class/hwmon", files->d_name);
+            sprintf(buf2, "%s/%.64s/name", base, files->d_name);
             if (!readFile(buf2, 50) || strstr(buf, name) == NULL) {
                 continue;
             }
-            sprintf(buf, "%s/%s", "/sys/class/hwmon", files->d_name);
+            sprintf(buf, "%s/%.64s", base, files->d_name);
             foundPath = true;
             break;
         }
@@ -181,29 +265,15 @@ bool openFiles() {
 }
 
 void mkFanLut(bool printLut) {
-    float tdiff = (float) (highFanSpeed - lowFanSpeed) / (float) (highTemp - lowTemp);
-    float curSpeed = (float) lowFanSpeed;
-    int rndSpeed;
-    if (!silent && printLut) {
-        printf("Temp <= %2d C ; FanSpeed = %3d PWM\n", lowTemp-1, minFanSpeed);
+    fillFanLut(fanLut, lowFanSpeed, lowTemp, highFanSpeed, highTemp);
+    if (silent || !printLut) {
+        return;
     }
+    printf("Temp <= %2d C ; FanSpeed = %3d PWM\n", lowTemp-1, minFanSpeed);
     for (int i = lowTemp; i <= highTemp; i++) {
-        rndSpeed = (int) round(curSpeed);
-        if (rndSpeed <= lowFanSpeed) {
-            fanLut[i] = lowFanSpeed;
-        } else if (rndSpeed >= highFanSpeed) {
-            fanLut[i] = highFanSpeed;
-        } else {
-            fanLut[i] = rndSpeed;
-        }
-        curSpeed += tdiff;
-        if (!silent && printLut) {
-            printf("Temp == %2d C ; FanSpeed = %3d PWM\n", i, fanLut[i]);
-        }
-    }
-    if (!silent && printLut) {
-        printf("Temp >= %2d C ; FanSpeed = %3d PWM\n", highTemp+1, highFanSpeed);
+        printf("Temp == %2d C ; FanSpeed = %3d PWM\n", i, fanLut[i]);
     }
+    printf("Temp >= %2d C ; FanSpeed = %3d PWM\n", highTemp+1, highFanSpeed);
 }
 
 void enableFan() {
@@ -216,6 +286,32 @@ void enableFan() {
     }
 }
 
+// A hwmon device was added (driver reload), its hwmonN can be another one : look the paths up again, like
+// rebindHwmon() of ccpfc. The old ones are kept if a device isn't there (yet).
+void rebindHwmon() {
+    char temp1[PATH_MAX], enable[PATH_MAX], pwm[PATH_MAX], gpuTemp1[PATH_MAX];
+    memcpy(temp1, it8665_temp1_input, PATH_MAX);
+    memcpy(enable, it8665_pwm5_enable, PATH_MAX);
+    memcpy(pwm, it8665_pwm5, PATH_MAX);
+    memcpy(gpuTemp1, amdgpu_temp1_input, PATH_MAX);
+    if (openFiles()) {
+        return;
+    }
+    fprintf(stderr, "WARNING: Could not find the hwmon files again, keeping the old paths.\n");
+    memcpy(it8665_temp1_input, temp1, PATH_MAX);
+    memcpy(it8665_pwm5_enable, enable, PATH_MAX);
+    memcpy(it8665_pwm5, pwm, PATH_MAX);
+    memcpy(amdgpu_temp1_input, gpuTemp1, PATH_MAX);
+}
+
+// The BIOS takes the fan back on resume, enable manual mode and write the fan speed again.
+void resumeFan() {
+    slept = suspendedTime();
+    enableFan();
+    sprintf(buf, "%d", lastFanSpeed);
+    writeFile(it8665_pwm5, buf);
+}
+
 void printUsage() {
     printf("Program for controling PWM chassis fans on Linux.\n");
     printf("Options:\n");
@@ -243,6 +339,40 @@ void printUsage() {
     printf("   Fan speed used for fan LUT calculation when temperature at --fan-temp-high. (valid: 1 to 10000)\n");
     printf(" -g, --fan-temp-high=NUM\n");
     printf("   Highest temperature for fan LUT calculation. (valid: 1 to 99)\n");
+    printf(" -r, --sysfs-root=DIR\n");
+    printf("   Use DIR instead of /sys, for example a directory made by fanbench.sh.\n");
+    printf(" -T, --telemetry=FILE\n");
+    printf("   Publish every loop's temperatures and fan speeds to a shared memory ring in FILE, for example /dev/shm/cfancontrol\n");
+    printf(" -R, --realtime=NUM\n");
+    printf("   Run the loop with SCHED_FIFO priority NUM and the memory locked, so it isn't starved when the machine is busy. (valid: 1 to 99)\n");
+    printf(" -D, --deadline=MS\n");
+    printf("   A loop that takes longer than MS milliseconds, or starts a loop late, switches to the fail-safe. (valid: 1 to 60000) (default: --interval)\n");
+    printf(" -E, --fail-safe-reads=NUM\n");
+    printf("   NUM loops in a row with a failed sensor read switch to the fail-safe, after NUM good loops in a row it's left. (valid: 1 to 255) (default: 3)\n");
+    printf("   In the fail-safe the fan is at --fan-speed-high. Missed deadlines are sent to systemd (sd_notify), every loop\n");
+    printf("   feeds the watchdog (WatchdogSec=, at least 4 --interval).\n");
+}
+
+// Only sets a flag, nothing cleanup() calls is async-signal-safe.
+void onStop() {
+    stopPending = 1;
+}
+
+// Before the files are made and the fans are driven, a stop has to go through cleanup() from main().
+// The signals stay blocked outside of ppoll(), so a stop can't slip in between the check and the wait.
+// There's no config to reload, SIGHUP stops it too.
+void catchStop() {
+    sigset_t sigs;
+    signal(SIGQUIT, onStop);
+    signal(SIGINT, onStop);
+    signal(SIGTERM, onStop);
+    signal(SIGHUP, onStop);
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGQUIT);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGHUP);
+    sigprocmask(SIG_BLOCK, &sigs, &waitMask);
 }
 
 int main(int argc, char **argv) {
@@ -250,10 +380,6 @@ int main(int argc, char **argv) {
     fprintf(stderr, "ERROR: Operating system must be Linux.\n");
     return 1;
 #endif
-    signal(SIGQUIT, cleanup);
-    signal(SIGINT, cleanup);
-    signal(SIGTERM, cleanup);
-    signal(SIGHUP, cleanup);
     {
         bool printLut = false;
         int c;
@@ -270,9 +396,14 @@ int main(int argc, char **argv) {
             {"fan-temp-low",          required_argument, 0, 'e'},
             {"fan-speed-high",        required_argument, 0, 'f'},
             {"fan-temp-high",         required_argument, 0, 'g'},
+            {"sysfs-root",            required_argument, 0, 'r'},
+            {"telemetry",             required_argument, 0, 'T'},
+            {"realtime",              required_argument, 0, 'R'},
+            {"deadline",              required_argument, 0, 'D'},
+            {"fail-safe-reads",       required_argument, 0, 'E'},
             {0,                       0,                 0,  0 }
         };
-        while (c = getopt_long(argc, argv, "a:b:c:d:e:f:g:hi:ln:s", long_options, NULL)) {
+        while (c = getopt_long(argc, argv, "a:b:c:d:e:f:g:hi:ln:r:sD:E:R:T:", long_options, NULL)) {
             if (c == -1) {
                 break;
             }
@@ -335,12 +466,40 @@ int main(int argc, char **argv) {
                     }
                     nice(niceness);
                     break;
+                case 'r':
+                    sysfsRoot = optarg;
+                    fakeSysfs = strcmp(sysfsRoot, "/sys") != 0;
+                    break;
                 case 's':
                     silent = true;
                     break;
+                case 'T':
+                    telePath = optarg;
+                    break;
+                case 'R':
+                    rtPriority = atoi(optarg);
+                    if (rtPriority < 1 || rtPriority > 99) {
+                        fprintf(stderr, "ERROR: --realtime must be between 1 and 99.\n");
+                        return EXIT_FAILURE;
+                    }
+                    break;
+                case 'D':
+                    deadline = (unsigned short) atoi(optarg);
+                    if (atoi(optarg) < 1 || atoi(optarg) > 60000) {
+                        fprintf(stderr, "ERROR: --deadline must be between 1 and 60000.\n");
+                        return EXIT_FAILURE;
+                    }
+                    break;
+                case 'E':
+                    failSafeReads = (unsigned char) atoi(optarg);
+                    if (atoi(optarg) < 1 || atoi(optarg) > 255) {
+                        fprintf(stderr, "ERROR: --fail-safe-reads must be between 1 and 255.\n");
+                        return EXIT_FAILURE;
+                    }
+                    break;
             }
         }
-        if (geteuid() != 0) {
+        if (geteuid() != 0 && !fakeSysfs) {
             fprintf(stderr, "ERROR: cfancontrol must be run as root.\n");
             return EXIT_FAILURE;
         }
@@ -364,15 +523,72 @@ int main(int argc, char **argv) {
         if (printLut) {
             return EXIT_SUCCESS;
         }
+        catchStop();
+        if (telePath) {
+            if (!(tele = createRing(telePath, "cfancontrol", 2, 1, "PWM", teleCounters))) {
+                return EXIT_FAILURE;
+            }
+            snprintf(tele->tempNames[0], sizeof(tele->tempNames[0]), "cpu");
+            snprintf(tele->tempNames[1], sizeof(tele->tempNames[1]), "gpu");
+        }
+        if (rtPriority && !enterRealtime(RTHEAP)) {
+            cleanup();
+            return EXIT_FAILURE;
+        }
+        if (!openNotify()) {
+            cleanup();
+            return EXIT_FAILURE;
+        }
+    }
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tfd < 0) {
+        fprintf(stderr, "ERROR: Could not create timer.\n");
+        cleanup();
+        return EXIT_FAILURE;
     }
-    int i = 120;
-    while (1) {
-        if (120 == i++) {
-            enableFan();
-            i = 0;
+    armTimer(tfd);
+    // Manual fan mode is only enabled again after a resume or a new hwmon device, instead of polling pwm5_enable.
+    int rfd = openResumeTimer();
+    // The it8665 hwmon device being added again (driver reload) means manual mode is lost.
+    int nfd = fakeSysfs ? -1 : openUevents(NULL);
+    struct pollfd pfds[3];
+    struct timespec tickStart;
+    uint64_t expirations;
+    enableFan();
+    slept = suspendedTime();
+    sdNotify("READY=1\nSTATUS=Running");
+    while (!stopPending) {
+        clock_gettime(CLOCK_MONOTONIC, &tickStart);
+        // In case the resume timer was missed.
+        if (suspendedTime() > slept + 1.0) {
+            resumeFan();
         }
+        checkFailSafe();
         setFanSpeed();
-        sleep(interval);
+        if (tele) {
+            publishTelemetry(&tickStart);
+        }
+        endTick(&tickStart);
+        do {
+            pfds[0] = (struct pollfd) {tfd, POLLIN, 0};
+            pfds[1] = (struct pollfd) {rfd, POLLIN, 0};
+            pfds[2] = (struct pollfd) {nfd, POLLIN, 0};
+            if (ppoll(pfds, 3, NULL, &waitMask) < 0) {
+                continue;
+            }
+            bool added = (pfds[2].revents & POLLIN) && hwmonUevent(nfd);
+            if (added) {
+                rebindHwmon();
+            }
+            if (((pfds[1].revents & POLLIN) && clockWasSet(rfd)) || added) {
+                resumeFan();
+            }
+        } while (!stopPending && read(tfd, &expirations, sizeof(expirations)) != sizeof(expirations));
+        if (stopPending) {
+            break;
+        }
+        checkLateness(expirations);
     }
+    cleanup();
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,275 @@
+#!/bin/bash
+
+cat > /dev/null <<LICENSE
+    Copyright (C) 2022  kevinlekiller
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+    https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
+LICENSE
+
+# Benchmark of ccpfc, cfancontrol, vega64control and hwfc without the hardware (it8665, Commander Pro, Vega 64).
+# Builds the daemons from this checkout, makes a fake sysfs tree on tmpfs with an it8665, a Commander Pro,
+# SENSORS drives and a Vega 64 (class/drm/card0/device), and runs every daemon against it with --sysfs-root.
+# For each one it prints the CPU time and I/O calls (counted by fanbenchshim.c) per loop, the wakeups per
+# second and the RSS, from the loops after WARMUP.
+# Example:
+#  ./fanbench.sh
+#  SENSORS=200 DURATION=30 ./fanbench.sh ccpfc
+#  SLOW=gpu_busy_percent DELAY_US=20000 ./fanbench.sh vega64control
+#  ./fanbench.sh hwfc
+#  CFLAGS=-DLATENCYSTATS ./fanbench.sh
+
+# Where to create the fake sysfs tree and the binaries, should be on tmpfs.
+BENCHROOT=${BENCHROOT:-/dev/shm/fanbench}
+
+# Seconds to measure every daemon, after WARMUP seconds.
+DURATION=${DURATION:-10}
+WARMUP=${WARMUP:-2}
+
+# --interval of the daemons.
+INTERVAL=${INTERVAL:-0.05}
+
+# Amount of simulated drives, each one a drivetemp hwmon directory with a temp1_input, read by ccpfc and hwfc.
+SENSORS=${SENSORS:-0}
+
+# The temperatures go from TEMPLOW to TEMPHIGH (millidegrees) and back every PERIOD seconds, the GPU load from 0 to 100 %.
+TEMPLOW=${TEMPLOW:-35000}
+TEMPHIGH=${TEMPHIGH:-85000}
+PERIOD=${PERIOD:-20}
+
+# Or, CSV file in the ccpfc --replay format (time,millidegrees), its second column is used instead.
+TRACE=${TRACE:-}
+
+# Seconds between updating the temperatures.
+UPDATE=${UPDATE:-0.5}
+
+# Reads / writes of files whose path contains SLOW take DELAY_US longer. Example: SLOW=amdgpu
+SLOW=${SLOW:-}
+DELAY_US=${DELAY_US:-10000}
+
+# Extra gcc flags for the daemons.
+CFLAGS=${CFLAGS:-}
+
+# Set to 1 to print the count of every I/O call.
+VERBOSE=${VERBOSE:-0}
+
+###############################################################################
+###############################################################################
+
+SRCDIR=$(cd "$(dirname "$0")" && pwd)
+SYS=$BENCHROOT/sys
+BIN=$BENCHROOT/bin
+# Same order as the enum in fanbenchshim.c.
+CALLS=(open close read pread write pwrite ftruncate poll fopen fclose fread fputs fseek)
+DAEMONS=("${@:-ccpfc cfancontrol vega64control hwfc}")
+read -ra DAEMONS <<< "${DAEMONS[*]}"
+
+if [[ -d $BENCHROOT ]]; then
+    echo "ERROR: $BENCHROOT already exists, another fanbench.sh running?" >&2
+    exit 1
+fi
+mkdir -p "$BIN" || exit 1
+
+trap catchExit EXIT
+function catchExit() {
+    [[ -n $UPDATER ]] && kill "$UPDATER" 2> /dev/null
+    [[ -n $DAEMON ]] && kill "$DAEMON" 2> /dev/null
+    wait 2> /dev/null
+    rm -rf "$BENCHROOT"
+}
+trap 'exit 1' SIGHUP SIGINT SIGQUIT SIGTERM
+
+# $1 hwmon number, $2 device directory under devices, $3 name
+function mkHwmon() {
+    local HWMON=$SYS/devices/$2/hwmon/hwmon$1
+    mkdir -p "$HWMON" "$SYS/class/hwmon" || exit 1
+    ln -sfn "../.." "$HWMON/device"
+    ln -sfn "../../devices/$2/hwmon/hwmon$1" "$SYS/class/hwmon/hwmon$1"
+    echo "$3" > "$HWMON/name"
+    echo "$TEMPLOW" > "$HWMON/temp1_input"
+}
+
+function mkTree() {
+    local IT87=$SYS/devices/platform/it87.2608/hwmon/hwmon0
+    local GPU=$SYS/devices/pci0000:00/0000:03:00.0
+    local CCP=$SYS/devices/ccpsim.0001/hwmon/hwmon2
+    mkHwmon 0 platform/it87.2608 it8665
+    echo 0 > "$IT87/pwm5"
+    echo 2 > "$IT87/pwm5_enable"
+    echo 0 > "$IT87/fan5_input"
+    mkHwmon 1 pci0000:00/0000:03:00.0 amdgpu
+    echo 0 > "$GPU/hwmon/hwmon1/fan1_enable"
+    echo 0 > "$GPU/hwmon/hwmon1/fan1_target"
+    echo 0 > "$GPU/hwmon/hwmon1/fan1_input"
+    echo "  0" > "$GPU/gpu_busy_percent"
+    echo auto > "$GPU/power_dpm_force_performance_level"
+    printf '0: 852Mhz *\n1: 991Mhz\n2: 1084Mhz\n3: 1138Mhz\n4: 1200Mhz\n5: 1401Mhz\n6: 1536Mhz\n7: 1630Mhz\n' > "$GPU/pp_dpm_sclk"
+    printf '0: 600Mhz *\n1: 720Mhz\n2: 800Mhz\n3: 847Mhz\n4: 900Mhz\n5: 960Mhz\n6: 1028Mhz\n7: 1107Mhz\n' > "$GPU/pp_dpm_socclk"
+    printf '0: 167Mhz *\n1: 500Mhz\n2: 800Mhz\n3: 945Mhz\n' > "$GPU/pp_dpm_mclk"
+    head -c 1024 /dev/zero > "$GPU/pp_table"
+    mkdir -p "$SYS/class/drm/card0" || exit 1
+    ln -sfn "../../../devices/pci0000:00/0000:03:00.0" "$SYS/class/drm/card0/device"
+    mkHwmon 2 ccpsim.0001 corsaircpro
+    for ((i = 1; i <= 6; i++)); do
+        echo 0 > "$CCP/pwm$i"
+        echo 0 > "$CCP/fan${i}_input"
+    done
+    for ((i = 1; i <= SENSORS; i++)); do
+        mkHwmon $((i + 2)) "$(printf "drivesim.%04d" "$i")" drivetemp
+    done
+    TEMPFILES=("$SYS"/class/hwmon/hwmon*/temp1_input)
+    LOADFILE=$GPU/gpu_busy_percent
+}
+
+# Writes the temperatures in place (1<>) with a fixed width, so a daemon reading at the same time never sees an empty file.
+function runUpdater() {
+    local STEPS STEP=0 TRI TEMP VALUES=()
+    STEPS=$(awk "BEGIN {s = int($PERIOD / $UPDATE); print s < 2 ? 2 : s}")
+    if [[ -n $TRACE ]]; then
+        mapfile -t VALUES < <(awk -F, 'NR > 1 || $2 ~ /^[0-9]+$/ {print int($2)}' "$TRACE")
+    fi
+    while true; do
+        TRI=$((STEP % STEPS < STEPS / 2 ? STEP % STEPS : STEPS - STEP % STEPS))
+        if [[ ${#VALUES[@]} -gt 0 ]]; then
+            TEMP=${VALUES[$((STEP % ${#VALUES[@]}))]}
+        else
+            TEMP=$((TEMPLOW + (TEMPHIGH - TEMPLOW) * TRI / (STEPS / 2)))
+        fi
+        for FILE in "${TEMPFILES[@]}"; do
+            printf '%06d\n' "$TEMP" 1<> "$FILE"
+        done
+        printf '%3d\n' $((100 * TRI / (STEPS / 2))) 1<> "$LOADFILE"
+        STEP=$((STEP + 1))
+        sleep "$UPDATE"
+    done
+}
+
+function build() {
+    # shellcheck disable=SC2086
+    gcc "$SRCDIR/ccpfc.c" -o "$BIN/ccpfc" -Wextra -O2 -lm -pthread $CFLAGS &&
+    gcc "$SRCDIR/cfancontrol.c" -o "$BIN/cfancontrol" -Wextra -O2 -lm $CFLAGS &&
+    gcc "$SRCDIR/../amdgpu/vega64control.c" -o "$BIN/vega64control" -Wextra -O2 -lm -pthread $CFLAGS &&
+    gcc "$SRCDIR/hwfc.c" -o "$BIN/hwfc" -Wextra -O2 -lm $CFLAGS &&
+    gcc "$SRCDIR/fanbenchshim.c" -o "$BIN/fanbenchshim.so" -Wextra -O2 -shared -fPIC -ldl
+}
+
+# ccpfc --replay check of lazy sensors and sensor backoff : a drive with a RATE fails for 5 s then comes back cooler,
+# while the CPU is hot enough that the drive is lazily skipped. ccpfc fails if the backed off drive isn't probed.
+function replayCheck() {
+    awk 'BEGIN {for (t = 0; t <= 60; t += 0.05) {printf "%.2f,%d,%s\n", t, (t >= 10 && t < 40) ? 80000 : 55000, (t < 5) ? 65000 : ((t < 10) ? "x" : 60000)}}' \
+        > "$BENCHROOT/backoff.csv"
+    if ! "$BIN/ccpfc" --replay="$BENCHROOT/backoff.csv" --temp-sensors="k10temp:temp1_input:0:0;drivetemp:temp1_input:0:0:0.5" \
+        --fan-speed-min=0 --fan-speed-low=45 --fan-temp-low=50 --fan-speed-high=255 --fan-temp-high=77 --interval=0.05 \
+        > "$BENCHROOT/replay.out" 2>&1; then
+        echo "ERROR: ccpfc --replay check failed :" >&2
+        cat "$BENCHROOT/replay.out" >&2
+        exit 1
+    fi
+}
+
+# Loops, CPU ns, context switches and the I/O call counters of $DAEMON, on one line.
+function snapshot() {
+    local TICKS CPU CTX
+    TICKS=$(od -An -t u8 -j 56 -N 8 "$BENCHROOT/$1.tele" 2> /dev/null)
+    read -r CPU _ < "/proc/$DAEMON/schedstat"
+    CTX=$(awk '/ctxt_switches/ {n += $2} END {print n}' "/proc/$DAEMON/status")
+    echo "${TICKS:-0} $CPU $CTX $(od -An -t u8 -v "$BENCHROOT/$1.counts" | tr -s ' \n' ' ')"
+}
+
+function daemonArgs() {
+    local SEN="corsaircpro:temp1_input:0:0"
+    case $1 in
+        ccpfc)
+            for ((i = 0; i < SENSORS; i++)); do
+                SEN+=";drivetemp@$i:temp1_input:0:0"
+            done
+            ARGS=(--calibration-file="$BENCHROOT/calibration" --fans="pwm1:0;pwm2:0;pwm3:0" --temp-sensors="$SEN"
+                --fan-speed-min=0 --fan-speed-low=45 --fan-temp-low=50 --fan-speed-high=255 --fan-temp-high=77 --sysfs-root="$SYS")
+            ;;
+        cfancontrol)
+            ARGS=(--fan-speed-min=0 --fan-speed-low=45 --fan-temp-low=50 --fan-speed-high=255 --fan-temp-high=77 --sysfs-root="$SYS")
+            ;;
+        vega64control)
+            ARGS=(--pstate-control --fan-speed-min=500 --fan-speed-low=800 --fan-temp-low=50 --fan-speed-high=2500 --fan-temp-high=77
+                --gpu-id=0 --sysfs-root="$SYS")
+            ;;
+        # The work of the three others in one process.
+        hwfc)
+            ARGS=(--sensor=cpu:it8665:temp1_input --sensor=ccp:corsaircpro:temp1_input --sensor=gpu:amdgpu:temp1_input
+                --gpu=vega:0:50:10:7:7:3 --fan=chassis:it8665/pwm5 --fan=gpufan:amdgpu/fan1_target --sysfs-root="$SYS")
+            SEN=ccp
+            for ((i = 0; i < SENSORS; i++)); do
+                ARGS+=(--sensor="drive$i:drivetemp@$i:temp1_input")
+                SEN+=",drive$i"
+            done
+            for ((i = 1; i <= 3; i++)); do
+                ARGS+=(--fan="ccp$i:corsaircpro/pwm$i")
+            done
+            ARGS+=(--controller=chassis:cpu:0:45:50:255:77 --controller="ccp1,ccp2,ccp3:$SEN:0:45:50:255:77"
+                --controller=gpufan:gpu:500:800:50:2500:77)
+            ;;
+        *)
+            echo "ERROR: Unknown daemon '$1', can be ccpfc, cfancontrol, vega64control or hwfc." >&2
+            exit 1
+            ;;
+    esac
+}
+
+function bench() {
+    local START END
+    daemonArgs "$1"
+    LD_PRELOAD=$BIN/fanbenchshim.so FANBENCH_COUNTS=$BENCHROOT/$1.counts FANBENCH_SLOW=$SLOW FANBENCH_DELAY_US=$DELAY_US \
+        "$BIN/$1" "${ARGS[@]}" --silent --interval="$INTERVAL" --telemetry="$BENCHROOT/$1.tele" > /dev/null 2> "$BENCHROOT/$1.err" &
+    DAEMON=$!
+    sleep "$WARMUP"
+    if ! kill -0 "$DAEMON" 2> /dev/null; then
+        echo "ERROR: $1 exited :" >&2
+        cat "$BENCHROOT/$1.err" >&2
+        DAEMON=
+        return
+    fi
+    read -ra START <<< "$(snapshot "$1")"
+    sleep "$DURATION"
+    read -ra END <<< "$(snapshot "$1")"
+    local RSS
+    RSS=$(awk '/VmRSS/ {print $2}' "/proc/$DAEMON/status")
+    kill "$DAEMON"
+    wait "$DAEMON" 2> /dev/null
+    DAEMON=
+    local LOOPS=$((END[0] - START[0])) CALLSUM=0
+    for ((i = 0; i < ${#CALLS[@]}; i++)); do
+        CALLSUM=$((CALLSUM + END[i + 3] - START[i + 3]))
+    done
+    awk -v d="$1" -v l="$LOOPS" -v cpu=$((END[1] - START[1])) -v c="$CALLSUM" -v w=$((END[2] - START[2])) -v t="$DURATION" -v r="$RSS" \
+        'BEGIN {printf "%-14s %8d %12.1f %11.1f %10.1f %8d\n", d, l, l ? cpu / l / 1000 : 0, l ? c / l : 0, w / t, r}'
+    if [[ $VERBOSE == 1 && $LOOPS -gt 0 ]]; then
+        for ((i = 0; i < ${#CALLS[@]}; i++)); do
+            awk -v n="${CALLS[$i]}" -v c=$((END[i + 3] - START[i + 3])) -v l="$LOOPS" 'BEGIN {if (c) printf "  %-12s %8.2f per loop\n", n, c / l}'
+        done
+    fi
+}
+
+build || exit 1
+if [[ " ${DAEMONS[*]} " == *" ccpfc "* ]]; then
+    replayCheck
+fi
+mkTree
+runUpdater &
+UPDATER=$!
+echo "Interval $INTERVAL s ; $DURATION s after $WARMUP s warmup ; $SENSORS drives${SLOW:+ ; '$SLOW' files $DELAY_US us slower}"
+echo "daemon            loops  cpu us/loop  calls/loop  wakeups/s   RSS kB"
+for NAME in "${DAEMONS[@]}"; do
+    bench "$NAME"
+done
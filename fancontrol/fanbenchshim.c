@@ -0,0 +1,230 @@
+/**
+ * Copyright (C) 2022  kevinlekiller
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * LD_PRELOAD shim used by fanbench.sh, counts the I/O calls of ccpfc, cfancontrol and vega64control.
+ *
+ * FANBENCH_COUNTS=FILE : the counters are uint64_t in FILE (mmap), in the order of callNames,
+ *                        so fanbench.sh can read them while the daemon runs.
+ * FANBENCH_SLOW=TEXT   : reads / writes of files whose path contains TEXT sleep FANBENCH_DELAY_US first,
+ *                        like an amdgpu file of a GPU in runtime PM.
+ *
+ * stdio calls (fopen, fread, ...) are counted as themselves, glibc's own read / write under them can't be seen.
+ *
+ * Compile: gcc fanbenchshim.c -o fanbenchshim.so -Wextra -O2 -shared -fPIC -ldl
+*/
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Same order as CALLS in fanbench.sh.
+enum {CALLOPEN, CALLCLOSE, CALLREAD, CALLPREAD, CALLWRITE, CALLPWRITE, CALLFTRUNCATE, CALLPOLL,
+    CALLFOPEN, CALLFCLOSE, CALLFREAD, CALLFPUTS, CALLFSEEK, CALLS};
+#define MAXSLOWFDS 1024
+
+uint64_t localCounts[CALLS];
+uint64_t * counts = localCounts;
+bool slowFds[MAXSLOWFDS];
+const char * slowText = NULL;
+useconds_t slowDelay = 0;
+
+__attribute__((constructor)) void shimInit() {
+    const char * path = getenv("FANBENCH_COUNTS");
+    slowText = getenv("FANBENCH_SLOW");
+    slowDelay = getenv("FANBENCH_DELAY_US") ? atoi(getenv("FANBENCH_DELAY_US")) : 0;
+    if (slowText && !slowText[0]) {
+        slowText = NULL;
+    }
+    if (!path) {
+        return;
+    }
+    // Raw syscalls, open() / ftruncate() below are the counted ones.
+    int fd = syscall(SYS_openat, AT_FDCWD, path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0 || syscall(SYS_ftruncate, fd, (long) sizeof(localCounts)) != 0) {
+        return;
+    }
+    void * map = mmap(NULL, sizeof(localCounts), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    syscall(SYS_close, fd);
+    if (map != MAP_FAILED) {
+        counts = map;
+        memset(counts, 0, sizeof(localCounts));
+    }
+}
+
+void markFd(int fd, const char * path) {
+    if (fd >= 0 && fd < MAXSLOWFDS) {
+        slowFds[fd] = slowText && path && strstr(path, slowText);
+    }
+}
+
+void slowDown(int fd) {
+    if (fd >= 0 && fd < MAXSLOWFDS && slowFds[fd]) {
+        usleep(slowDelay);
+    }
+}
+
+#define REAL(ret, name, ...) static ret (* real)(__VA_ARGS__); if (!real) { real = dlsym(RTLD_NEXT, name); }
+
+int openMode(const char * path, int flags, mode_t mode) {
+    REAL(int, "open", const char *, int, ...);
+    counts[CALLOPEN]++;
+    int fd = real(path, flags, mode);
+    markFd(fd, path);
+    return fd;
+}
+
+int open(const char * path, int flags, ...) {
+    mode_t mode = 0;
+    if (flags & (O_CREAT | O_TMPFILE)) {
+        va_list ap;
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+    return openMode(path, flags, mode);
+}
+
+int open64(const char * path, int flags, ...) {
+    mode_t mode = 0;
+    if (flags & (O_CREAT | O_TMPFILE)) {
+        va_list ap;
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+    return openMode(path, flags, mode);
+}
+
+int openat(int dirFd, const char * path, int flags, ...) {
+    REAL(int, "openat", int, const char *, int, ...);
+    mode_t mode = 0;
+    if (flags & (O_CREAT | O_TMPFILE)) {
+        va_list ap;
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+    counts[CALLOPEN]++;
+    int fd = real(dirFd, path, flags, mode);
+    markFd(fd, path);
+    return fd;
+}
+
+int close(int fd) {
+    REAL(int, "close", int);
+    counts[CALLCLOSE]++;
+    markFd(fd, NULL);
+    return real(fd);
+}
+
+ssize_t read(int fd, void * data, size_t size) {
+    REAL(ssize_t, "read", int, void *, size_t);
+    counts[CALLREAD]++;
+    slowDown(fd);
+    return real(fd, data, size);
+}
+
+ssize_t pread(int fd, void * data, size_t size, off_t offset) {
+    REAL(ssize_t, "pread", int, void *, size_t, off_t);
+    counts[CALLPREAD]++;
+    slowDown(fd);
+    return real(fd, data, size, offset);
+}
+
+ssize_t pread64(int fd, void * data, size_t size, off_t offset) {
+    return pread(fd, data, size, offset);
+}
+
+ssize_t write(int fd, const void * data, size_t size) {
+    REAL(ssize_t, "write", int, const void *, size_t);
+    counts[CALLWRITE]++;
+    slowDown(fd);
+    return real(fd, data, size);
+}
+
+ssize_t pwrite(int fd, const void * data, size_t size, off_t offset) {
+    REAL(ssize_t, "pwrite", int, const void *, size_t, off_t);
+    counts[CALLPWRITE]++;
+    slowDown(fd);
+    return real(fd, data, size, offset);
+}
+
+ssize_t pwrite64(int fd, const void * data, size_t size, off_t offset) {
+    return pwrite(fd, data, size, offset);
+}
+
+int ftruncate(int fd, off_t size) {
+    REAL(int, "ftruncate", int, off_t);
+    counts[CALLFTRUNCATE]++;
+    return real(fd, size);
+}
+
+int poll(struct pollfd * fds, nfds_t nfds, int timeout) {
+    REAL(int, "poll", struct pollfd *, nfds_t, int);
+    counts[CALLPOLL]++;
+    return real(fds, nfds, timeout);
+}
+
+FILE * fopen(const char * path, const char * mode) {
+    REAL(FILE *, "fopen", const char *, const char *);
+    counts[CALLFOPEN]++;
+    FILE * fh = real(path, mode);
+    if (fh) {
+        markFd(fileno(fh), path);
+    }
+    return fh;
+}
+
+int fclose(FILE * fh) {
+    REAL(int, "fclose", FILE *);
+    counts[CALLFCLOSE]++;
+    if (fh) {
+        markFd(fileno(fh), NULL);
+    }
+    return real(fh);
+}
+
+size_t fread(void * data, size_t size, size_t n, FILE * fh) {
+    REAL(size_t, "fread", void *, size_t, size_t, FILE *);
+    counts[CALLFREAD]++;
+    slowDown(fh ? fileno(fh) : -1);
+    return real(data, size, n, fh);
+}
+
+int fputs(const char * str, FILE * fh) {
+    REAL(int, "fputs", const char *, FILE *);
+    counts[CALLFPUTS]++;
+    slowDown(fh ? fileno(fh) : -1);
+    return real(str, fh);
+}
+
+int fseek(FILE * fh, long offset, int whence) {
+    REAL(int, "fseek", FILE *, long, int);
+    counts[CALLFSEEK]++;
+    return real(fh, offset, whence);
+}
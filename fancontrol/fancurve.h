@@ -0,0 +1,75 @@
+/**
+ * Copyright (C) 2022  kevinlekiller
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * The fan curve of the daemons and the part of ccpfc's control that ccpfctune replays : the LUT, the sensor
+ * offsets, smoothing and the thermal model of --replay-model. ccpfctune tunes ccpfc through these, a change
+ * here changes both.
+ */
+
+#ifndef FANCURVE_H
+#define FANCURVE_H
+
+#include <math.h>
+
+// lut[lowTemp] = lowSpeed to lut[highTemp] = highSpeed in a straight line, rounded to the nearest.
+static inline void fillFanLut(int * lut, int lowSpeed, int lowTemp, int highSpeed, int highTemp) {
+    float tdiff = (float) (highSpeed - lowSpeed) / (float) (highTemp - lowTemp);
+    float curSpeed = (float) lowSpeed;
+    for (int i = lowTemp; i <= highTemp; i++) {
+        int rndSpeed = (int) round(curSpeed);
+        lut[i] = rndSpeed <= lowSpeed ? lowSpeed : rndSpeed >= highSpeed ? highSpeed : rndSpeed;
+        curSpeed += tdiff;
+    }
+}
+
+// minSpeed under lowTemp, the LUT up to highTemp, highSpeed over it.
+static inline int lutSpeed(const int * lut, int temp, int minSpeed, int lowTemp, int highTemp, int highSpeed) {
+    if (temp < lowTemp) {
+        return minSpeed;
+    }
+    if (temp <= highTemp && lut[temp]) {
+        return lut[temp];
+    }
+    return highSpeed;
+}
+
+// A sensor's temperature with its --temp-sensors OFFSET, added over THRES.
+static inline int offsetTemp(int temp, int offs, int thres) {
+    return temp + (temp > thres) * offs;
+}
+
+// --fan-smooth-up / --fan-smooth-down : from lastSpeed towards speed by at most smoothUp / smoothDown, 0 is no limit.
+static inline int smoothSpeed(int speed, int lastSpeed, int smoothUp, int smoothDown, int minSpeed, int highSpeed) {
+    if (smoothDown && speed < lastSpeed) {
+        return lastSpeed - smoothDown < minSpeed ? minSpeed : lastSpeed - smoothDown;
+    }
+    if (smoothUp && speed > lastSpeed) {
+        return lastSpeed + smoothUp > highSpeed ? highSpeed : lastSpeed + smoothUp;
+    }
+    return speed;
+}
+
+// First order thermal model, one --interval step of temp towards hot (the temperature with the fans off)
+// cooled by the fans at pwm. decay is 1 - exp(-interval / TAU).
+static inline double modelStep(double temp, double ambient, double hot, double cooling, int pwm, double decay) {
+    double target = ambient + (hot - ambient) * (1.0 - cooling * pwm / 255.0);
+    return temp + (target - temp) * decay;
+}
+
+#endif
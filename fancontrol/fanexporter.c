@@ -0,0 +1,485 @@
+/**
+ * Copyright (C) 2022  kevinlekiller
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Prometheus exporter for ccpfc, cfancontrol and vega64control.
+ *
+ * Reads the --telemetry ring of the daemons, so the daemons never wait on a scrape :
+ * every scrape maps the ring, copies the newest samples and renders them in this process.
+ * Fan RPM is read from the fanN_input files the daemons list in the ring header.
+ * Every sample has a path label with its --telemetry FILE, two rings of the same daemon give one set of metrics.
+ * Metrics are served over HTTP (--listen) and / or written to a node_exporter textfile
+ * collector file (--textfile), which is written to a temporary file and renamed.
+ *
+ * Compile: gcc fanexporter.c -o fanexporter -Wextra -O2
+ * Run : ./fanexporter --telemetry=/dev/shm/ccpfc --telemetry=/dev/shm/vega64control --listen=9101
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "telemetry.h"
+
+// Max amount of --telemetry.
+#define MAXRINGS 8
+#define MAXBLOCKS 64
+
+const char * ringPaths[MAXRINGS];
+int curRings = 0;
+const char * listenAddr = "127.0.0.1";
+int listenPort = 0;
+const char * textFile = NULL;
+float interval = 15.0;
+struct teleSample samples[TELESLOTS];
+uint32_t tickNs[TELESLOTS];
+
+int cmpTicks(const void * a, const void * b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+// Copies the samples still in the ring, newest first, skipping the ones being written.
+int copySamples(const struct teleHeader * tele) {
+    int count = 0;
+    uint64_t head = ringHead(tele);
+    // The oldest slot is the next one the daemon writes, leave it out.
+    for (uint64_t i = head; i > 0 && head - i < TELESLOTS - 1; i--) {
+        count += readSample(tele, i - 1, &samples[count]);
+    }
+    return count;
+}
+
+// Metric names are prefixed with the daemon name, anything that's not [a-z0-9_] becomes _
+void metricName(char * out, size_t size, const char * daemon, const char * name) {
+    snprintf(out, size, "%s_%s", daemon, name);
+    for (char * ptr = out; *ptr; ptr++) {
+        if ((*ptr < 'a' || *ptr > 'z') && (*ptr < '0' || *ptr > '9') && *ptr != '_') {
+            *ptr = '_';
+        }
+    }
+}
+
+// Escapes a label value the way the text format wants it, \\ \" and \n.
+void labelValue(char * out, size_t size, const char * value, size_t maxLen) {
+    size_t len = 0;
+    for (size_t i = 0; i < maxLen && value[i] && len + 3 < size; i++) {
+        if (value[i] == '\\' || value[i] == '"' || value[i] == '\n') {
+            out[len++] = '\\';
+        }
+        out[len++] = value[i] == '\n' ? 'n' : value[i];
+    }
+    out[len] = 0;
+}
+
+void metricHeader(FILE * out, const char * metric, const char * type, const char * help) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", metric, help, metric, type);
+}
+
+bool readRpm(const char * path, int * rpm) {
+    char buf[16];
+    int fd = path[0] ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    if (fd < 0) {
+        return false;
+    }
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len < 1) {
+        return false;
+    }
+    buf[len] = 0;
+    *rpm = atoi(buf);
+    return true;
+}
+
+// Returns false if the ring can't be used (daemon not running, other version).
+bool renderRing(FILE * out, const char * path) {
+    char daemon[16], unit[8], name[32], metric[128], label[272], ring[PATH_MAX * 2];
+    struct teleHeader * tele = mapRing(path, NULL);
+    int count = tele ? copySamples(tele) : 0;
+    if (!count) {
+        if (tele) {
+            unmapRing(tele);
+        }
+        return false;
+    }
+    const struct teleSample * last = &samples[0];
+    snprintf(daemon, sizeof(daemon), "%.15s", tele->daemon);
+    snprintf(unit, sizeof(unit), "%.7s", tele->fanUnit);
+    for (char * ptr = unit; *ptr; ptr++) {
+        *ptr = *ptr >= 'A' && *ptr <= 'Z' ? *ptr + 32 : *ptr;
+    }
+    // Every sample has the path of its ring, two daemons with the same name give the same metrics.
+    labelValue(ring, sizeof(ring), path, PATH_MAX);
+    unsigned int nTemps = tele->nTemps > TELETEMPS ? TELETEMPS : tele->nTemps;
+    unsigned int nFans = tele->nFans > TELEFANS ? TELEFANS : tele->nFans;
+
+    metricName(metric, sizeof(metric), daemon, "ticks_total");
+    metricHeader(out, metric, "counter", "Loops done since the daemon started.");
+    fprintf(out, "%s{path=\"%s\"} %llu\n", metric, ring, (unsigned long long) ringHead(tele));
+    metricName(metric, sizeof(metric), daemon, "last_tick_timestamp_seconds");
+    metricHeader(out, metric, "gauge", "Time of the newest loop.");
+    fprintf(out, "%s{path=\"%s\"} %.3f\n", metric, ring, last->timeNs / 1e9);
+    metricName(metric, sizeof(metric), daemon, "temperature_celsius");
+    metricHeader(out, metric, "gauge", "Temperature the fan speed is based on.");
+    fprintf(out, "%s{path=\"%s\"} %d\n", metric, ring, last->temp);
+    metricName(metric, sizeof(metric), daemon, "sensor_temperature_celsius");
+    metricHeader(out, metric, "gauge", "Temperature of every sensor, -274 if it could not be read.");
+    for (unsigned int i = 0; i < nTemps; i++) {
+        labelValue(label, sizeof(label), tele->tempNames[i], sizeof(tele->tempNames[i]));
+        fprintf(out, "%s{path=\"%s\",sensor=\"%u\",name=\"%s\"} %d\n", metric, ring, i, label, last->temps[i]);
+    }
+    snprintf(name, sizeof(name), "fan_set_%s", unit);
+    metricName(metric, sizeof(metric), daemon, name);
+    metricHeader(out, metric, "gauge", "Fan speed set by the daemon.");
+    for (unsigned int i = 0; i < nFans; i++) {
+        fprintf(out, "%s{path=\"%s\",fan=\"%u\"} %u\n", metric, ring, i, last->fans[i]);
+    }
+    metricName(metric, sizeof(metric), daemon, "fan_speed_rpm");
+    metricHeader(out, metric, "gauge", "Fan speed read from fanN_input.");
+    for (unsigned int i = 0; i < nFans; i++) {
+        int rpm;
+        char rpmPath[128];
+        snprintf(rpmPath, sizeof(rpmPath), "%.127s", tele->rpmPaths[i]);
+        if (readRpm(rpmPath, &rpm)) {
+            fprintf(out, "%s{path=\"%s\",fan=\"%u\"} %d\n", metric, ring, i, rpm);
+        }
+    }
+    if (tele->flags & TELEGPU) {
+        const char * domains[] = {"gpu", "soc", "vram"};
+        metricName(metric, sizeof(metric), daemon, "pstate");
+        metricHeader(out, metric, "gauge", "Highest allowed P-State.");
+        for (int i = 0; i < 3; i++) {
+            fprintf(out, "%s{path=\"%s\",domain=\"%s\"} %u\n", metric, ring, domains[i], last->pstates[i]);
+        }
+        metricName(metric, sizeof(metric), daemon, "load_percent");
+        metricHeader(out, metric, "gauge", "GPU load.");
+        fprintf(out, "%s{path=\"%s\"} %u\n", metric, ring, last->load);
+    }
+    if (tele->flags & TELETHROTTLE) {
+        metricName(metric, sizeof(metric), daemon, "throttled");
+        metricHeader(out, metric, "gauge", "1 if the hardware throttled during the newest loop.");
+        fprintf(out, "%s{path=\"%s\"} %u\n", metric, ring, last->throttled);
+    }
+    // Tick time over the samples still in the ring (the last TELESLOTS loops).
+    for (int i = 0; i < count; i++) {
+        tickNs[i] = samples[i].tickNs;
+    }
+    qsort(tickNs, count, sizeof(uint32_t), cmpTicks);
+    metricName(metric, sizeof(metric), daemon, "tick_seconds");
+    metricHeader(out, metric, "gauge", "Time spent in a loop, over the last loops kept in the telemetry ring.");
+    fprintf(out, "%s{path=\"%s\",stat=\"last\"} %.9f\n", metric, ring, last->tickNs / 1e9);
+    fprintf(out, "%s{path=\"%s\",stat=\"p50\"} %.9f\n", metric, ring, tickNs[count / 2] / 1e9);
+    fprintf(out, "%s{path=\"%s\",stat=\"p99\"} %.9f\n", metric, ring, tickNs[count * 99 / 100] / 1e9);
+    fprintf(out, "%s{path=\"%s\",stat=\"max\"} %.9f\n", metric, ring, tickNs[count - 1] / 1e9);
+    for (int i = 0; i < TELECOUNTERS; i++) {
+        snprintf(name, sizeof(name), "%.23s", tele->counterNames[i]);
+        if (!name[0]) {
+            continue;
+        }
+        strcat(name, "_total");
+        metricName(metric, sizeof(metric), daemon, name);
+        metricHeader(out, metric, "counter", "Counter of the daemon.");
+        fprintf(out, "%s{path=\"%s\"} %llu\n", metric, ring, (unsigned long long) tele->counters[i]);
+    }
+    unmapRing(tele);
+    return true;
+}
+
+// A metric in the text of a ring : its # HELP and # TYPE lines and its samples.
+struct bStruct {
+    const char * start;
+    size_t len, nameLen;
+    bool done;
+};
+
+// Splits the text renderRing() made at every # HELP line.
+int splitBlocks(const char * text, size_t len, struct bStruct * blocks) {
+    int n = 0;
+    const char * end = text + len, * ptr = text;
+    while (ptr < end && n < MAXBLOCKS) {
+        const char * next = ptr, * nl;
+        while ((nl = memchr(next, '\n', end - next)) != NULL && nl + 1 < end && strncmp(nl + 1, "# HELP ", 7) != 0) {
+            next = nl + 1;
+        }
+        const char * blockEnd = nl && nl + 1 < end ? nl + 1 : end;
+        blocks[n].start = ptr;
+        blocks[n].len = blockEnd - ptr;
+        blocks[n].nameLen = strcspn(ptr + 7, " \n");
+        blocks[n++].done = false;
+        ptr = blockEnd;
+    }
+    return n;
+}
+
+// Writes the samples of a block, without its # HELP and # TYPE lines.
+void writeSamples(FILE * out, const struct bStruct * block) {
+    const char * ptr = block->start, * end = block->start + block->len;
+    for (int i = 0; i < 2 && ptr < end; i++) {
+        const char * nl = memchr(ptr, '\n', end - ptr);
+        ptr = nl ? nl + 1 : end;
+    }
+    fwrite(ptr, 1, end - ptr, out);
+}
+
+// Renders every --telemetry ring, the caller frees the returned text.
+// The lines of a metric have to be together, so the rings are rendered first, then every metric is written
+// once with the samples of all the rings that have it (rings of daemons with the same name).
+char * render(size_t * len) {
+    char * text = NULL, * ringText[MAXRINGS];
+    size_t ringLen[MAXRINGS];
+    bool up[MAXRINGS];
+    static struct bStruct blocks[MAXRINGS][MAXBLOCKS];
+    int nBlocks[MAXRINGS] = {0};
+    for (int i = 0; i < curRings; i++) {
+        FILE * ringOut = open_memstream(&ringText[i], &ringLen[i]);
+        up[i] = ringOut && renderRing(ringOut, ringPaths[i]);
+        if (ringOut) {
+            fclose(ringOut);
+        } else {
+            ringText[i] = NULL;
+        }
+    }
+    FILE * out = open_memstream(&text, len);
+    if (out) {
+        char ring[PATH_MAX * 2];
+        metricHeader(out, "fanexporter_ring_up", "gauge", "1 if the telemetry ring of the daemon has samples.");
+        for (int i = 0; i < curRings; i++) {
+            labelValue(ring, sizeof(ring), ringPaths[i], PATH_MAX);
+            fprintf(out, "fanexporter_ring_up{path=\"%s\"} %d\n", ring, up[i]);
+            nBlocks[i] = up[i] ? splitBlocks(ringText[i], ringLen[i], blocks[i]) : 0;
+        }
+        for (int i = 0; i < curRings; i++) {
+            for (int b = 0; b < nBlocks[i]; b++) {
+                struct bStruct * block = &blocks[i][b];
+                if (block->done) {
+                    continue;
+                }
+                fwrite(block->start, 1, block->len, out);
+                for (int j = i + 1; j < curRings; j++) {
+                    for (int c = 0; c < nBlocks[j]; c++) {
+                        struct bStruct * other = &blocks[j][c];
+                        if (!other->done && other->nameLen == block->nameLen
+                            && memcmp(other->start + 7, block->start + 7, block->nameLen) == 0) {
+                            writeSamples(out, other);
+                            other->done = true;
+                        }
+                    }
+                }
+            }
+        }
+        fclose(out);
+    }
+    for (int i = 0; i < curRings; i++) {
+        free(ringText[i]);
+    }
+    return text;
+}
+
+void writeTextFile() {
+    char tmpPath[4096];
+    size_t len;
+    char * text = render(&len);
+    if (!text) {
+        return;
+    }
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", textFile);
+    FILE * out = fopen(tmpPath, "w");
+    if (!out) {
+        fprintf(stderr, "ERROR: Could not write '%s'\n", tmpPath);
+    } else if (fwrite(text, 1, len, out) != len || fclose(out) != 0 || rename(tmpPath, textFile) != 0) {
+        fprintf(stderr, "ERROR: Could not write '%s'\n", textFile);
+    }
+    free(text);
+}
+
+bool sendAll(int cfd, const char * data, size_t len) {
+    while (len) {
+        ssize_t sent = send(cfd, data, len, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        } else if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+// One request per connection, anything but GET / or GET /metrics is a 404.
+void serveClient(int cfd) {
+    char req[4096], head[256];
+    struct pollfd pfd = {cfd, POLLIN, 0};
+    ssize_t len = poll(&pfd, 1, 2000) == 1 ? recv(cfd, req, sizeof(req) - 1, 0) : -1;
+    if (len < 1) {
+        return;
+    }
+    req[len] = 0;
+    if (strncmp(req, "GET /metrics", 12) != 0 && strncmp(req, "GET / ", 6) != 0) {
+        const char * notFound = "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: 10\r\nConnection: close\r\n\r\nNot Found\n";
+        sendAll(cfd, notFound, strlen(notFound));
+        return;
+    }
+    size_t size;
+    char * text = render(&size);
+    if (!text) {
+        return;
+    }
+    int headLen = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+        "Content-Length: %zu\r\nConnection: close\r\n\r\n", size);
+    if (sendAll(cfd, head, headLen)) {
+        sendAll(cfd, text, size);
+    }
+    free(text);
+}
+
+int openListener() {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(listenPort);
+    if (inet_pton(AF_INET, listenAddr, &addr.sin_addr) != 1) {
+        fprintf(stderr, "ERROR: --listen : invalid address '%s'\n", listenAddr);
+        return -1;
+    }
+    int one = 1, lfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (lfd < 0 || setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0
+        || bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(lfd, 16) != 0) {
+        fprintf(stderr, "ERROR: Could not listen on %s:%d\n", listenAddr, listenPort);
+        if (lfd >= 0) {
+            close(lfd);
+        }
+        return -1;
+    }
+    return lfd;
+}
+
+double monoTime() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void printUsage() {
+    printf("Prometheus exporter for the --telemetry ring of ccpfc, cfancontrol and vega64control.\n");
+    printf("Options:\n");
+    printf(" -h, --help\n");
+    printf("   Displays this information.\n");
+    printf(" -T, --telemetry=FILE\n");
+    printf("   --telemetry FILE of a daemon, can be passed up to %d times. Example: --telemetry=/dev/shm/ccpfc\n", MAXRINGS);
+    printf(" -l, --listen=[ADDRESS:]PORT\n");
+    printf("   Serve the metrics over HTTP on ADDRESS:PORT/metrics. (default ADDRESS: 127.0.0.1)\n");
+    printf(" -o, --textfile=FILE\n");
+    printf("   Write the metrics to FILE every --interval seconds, for the node_exporter textfile collector.\n");
+    printf("   Example: --textfile=/var/lib/node_exporter/textfile_collector/fans.prom\n");
+    printf(" -i, --interval=FLOAT\n");
+    printf("   Seconds between writes of --textfile. (valid: 1 to 3600) (default: 15)\n");
+}
+
+int main(int argc, char **argv) {
+    int c;
+    static struct option long_options[] = {
+        {"help",                  no_argument,       0, 'h'},
+        {"telemetry",             required_argument, 0, 'T'},
+        {"listen",                required_argument, 0, 'l'},
+        {"textfile",              required_argument, 0, 'o'},
+        {"interval",              required_argument, 0, 'i'},
+        {0,                       0,                 0,  0 }
+    };
+    while ((c = getopt_long(argc, argv, "hT:l:o:i:", long_options, NULL)) != -1) {
+        switch (c) {
+            case 'T':
+                if (curRings == MAXRINGS) {
+                    fprintf(stderr, "ERROR: --telemetry : Exceeded maximum allowed rings (%d).\n", MAXRINGS);
+                    return EXIT_FAILURE;
+                }
+                ringPaths[curRings++] = optarg;
+                break;
+            case 'l':
+                if (strrchr(optarg, ':') != NULL) {
+                    *strrchr(optarg, ':') = 0;
+                    listenAddr = optarg;
+                    optarg += strlen(optarg) + 1;
+                }
+                listenPort = atoi(optarg);
+                if (listenPort < 1 || listenPort > 65535) {
+                    fprintf(stderr, "ERROR: --listen : PORT must be 1 to 65535.\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'o':
+                textFile = optarg;
+                break;
+            case 'i':
+                interval = atof(optarg);
+                if (interval < 1 || interval > 3600) {
+                    fprintf(stderr, "ERROR: --interval must be between 1 and 3600.\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'h':
+            default:
+                printUsage();
+                return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (!curRings || (!listenPort && !textFile)) {
+        printUsage();
+        return EXIT_FAILURE;
+    }
+    int lfd = listenPort ? openListener() : -1;
+    if (listenPort && lfd < 0) {
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    double nextWrite = monoTime();
+    while (1) {
+        int timeout = -1;
+        if (textFile) {
+            if (monoTime() >= nextWrite) {
+                writeTextFile();
+                nextWrite += interval;
+            }
+            timeout = (int) ((nextWrite - monoTime()) * 1000) + 1;
+            timeout = timeout < 0 ? 0 : timeout;
+        }
+        struct pollfd pfd = {lfd, POLLIN, 0};
+        if (poll(&pfd, 1, timeout) == 1 && (pfd.revents & POLLIN)) {
+            int cfd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+            if (cfd >= 0) {
+                serveClient(cfd);
+                close(cfd);
+            }
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,633 @@
+/**
+ * Copyright (C) 2022  kevinlekiller
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Per loop history of ccpfc, cfancontrol and vega64control.
+ *
+ * --record copies every sample of a daemon's --telemetry ring to a history file, every --flush seconds.
+ * --export writes a time range of a history file as CSV, for ccpfc --replay and ccpfctune.
+ *
+ * File format : BLOCKSIZE blocks, block 0 is the file header (channel names), the others hold samples.
+ * Every block starts with a blockHeader and can be decoded on its own : the first sample of a block
+ * is a keyframe (the deltas are against 0), the next ones are stored as
+ *  varint   : time delta of delta (ms, zigzag)
+ *  bytes    : one bit per channel, set if the channel changed
+ *  varints  : the change of every channel that changed (zigzag)
+ * so a channel that didn't change costs 1 bit. The blocks are in time order and hold their first and
+ * last sample time, seeking to a time is a binary search over the block headers.
+ * Only the bytes added since the last flush and the block header are written.
+ *
+ * Compile: gcc fanhistory.c -o fanhistory -Wextra -O2
+ * Run : ./fanhistory --record=/dev/shm/ccpfc:/var/lib/ccpfc/history
+ *       ./fanhistory --export=/var/lib/ccpfc/history --from=-86400 --replay-csv > trace.csv
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "telemetry.h"
+
+#define HISTMAGIC "FANHIST1"
+#define BLOCKMAGIC 0x4b4c4248
+#define BLOCKSIZE 4096
+// temp, temps, fans, 3 pstates, load, throttled, tick time.
+#define MAXCHANNELS (1 + TELETEMPS + TELEFANS + 3 + 1 + 1 + 1)
+// Max size of one encoded sample.
+#define MAXENC (10 + (MAXCHANNELS + 7) / 8 + MAXCHANNELS * 10)
+// Max amount of --record.
+#define MAXRINGS 8
+
+struct histHeader {
+    char magic[8];
+    uint32_t blockSize, nChannels;
+    char daemon[16];
+    char channels[MAXCHANNELS][16];
+};
+struct blockHeader {
+    uint32_t magic;
+    uint16_t used;               // Bytes of samples after the header
+    uint16_t samples;
+    uint64_t firstNs, lastNs;    // CLOCK_REALTIME of the first and last sample
+};
+#define BLOCKDATA (BLOCKSIZE - sizeof(struct blockHeader))
+
+// Encoder / decoder state, reset at the start of every block.
+struct codec {
+    int64_t prev[MAXCHANNELS];
+    int64_t prevMs, prevDt;
+};
+
+struct rStruct {
+    const char * telePath;
+    const char * histPath;
+    int fd;
+    struct histHeader head;
+    uint64_t teleHead;           // Samples of the ring already recorded
+    uint64_t block;              // Index of the block being filled
+    unsigned char buf[BLOCKSIZE];
+    size_t flushed;              // Bytes of buf already written
+    struct codec enc;
+    uint64_t lastNs;             // Time of the last sample in the file when it was opened, see recordRing()
+    unsigned long samples, lost;
+};
+struct rStruct recArr[MAXRINGS];
+int curRecs = 0;
+float flushInterval = 10.0;
+volatile sig_atomic_t stop = 0;
+const char * exportPath = NULL, * infoPath = NULL;
+double fromTime = 0, toTime = 0;
+bool hasFrom = false, hasTo = false, replayCsv = false;
+
+unsigned char * putVarint(unsigned char * ptr, uint64_t value) {
+    while (value >= 0x80) {
+        *ptr++ = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    *ptr++ = (unsigned char) value;
+    return ptr;
+}
+
+const unsigned char * getVarint(const unsigned char * ptr, const unsigned char * end, uint64_t * value) {
+    *value = 0;
+    for (int shift = 0; ptr < end && shift < 64; shift += 7) {
+        *value |= (uint64_t) (*ptr & 0x7f) << shift;
+        if (!(*ptr++ & 0x80)) {
+            return ptr;
+        }
+    }
+    return NULL;
+}
+
+uint64_t zigzag(int64_t value) {
+    return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+int64_t unzigzag(uint64_t value) {
+    return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
+
+// Channels of a ring, the same for every sample while the daemon runs with the same config.
+int ringChannels(const struct teleHeader * tele, char names[][16]) {
+    int n = 0;
+    unsigned int nTemps = tele->nTemps > TELETEMPS ? TELETEMPS : tele->nTemps;
+    unsigned int nFans = tele->nFans > TELEFANS ? TELEFANS : tele->nFans;
+    snprintf(names[n++], 16, "temp");
+    for (unsigned int i = 0; i < nTemps; i++) {
+        snprintf(names[n++], 16, "temp%u", i);
+    }
+    for (unsigned int i = 0; i < nFans; i++) {
+        snprintf(names[n++], 16, "fan%u_%.7s", i, tele->fanUnit);
+    }
+    if (tele->flags & TELEGPU) {
+        snprintf(names[n++], 16, "pstate_gpu");
+        snprintf(names[n++], 16, "pstate_soc");
+        snprintf(names[n++], 16, "pstate_vram");
+        snprintf(names[n++], 16, "load");
+    }
+    if (tele->flags & TELETHROTTLE) {
+        snprintf(names[n++], 16, "throttled");
+    }
+    snprintf(names[n++], 16, "tick_us");
+    return n;
+}
+
+void sampleValues(const struct teleHeader * tele, const struct teleSample * smp, int64_t * values) {
+    int n = 0;
+    unsigned int nTemps = tele->nTemps > TELETEMPS ? TELETEMPS : tele->nTemps;
+    unsigned int nFans = tele->nFans > TELEFANS ? TELEFANS : tele->nFans;
+    values[n++] = smp->temp;
+    for (unsigned int i = 0; i < nTemps; i++) {
+        values[n++] = smp->temps[i];
+    }
+    for (unsigned int i = 0; i < nFans; i++) {
+        values[n++] = smp->fans[i];
+    }
+    if (tele->flags & TELEGPU) {
+        for (int i = 0; i < 3; i++) {
+            values[n++] = smp->pstates[i];
+        }
+        values[n++] = smp->load;
+    }
+    if (tele->flags & TELETHROTTLE) {
+        values[n++] = smp->throttled;
+    }
+    values[n++] = smp->tickNs / 1000;
+}
+
+size_t encodeSample(struct codec * enc, int nChannels, int64_t timeMs, const int64_t * values, unsigned char * out) {
+    unsigned char * ptr = out, * mask;
+    int64_t dt = timeMs - enc->prevMs;
+    ptr = putVarint(ptr, zigzag(dt - enc->prevDt));
+    enc->prevMs = timeMs;
+    enc->prevDt = dt;
+    mask = ptr;
+    ptr += (nChannels + 7) / 8;
+    memset(mask, 0, (nChannels + 7) / 8);
+    for (int i = 0; i < nChannels; i++) {
+        if (values[i] != enc->prev[i]) {
+            mask[i / 8] |= 1 << (i % 8);
+            ptr = putVarint(ptr, zigzag(values[i] - enc->prev[i]));
+            enc->prev[i] = values[i];
+        }
+    }
+    return ptr - out;
+}
+
+const unsigned char * decodeSample(struct codec * dec, int nChannels, const unsigned char * ptr, const unsigned char * end) {
+    uint64_t value;
+    if (!(ptr = getVarint(ptr, end, &value))) {
+        return NULL;
+    }
+    dec->prevDt += unzigzag(value);
+    dec->prevMs += dec->prevDt;
+    const unsigned char * mask = ptr;
+    ptr += (nChannels + 7) / 8;
+    for (int i = 0; i < nChannels && ptr <= end; i++) {
+        if (!(mask[i / 8] & (1 << (i % 8)))) {
+            continue;
+        }
+        if (!(ptr = getVarint(ptr, end, &value))) {
+            return NULL;
+        }
+        dec->prev[i] += unzigzag(value);
+    }
+    return ptr <= end ? ptr : NULL;
+}
+
+void startBlock(struct rStruct * rec, uint64_t timeNs) {
+    struct blockHeader * bh = (struct blockHeader *) rec->buf;
+    memset(rec->buf, 0, sizeof(rec->buf));
+    bh->magic = BLOCKMAGIC;
+    bh->firstNs = bh->lastNs = timeNs;
+    rec->flushed = 0;
+    memset(&rec->enc, 0, sizeof(rec->enc));
+    rec->enc.prevMs = timeNs / 1000000;
+}
+
+// Writes what was added to the block since the last flush, then its header.
+void flushBlock(struct rStruct * rec) {
+    struct blockHeader * bh = (struct blockHeader *) rec->buf;
+    off_t offset = (off_t) rec->block * BLOCKSIZE;
+    if (bh->used == rec->flushed) {
+        return;
+    }
+    if (pwrite(rec->fd, rec->buf + sizeof(struct blockHeader) + rec->flushed, bh->used - rec->flushed,
+        offset + sizeof(struct blockHeader) + rec->flushed) < 0 || pwrite(rec->fd, bh, sizeof(struct blockHeader), offset) < 0) {
+        fprintf(stderr, "ERROR: Could not write to '%s' : %s\n", rec->histPath, strerror(errno));
+        return;
+    }
+    rec->flushed = bh->used;
+}
+
+void appendSample(struct rStruct * rec, const struct teleHeader * tele, const struct teleSample * smp) {
+    unsigned char enc[MAXENC];
+    int64_t values[MAXCHANNELS];
+    struct blockHeader * bh = (struct blockHeader * ) rec->buf;
+    struct codec saved = rec->enc;
+    sampleValues(tele, smp, values);
+    size_t len = bh->samples ? encodeSample(&rec->enc, rec->head.nChannels, smp->timeNs / 1000000, values, enc) : 0;
+    // Block full (or a new one) : the sample is the keyframe of the next block.
+    if (!bh->samples || bh->used + len > BLOCKDATA) {
+        if (bh->samples) {
+            rec->enc = saved;
+            flushBlock(rec);
+            rec->block++;
+        }
+        startBlock(rec, smp->timeNs);
+        len = encodeSample(&rec->enc, rec->head.nChannels, smp->timeNs / 1000000, values, enc);
+    }
+    memcpy(rec->buf + sizeof(struct blockHeader) + bh->used, enc, len);
+    bh->used += len;
+    bh->samples++;
+    bh->lastNs = smp->timeNs;
+    rec->samples++;
+}
+
+bool readBlock(int fd, uint64_t block, unsigned char * buf);
+
+// Opens the history file, a file with other channels (the daemon's config changed) is moved to FILE.YYYYMMDD-HHMMSS
+// (FILE.YYYYMMDD-HHMMSS.N if that exists), so every earlier layout is kept.
+bool openHistory(struct rStruct * rec, const struct histHeader * want) {
+    struct histHeader have;
+    struct stat sb;
+    if (rec->fd >= 0) {
+        close(rec->fd);
+    }
+    rec->fd = open(rec->histPath, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (rec->fd < 0 || fstat(rec->fd, &sb) != 0) {
+        fprintf(stderr, "ERROR: Could not open '%s'\n", rec->histPath);
+        return false;
+    }
+    if (sb.st_size > 0 && (pread(rec->fd, &have, sizeof(have), 0) != sizeof(have) || memcmp(&have, want, sizeof(have)) != 0)) {
+        char oldPath[4096], stamp[32];
+        time_t now = time(NULL);
+        strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+        snprintf(oldPath, sizeof(oldPath), "%s.%s", rec->histPath, stamp);
+        for (int n = 1; access(oldPath, F_OK) == 0; n++) {
+            snprintf(oldPath, sizeof(oldPath), "%s.%s.%d", rec->histPath, stamp, n);
+        }
+        close(rec->fd);
+        rec->fd = -1;
+        if (rename(rec->histPath, oldPath) != 0) {
+            fprintf(stderr, "ERROR: '%s' has other channels, could not move it to '%s'\n", rec->histPath, oldPath);
+            return false;
+        }
+        fprintf(stderr, "WARNING: '%s' has other channels, moved it to '%s'\n", rec->histPath, oldPath);
+        return openHistory(rec, want);
+    }
+    if (sb.st_size == 0) {
+        unsigned char block[BLOCKSIZE];
+        memset(block, 0, sizeof(block));
+        memcpy(block, want, sizeof(struct histHeader));
+        if (pwrite(rec->fd, block, sizeof(block), 0) != sizeof(block)) {
+            fprintf(stderr, "ERROR: Could not write to '%s'\n", rec->histPath);
+            return false;
+        }
+        sb.st_size = BLOCKSIZE;
+    }
+    rec->head = *want;
+    // Continue in a new block after the last one.
+    rec->block = (sb.st_size + BLOCKSIZE - 1) / BLOCKSIZE;
+    rec->lastNs = 0;
+    for (uint64_t b = rec->block; b > 1 && !rec->lastNs; b--) {
+        if (readBlock(rec->fd, b - 1, rec->buf)) {
+            rec->lastNs = ((struct blockHeader *) rec->buf)->lastNs;
+        }
+    }
+    memset(rec->buf, 0, sizeof(rec->buf));
+    rec->flushed = 0;
+    return true;
+}
+
+// Copies the new samples of the ring, samples that were overwritten before this ran are counted as lost.
+void recordRing(struct rStruct * rec) {
+    struct histHeader want;
+    struct teleHeader * tele = mapRing(rec->telePath, NULL);
+    if (!tele) {
+        return;
+    }
+    memset(&want, 0, sizeof(want));
+    memcpy(want.magic, HISTMAGIC, 8);
+    want.blockSize = BLOCKSIZE;
+    want.nChannels = ringChannels(tele, want.channels);
+    snprintf(want.daemon, sizeof(want.daemon), "%.15s", tele->daemon);
+    if (memcmp(&want, &rec->head, sizeof(want)) != 0) {
+        flushBlock(rec);
+        if (!openHistory(rec, &want)) {
+            unmapRing(tele);
+            return;
+        }
+    }
+    uint64_t head = ringHead(tele);
+    // The daemon restarted.
+    if (head < rec->teleHead) {
+        rec->teleHead = 0;
+    }
+    // The oldest slot is the next one the daemon writes, leave it out.
+    if (head - rec->teleHead > TELESLOTS - 1) {
+        // Before the first copy, the samples the ring no longer holds were never ours to lose.
+        rec->lost += rec->samples ? head - (TELESLOTS - 1) - rec->teleHead : 0;
+        rec->teleHead = head - (TELESLOTS - 1);
+    }
+    for (; rec->teleHead < head; rec->teleHead++) {
+        struct teleSample smp;
+        if (!readSample(tele, rec->teleHead, &smp)) {
+            rec->lost++;
+            continue;
+        }
+        // Only for the first copy after the file was opened : the ring can hold samples a previous run already
+        // recorded. After it, teleHead (the ring's sequence) says what is new, a clock set back drops nothing.
+        if (smp.timeNs <= rec->lastNs) {
+            continue;
+        }
+        appendSample(rec, tele, &smp);
+    }
+    rec->lastNs = 0;
+    unmapRing(tele);
+    flushBlock(rec);
+}
+
+void onStop() {
+    stop = 1;
+}
+
+int runRecord() {
+    struct timespec next;
+    signal(SIGINT, onStop);
+    signal(SIGTERM, onStop);
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (!stop) {
+        for (int i = 0; i < curRecs; i++) {
+            unsigned long lost = recArr[i].lost;
+            recordRing(&recArr[i]);
+            if (recArr[i].lost != lost) {
+                fprintf(stderr, "WARNING: %s : %lu samples lost, --flush is longer than the telemetry ring.\n",
+                    recArr[i].telePath, recArr[i].lost - lost);
+            }
+        }
+        next.tv_sec += (time_t) flushInterval;
+        next.tv_nsec += (long) ((flushInterval - (time_t) flushInterval) * 1e9);
+        if (next.tv_nsec >= 1000000000) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000;
+        }
+        while (!stop && clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
+    }
+    for (int i = 0; i < curRecs; i++) {
+        recordRing(&recArr[i]);
+    }
+    return EXIT_SUCCESS;
+}
+
+bool readBlock(int fd, uint64_t block, unsigned char * buf) {
+    const struct blockHeader * bh = (const struct blockHeader *) buf;
+    ssize_t len = pread(fd, buf, BLOCKSIZE, (off_t) block * BLOCKSIZE);
+    return len >= (ssize_t) sizeof(struct blockHeader) && bh->magic == BLOCKMAGIC
+        && bh->used <= BLOCKDATA && len >= (ssize_t) (sizeof(struct blockHeader) + bh->used);
+}
+
+bool openExport(const char * path, int * fd, struct histHeader * head, uint64_t * blocks) {
+    struct stat sb;
+    *fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (*fd < 0 || fstat(*fd, &sb) != 0 || pread(*fd, head, sizeof(*head), 0) != sizeof(*head)
+        || memcmp(head->magic, HISTMAGIC, 8) != 0 || head->blockSize != BLOCKSIZE || head->nChannels > MAXCHANNELS) {
+        fprintf(stderr, "ERROR: '%s' is not a history file.\n", path);
+        return false;
+    }
+    *blocks = (sb.st_size + BLOCKSIZE - 1) / BLOCKSIZE;
+    return true;
+}
+
+// Binary search for the first block that has samples at or after timeNs. Blocks that can't
+// be read (never written after a crash) count as being before timeNs.
+uint64_t seekBlock(int fd, uint64_t blocks, uint64_t timeNs) {
+    unsigned char buf[BLOCKSIZE];
+    uint64_t lo = 1, hi = blocks;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (readBlock(fd, mid, buf) && ((struct blockHeader *) buf)->lastNs >= timeNs) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+int runExport() {
+    int fd;
+    struct histHeader head;
+    uint64_t blocks;
+    unsigned char buf[BLOCKSIZE];
+    if (!openExport(exportPath, &fd, &head, &blocks)) {
+        return EXIT_FAILURE;
+    }
+    // Negative --from / --to are seconds before the last sample.
+    uint64_t lastNs = 0;
+    for (uint64_t b = blocks; b > 1 && !lastNs; b--) {
+        if (readBlock(fd, b - 1, buf)) {
+            lastNs = ((struct blockHeader *) buf)->lastNs;
+        }
+    }
+    uint64_t fromNs = !hasFrom ? 0 : fromTime < 0 ? lastNs + fromTime * 1e9 : fromTime * 1e9;
+    uint64_t toNs = !hasTo ? UINT64_MAX : toTime < 0 ? lastNs + toTime * 1e9 : toTime * 1e9;
+    double startMs = -1;
+    if (replayCsv) {
+        printf("time");
+        for (unsigned int i = 1; i < head.nChannels && strncmp(head.channels[i], "temp", 4) == 0; i++) {
+            printf(",%s", head.channels[i]);
+        }
+        printf("\n");
+    } else {
+        printf("time");
+        for (unsigned int i = 0; i < head.nChannels; i++) {
+            printf(",%s", head.channels[i]);
+        }
+        printf("\n");
+    }
+    for (uint64_t b = seekBlock(fd, blocks, fromNs); b < blocks; b++) {
+        struct codec dec;
+        if (!readBlock(fd, b, buf)) {
+            continue;
+        }
+        const struct blockHeader * bh = (const struct blockHeader *) buf;
+        if (bh->firstNs > toNs) {
+            break;
+        }
+        const unsigned char * ptr = buf + sizeof(struct blockHeader), * end = ptr + bh->used;
+        memset(&dec, 0, sizeof(dec));
+        dec.prevMs = bh->firstNs / 1000000;
+        for (int s = 0; s < bh->samples && ptr && ptr < end; s++) {
+            ptr = decodeSample(&dec, head.nChannels, ptr, end);
+            uint64_t timeNs = (uint64_t) dec.prevMs * 1000000;
+            if (!ptr || timeNs < fromNs / 1000000 * 1000000 || timeNs > toNs) {
+                continue;
+            }
+            if (replayCsv) {
+                // ccpfc --replay : seconds from the first sample, temperatures in millidegrees.
+                if (startMs < 0) {
+                    startMs = dec.prevMs;
+                }
+                printf("%.3f", (dec.prevMs - startMs) / 1000.0);
+                for (unsigned int i = 1; i < head.nChannels && strncmp(head.channels[i], "temp", 4) == 0; i++) {
+                    printf(",%lld", (long long) dec.prev[i] * 1000);
+                }
+            } else {
+                printf("%.3f", dec.prevMs / 1000.0);
+                for (unsigned int i = 0; i < head.nChannels; i++) {
+                    printf(",%lld", (long long) dec.prev[i]);
+                }
+            }
+            printf("\n");
+        }
+    }
+    close(fd);
+    return EXIT_SUCCESS;
+}
+
+int runInfo() {
+    int fd;
+    struct histHeader head;
+    uint64_t blocks, samples = 0, bytes = 0, firstNs = 0, lastNs = 0;
+    unsigned char buf[BLOCKSIZE];
+    if (!openExport(infoPath, &fd, &head, &blocks)) {
+        return EXIT_FAILURE;
+    }
+    for (uint64_t b = 1; b < blocks; b++) {
+        if (!readBlock(fd, b, buf)) {
+            continue;
+        }
+        const struct blockHeader * bh = (const struct blockHeader *) buf;
+        samples += bh->samples;
+        bytes += bh->used + sizeof(struct blockHeader);
+        firstNs = firstNs ? firstNs : bh->firstNs;
+        lastNs = bh->lastNs;
+    }
+    close(fd);
+    printf("Daemon       : %.15s\n", head.daemon);
+    printf("Channels     : %u :", head.nChannels);
+    for (unsigned int i = 0; i < head.nChannels; i++) {
+        printf(" %s", head.channels[i]);
+    }
+    printf("\nSamples      : %llu in %llu blocks, %.0f s\n", (unsigned long long) samples, (unsigned long long) blocks - 1,
+        samples ? (lastNs - firstNs) / 1e9 : 0.0);
+    printf("Size         : %llu bytes, %.3f bytes per sample per channel\n", (unsigned long long) bytes,
+        samples ? (double) bytes / samples / head.nChannels : 0.0);
+    return EXIT_SUCCESS;
+}
+
+void printUsage() {
+    printf("Per loop history of ccpfc, cfancontrol and vega64control, from their --telemetry ring.\n");
+    printf("Options:\n");
+    printf(" -h, --help\n");
+    printf("   Displays this information.\n");
+    printf(" -r, --record=TELEMETRY:FILE\n");
+    printf("   Append every sample of the --telemetry ring TELEMETRY to the history file FILE. Can be passed up to %d times.\n", MAXRINGS);
+    printf("   Example: --record=/dev/shm/ccpfc:/var/lib/ccpfc/history\n");
+    printf(" -f, --flush=FLOAT\n");
+    printf("   Seconds between copying the ring to FILE, must be shorter than the %d loops the ring holds. (default: 10)\n", TELESLOTS);
+    printf(" -e, --export=FILE\n");
+    printf("   Write the samples of the history file FILE to stdout as CSV : time,CHANNEL,CHANNEL,...\n");
+    printf(" -b, --from=SECONDS\n");
+    printf("   --export samples from this UNIX time, or if negative from this many seconds before the last sample.\n");
+    printf(" -t, --to=SECONDS\n");
+    printf("   --export samples up to this UNIX time, or if negative up to this many seconds before the last sample.\n");
+    printf(" -p, --replay-csv\n");
+    printf("   --export in the ccpfc --replay / ccpfctune format : seconds from the first sample, the sensors in millidegrees.\n");
+    printf(" -i, --info=FILE\n");
+    printf("   Print the channels, amount of samples and size per sample of the history file FILE.\n");
+}
+
+int main(int argc, char **argv) {
+    int c;
+    static struct option long_options[] = {
+        {"help",                  no_argument,       0, 'h'},
+        {"record",                required_argument, 0, 'r'},
+        {"flush",                 required_argument, 0, 'f'},
+        {"export",                required_argument, 0, 'e'},
+        {"from",                  required_argument, 0, 'b'},
+        {"to",                    required_argument, 0, 't'},
+        {"replay-csv",            no_argument,       0, 'p'},
+        {"info",                  required_argument, 0, 'i'},
+        {0,                       0,                 0,  0 }
+    };
+    while ((c = getopt_long(argc, argv, "hr:f:e:b:t:pi:", long_options, NULL)) != -1) {
+        switch (c) {
+            case 'r': {
+                char * sep = strchr(optarg, ':');
+                if (!sep || curRecs == MAXRINGS) {
+                    fprintf(stderr, "ERROR: --record must be TELEMETRY:FILE, up to %d times.\n", MAXRINGS);
+                    return EXIT_FAILURE;
+                }
+                *sep = 0;
+                memset(&recArr[curRecs], 0, sizeof(struct rStruct));
+                recArr[curRecs].telePath = optarg;
+                recArr[curRecs].histPath = sep + 1;
+                recArr[curRecs].fd = -1;
+                curRecs++;
+                break;
+            }
+            case 'f':
+                flushInterval = atof(optarg);
+                if (flushInterval < 0.1 || flushInterval > 3600) {
+                    fprintf(stderr, "ERROR: --flush must be between 0.1 and 3600.\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'e':
+                exportPath = optarg;
+                break;
+            case 'b':
+                fromTime = atof(optarg);
+                hasFrom = true;
+                break;
+            case 't':
+                toTime = atof(optarg);
+                hasTo = true;
+                break;
+            case 'p':
+                replayCsv = true;
+                break;
+            case 'i':
+                infoPath = optarg;
+                break;
+            case 'h':
+            default:
+                printUsage();
+                return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (infoPath) {
+        return runInfo();
+    } else if (exportPath) {
+        return runExport();
+    } else if (curRecs) {
+        return runRecord();
+    }
+    printUsage();
+    return EXIT_FAILURE;
+}
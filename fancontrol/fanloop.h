@@ -0,0 +1,253 @@
+/**
+ * Copyright (C) 2022  kevinlekiller
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * The loop of the fan daemons (ccpfc, cfancontrol, vega64control, hwfc) : the interval timer, real-time mode
+ * and the deadline monitor, sd_notify() and the watchdog, suspend / resume and hwmon uevents.
+ * The fan curve is in fancurve.h.
+ * Each daemon is one file that includes this once, it defines interval and silent, and its own checkFailSafe()
+ * since the fail-safe is what differs between them.
+ */
+
+#ifndef FANLOOP_H
+#define FANLOOP_H
+
+#include <errno.h>
+#include <malloc.h>
+#include <math.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <linux/netlink.h>
+
+#include "fancurve.h"
+
+extern float interval;
+extern bool silent;
+
+// Real-time mode (--realtime) and the deadline monitor. A tick has to be done within --deadline and the next one
+// has to start on time, a missed deadline or --fail-safe-reads ticks in a row with failed sensor reads switch to
+// the fail-safe of the daemon, until as many ticks in a row are fine again.
+#define RTSTACK (256 * 1024)
+int rtPriority = 0;
+unsigned short deadline = 0;
+unsigned char failSafeReads = 3;
+unsigned int failedTicks = 0, goodTicks = 0;
+bool tickFailed = false, deadlineMissed = false, failSafe = false;
+unsigned long statDeadlineMisses = 0, statFailSafes = 0;
+// sd_notify() without libsystemd : datagrams to $NOTIFY_SOCKET, WATCHDOG=1 at most every watchdogNs / 4.
+int notifyFd = -1;
+struct sockaddr_un notifyAddr;
+socklen_t notifyLen = 0;
+uint64_t watchdogNs = 0, lastPingNs = 0;
+
+static inline double monoTime() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// The loop has to be able to feed the watchdog at least 4 times per WatchdogSec=.
+static inline bool checkWatchdog() {
+    if (watchdogNs && interval * 1e9 > watchdogNs / 4) {
+        fprintf(stderr, "ERROR: --interval must be at most a quarter of the systemd watchdog timeout (WatchdogSec=%.3f).\n", watchdogNs / 1e9);
+        return false;
+    }
+    return true;
+}
+
+static inline bool openNotify() {
+    const char * path = getenv("NOTIFY_SOCKET");
+    const char * usec = getenv("WATCHDOG_USEC");
+    if (!path || (path[0] != '/' && path[0] != '@') || strlen(path) >= sizeof(notifyAddr.sun_path)) {
+        return true;
+    }
+    notifyAddr.sun_family = AF_UNIX;
+    memcpy(notifyAddr.sun_path, path, strlen(path));
+    // '@' is an abstract socket.
+    if (path[0] == '@') {
+        notifyAddr.sun_path[0] = 0;
+    }
+    notifyLen = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+    notifyFd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    watchdogNs = usec ? strtoull(usec, NULL, 10) * 1000 : 0;
+    return checkWatchdog();
+}
+
+static inline void sdNotify(const char * msg) {
+    if (notifyFd >= 0) {
+        sendto(notifyFd, msg, strlen(msg), MSG_NOSIGNAL, (struct sockaddr *) &notifyAddr, notifyLen);
+    }
+}
+
+// Maps the stack a tick can use before mlockall() locks it.
+__attribute__((noinline)) static void prefaultStack() {
+    unsigned char stack[RTSTACK];
+    // Through a volatile pointer, gcc can't drop the writes to an array that is never read.
+    volatile unsigned char * page = stack;
+    for (int i = 0; i < RTSTACK; i += 4096) {
+        page[i] = 0;
+    }
+}
+
+// Freed memory stays in the heap and new memory comes from it, so a tick never waits for the kernel to map
+// a page ; heap bytes are made room for now, for what the daemon allocates once running.
+static inline bool enterRealtime(size_t heap) {
+    struct sched_param param = {.sched_priority = rtPriority};
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+    volatile unsigned char * room = heap ? malloc(heap) : NULL;
+    for (size_t i = 0; room && i < heap; i += 4096) {
+        room[i] = 0;
+    }
+    free((void *) room);
+    prefaultStack();
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        fprintf(stderr, "ERROR: --realtime : Could not lock the memory : %s\n", strerror(errno));
+        return false;
+    }
+    // Programs started from the loop don't inherit SCHED_FIFO.
+    if (sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK, &param) != 0) {
+        fprintf(stderr, "ERROR: --realtime : Could not set SCHED_FIFO priority %d : %s\n", rtPriority, strerror(errno));
+        return false;
+    }
+    if (!silent) {
+        printf("Real-time mode : SCHED_FIFO priority %d, memory locked.\n", rtPriority);
+    }
+    return true;
+}
+
+static inline void missDeadline(const char * what, double ms) {
+    char msg[128];
+    statDeadlineMisses++;
+    deadlineMissed = true;
+    snprintf(msg, sizeof(msg), "STATUS=Missed a deadline (%s by %.1f ms), %lu misses", what, ms, statDeadlineMisses);
+    sdNotify(msg);
+}
+
+// When a tick is done. Every tick that gets done feeds the watchdog, a hung loop stops feeding it, a late
+// tick only switches to the fail-safe.
+static inline void endTick(const struct timespec * tickStart) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t nowNs = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    double took = (nowNs - (tickStart->tv_sec * 1000000000ULL + tickStart->tv_nsec)) / 1e6;
+    double limit = deadline ? deadline : interval * 1000.0;
+    if (took > limit) {
+        missDeadline("tick took too long", took - limit);
+    }
+    if (watchdogNs && nowNs - lastPingNs >= watchdogNs / 4) {
+        lastPingNs = nowNs;
+        sdNotify("WATCHDOG=1");
+    }
+}
+
+// With the expirations of the timer read before a tick, more than 1 means ticks were skipped.
+static inline void checkLateness(uint64_t expirations) {
+    if (expirations > 1) {
+        missDeadline("ticks skipped", (expirations - 1) * interval * 1000.0);
+    }
+}
+
+static inline void armTimer(int tfd) {
+    struct itimerspec its;
+    its.it_interval.tv_sec = (time_t) interval;
+    its.it_interval.tv_nsec = (long) ((interval - its.it_interval.tv_sec) * 1e9);
+    its.it_value = its.it_interval;
+    timerfd_settime(tfd, 0, &its, NULL);
+}
+
+// Suspend / resume : a CLOCK_REALTIME timerfd with TFD_TIMER_CANCEL_ON_SET is canceled when the clock
+// is set, which the kernel does on resume. It's armed far in the future, it only ever gets canceled.
+static inline void armResumeTimer(int rfd) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = INT32_MAX;
+    timerfd_settime(rfd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL);
+}
+
+static inline int openResumeTimer() {
+    int rfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (rfd >= 0) {
+        armResumeTimer(rfd);
+    }
+    return rfd;
+}
+
+static inline bool clockWasSet(int rfd) {
+    uint64_t expirations;
+    if (read(rfd, &expirations, sizeof(expirations)) >= 0 || errno != ECANCELED) {
+        return false;
+    }
+    armResumeTimer(rfd);
+    return true;
+}
+
+// Seconds spent suspended since boot, CLOCK_BOOTTIME counts them and CLOCK_MONOTONIC doesn't.
+static inline double suspendedTime() {
+    struct timespec boot, mono;
+    clock_gettime(CLOCK_BOOTTIME, &boot);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    return (boot.tv_sec - mono.tv_sec) + (boot.tv_nsec - mono.tv_nsec) / 1e9;
+}
+
+// Kernel uevents, to notice devices being added / removed (a driver reload). warning is printed if
+// they can't be listened to, NULL prints nothing.
+static inline int openUevents(const char * warning) {
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1;
+    int nfd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (nfd >= 0 && bind(nfd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        close(nfd);
+        nfd = -1;
+    }
+    if (nfd < 0 && warning) {
+        fprintf(stderr, "WARNING: Could not listen to uevents, %s\n", warning);
+    }
+    return nfd;
+}
+
+// Messages are "ACTION@DEVPATH" followed by NUL separated KEY=VALUE, true if one was about a hwmon device.
+static inline bool hwmonUevent(int nfd) {
+    char msg[8192];
+    bool found = false;
+    ssize_t len;
+    while ((len = recv(nfd, msg, sizeof(msg) - 1, 0)) > 0) {
+        msg[len] = 0;
+        for (char * ptr = msg; ptr < msg + len; ptr += strlen(ptr) + 1) {
+            if (strcmp(ptr, "SUBSYSTEM=hwmon") == 0) {
+                found = true;
+            }
+        }
+    }
+    return found;
+}
+
+#endif
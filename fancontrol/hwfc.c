@@ -0,0 +1,1144 @@
+/**
+ * Copyright (C) 2022  kevinlekiller
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * hwmon fan control : ccpfc, cfancontrol and vega64control in one daemon with one loop.
+ *
+ * Every loop, each sensor is read once, then every controller computes a fan speed from the
+ * sensors it uses, a fan driven by several controllers gets the highest speed, then the fans
+ * that changed are written and the P-States of the GPUs are set from their load.
+ * Fans are any hwmon pwmN (it87, corsair-cpro, amdgpu, ...) or fanN_target (RPM, amdgpu).
+ * The load of a --gpu is a sensor too, so chassis fans can follow the GPU.
+ * After a hwmon uevent or failed reads / writes (a driver reload), the sensors and fans are reopened
+ * in their new hwmon directory, like ccpfc does.
+ *
+ * Compile: gcc hwfc.c -o hwfc -Wextra -O2 -lm
+ * Run : ./hwfc --help
+*/
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <malloc.h>
+#include <math.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+
+#include "fanloop.h"
+#include "telemetry.h"
+
+// Value of a sensor that could not be read.
+#define TEMPNONE -274
+// Controller inputs are 0 to 100 (C or % of GPU load).
+#define LUTSIZE 101
+// Min seconds between looking up the hwmon directories again after failed reads / writes.
+#define REBINDDELAY 5.0
+
+bool silent = false, printLut = false, fakeSysfs = false;
+volatile sig_atomic_t stopPending = 0;
+sigset_t waitMask;
+const char * confFile = NULL;
+const char * sysfsRoot = "/sys";
+int optArgc;
+char ** optArgv;
+char buf[256];
+float interval = 1.0;
+double slept = 0;
+unsigned long statLoops = 0, statFanWrites = 0, statPstateChanges = 0, statReadErrors = 0;
+
+// --sensor, a hwmon file, or the load of a --gpu (NAME.load).
+struct sStruct {
+    char name[32];
+    char dev[64];
+    char file[64];
+    char path[256];
+    int fd;
+    int gpu;                     // Index in gpuArr for NAME.load, else -1
+    bool stale;                  // A read failed, reopened by rebindHwmon()
+    bool used;                   // Read every loop, a controller uses it
+    int value;
+};
+// --fan, pwmN or fanN_target of a hwmon directory.
+struct fStruct {
+    char name[32];
+    char dev[64];
+    char file[64];
+    char path[256];
+    char enablePath[256];        // pwmN_enable / fanN_enable, empty if there is none
+    char enableWas[16];          // Written back at exit
+    int fd;
+    bool rpm;                    // fanN_target
+    bool stale;                  // A write failed, reopened by rebindHwmon()
+    bool used;                   // In a controller, a fan without one is rejected
+    int smoothUp, smoothDown;
+    int speed, lastSpeed;
+};
+// --controller, a fan curve from the highest of its sensors to its fans.
+struct cStruct {
+    int * sensors, nSensors;
+    int * fans, nFans;
+    int minSpeed, lowSpeed, lowTemp, highSpeed, highTemp;
+    int lut[LUTSIZE];
+};
+// --gpu, amdgpu card, its load is read every loop if used, its P-States set from it if loadCheck.
+struct gStruct {
+    char name[32];
+    int card;
+    char devPath[256];
+    int loadFd;
+    int load;
+    unsigned char loadCheck, iterLimit, maxGpuState, maxSocState, maxVramState;
+    unsigned char gpuPstate, socPstate, vramPstate, iters;
+};
+struct sStruct * senArr = NULL;
+struct fStruct * fanArr = NULL;
+struct cStruct * ctlArr = NULL;
+struct gStruct * gpuArr = NULL;
+int curSens = 0, curFans = 0, curCtls = 0, curGpus = 0;
+
+// Index of the hwmon directories, sorted by the device they belong to, see ccpfc.
+struct hStruct {
+    char name[64];
+    char path[256];
+    char dev[256];
+};
+struct hStruct * hwmonArr = NULL;
+int curHwmon = 0, hwmonSize = 0, ueventFd = -1;
+bool rebindPending = false;
+double lastRebind = 0;
+
+#define GROWARR(arr, cur) do { void * tmp = realloc(arr, ((cur) + 1) * sizeof(*(arr))); if (!tmp) { fprintf(stderr, "ERROR: Out of memory.\n"); return false; } arr = tmp; memset(&(arr)[cur], 0, sizeof(*(arr))); } while (0)
+
+bool writeFile(const char * path, const char * value) {
+    ssize_t size = strlen(value);
+    int fd = open(path, O_WRONLY | O_CLOEXEC | (fakeSysfs ? O_TRUNC : 0));
+    bool ok = fd >= 0 && write(fd, value, size) == size;
+    close(fd);
+    return ok;
+}
+
+bool readFile(const char * path, ssize_t size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t len = fd >= 0 ? read(fd, buf, size) : -1;
+    close(fd);
+    buf[len > 0 ? len : 0] = 0;
+    return len > 0;
+}
+
+// Persistent fds, sysfs files can be read / written again at offset 0.
+bool readFd(int fd, ssize_t size) {
+    ssize_t len = fd >= 0 ? pread(fd, buf, size, 0) : -1;
+    buf[len > 0 ? len : 0] = 0;
+    return len > 0;
+}
+
+bool writeFd(int fd, const char * value) {
+    ssize_t size = strlen(value);
+    // A --sysfs-root tree is made of regular files, cut what's left of a longer previous value.
+    return fd >= 0 && pwrite(fd, value, size, 0) == size && (!fakeSysfs || ftruncate(fd, size) == 0);
+}
+
+bool fileExists(const char * path) {
+    return path && access(path, F_OK) == 0;
+}
+
+// A failed read / write usually means the driver was reloaded, see rebindHwmon().
+void markStale(bool * stale) {
+    *stale = true;
+    if (monoTime() - lastRebind >= REBINDDELAY) {
+        rebindPending = true;
+    }
+}
+
+// Fail-safe of hwfc : every controller at its HIGH and the GPUs at --fail-safe-pstates, see fanloop.h.
+// hwfc allocates nothing once running, enterRealtime() makes no room in the heap.
+unsigned char safeGpuPstate = 0, safeSocPstate = 0, safeVramPstate = 0;
+
+// Once per tick before the sensors are read, with the reads of the previous tick. True while in the fail-safe.
+bool checkFailSafe() {
+    failedTicks = tickFailed ? failedTicks + 1 : 0;
+    if (deadlineMissed || failedTicks >= failSafeReads) {
+        goodTicks = 0;
+        if (!failSafe) {
+            failSafe = true;
+            statFailSafes++;
+            fprintf(stderr, "\nWARNING: %s, fail-safe fan speeds and P-States.\n", deadlineMissed ? "Missed a deadline" : "Sensor reads failed");
+            sdNotify(deadlineMissed ? "STATUS=Fail-safe : missed a deadline" : "STATUS=Fail-safe : sensor reads failed");
+        }
+    } else if (failSafe && ++goodTicks >= failSafeReads) {
+        failSafe = false;
+        if (!silent) {
+            printf("\nLeft the fail-safe, back to the controllers.\n");
+        }
+        sdNotify("STATUS=Running");
+    }
+    deadlineMissed = false;
+    return failSafe;
+}
+
+// Telemetry ring, see --telemetry and telemetry.h.
+struct teleHeader * tele = NULL;
+const char * telePath = NULL;
+// Counters in the telemetry header, in the order publishTelemetry() fills them.
+const char * teleCounters[] = {"fan_writes", "pstate_changes", "read_errors", "deadline_misses", "fail_safes", NULL};
+
+// The first TELETEMPS sensors and TELEFANS fans, the P-States of the first GPU.
+void publishTelemetry(const struct timespec * tickStart) {
+    struct teleSample * smp = beginSample(tele, tickStart);
+    smp->temp = TEMPNONE;
+    for (unsigned int i = 0; i < tele->nTemps; i++) {
+        smp->temps[i] = senArr[i].value;
+        smp->temp = senArr[i].gpu < 0 && senArr[i].value > smp->temp ? senArr[i].value : smp->temp;
+    }
+    for (unsigned int i = 0; i < tele->nFans; i++) {
+        smp->fans[i] = fanArr[i].lastSpeed;
+    }
+    if (curGpus) {
+        smp->pstates[0] = gpuArr[0].gpuPstate;
+        smp->pstates[1] = gpuArr[0].socPstate;
+        smp->pstates[2] = gpuArr[0].vramPstate;
+        smp->load = gpuArr[0].load;
+    }
+    endSample(tele, smp);
+    tele->counters[0] = statFanWrites;
+    tele->counters[1] = statPstateChanges;
+    tele->counters[2] = statReadErrors;
+    tele->counters[3] = statDeadlineMisses;
+    tele->counters[4] = statFailSafes;
+}
+
+// fanN_input of the first TELEFANS fans, for fanexporter. Again when a fan moved to another hwmon directory.
+void publishRpmPaths() {
+    for (unsigned int i = 0; i < tele->nFans; i++) {
+        const char * num = fanArr[i].file + strcspn(fanArr[i].file, "0123456789");
+        snprintf(tele->rpmPaths[i], sizeof(tele->rpmPaths[i]), "%.*s/fan%.*s_input", (int) (strrchr(fanArr[i].path, '/') - fanArr[i].path),
+            fanArr[i].path, (int) strspn(num, "0123456789"), num);
+    }
+}
+
+int cmpHwmon(const void * a, const void * b) {
+    return strcmp(((const struct hStruct *) a)->dev, ((const struct hStruct *) b)->dev);
+}
+
+bool scanHwmon() {
+    char base[128], tmpPath[300], devPath[PATH_MAX];
+    sprintf(base, "%.100s/class/hwmon", sysfsRoot);
+    DIR *dir = opendir(base);
+    if (!dir) {
+        fprintf(stderr, "ERROR: Could not find base hwmon directory.\n");
+        return false;
+    }
+    struct dirent *files;
+    curHwmon = 0;
+    while ((files = readdir(dir)) != NULL) {
+        if (!strstr(files->d_name, "hwmon")) {
+            continue;
+        }
+        if (curHwmon == hwmonSize) {
+            struct hStruct * tmp = realloc(hwmonArr, (hwmonSize ? hwmonSize * 2 : 32) * sizeof(struct hStruct));
+            if (!tmp) {
+                break;
+            }
+            hwmonArr = tmp;
+            hwmonSize = hwmonSize ? hwmonSize * 2 : 32;
+        }
+        struct hStruct * hw = &hwmonArr[curHwmon];
+        snprintf(hw->path, sizeof(hw->path), "%.100s/%.100s", base, files->d_name);
+        snprintf(tmpPath, sizeof(tmpPath), "%s/name", hw->path);
+        if (!readFile(tmpPath, sizeof(hw->name) - 1)) {
+            continue;
+        }
+        snprintf(hw->name, sizeof(hw->name), "%.*s", (int) strcspn(buf, "\n"), buf);
+        snprintf(tmpPath, sizeof(tmpPath), "%s/device", hw->path);
+        snprintf(hw->dev, sizeof(hw->dev), "%s", realpath(tmpPath, devPath) ? devPath : hw->path);
+        curHwmon++;
+    }
+    closedir(dir);
+    qsort(hwmonArr, curHwmon, sizeof(struct hStruct), cmpHwmon);
+    return true;
+}
+
+// NAME@N is the Nth (from 0) hwmon directory called NAME in the index.
+const struct hStruct * lookupHwmon(const char * name, bool showErr) {
+    char want[64];
+    int skip = strchr(name, '@') ? atoi(strchr(name, '@') + 1) : 0;
+    snprintf(want, sizeof(want), "%.*s", (int) strcspn(name, "@"), name);
+    for (int i = 0; i < curHwmon; i++) {
+        if (strcmp(hwmonArr[i].name, want) == 0 && skip-- == 0) {
+            return &hwmonArr[i];
+        }
+    }
+    if (showErr) {
+        fprintf(stderr, "ERROR: Could not find hwmon directory '%s'\n", name);
+    }
+    return NULL;
+}
+
+int findSensor(const char * name, size_t len) {
+    for (int i = 0; i < curSens; i++) {
+        if (strlen(senArr[i].name) == len && strncmp(senArr[i].name, name, len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int findFan(const char * name, size_t len) {
+    for (int i = 0; i < curFans; i++) {
+        if (strlen(fanArr[i].name) == len && strncmp(fanArr[i].name, name, len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool openSensors() {
+    for (int i = 0; i < curSens; i++) {
+        struct sStruct * sen = &senArr[i];
+        if (sen->gpu >= 0) {
+            continue;
+        }
+        const struct hStruct * hw = lookupHwmon(sen->dev, true);
+        if (!hw) {
+            return false;
+        }
+        snprintf(sen->path, sizeof(sen->path), "%.190s/%.60s", hw->path, sen->file);
+        sen->fd = open(sen->path, O_RDONLY | O_CLOEXEC);
+        if (sen->fd < 0) {
+            fprintf(stderr, "ERROR: Could not open sensor '%s' : %s\n", sen->name, sen->path);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Manual mode : pwmN_enable / fanN_enable to 1, the old value is written back at exit.
+void enableFan(struct fStruct * fan) {
+    if (fan->enablePath[0] && (!readFile(fan->enablePath, 3) || atoi(buf) != 1)) {
+        writeFile(fan->enablePath, "1");
+    }
+}
+
+// pwmN_enable / fanN_enable of the fan in hwmonPath, empty if there is none.
+void setEnablePath(struct fStruct * fan, const char * hwmonPath) {
+    const char * num = fan->file + strcspn(fan->file, "0123456789");
+    snprintf(fan->enablePath, sizeof(fan->enablePath), "%.190s/%s%.*s_enable", hwmonPath, fan->rpm ? "fan" : "pwm",
+        (int) strspn(num, "0123456789"), num);
+    if (!fileExists(fan->enablePath)) {
+        fan->enablePath[0] = 0;
+    }
+}
+
+bool openFans() {
+    for (int i = 0; i < curFans; i++) {
+        struct fStruct * fan = &fanArr[i];
+        const struct hStruct * hw = lookupHwmon(fan->dev, true);
+        if (!hw) {
+            return false;
+        }
+        snprintf(fan->path, sizeof(fan->path), "%.190s/%.60s", hw->path, fan->file);
+        fan->fd = open(fan->path, O_RDWR | O_CLOEXEC);
+        if (fan->fd < 0) {
+            fprintf(stderr, "ERROR: Could not open fan '%s' : %s\n", fan->name, fan->path);
+            return false;
+        }
+        setEnablePath(fan, hw->path);
+        if (fan->enablePath[0] && readFile(fan->enablePath, sizeof(fan->enableWas) - 1)) {
+            snprintf(fan->enableWas, sizeof(fan->enableWas), "%.*s", (int) strcspn(buf, "\n"), buf);
+        }
+        fan->lastSpeed = -1;
+        enableFan(fan);
+    }
+    return true;
+}
+
+bool openGpus() {
+    char tmpPath[300];
+    const char * files[] = {"gpu_busy_percent", "power_dpm_force_performance_level", "pp_dpm_sclk", "pp_dpm_socclk", "pp_dpm_mclk"};
+    for (int i = 0; i < curGpus; i++) {
+        struct gStruct * gpu = &gpuArr[i];
+        snprintf(gpu->devPath, sizeof(gpu->devPath), "%.100s/class/drm/card%d/device", sysfsRoot, gpu->card);
+        for (unsigned int f = 0; f < (gpu->loadCheck ? 5 : 1); f++) {
+            snprintf(tmpPath, sizeof(tmpPath), "%s/%s", gpu->devPath, files[f]);
+            if (!fileExists(tmpPath)) {
+                fprintf(stderr, "ERROR: Could not find file '%s'\n", tmpPath);
+                return false;
+            }
+        }
+        snprintf(tmpPath, sizeof(tmpPath), "%s/gpu_busy_percent", gpu->devPath);
+        gpu->loadFd = open(tmpPath, O_RDONLY | O_CLOEXEC);
+        if (gpu->loadCheck) {
+            snprintf(tmpPath, sizeof(tmpPath), "%s/power_dpm_force_performance_level", gpu->devPath);
+            writeFile(tmpPath, "manual");
+        }
+    }
+    return true;
+}
+
+// Reopens a sensor / fan if its hwmon directory moved or its fd stopped working.
+bool reopenFd(int * fd, bool * stale, char * path, const struct hStruct * hw, const char * file, int flags) {
+    char newPath[256];
+    if (!hw) {
+        return false;
+    }
+    snprintf(newPath, sizeof(newPath), "%.190s/%.60s", hw->path, file);
+    if (*fd >= 0 && !*stale && strcmp(newPath, path) == 0) {
+        return false;
+    }
+    if (*fd >= 0) {
+        close(*fd);
+    }
+    strcpy(path, newPath);
+    *fd = open(path, flags | O_CLOEXEC);
+    *stale = false;
+    if (!silent) {
+        printf("\n%s '%s'\n", *fd >= 0 ? "Reopened" : "Could not reopen", path);
+    }
+    return true;
+}
+
+// After a hwmon uevent or failed reads / writes : the hwmon index is made again and the sensors / fans
+// that moved to another hwmonN (a driver reload for example) are reopened, see rebindHwmon() of ccpfc.
+void rebindHwmon() {
+    rebindPending = false;
+    lastRebind = monoTime();
+    if (!scanHwmon()) {
+        return;
+    }
+    for (int i = 0; i < curSens; i++) {
+        struct sStruct * sen = &senArr[i];
+        if (sen->gpu < 0) {
+            reopenFd(&sen->fd, &sen->stale, sen->path, lookupHwmon(sen->dev, false), sen->file, O_RDONLY);
+        }
+    }
+    for (int i = 0; i < curFans; i++) {
+        struct fStruct * fan = &fanArr[i];
+        const struct hStruct * hw = lookupHwmon(fan->dev, false);
+        if (reopenFd(&fan->fd, &fan->stale, fan->path, hw, fan->file, O_RDWR)) {
+            // The driver starts in automatic mode and doesn't remember the speed, both are set on the next loop.
+            setEnablePath(fan, hw->path);
+            enableFan(fan);
+            fan->lastSpeed = -1;
+        }
+    }
+    if (tele) {
+        publishRpmPaths();
+    }
+}
+
+// Every sensor a controller uses, once per loop. A GPU's load is read at most once, for its
+// NAME.load sensor and its P-States.
+void readSensors() {
+    tickFailed = false;
+    for (int i = 0; i < curGpus; i++) {
+        gpuArr[i].load = -1;
+    }
+    for (int i = 0; i < curSens; i++) {
+        struct sStruct * sen = &senArr[i];
+        if (!sen->used) {
+            continue;
+        }
+        if (sen->gpu >= 0) {
+            struct gStruct * gpu = &gpuArr[sen->gpu];
+            if (gpu->load < 0) {
+                gpu->load = readFd(gpu->loadFd, 4) ? atoi(buf) : TEMPNONE;
+            }
+            sen->value = gpu->load;
+        } else {
+            sen->value = readFd(sen->fd, 7) ? (int) round(atof(buf) / 1000.0) : TEMPNONE;
+        }
+        if (sen->value == TEMPNONE) {
+            statReadErrors++;
+            tickFailed = tickFailed || sen->gpu < 0;
+            if (sen->gpu < 0) {
+                markStale(&sen->stale);
+            }
+        }
+    }
+}
+
+// Highest of the controller's sensors through its curve. None of them could be read, or the fail-safe : highSpeed.
+int controllerSpeed(const struct cStruct * ctl) {
+    int temp = TEMPNONE;
+    if (failSafe) {
+        return ctl->highSpeed;
+    }
+    for (int i = 0; i < ctl->nSensors; i++) {
+        int value = senArr[ctl->sensors[i]].value;
+        temp = value > temp ? value : temp;
+    }
+    if (temp == TEMPNONE || temp > ctl->highTemp) {
+        return ctl->highSpeed;
+    } else if (temp < ctl->lowTemp) {
+        return ctl->minSpeed;
+    }
+    return ctl->lut[temp];
+}
+
+void setFanSpeeds() {
+    for (int i = 0; i < curFans; i++) {
+        fanArr[i].speed = 0;
+    }
+    for (int i = 0; i < curCtls; i++) {
+        int speed = controllerSpeed(&ctlArr[i]);
+        for (int f = 0; f < ctlArr[i].nFans; f++) {
+            struct fStruct * fan = &fanArr[ctlArr[i].fans[f]];
+            fan->speed = speed > fan->speed ? speed : fan->speed;
+        }
+    }
+    for (int i = 0; i < curFans; i++) {
+        struct fStruct * fan = &fanArr[i];
+        // No smoothing in the fail-safe, straight to the HIGH of the controllers.
+        if (!failSafe && fan->lastSpeed >= 0 && fan->smoothDown && fan->speed < fan->lastSpeed - fan->smoothDown) {
+            fan->speed = fan->lastSpeed - fan->smoothDown;
+        } else if (!failSafe && fan->lastSpeed >= 0 && fan->smoothUp && fan->speed > fan->lastSpeed + fan->smoothUp) {
+            fan->speed = fan->lastSpeed + fan->smoothUp;
+        }
+        if (fan->speed != fan->lastSpeed) {
+            sprintf(buf, "%d", fan->speed);
+            // A failed write is tried again the next loop.
+            if (writeFd(fan->fd, buf)) {
+                statFanWrites++;
+                fan->lastSpeed = fan->speed;
+            } else {
+                markStale(&fan->stale);
+            }
+        }
+    }
+}
+
+bool writePstate(const struct gStruct * gpu, const char * file, int pstate) {
+    char path[300], value[4];
+    snprintf(path, sizeof(path), "%s/%s", gpu->devPath, file);
+    snprintf(value, sizeof(value), "%d", pstate);
+    return writeFile(path, value);
+}
+
+// VRAM follows the SOC P-State, see vega64control.
+void setVramPstate(struct gStruct * gpu) {
+    gpu->vramPstate = gpu->socPstate >= 6 ? 3 : gpu->socPstate >= 2 ? 2 : gpu->socPstate;
+    gpu->vramPstate = gpu->vramPstate > gpu->maxVramState ? gpu->maxVramState : gpu->vramPstate;
+    writePstate(gpu, "pp_dpm_mclk", gpu->vramPstate);
+}
+
+// Same logic as vega64control : up one P-State every loop the load is >= loadCheck,
+// down one after iterLimit loops under it.
+void setPstates(struct gStruct * gpu) {
+    // The normal logic starts from the fail-safe P-States once it's left.
+    if (failSafe) {
+        unsigned char gpuState = safeGpuPstate > gpu->maxGpuState ? gpu->maxGpuState : safeGpuPstate;
+        unsigned char socState = safeSocPstate > gpu->maxSocState ? gpu->maxSocState : safeSocPstate;
+        unsigned char vramState = safeVramPstate > gpu->maxVramState ? gpu->maxVramState : safeVramPstate;
+        if (gpu->gpuPstate != gpuState || gpu->socPstate != socState || gpu->vramPstate != vramState) {
+            gpu->gpuPstate = gpuState;
+            gpu->socPstate = socState;
+            gpu->vramPstate = vramState;
+            writePstate(gpu, "pp_dpm_socclk", socState);
+            writePstate(gpu, "pp_dpm_sclk", gpuState);
+            writePstate(gpu, "pp_dpm_mclk", vramState);
+            gpu->iters = 0;
+            statPstateChanges++;
+        }
+        return;
+    }
+    if (gpu->load < 0) {
+        gpu->load = readFd(gpu->loadFd, 4) ? atoi(buf) : TEMPNONE;
+    }
+    if (gpu->load == TEMPNONE) {
+        statReadErrors++;
+        return;
+    }
+    bool changed = false;
+    if (gpu->load >= gpu->loadCheck) {
+        gpu->iters = 0;
+        if (gpu->socPstate < gpu->maxSocState && writePstate(gpu, "pp_dpm_socclk", gpu->socPstate + 1)) {
+            gpu->socPstate++;
+            setVramPstate(gpu);
+            changed = true;
+        }
+        if (gpu->gpuPstate < gpu->maxGpuState && writePstate(gpu, "pp_dpm_sclk", gpu->gpuPstate + 1)) {
+            gpu->gpuPstate++;
+            changed = true;
+        }
+    } else if ((gpu->gpuPstate > 0 || gpu->socPstate > 0) && gpu->iters++ > gpu->iterLimit) {
+        gpu->iters = 0;
+        if (gpu->socPstate > 0) {
+            writePstate(gpu, "pp_dpm_socclk", --gpu->socPstate);
+            setVramPstate(gpu);
+        }
+        if (gpu->gpuPstate > 0) {
+            writePstate(gpu, "pp_dpm_sclk", --gpu->gpuPstate);
+        }
+        changed = true;
+    }
+    if (changed) {
+        statPstateChanges++;
+        if (!silent) {
+            printf("\n%s P-States: GPU %d ; SOC %d ; VRAM %d\n", gpu->name, gpu->gpuPstate, gpu->socPstate, gpu->vramPstate);
+        }
+    }
+}
+
+void printStatus() {
+    printf("\r");
+    for (int i = 0; i < curSens; i++) {
+        if (senArr[i].used) {
+            printf("%s %d%s ; ", senArr[i].name, senArr[i].value, senArr[i].gpu >= 0 ? "%" : "C");
+        }
+    }
+    printf("->");
+    for (int i = 0; i < curFans; i++) {
+        printf(" %s %d%s", fanArr[i].name, fanArr[i].lastSpeed, fanArr[i].rpm ? "RPM" : "");
+    }
+    printf("   ");
+    fflush(stdout);
+}
+
+void mkLut(struct cStruct * ctl, int num) {
+    fillFanLut(ctl->lut, ctl->lowSpeed, ctl->lowTemp, ctl->highSpeed, ctl->highTemp);
+    if (!printLut) {
+        return;
+    }
+    printf("Controller %d :\n", num);
+    printf("Input <= %3d ; Speed = %4d\n", ctl->lowTemp - 1, ctl->minSpeed);
+    for (int i = ctl->lowTemp; i <= ctl->highTemp; i++) {
+        printf("Input == %3d ; Speed = %4d\n", i, ctl->lut[i]);
+    }
+    printf("Input >= %3d ; Speed = %4d\n", ctl->highTemp + 1, ctl->highSpeed);
+}
+
+// Called from main() once the loop stopped, or when starting failed after the fans were taken over.
+void cleanup() {
+    for (int i = 0; i < curFans; i++) {
+        if (fanArr[i].enablePath[0] && fanArr[i].enableWas[0]) {
+            writeFile(fanArr[i].enablePath, fanArr[i].enableWas);
+        }
+    }
+    for (int i = 0; i < curGpus; i++) {
+        if (gpuArr[i].loadCheck) {
+            char path[300];
+            snprintf(path, sizeof(path), "%s/power_dpm_force_performance_level", gpuArr[i].devPath);
+            writeFile(path, "auto");
+        }
+    }
+    if (tele) {
+        unlink(telePath);
+    }
+    if (!silent) {
+        printf("\n");
+    }
+}
+
+// The firmware takes the fans and P-States back on resume : manual mode, then the last values again.
+void resumeControl() {
+    slept = suspendedTime();
+    for (int i = 0; i < curFans; i++) {
+        enableFan(&fanArr[i]);
+        if (fanArr[i].lastSpeed >= 0) {
+            sprintf(buf, "%d", fanArr[i].lastSpeed);
+            writeFd(fanArr[i].fd, buf);
+        }
+    }
+    for (int i = 0; i < curGpus; i++) {
+        struct gStruct * gpu = &gpuArr[i];
+        if (gpu->loadCheck) {
+            char path[300];
+            snprintf(path, sizeof(path), "%s/power_dpm_force_performance_level", gpu->devPath);
+            writeFile(path, "manual");
+            writePstate(gpu, "pp_dpm_socclk", gpu->socPstate);
+            writePstate(gpu, "pp_dpm_sclk", gpu->gpuPstate);
+            writePstate(gpu, "pp_dpm_mclk", gpu->vramPstate);
+        }
+    }
+}
+
+void printUsage() {
+    printf("Fan / P-State control of hwmon fans and amdgpu GPUs in one loop, replaces ccpfc, cfancontrol and vega64control.\n");
+    printf("Options:\n");
+    printf(" -h, --help\n");
+    printf("   Displays this information.\n");
+    printf(" -C, --config=FILE\n");
+    printf("   Read options from FILE, one per line using the long option names, for example: sensor = cpu:it8665:temp1_input\n");
+    printf("   Options passed on the command line are added to the ones in FILE.\n");
+    printf(" -s, --silent\n");
+    printf("   Output nothing to stdout.\n");
+    printf(" -i, --interval=FLOAT\n");
+    printf("   Loop pause time. (valid: 0.05 to 60) (default: 1.0)\n");
+    printf(" -n, --niceness=NUM\n");
+    printf("   Set the process priority (niceness). (valid: -20 to 19)\n");
+    printf(" -e, --sensor=NAME:DEVICE:FILE\n");
+    printf("   Temperature sensor FILE of the hwmon directory called DEVICE, DEVICE@N for the Nth one (from 0). Can be passed many times.\n");
+    printf("   Example: --sensor=cpu:it8665:temp1_input --sensor=gpu:amdgpu:temp1_input --sensor=drive0:drivetemp@0:temp1_input\n");
+    printf(" -g, --gpu=NAME:CARD[:LOAD:LOOPS:GPUMAX:SOCMAX:VRAMMAX]\n");
+    printf("   amdgpu /sys/class/drm/cardCARD, its load (%%) is the sensor NAME.load. With LOAD, the P-States are set like vega64control:\n");
+    printf("   up one every loop the load is LOAD or more, down one after LOOPS loops under it, up to GPUMAX (0-7), SOCMAX (0-7), VRAMMAX (0-3).\n");
+    printf("   Example: --gpu=vega:0:50:10:7:7:3\n");
+    printf(" -f, --fan=NAME:DEVICE/FILE[:SMOOTHUP:SMOOTHDOWN]\n");
+    printf("   Fan FILE of the hwmon directory DEVICE : pwmN (PWM) or fanN_target (RPM). When changing speed, go up / down by at most\n");
+    printf("   SMOOTHUP / SMOOTHDOWN per --interval seconds. Can be passed many times, every fan has to be in a --controller.\n");
+    printf("   Example: --fan=chassis:it8665/pwm5:10:1 --fan=front:corsaircpro/pwm1 --fan=gpufan:amdgpu/fan1_target\n");
+    printf(" -c, --controller=FANS:SENSORS:MIN:LOW:TEMPLOW:HIGH:TEMPHIGH\n");
+    printf("   Fan curve from the highest of SENSORS to FANS (comma separated names) : MIN under TEMPLOW, LOW at TEMPLOW up to HIGH\n");
+    printf("   at TEMPHIGH, HIGH over it or if no sensor can be read. A fan in many controllers gets the highest speed. Can be passed many times.\n");
+    printf("   Example: --controller=chassis,front:cpu:0:60:50:255:77 --controller=chassis:gpu:0:60:55:255:80 --controller=front:vega.load:0:0:50:150:100\n");
+    printf(" -l, --print-lut\n");
+    printf("   Print the curve of every controller and exit.\n");
+    printf(" -r, --sysfs-root=DIR\n");
+    printf("   Use DIR instead of /sys, for example a directory made by fanbench.sh.\n");
+    printf(" -T, --telemetry=FILE\n");
+    printf("   Publish every loop's sensors (first %d), fan speeds (first %d) and the first GPU's P-States and load to a shared memory ring\n", TELETEMPS, TELEFANS);
+    printf("   in FILE, for example /dev/shm/hwfc\n");
+    printf(" -R, --realtime=NUM\n");
+    printf("   Run the loop with SCHED_FIFO priority NUM and the memory locked, so it isn't starved when the machine is busy. (valid: 1 to 99)\n");
+    printf(" -D, --deadline=MS\n");
+    printf("   A loop that takes longer than MS milliseconds, or starts a loop late, switches to the fail-safe. (valid: 1 to 60000) (default: --interval)\n");
+    printf(" -E, --fail-safe-reads=NUM\n");
+    printf("   NUM loops in a row with a failed --sensor read switch to the fail-safe, after NUM good loops in a row it's left. (valid: 1 to 255) (default: 3)\n");
+    printf(" -G, --fail-safe-pstates=GPU:SOC:VRAM\n");
+    printf("   P-States of the GPUs with LOAD in the fail-safe (up to their maximums), the fans get the HIGH of their controllers. (default: 0:0:0)\n");
+    printf("   Missed deadlines are sent to systemd (sd_notify), every loop feeds the watchdog (WatchdogSec=, at least 4 --interval).\n");
+}
+
+struct option long_options[] = {
+    {"help",                  no_argument,       0, 'h'},
+    {"config",                required_argument, 0, 'C'},
+    {"silent",                no_argument,       0, 's'},
+    {"interval",              required_argument, 0, 'i'},
+    {"niceness",              required_argument, 0, 'n'},
+    {"sensor",                required_argument, 0, 'e'},
+    {"gpu",                   required_argument, 0, 'g'},
+    {"fan",                   required_argument, 0, 'f'},
+    {"controller",            required_argument, 0, 'c'},
+    {"print-lut",             no_argument,       0, 'l'},
+    {"sysfs-root",            required_argument, 0, 'r'},
+    {"telemetry",             required_argument, 0, 'T'},
+    {"realtime",              required_argument, 0, 'R'},
+    {"deadline",              required_argument, 0, 'D'},
+    {"fail-safe-reads",       required_argument, 0, 'E'},
+    {"fail-safe-pstates",     required_argument, 0, 'G'},
+    {0,                       0,                 0,  0 }
+};
+const char * short_options = "hC:si:n:e:g:f:c:lr:T:R:D:E:G:";
+
+// NAME,NAME list to indexes with find(), in a new array.
+bool parseNames(const char * list, int (* find)(const char *, size_t), int ** arr, int * count, const char * what) {
+    *count = 0;
+    for (const char * ptr = list; *ptr; ptr += strcspn(ptr, ",") + (ptr[strcspn(ptr, ",")] == ',')) {
+        size_t len = strcspn(ptr, ",");
+        int idx = find(ptr, len);
+        if (idx < 0) {
+            fprintf(stderr, "ERROR: Unknown %s '%.*s', it must be added before the --controller using it.\n", what, (int) len, ptr);
+            return false;
+        }
+        GROWARR(*arr, *count);
+        (*arr)[(*count)++] = idx;
+    }
+    return *count > 0;
+}
+
+bool setOption(int c, const char * arg) {
+    switch (c) {
+        case 'C':
+            break;
+        case 's':
+            silent = true;
+            break;
+        case 'i':
+            interval = atof(arg);
+            if (!interval || interval < 0.05 || interval > 60.0) {
+                fprintf(stderr, "ERROR: --interval must be between 0.05 and 60.0.\n");
+                return false;
+            }
+            break;
+        case 'n': {
+            int niceness = atoi(arg);
+            if (niceness < -20 || niceness > 19) {
+                fprintf(stderr, "ERROR: --niceness must be -20 to 19.\n");
+                return false;
+            }
+            setpriority(PRIO_PROCESS, 0, niceness);
+            break;
+        }
+        case 'e': {
+            GROWARR(senArr, curSens);
+            struct sStruct * sen = &senArr[curSens];
+            if (sscanf(arg, "%31[^:]:%63[^:]:%63s", sen->name, sen->dev, sen->file) != 3) {
+                fprintf(stderr, "ERROR: --sensor must be in the format NAME:DEVICE:FILE\n");
+                return false;
+            }
+            sen->fd = -1;
+            sen->gpu = -1;
+            sen->value = TEMPNONE;
+            curSens++;
+            break;
+        }
+        case 'g': {
+            int loadCheck = 0, iterLimit = 10, maxGpu = 7, maxSoc = 7, maxVram = 3;
+            GROWARR(gpuArr, curGpus);
+            struct gStruct * gpu = &gpuArr[curGpus];
+            if (sscanf(arg, "%27[^:]:%d:%d:%d:%d:%d:%d", gpu->name, &gpu->card, &loadCheck, &iterLimit, &maxGpu, &maxSoc, &maxVram) < 2
+                || gpu->card < 0 || loadCheck < 0 || loadCheck > 100 || iterLimit < 1 || iterLimit > 255
+                || maxGpu < 0 || maxGpu > 7 || maxSoc < 0 || maxSoc > 7 || maxVram < 0 || maxVram > 3) {
+                fprintf(stderr, "ERROR: --gpu must be in the format NAME:CARD[:LOAD:LOOPS:GPUMAX:SOCMAX:VRAMMAX]\n");
+                return false;
+            }
+            gpu->loadCheck = loadCheck;
+            gpu->iterLimit = iterLimit;
+            gpu->maxGpuState = maxGpu;
+            gpu->maxSocState = maxSoc;
+            gpu->maxVramState = maxVram;
+            gpu->loadFd = -1;
+            GROWARR(senArr, curSens);
+            snprintf(senArr[curSens].name, sizeof(senArr[curSens].name), "%s.load", gpu->name);
+            senArr[curSens].fd = -1;
+            senArr[curSens].gpu = curGpus;
+            senArr[curSens].value = TEMPNONE;
+            curSens++;
+            curGpus++;
+            break;
+        }
+        case 'f': {
+            GROWARR(fanArr, curFans);
+            struct fStruct * fan = &fanArr[curFans];
+            if (sscanf(arg, "%31[^:]:%63[^/]/%63[^:]:%d:%d", fan->name, fan->dev, fan->file, &fan->smoothUp, &fan->smoothDown) < 3
+                || fan->smoothUp < 0 || fan->smoothDown < 0) {
+                fprintf(stderr, "ERROR: --fan must be in the format NAME:DEVICE/FILE[:SMOOTHUP:SMOOTHDOWN]\n");
+                return false;
+            }
+            fan->rpm = strncmp(fan->file, "fan", 3) == 0 && strstr(fan->file, "_target");
+            if (!fan->rpm && strncmp(fan->file, "pwm", 3) != 0) {
+                fprintf(stderr, "ERROR: --fan '%s' : FILE must be pwmN or fanN_target.\n", fan->name);
+                return false;
+            }
+            fan->fd = -1;
+            curFans++;
+            break;
+        }
+        case 'c': {
+            char fans[256], sensors[256];
+            GROWARR(ctlArr, curCtls);
+            struct cStruct * ctl = &ctlArr[curCtls];
+            if (sscanf(arg, "%255[^:]:%255[^:]:%d:%d:%d:%d:%d", fans, sensors, &ctl->minSpeed, &ctl->lowSpeed, &ctl->lowTemp,
+                &ctl->highSpeed, &ctl->highTemp) != 7) {
+                fprintf(stderr, "ERROR: --controller must be in the format FANS:SENSORS:MIN:LOW:TEMPLOW:HIGH:TEMPHIGH\n");
+                return false;
+            }
+            curCtls++;
+            if (!parseNames(fans, findFan, &ctl->fans, &ctl->nFans, "fan") || !parseNames(sensors, findSensor, &ctl->sensors, &ctl->nSensors, "sensor")) {
+                return false;
+            }
+            if (ctl->lowTemp < 0 || ctl->lowTemp >= ctl->highTemp || ctl->highTemp >= LUTSIZE) {
+                fprintf(stderr, "ERROR: --controller TEMPLOW must be less than TEMPHIGH, between 0 and %d.\n", LUTSIZE - 1);
+                return false;
+            }
+            if (ctl->minSpeed < 0 || ctl->minSpeed > ctl->lowSpeed || ctl->lowSpeed > ctl->highSpeed || ctl->highSpeed > 10000) {
+                fprintf(stderr, "ERROR: --controller speeds must be MIN <= LOW <= HIGH <= 10000.\n");
+                return false;
+            }
+            for (int i = 0; i < ctl->nFans; i++) {
+                const struct fStruct * fan = &fanArr[ctl->fans[i]];
+                if (fan->rpm != fanArr[ctl->fans[0]].rpm || (!fan->rpm && ctl->highSpeed > 255)) {
+                    fprintf(stderr, "ERROR: --controller fans must all be PWM (0-255) or all RPM, '%s' isn't.\n", fan->name);
+                    return false;
+                }
+            }
+            for (int i = 0; i < ctl->nFans; i++) {
+                fanArr[ctl->fans[i]].used = true;
+            }
+            for (int i = 0; i < ctl->nSensors; i++) {
+                senArr[ctl->sensors[i]].used = true;
+            }
+            break;
+        }
+        case 'l':
+            printLut = true;
+            break;
+        case 'r':
+            sysfsRoot = strdup(arg);
+            fakeSysfs = strcmp(sysfsRoot, "/sys") != 0;
+            break;
+        case 'T':
+            telePath = strdup(arg);
+            break;
+        case 'R':
+            rtPriority = atoi(arg);
+            if (rtPriority < 1 || rtPriority > 99) {
+                fprintf(stderr, "ERROR: --realtime must be between 1 and 99.\n");
+                return false;
+            }
+            break;
+        case 'D':
+            deadline = (unsigned short) atoi(arg);
+            if (atoi(arg) < 1 || atoi(arg) > 60000) {
+                fprintf(stderr, "ERROR: --deadline must be between 1 and 60000.\n");
+                return false;
+            }
+            break;
+        case 'E':
+            failSafeReads = (unsigned char) atoi(arg);
+            if (atoi(arg) < 1 || atoi(arg) > 255) {
+                fprintf(stderr, "ERROR: --fail-safe-reads must be between 1 and 255.\n");
+                return false;
+            }
+            break;
+        case 'G': {
+            unsigned int gpu, soc, vram;
+            if (sscanf(arg, "%u:%u:%u", &gpu, &soc, &vram) != 3 || gpu > 7 || soc > 7 || vram > 3) {
+                fprintf(stderr, "ERROR: --fail-safe-pstates must be GPU:SOC:VRAM, GPU and SOC 0 to 7, VRAM 0 to 3.\n");
+                return false;
+            }
+            safeGpuPstate = gpu;
+            safeSocPstate = soc;
+            safeVramPstate = vram;
+            break;
+        }
+        case 'h':
+        default:
+            printUsage();
+            exit(c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    return true;
+}
+
+bool loadConfig(const char * path) {
+    char line[4096];
+    int lineNum = 0;
+    bool ok = true;
+    FILE * in = fopen(path, "r");
+    if (!in) {
+        fprintf(stderr, "ERROR: Could not open config file '%s'\n", path);
+        return false;
+    }
+    while (ok && fgets(line, sizeof(line), in)) {
+        lineNum++;
+        char * name = line + strspn(line, " \t");
+        name[strcspn(name, "#\r\n")] = 0;
+        char * value = strchr(name, '=');
+        if (value) {
+            *value++ = 0;
+            value += strspn(value, " \t");
+            for (int i = strlen(value) - 1; i >= 0 && (value[i] == ' ' || value[i] == '\t'); i--) {
+                value[i] = 0;
+            }
+        }
+        for (int i = strlen(name) - 1; i >= 0 && (name[i] == ' ' || name[i] == '\t'); i--) {
+            name[i] = 0;
+        }
+        if (!*name) {
+            continue;
+        }
+        struct option * opt = long_options;
+        while (opt->name && strcmp(opt->name, name) != 0) {
+            opt++;
+        }
+        if (!opt->name || opt->val == 'C' || opt->val == 'h') {
+            fprintf(stderr, "ERROR: %s line %d : Unknown option '%s'\n", path, lineNum, name);
+            ok = false;
+        } else if ((opt->has_arg == required_argument) != (value != NULL && *value)) {
+            fprintf(stderr, "ERROR: %s line %d : '%s' %s\n", path, lineNum, name, opt->has_arg ? "requires a value" : "takes no value");
+            ok = false;
+        } else {
+            ok = setOption(opt->val, value);
+        }
+    }
+    fclose(in);
+    return ok;
+}
+
+// The config file is applied first, then the command line.
+bool applyOptions() {
+    int c;
+    if (confFile && !loadConfig(confFile)) {
+        return false;
+    }
+    optind = 0;
+    while ((c = getopt_long(optArgc, optArgv, short_options, long_options, NULL)) != -1) {
+        if (!setOption(c, optarg)) {
+            return false;
+        }
+    }
+    // setFanSpeeds() would stop it, a fan is only driven by its controllers.
+    for (int i = 0; i < curFans; i++) {
+        if (!fanArr[i].used) {
+            fprintf(stderr, "ERROR: --fan '%s' is not in a --controller.\n", fanArr[i].name);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Only sets a flag, nothing cleanup() calls is async-signal-safe.
+void onStop() {
+    stopPending = 1;
+}
+
+// Before the files are made and the fans are driven, a stop has to go through cleanup() from main().
+// The signals stay blocked outside of ppoll(), so a stop can't slip in between the check and the wait.
+void catchStop() {
+    sigset_t sigs;
+    signal(SIGQUIT, onStop);
+    signal(SIGINT, onStop);
+    signal(SIGTERM, onStop);
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGQUIT);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    sigprocmask(SIG_BLOCK, &sigs, &waitMask);
+}
+
+int main(int argc, char **argv) {
+#ifndef linux
+    fprintf(stderr, "ERROR: Operating system must be Linux.\n");
+    return 1;
+#endif
+    // The --config is only read at start, there's nothing to reload.
+    signal(SIGHUP, SIG_IGN);
+    {
+        int c;
+        optArgc = argc;
+        optArgv = argv;
+        opterr = 0;
+        while ((c = getopt_long(argc, argv, short_options, long_options, NULL)) != -1) {
+            if (c == 'C') {
+                confFile = optarg;
+            }
+        }
+        opterr = 1;
+        if (!applyOptions()) {
+            return EXIT_FAILURE;
+        }
+        if (!curCtls && !curGpus) {
+            printUsage();
+            return EXIT_FAILURE;
+        }
+        for (int i = 0; i < curCtls; i++) {
+            mkLut(&ctlArr[i], i);
+        }
+        if (printLut) {
+            return EXIT_SUCCESS;
+        }
+        if (geteuid() != 0 && !fakeSysfs) {
+            fprintf(stderr, "ERROR: hwfc must be run as root.\n");
+            return EXIT_FAILURE;
+        }
+        catchStop();
+        if (!scanHwmon() || !openSensors() || !openGpus() || !openFans()) {
+            cleanup();
+            return EXIT_FAILURE;
+        }
+        if (telePath) {
+            if (!(tele = createRing(telePath, "hwfc", curSens, curFans, curFans && fanArr[0].rpm ? "RPM" : "PWM", teleCounters))) {
+                cleanup();
+                return EXIT_FAILURE;
+            }
+            tele->flags = curGpus ? TELEGPU : 0;
+            publishRpmPaths();
+            for (unsigned int i = 0; i < tele->nTemps; i++) {
+                snprintf(tele->tempNames[i], sizeof(tele->tempNames[i]), "%s", senArr[i].name);
+            }
+        }
+        if (rtPriority && !enterRealtime(0)) {
+            cleanup();
+            return EXIT_FAILURE;
+        }
+        if (!openNotify()) {
+            cleanup();
+            return EXIT_FAILURE;
+        }
+    }
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tfd < 0) {
+        fprintf(stderr, "ERROR: Could not create timer.\n");
+        cleanup();
+        return EXIT_FAILURE;
+    }
+    armTimer(tfd);
+    int rfd = openResumeTimer();
+    if (!fakeSysfs) {
+        ueventFd = openUevents("hwmon directories are only looked up again after failed reads / writes.");
+    }
+    struct pollfd pfds[3];
+    struct timespec tickStart;
+    uint64_t expirations;
+    slept = suspendedTime();
+    sdNotify("READY=1\nSTATUS=Running");
+    while (!stopPending) {
+        clock_gettime(CLOCK_MONOTONIC, &tickStart);
+        // In case the resume timer was missed.
+        if (suspendedTime() > slept + 1.0) {
+            resumeControl();
+        }
+        checkFailSafe();
+        readSensors();
+        setFanSpeeds();
+        for (int i = 0; i < curGpus; i++) {
+            if (gpuArr[i].loadCheck) {
+                setPstates(&gpuArr[i]);
+            }
+        }
+        statLoops++;
+        if (!silent) {
+            printStatus();
+        }
+        if (tele) {
+            publishTelemetry(&tickStart);
+        }
+        endTick(&tickStart);
+        // Wait for the next loop, hwmon rebinds are done while waiting.
+        do {
+            if (rebindPending) {
+                rebindHwmon();
+            }
+            pfds[0] = (struct pollfd) {tfd, POLLIN, 0};
+            pfds[1] = (struct pollfd) {rfd, POLLIN, 0};
+            pfds[2] = (struct pollfd) {ueventFd, POLLIN, 0};
+            if (ppoll(pfds, 3, NULL, &waitMask) < 0) {
+                continue;
+            }
+            if ((pfds[1].revents & POLLIN) && clockWasSet(rfd)) {
+                resumeControl();
+            }
+            if ((pfds[2].revents & POLLIN) && hwmonUevent(ueventFd)) {
+                rebindPending = true;
+            }
+        } while (!stopPending && read(tfd, &expirations, sizeof(expirations)) != sizeof(expirations));
+        if (stopPending) {
+            break;
+        }
+        checkLateness(expirations);
+    }
+    cleanup();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,107 @@
+#!/bin/bash
+
+cat > /dev/null <<LICENSE
+    Copyright (C) 2022  kevinlekiller
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+    https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
+LICENSE
+
+# Simulated Corsair Commander Pro, to try ccpfc without the hardware.
+# Creates a fake sysfs tree, then keeps updating fanN_input based on what is written to pwmN.
+# Example:
+#  ./simfan.sh &
+#  ./ccpfc --sysfs-root=/tmp/simfan --calibration-file=/tmp/simfan/calibration --interval=0.1 --calibrate --fans="pwm1:0;pwm2:0"
+# Benchmark with 200 simulated drives:
+#  SENSORS=200 ./simfan.sh &
+#  ./ccpfc --sysfs-root=/tmp/simfan --benchmark=10000 --fans="pwm1:0" --fan-speed-low=50 --fan-temp-low=30 --fan-speed-high=255 --fan-temp-high=70 \
+#   --temp-sensors="$(for i in {0..199}; do printf 'drivetemp@%d:temp1_input:0:0;' $i; done)"
+
+# Where to create the fake sysfs tree.
+SIMROOT=${SIMROOT:-/tmp/simfan}
+
+# Amount of fans to simulate.
+FANS=${FANS:-6}
+
+# Fan stops spinning under this PWM.
+STOPPWM=${STOPPWM:-40}
+
+# A stopped fan needs at least this PWM to start spinning.
+STARTPWM=${STARTPWM:-65}
+
+# Above this PWM the RPM doesn't go up anymore.
+SATPWM=${SATPWM:-210}
+
+# RPM of the fan at SATPWM.
+MAXRPM=${MAXRPM:-1800}
+
+# Temperature reported by temp1_input, in millidegrees.
+TEMP=${TEMP:-40000}
+
+# Amount of simulated drives, each one is a drivetemp hwmon directory with a temp1_input.
+SENSORS=${SENSORS:-0}
+
+# Delay (in seconds) between updating the RPM.
+INTERVAL=${INTERVAL:-0.05}
+
+###############################################################################
+###############################################################################
+
+HWMON=$SIMROOT/class/hwmon/hwmon0
+mkdir -p "$HWMON" "$SIMROOT/devices/ccpsim.0001" || exit 1
+ln -sfn ../../../devices/ccpsim.0001 "$HWMON/device"
+echo corsaircpro > "$HWMON/name"
+echo "$TEMP" > "$HWMON/temp1_input"
+for ((i = 1; i <= SENSORS; i++)); do
+    DEV=$(printf "drivesim.%04d" "$i")
+    mkdir -p "$SIMROOT/class/hwmon/hwmon$i" "$SIMROOT/devices/$DEV" || exit 1
+    ln -sfn "../../../devices/$DEV" "$SIMROOT/class/hwmon/hwmon$i/device"
+    echo drivetemp > "$SIMROOT/class/hwmon/hwmon$i/name"
+    echo $((TEMP - 10000 + i % 20 * 1000)) > "$SIMROOT/class/hwmon/hwmon$i/temp1_input"
+done
+declare -A RPM
+for ((i = 1; i <= FANS; i++)); do
+    echo 0 > "$HWMON/pwm$i"
+    echo 0 > "$HWMON/fan${i}_input"
+    RPM[$i]=0
+done
+
+trap catchExit SIGHUP SIGINT SIGQUIT SIGTERM
+function catchExit() {
+    rm -rf "$SIMROOT"
+    exit 0
+}
+
+while true; do
+    for ((i = 1; i <= FANS; i++)); do
+        PWM=$(< "$HWMON/pwm$i")
+        PWM=${PWM:-0}
+        if [[ $PWM -lt $STOPPWM ]] || [[ ${RPM[$i]} -eq 0 && $PWM -lt $STARTPWM ]]; then
+            TARGET=0
+        elif [[ $PWM -ge $SATPWM ]]; then
+            TARGET=$MAXRPM
+        else
+            TARGET=$((PWM * MAXRPM / SATPWM))
+        fi
+        # Spin up / down halfway to the target RPM every INTERVAL.
+        RPM[$i]=$((RPM[$i] + (TARGET - RPM[$i]) / 2))
+        if [[ $TARGET -eq 0 && ${RPM[$i]} -lt 100 ]]; then
+            RPM[$i]=0
+        fi
+        echo "${RPM[$i]}" > "$HWMON/fan${i}_input.tmp"
+        mv "$HWMON/fan${i}_input.tmp" "$HWMON/fan${i}_input"
+    done
+    sleep "$INTERVAL"
+done
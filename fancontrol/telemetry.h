@@ -0,0 +1,184 @@
+/**
+ * Copyright (C) 2022  kevinlekiller
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * The --telemetry ring, shared by the daemons that write it (ccpfc, cfancontrol, vega64control, hwfc) and the
+ * programs that read it (fanexporter, fanhistory, gpustat). The layout is what the processes agree on,
+ * bump TELEVERSION on any change to it, readers ignore a ring of another version.
+ *
+ * Single writer, any amount of readers mmap the file. The writer sets the seq of a slot to an odd value,
+ * fills the slot, sets seq to an even value and increments head. A reader only uses the copy of a slot
+ * if its seq was the expected even value before and after copying it, see readSample().
+ */
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define TELEMAGIC 0x4d454c54
+#define TELEVERSION 4
+#define TELESLOTS 1024
+#define TELETEMPS 8
+#define TELEFANS 8
+#define TELECOUNTERS 16
+// teleHeader flags, TELEGPU : the pstates and load of the samples are used, TELETHROTTLE : their throttled is.
+#define TELEGPU 1
+#define TELETHROTTLE 2
+
+struct teleSample {
+    uint64_t seq;                // 2 * sample + 1 while being written, 2 * sample + 2 when done
+    uint64_t timeNs;             // CLOCK_REALTIME
+    uint32_t tickNs;             // Time spent in the tick
+    int16_t temp;                // Temperature used for the fan speed (C)
+    int16_t temps[TELETEMPS];    // Every sensor (C)
+    uint16_t fans[TELEFANS];     // PWM or RPM of every fan
+    uint8_t pstates[3];          // GPU / SOC / VRAM
+    uint8_t load;                // GPU load (%)
+    uint8_t throttled;           // 1 if the hardware throttled during the tick
+    uint8_t pad[5];
+};
+struct teleHeader {
+    uint32_t magic, version, slots, sampleSize, nTemps, nFans;
+    uint32_t flags;              // TELEGPU | TELETHROTTLE
+    char daemon[16];
+    char fanUnit[8];
+    uint64_t head;               // Amount of samples written
+    uint64_t counters[TELECOUNTERS];         // Totals since the daemon started, named by counterNames
+    char counterNames[TELECOUNTERS][24];     // Empty for the unused counters
+    char rpmPaths[TELEFANS][128];            // fanN_input of every fan, for fanexporter
+    char tempNames[TELETEMPS][32];           // Name of every temps[] channel
+    uint64_t pad[3];
+    struct teleSample ring[TELESLOTS];
+};
+// fanbench.sh reads head with od at this offset.
+_Static_assert(offsetof(struct teleHeader, head) == 56, "teleHeader head moved");
+_Static_assert(sizeof(struct teleSample) == 64, "teleSample size changed");
+
+// Writer : makes the ring in FILE.tmp and renames it over FILE, a reader that still has the ring of a previous run
+// mapped keeps it instead of getting a SIGBUS from the file being truncated under it. counterNames ends with NULL.
+static inline struct teleHeader * createRing(const char * path, const char * daemon, unsigned int nTemps, unsigned int nFans,
+    const char * fanUnit, const char * const * counterNames) {
+    char tmpPath[PATH_MAX];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+    int teleFd = open(tmpPath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (teleFd < 0 || ftruncate(teleFd, sizeof(struct teleHeader)) != 0) {
+        fprintf(stderr, "ERROR: Could not create telemetry file '%s'\n", tmpPath);
+        close(teleFd);
+        unlink(tmpPath);
+        return NULL;
+    }
+    struct teleHeader * tele = mmap(NULL, sizeof(struct teleHeader), PROT_READ | PROT_WRITE, MAP_SHARED, teleFd, 0);
+    close(teleFd);
+    if (tele == MAP_FAILED) {
+        fprintf(stderr, "ERROR: Could not map telemetry file '%s'\n", tmpPath);
+        unlink(tmpPath);
+        return NULL;
+    }
+    tele->version = TELEVERSION;
+    tele->slots = TELESLOTS;
+    tele->sampleSize = sizeof(struct teleSample);
+    tele->nTemps = nTemps > TELETEMPS ? TELETEMPS : nTemps;
+    tele->nFans = nFans > TELEFANS ? TELEFANS : nFans;
+    snprintf(tele->daemon, sizeof(tele->daemon), "%s", daemon);
+    snprintf(tele->fanUnit, sizeof(tele->fanUnit), "%s", fanUnit);
+    for (int i = 0; i < TELECOUNTERS && counterNames[i]; i++) {
+        snprintf(tele->counterNames[i], sizeof(tele->counterNames[i]), "%s", counterNames[i]);
+    }
+    __atomic_store_n(&tele->magic, TELEMAGIC, __ATOMIC_RELEASE);
+    if (rename(tmpPath, path) != 0) {
+        fprintf(stderr, "ERROR: Could not create telemetry file '%s'\n", path);
+        munmap(tele, sizeof(struct teleHeader));
+        unlink(tmpPath);
+        return NULL;
+    }
+    return tele;
+}
+
+// Writer : returns the sample to fill in, with its time and the time since tickStart set, call endSample() when done.
+static inline struct teleSample * beginSample(struct teleHeader * tele, const struct timespec * tickStart) {
+    struct timespec now;
+    struct teleSample * smp = &tele->ring[tele->head % TELESLOTS];
+    __atomic_store_n(&smp->seq, 2 * tele->head + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    smp->tickNs = (now.tv_sec - tickStart->tv_sec) * 1000000000 + now.tv_nsec - tickStart->tv_nsec;
+    clock_gettime(CLOCK_REALTIME, &now);
+    smp->timeNs = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    return smp;
+}
+
+static inline void endSample(struct teleHeader * tele, struct teleSample * smp) {
+    __atomic_store_n(&smp->seq, 2 * tele->head + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&tele->head, tele->head + 1, __ATOMIC_RELEASE);
+}
+
+// Reader : maps the ring of FILE read only, NULL if there's none or it has another layout.
+// inode (can be NULL) gets the inode of FILE, a daemon that restarted made a new one.
+static inline struct teleHeader * mapRing(const char * path, ino_t * inode) {
+    struct stat sb;
+    struct teleHeader * tele = MAP_FAILED;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0 && fstat(fd, &sb) == 0 && sb.st_size >= (off_t) sizeof(struct teleHeader)) {
+        tele = mmap(NULL, sizeof(struct teleHeader), PROT_READ, MAP_SHARED, fd, 0);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (tele == MAP_FAILED) {
+        return NULL;
+    }
+    if (__atomic_load_n(&tele->magic, __ATOMIC_ACQUIRE) != TELEMAGIC || tele->version != TELEVERSION
+        || tele->sampleSize != sizeof(struct teleSample)) {
+        munmap(tele, sizeof(struct teleHeader));
+        return NULL;
+    }
+    if (inode) {
+        *inode = sb.st_ino;
+    }
+    return tele;
+}
+
+static inline void unmapRing(struct teleHeader * tele) {
+    munmap(tele, sizeof(struct teleHeader));
+}
+
+// Reader : amount of samples the daemon wrote, n below it can be given to readSample().
+static inline uint64_t ringHead(const struct teleHeader * tele) {
+    return __atomic_load_n(&tele->head, __ATOMIC_ACQUIRE);
+}
+
+// Reader : copies sample n (0 is the first the daemon wrote), false if the daemon overwrote it or is writing it.
+static inline bool readSample(const struct teleHeader * tele, uint64_t n, struct teleSample * smp) {
+    const struct teleSample * slot = &tele->ring[n % TELESLOTS];
+    uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    memcpy(smp, slot, sizeof(struct teleSample));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return seq == 2 * n + 2 && __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq;
+}
+
+#endif